@@ -272,6 +272,12 @@ typedef unsigned int	MDB_dbi;
 /** @brief Opaque structure for navigating through a database */
 typedef struct MDB_cursor MDB_cursor;
 
+/** @brief Opaque structure for loading sorted data into an empty database */
+typedef struct MDB_bulk MDB_bulk;
+
+/** @brief Opaque structure for collecting updates outside a transaction */
+typedef struct MDB_batch MDB_batch;
+
 /** @brief Generic structure used for passing keys and data in and out
  * of the database.
  *
@@ -291,6 +297,35 @@ typedef struct MDB_val {
 /** @brief A callback function used to compare two keys in a database */
 typedef int  (MDB_cmp_func)(const MDB_val *a, const MDB_val *b);
 
+/** @brief The keys of one page, as passed to an #MDB_search_func.
+ *
+ * If \b ks_offs is NULL the keys all have size \b ks_ksize and are
+ * stored back to back, key \b i at <tt>ks_base + i * ks_ksize</tt>.
+ * Otherwise key \b i is at <tt>ks_base + ks_offs[i] + ks_koff</tt>,
+ * and its size is the unsigned short at <tt>ks_base + ks_offs[i] + ks_szoff</tt>.
+ * Keys are not aligned.
+ */
+typedef struct MDB_keyset {
+	const char		*ks_base;	/**< base address of the keys */
+	const uint16_t	*ks_offs;	/**< offsets of the keys' nodes, or NULL */
+	unsigned int	ks_koff;	/**< offset of a key in its node */
+	unsigned int	ks_szoff;	/**< offset of a key's size in its node */
+	unsigned int	ks_ksize;	/**< size of every key, if \b ks_offs is NULL */
+	unsigned int	ks_low;		/**< index of the first key to search */
+	unsigned int	ks_high;	/**< index after the last key to search */
+} MDB_keyset;
+
+/** @brief A callback function used to search the keys of a page.
+ *
+ * See #mdb_set_search() for details.
+ * @param[in] ks The keys to search, in ascending order.
+ * @param[in] key The key to search for.
+ * @param[out] exact Set to 1 if the returned key equals \b key, else 0.
+ * @return The index of the first key from \b ks_low up to \b ks_high
+ * which is not less than \b key, or \b ks_high if there is none.
+ */
+typedef unsigned int (MDB_search_func)(const MDB_keyset *ks, const MDB_val *key, int *exact);
+
 /** @brief A callback function used to relocate a position-dependent data item
  * in a fixed-address database.
  *
@@ -307,6 +342,33 @@ typedef int  (MDB_cmp_func)(const MDB_val *a, const MDB_val *b);
  */
 typedef void (MDB_rel_func)(MDB_val *item, void *oldptr, void *newptr, void *relctx);
 
+/** @brief A callback function used to compress or decompress values.
+ *
+ * See #mdb_set_codec() for details.
+ * @param[in] src The bytes to transform.
+ * @param[in,out] dst On input, \b mv_data is a buffer of \b mv_size bytes
+ * to write the result to. On success \b mv_size must be set to the size
+ * of the result.
+ * @param[in] ctx An application-provided context, set by #mdb_set_codec().
+ * @return 0 on success. A non-zero return from a compressor means the
+ * value is stored uncompressed, e.g. because the result did not fit in
+ * \b dst. A non-zero return from a decompressor is reported to the
+ * reader as #MDB_CORRUPTED.
+ */
+typedef int  (MDB_codec_func)(const MDB_val *src, MDB_val *dst, void *ctx);
+
+/** @brief A callback function used to scan one range of a database.
+ *
+ * See #mdb_range_scan() for details.
+ * @param[in] cursor A cursor on the database, for this thread's use only.
+ * Its position on entry is unspecified.
+ * @param[in] lo The first key of the range, or NULL for the start of the DB.
+ * @param[in] hi The first key past the range, or NULL for the end of the DB.
+ * @param[in] ctx The context passed to #mdb_range_scan().
+ * @return 0 to go on, or a non-zero value to stop the scan.
+ */
+typedef int  (MDB_range_func)(MDB_cursor *cursor, MDB_val *lo, MDB_val *hi, void *ctx);
+
 /** @defgroup	mdb_env	Environment Flags
  *	@{
  */
@@ -334,6 +396,8 @@ typedef void (MDB_rel_func)(MDB_val *item, void *oldptr, void *newptr, void *rel
 #define MDB_NOMEMINIT	0x1000000
 	/** use the previous snapshot rather than the latest one */
 #define MDB_PREVSNAPSHOT	0x2000000
+	/** let concurrent writer threads share one sync per group of commits */
+#define MDB_GROUPCOMMIT	0x4000000
 /** @} */
 
 /**	@defgroup	mdb_dbi_open	Database Flags
@@ -390,6 +454,24 @@ typedef void (MDB_rel_func)(MDB_val *item, void *oldptr, void *newptr, void *rel
 #define MDB_CP_COMPACT	0x01
 /*	@} */
 
+/**	@defgroup mdb_drop	Drop Flags
+ *	@{
+ */
+/** Free the DB's pages lazily, in later write transactions, instead of
+ * walking the whole tree now. See #mdb_drop().
+ */
+#define MDB_DROP_LAZY	0x02
+/*	@} */
+
+/**	@defgroup mdb_warmup	Warm-up Flags
+ *	@{
+ */
+/** Also read the leaf pages, after the branch pages of every DB */
+#define MDB_WARMUP_LEAVES	0x01
+/** Lock the branch pages into memory with mlock() */
+#define MDB_WARMUP_LOCK	0x02
+/*	@} */
+
 /** @brief Cursor Get operations.
  *
  *	This is the set of all operations for retrieving data
@@ -422,8 +504,11 @@ typedef enum MDB_cursor_op {
 	MDB_SET,				/**< Position at specified key */
 	MDB_SET_KEY,			/**< Position at specified key, return key + data */
 	MDB_SET_RANGE,			/**< Position at first key greater than or equal to specified key. */
-	MDB_PREV_MULTIPLE		/**< Position at previous page and return up to
+	MDB_PREV_MULTIPLE,		/**< Position at previous page and return up to
 								a page of duplicate data items. Only for #MDB_DUPFIXED */
+	MDB_GET_MULTI_SORTED	/**< Position at specified key, like #MDB_SET. Meant for
+								a series of lookups in ascending key order: searches
+								onward from the current position instead of the root */
 } MDB_cursor_op;
 
 /** @defgroup  errors	Return Codes
@@ -497,6 +582,48 @@ typedef struct MDB_stat {
 	mdb_size_t		ms_entries;			/**< Number of data items */
 } MDB_stat;
 
+	/** Number of buckets in the fill histograms of #MDB_pageinfo */
+#define MDB_FILL_HIST	10
+	/** Number of buckets in the other histograms of #MDB_pageinfo */
+#define MDB_SIZE_HIST	32
+
+/** @brief Page usage of a database, from #mdb_stat_pages().
+ *
+ *	The fill of a page is the part of the space after its header which
+ *	is in use. Bucket i of a fill histogram counts pages filled to
+ *	[10*i, 10*(i+1)) percent, and the last bucket also counts full pages.
+ *	Bucket 0 of a size histogram counts size 0, bucket i counts sizes in
+ *	[2^(i-1), 2^i), and the last bucket also counts everything larger.
+ *	Pages and items of the sub-databases of #MDB_DUPSORT keys are included.
+ */
+typedef struct MDB_pageinfo {
+	mdb_size_t	mi_branch_pages;	/**< Number of internal (non-leaf) pages */
+	mdb_size_t	mi_leaf_pages;		/**< Number of leaf pages */
+	mdb_size_t	mi_overflow_pages;	/**< Number of overflow pages */
+	mdb_size_t	mi_entries;			/**< Number of data items */
+	mdb_size_t	mi_branch_bytes;	/**< Bytes in use in branch pages, without headers */
+	mdb_size_t	mi_leaf_bytes;		/**< Bytes in use in leaf pages, without headers */
+	mdb_size_t	mi_branch_fill[MDB_FILL_HIST];	/**< Branch pages by fill */
+	mdb_size_t	mi_leaf_fill[MDB_FILL_HIST];	/**< Leaf pages by fill */
+	mdb_size_t	mi_key_sizes[MDB_SIZE_HIST];	/**< Keys by size */
+	mdb_size_t	mi_data_sizes[MDB_SIZE_HIST];	/**< Data items by stored size */
+	mdb_size_t	mi_overflow_values;	/**< Data items on overflow pages */
+	mdb_size_t	mi_overflow_waste;	/**< Bytes of overflow pages not holding data */
+	/** Leaf pages by their distance from the previous leaf in key order:
+	 *	bucket 0 counts leaves right after it in the file, and the others
+	 *	count the distance in pages in either direction, by size.
+	 *	A forward scan reads the pages in bucket 0 sequentially.
+	 */
+	mdb_size_t	mi_leaf_dist[MDB_SIZE_HIST];
+	/** Runs of consecutive free pages, for the free DB only: bucket i counts
+	 *	runs of [2^i, 2^(i+1)) pages. Lists in the free DB are merged,
+	 *	as page allocation does, and trees dropped with #MDB_DROP_LAZY
+	 *	that are not freed yet are left out.
+	 */
+	mdb_size_t	mi_free_runs[MDB_SIZE_HIST];
+	mdb_size_t	mi_free_pages;		/**< Pages in those runs */
+} MDB_pageinfo;
+
 /** @brief Information about the environment */
 typedef struct MDB_envinfo {
 	void	*me_mapaddr;			/**< Address of map, if fixed */
@@ -507,6 +634,68 @@ typedef struct MDB_envinfo {
 	unsigned int me_numreaders;		/**< max reader slots used in the environment */
 } MDB_envinfo;
 
+	/** Number of buckets in #MDB_metrics.mm_sync_hist */
+#define MDB_SYNC_HIST	24
+
+/** @brief Hot-path counters for the environment.
+ *
+ *	These count events in this process since the environment was
+ *	created. They are not stored persistently. They are updated by write
+ *	transactions without atomic operations, so syncs requested by
+ *	#mdb_env_sync() while another thread commits may occasionally go
+ *	uncounted.
+ */
+typedef struct MDB_metrics {
+	mdb_size_t	mm_splits;		/**< Page splits */
+	mdb_size_t	mm_rebalances;	/**< Pages checked for underflow after a delete */
+	mdb_size_t	mm_merges;		/**< Pages merged into a neighbor */
+	mdb_size_t	mm_spilled;		/**< Dirty pages spilled before commit */
+	mdb_size_t	mm_unspilled;	/**< Spilled pages made dirty again */
+	mdb_size_t	mm_loosened;	/**< Pages put on a txn's loose list */
+	mdb_size_t	mm_allocs;		/**< Page allocation requests */
+	mdb_size_t	mm_allocs_multi;	/**< Requests for more than one contiguous page */
+	mdb_size_t	mm_loose_reused;	/**< Requests satisfied from the txn's loose pages */
+	mdb_size_t	mm_free_reused;	/**< Requests satisfied from the freelist */
+	mdb_size_t	mm_free_reads;	/**< freeDB records read by the allocator */
+	mdb_size_t	mm_grows;		/**< Requests satisfied by growing the used map */
+	mdb_size_t	mm_grows_multi;	/**< Multi-page requests satisfied by growing the map */
+	mdb_size_t	mm_grow_retries;	/**< Failed freelist searches in allocations
+										that then grew the used map */
+	mdb_size_t	mm_retry_limit;	/**< Times the freelist search gave up while
+										older freeDB records were still available */
+	mdb_size_t	mm_reader_limit;	/**< Times the freelist search stopped because
+										the remaining freeDB records were still in use */
+	mdb_size_t	mm_run_builds;	/**< Times the freelist run index was rebuilt */
+	mdb_size_t	mm_flush_writes;	/**< Write calls to flush dirty pages */
+	mdb_size_t	mm_flush_bytes;	/**< Bytes written by those calls */
+	mdb_size_t	mm_syncs;		/**< Calls to fsync, fdatasync or msync */
+	mdb_size_t	mm_sync_usec;	/**< Total microseconds spent in those calls */
+	/** Sync latencies: bucket 0 counts syncs under 1 microsecond, bucket
+	 *	i counts those taking [2^(i-1), 2^i) microseconds, and the last
+	 *	bucket also counts everything slower.
+	 */
+	mdb_size_t	mm_sync_hist[MDB_SYNC_HIST];
+	mdb_size_t	mm_oldest_scans;	/**< Reader table scans for the oldest snapshot */
+	mdb_size_t	mm_oldest_slots;	/**< Reader slots examined by those scans */
+	mdb_size_t	mm_dpage_hits;	/**< Dirty page buffers reused from the env's caches */
+	mdb_size_t	mm_dpage_carved;	/**< Multi-page buffers carved from the env's arena */
+	mdb_size_t	mm_dpage_mallocs;	/**< Dirty page buffers from malloc() */
+} MDB_metrics;
+
+/** @brief Counters for the page mapping cache of \b MDB_VL32 builds.
+ *
+ *	These builds map the data file in chunks as they are read, and keep
+ *	the chunks mapped for reuse by all transactions of the environment.
+ *	The counters are for this process since the environment was opened.
+ */
+typedef struct MDB_rpageinfo {
+	mdb_size_t	mr_hits;		/**< Chunk lookups served by the cache */
+	mdb_size_t	mr_misses;		/**< Chunk lookups which had to map the chunk */
+	mdb_size_t	mr_evicts;		/**< Unused chunks unmapped to stay within the budget */
+	mdb_size_t	mr_mapped;		/**< Bytes currently mapped by the cache */
+	mdb_size_t	mr_budget;		/**< Target for mr_mapped, see #mdb_env_set_rpage_budget() */
+} MDB_rpageinfo;
+
 	/** @brief Return the LMDB library version information.
 	 *
 	 * @param[out] major if non-NULL, the library major version number is copied here
@@ -654,6 +843,18 @@ int  mdb_env_create(MDB_env **env);
 	 *		types of corruption. If opened with write access, this must be the
 	 *		only process using the environment. This flag is automatically reset
 	 *		after a write transaction is successfully committed.
+	 *	<li>#MDB_GROUPCOMMIT
+	 *		Coalesce the syncs of write transactions committed by different
+	 *		threads of this process. A committing transaction flushes its
+	 *		pages and releases the write lock without syncing; the first
+	 *		waiting committer then syncs the data file and writes the meta
+	 *		pages once for every transaction committed in the meantime.
+	 *		#mdb_txn_commit() still returns only after its own transaction
+	 *		is durable, and readers do not see a transaction until then.
+	 *		This adds no benefit when only one thread writes. Writers in
+	 *		other processes must not use the environment while it is open
+	 *		with this flag. The option is not implemented on Windows, where
+	 *		it is silently ignored.
 	 * </ul>
 	 * @param[in] mode The UNIX permissions to set on created files and semaphores.
 	 * This parameter is ignored on Windows.
@@ -745,6 +946,234 @@ int  mdb_env_copy2(MDB_env *env, const char *path, unsigned int flags);
 	 */
 int  mdb_env_copyfd2(MDB_env *env, mdb_filehandle_t fd, unsigned int flags);
 
+	/** @brief Copy an LMDB environment to the specified path, with options
+	 *	and multiple threads.
+	 *
+	 * This is #mdb_env_copy2() with extra threads for a compacting copy.
+	 * The environment is still walked and written in order by one thread,
+	 * so the copy is the same as without extra threads, but the other
+	 * threads read the subtrees of the database ahead of it. This helps
+	 * when the copy is bound by reading pages that aren't in memory.
+	 * Extra threads are not used on Windows or with MDB_VL32.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully.
+	 * @param[in] path The directory in which the copy will reside. This
+	 * directory must already exist and be writable but must otherwise be
+	 * empty.
+	 * @param[in] flags Special options for this operation.
+	 * See #mdb_env_copy2() for options.
+	 * @param[in] nthreads The number of threads reading the environment.
+	 * It is ignored unless #MDB_CP_COMPACT is set; 0 or 1 uses no extra threads.
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_env_copy3(MDB_env *env, const char *path, unsigned int flags,
+	unsigned int nthreads);
+
+	/** @brief Copy an LMDB environment to the specified file descriptor,
+	 *	with options and multiple threads.
+	 *
+	 * See #mdb_env_copy3() for further details.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully.
+	 * @param[in] fd The filedescriptor to write the copy to. It must
+	 * have already been opened for Write access.
+	 * @param[in] flags Special options for this operation.
+	 * See #mdb_env_copy2() for options.
+	 * @param[in] nthreads The number of threads reading the environment.
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_env_copyfd3(MDB_env *env, mdb_filehandle_t fd, unsigned int flags,
+	unsigned int nthreads);
+
+	/** @brief Write an incremental copy of an LMDB environment.
+	 *
+	 * This compares the current state of the environment with an
+	 * earlier plain (not compacted) copy of it, such as one made by
+	 * #mdb_env_copy(), and writes out just the pages which differ,
+	 * followed by the new meta pages. Applying the result to the earlier
+	 * copy with #mdb_env_apply_delta() brings it up to date.
+	 *
+	 * Both the environment and the earlier copy are read in full, but
+	 * the output only grows with the number of pages written since the
+	 * copy was made. Pages are compared by content, so an earlier copy
+	 * which has itself been brought up to date this way is a valid base
+	 * for the next one.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully.
+	 * @param[in] base The path of the earlier copy. It is named like the
+	 * path of #mdb_env_open(), so it is a directory unless the environment
+	 * was opened with #MDB_NOSUBDIR.
+	 * @param[in] path The file to write the changes to. It must not exist yet.
+	 * @return A non-zero error value on failure and 0 on success. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>#MDB_INVALID - \b base is not an LMDB copy.
+	 *	<li>EINVAL - \b base uses a different page size or is newer than
+	 *		the environment.
+	 * </ul>
+	 */
+int  mdb_env_copy_delta(MDB_env *env, const char *base, const char *path);
+
+	/** @brief Write an incremental copy of an LMDB environment to the
+	 *	specified file descriptor.
+	 *
+	 * See #mdb_env_copy_delta() for further details.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully.
+	 * @param[in] base The path of the earlier copy.
+	 * @param[in] fd The filedescriptor to write the changes to. It must
+	 * have already been opened for Write access.
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_env_copyfd_delta(MDB_env *env, const char *base, mdb_filehandle_t fd);
+
+	/** @brief Apply an incremental copy to an LMDB environment.
+	 *
+	 * Reads the output of #mdb_env_copyfd_delta() and writes its pages
+	 * into the environment, which must be the copy the changes were taken
+	 * against. The data pages are synced before the meta pages are
+	 * written. If the apply is interrupted the environment is unusable
+	 * until the same changes have been applied again. The environment must
+	 * not be in use by any other process or thread. Once this returns,
+	 * transactions see the applied changes and may update them.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully, without #MDB_RDONLY.
+	 * @param[in] fd The filedescriptor to read the changes from.
+	 * @return A non-zero error value on failure and 0 on success. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>#MDB_INVALID - the input is not an incremental copy, or is truncated.
+	 *	<li>EINVAL - the changes were taken against a different snapshot.
+	 *	<li>EBUSY - the environment has active transactions.
+	 *	<li>EACCES - the environment is read-only.
+	 * </ul>
+	 */
+int  mdb_env_apply_delta(MDB_env *env, mdb_filehandle_t fd);
+
+	/** @brief A run of consecutive pages written by a transaction.
+	 *
+	 * Passed to an #MDB_commit_func, and to #mdb_env_apply_pages().
+	 */
+typedef struct MDB_pageset {
+	mdb_size_t	ps_pgno;	/**< first page number of the run */
+	mdb_size_t	ps_count;	/**< number of pages in the run */
+	void		*ps_data;	/**< ps_count pages of the environment's page size */
+} MDB_pageset;
+
+	/** @brief A callback function for committed write transactions.
+	 *
+	 * Called by #mdb_txn_commit() after the transaction is committed,
+	 * while the writer lock is still held. The pages are sorted by page
+	 * number and point into the memory map; they are only valid until
+	 * the callback returns, and must not be modified. The last entry is
+	 * the new meta page, which is not part of the map. With
+	 * #MDB_GROUPCOMMIT the callback may run before the commit is synced.
+	 * The callback must not call any other LMDB function on \b env.
+	 * @param[in] env An environment handle returned by #mdb_env_create().
+	 * @param[in] txnid The ID of the committed transaction.
+	 * @param[in] pages The pages written by the transaction.
+	 * @param[in] count The number of entries in \b pages.
+	 * @param[in] ctx The context pointer given to #mdb_env_set_commit_hook().
+	 */
+typedef void (MDB_commit_func)(MDB_env *env, mdb_size_t txnid,
+	MDB_pageset *pages, mdb_size_t count, void *ctx);
+
+	/** @brief Set or reset the commit callback of the environment.
+	 *
+	 * This is meant for keeping read replicas up to date: the callback
+	 * receives every page a write transaction wrote, which can be sent to
+	 * a copy of the environment and written there by #mdb_env_apply_pages().
+	 * The cost in the writer is one page number per written page, and the
+	 * amount of data grows with the writes, not with the database size.
+	 * The replica must start out as a plain (not compacted) copy made by
+	 * #mdb_env_copy(), taken while no write transaction can commit without
+	 * the callback set, so that no transaction is missed.
+	 *
+	 * This must be called after #mdb_env_open() and while the environment
+	 * has no active write transaction. It is not supported by builds with
+	 * \b MDB_VL32.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] func An #MDB_commit_func function, or NULL to disable it.
+	 * @param[in] ctx An arbitrary pointer passed to \b func.
+	 * @return A non-zero error value on failure and 0 on success. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>EINVAL - the environment is not open, or has an active
+	 *		write transaction.
+	 *	<li>MDB_INCOMPATIBLE - this is an \b MDB_VL32 build.
+	 * </ul>
+	 */
+int  mdb_env_set_commit_hook(MDB_env *env, MDB_commit_func *func, void *ctx);
+
+	/** @brief Apply the pages of a committed transaction to a replica.
+	 *
+	 * Writes the pages passed to an #MDB_commit_func of another
+	 * environment into this one, which must be a replica of it as
+	 * described for #mdb_env_set_commit_hook(). The transactions must be
+	 * applied in order, without gaps. The data pages are synced before the
+	 * meta page is written, so the replica moves to the new transaction
+	 * atomically, as with an ordinary commit. Read transactions may keep
+	 * running in the replica, but none may be older than its last
+	 * applied transaction. The replica must not be written to otherwise.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully, without #MDB_RDONLY, and
+	 * with a map size at least as large as the other environment uses.
+	 * @param[in] txnid The ID of the transaction, as given to the callback.
+	 * @param[in] pages The pages of the transaction, ending with its meta page.
+	 * @param[in] count The number of entries in \b pages.
+	 * @return A non-zero error value on failure and 0 on success. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>MDB_INVALID - \b pages are not the pages of a transaction.
+	 *	<li>EINVAL - \b txnid does not follow the replica's last transaction,
+	 *		or the page size differs.
+	 *	<li>MDB_MAP_FULL - the pages do not fit in the replica's map size.
+	 *	<li>EBUSY - a read transaction is older than the last applied one,
+	 *		or there is an active write transaction. The call may be retried.
+	 *	<li>EACCES - the environment is read-only.
+	 *	<li>MDB_INCOMPATIBLE - this is an \b MDB_VL32 build.
+	 * </ul>
+	 */
+int  mdb_env_apply_pages(MDB_env *env, mdb_size_t txnid,
+	MDB_pageset *pages, mdb_size_t count);
+
+	/** @brief Shrink the data file of an environment, online.
+	 *
+	 * Performs one step of moving pages from the end of the file into
+	 * free pages lower down, as an ordinary write transaction. Readers
+	 * and other writers may keep running; the step only waits for the
+	 * writer lock. Free pages at the end of the file which no reader can
+	 * still see are dropped, and the file is truncated to the pages in use.
+	 *
+	 * Pages that were moved only become free once no reader can still
+	 * see them, so this must be called repeatedly until it returns
+	 * #MDB_NOTFOUND, pausing whenever it returns EBUSY. Every step
+	 * walks all of the databases in the environment, so \b maxpages
+	 * should be large enough that only a few steps are needed, and
+	 * small enough for the transaction to fit in memory. Large values
+	 * are moved into the lowest run of free pages that fits them, so
+	 * with a fragmented freelist the file may stay somewhat larger
+	 * than a compacting copy.
+	 * The file is not truncated in an environment opened with
+	 * #MDB_WRITEMAP, nor on Windows; there the pages are still moved,
+	 * so a compacting copy gets smaller and faster.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully, without #MDB_RDONLY.
+	 * The calling thread must not have a write transaction open.
+	 * @param[in] maxpages The most pages to move in this step, or 0 for
+	 * no limit.
+	 * @param[out] moved If non-NULL, the number of pages moved by this step.
+	 * @return A non-zero error value on failure and 0 on success. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>#MDB_NOTFOUND - there was nothing more to do.
+	 *	<li>EBUSY - no free page can be reused until an old reader ends.
+	 *	<li>EACCES - the environment is read-only.
+	 *	<li>MDB_INCOMPATIBLE - this is an \b MDB_VL32 build.
+	 * </ul>
+	 */
+int  mdb_env_shrink(MDB_env *env, mdb_size_t maxpages, mdb_size_t *moved);
+
 	/** @brief Return statistics about the LMDB environment.
 	 *
 	 * @param[in] env An environment handle returned by #mdb_env_create()
@@ -761,6 +1190,25 @@ int  mdb_env_stat(MDB_env *env, MDB_stat *stat);
 	 */
 int  mdb_env_info(MDB_env *env, MDB_envinfo *stat);
 
+	/** @brief Return hot-path counters for the LMDB environment.
+	 *
+	 * The counters cover B-tree restructuring, dirty page spilling,
+	 * page allocation and freelist work, page writes and syncs, and
+	 * reader table scans. Take two snapshots and subtract them to measure
+	 * a workload. Frequent growth for multi-page requests with a large
+	 * freelist usually means the freelist is fragmented.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[out] metrics The address of an #MDB_metrics structure
+	 * 	where the counters will be copied
+	 * @return A non-zero error value on failure and 0 on success. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the
+	 *		environment is not open.
+	 * </ul>
+	 */
+int  mdb_env_metrics(MDB_env *env, MDB_metrics *metrics);
+
 	/** @brief Flush the data buffers to disk.
 	 *
 	 * Data is always written to disk when #mdb_txn_commit() is called,
@@ -782,6 +1230,63 @@ int  mdb_env_info(MDB_env *env, MDB_envinfo *stat);
 	 */
 int  mdb_env_sync(MDB_env *env, int force);
 
+	/** @brief A callback function for the progress of #mdb_env_warmup().
+	 *
+	 * @param[in] env An environment handle returned by #mdb_env_create().
+	 * @param[in] done The number of pages read so far.
+	 * @param[in] total The number of pages to read.
+	 * @param[in] ctx The context passed to #mdb_env_warmup().
+	 * @return 0 to go on, or a non-zero value to stop the warm-up.
+	 */
+typedef int  (MDB_warmup_func)(MDB_env *env, mdb_size_t done, mdb_size_t total, void *ctx);
+
+	/** @brief Read the B-trees of the environment into memory.
+	 *
+	 * Right after #mdb_env_open() every page a request touches for the
+	 * first time costs a page fault and a disk read. This brings the
+	 * branch pages of all DBs into the page cache first, level by level
+	 * from the roots down, so the upper levels of every tree are resident
+	 * before any leaves are read. Each level is split between the threads,
+	 * which issue read-ahead advice for a batch of pages before reading them.
+	 * The main DB, the free DB and each named DB with an open handle in the
+	 * environment are included. Sub-databases of #MDB_DUPSORT DBs and
+	 * overflow pages are not.
+	 *
+	 * A read-only transaction is used, so the same rules as for
+	 * #mdb_txn_begin() apply to the calling thread. The caller is one of
+	 * the threads, and is the only one calling \b func.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully.
+	 * @param[in] flags Special options for the warm-up. This parameter
+	 * must be set to 0 or by bitwise OR'ing together one or more of the
+	 * values described here.
+	 * <ul>
+	 *	<li>#MDB_WARMUP_LEAVES
+	 *		Also read all leaf pages, once the branch pages are done.
+	 *	<li>#MDB_WARMUP_LOCK
+	 *		Lock the branch pages into memory with mlock(), subject to
+	 *		RLIMIT_MEMLOCK. They stay locked until the environment is closed.
+	 * </ul>
+	 * @param[in] nthreads The number of threads to use. A single thread is
+	 * used on Windows.
+	 * @param[in] timeout The number of seconds after which to stop, or 0
+	 * for no limit.
+	 * @param[in] func A #MDB_warmup_func function for progress reports,
+	 * or NULL.
+	 * @param[in] ctx An arbitrary pointer passed to \b func.
+	 * @return A non-zero error value on failure and 0 on success. The first
+	 * non-zero value returned by \b func stops the warm-up and is returned.
+	 * Some possible errors are:
+	 * <ul>
+	 *	<li>ETIMEDOUT - the warm-up did not finish within \b timeout.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>MDB_INCOMPATIBLE - this is an \b MDB_VL32 build.
+	 * </ul>
+	 * Errors from mlock() are returned as well.
+	 */
+int  mdb_env_warmup(MDB_env *env, unsigned int flags, unsigned int nthreads,
+	unsigned int timeout, MDB_warmup_func *func, void *ctx);
+
 	/** @brief Close the environment and release the memory map.
 	 *
 	 * Only a single thread may call this function. All transactions, databases,
@@ -935,6 +1440,68 @@ int  mdb_env_get_maxreaders(MDB_env *env, unsigned int *readers);
 	 */
 int  mdb_env_set_maxdbs(MDB_env *env, MDB_dbi dbs);
 
+	/** @brief Set the maximum number of dirty pages in a write transaction.
+	 *
+	 * This bounds how many pages a write transaction, including its nested
+	 * transactions, keeps in memory. Past this limit, LMDB writes some dirty
+	 * pages out to the map before the transaction commits, and may finally
+	 * fail with #MDB_TXN_FULL. The default is 131071 pages. Raising it lets
+	 * large transactions avoid that early spilling, at a cost of one
+	 * database page of memory for each extra dirty page.
+	 * This function may only be called after #mdb_env_create() and before #mdb_env_open().
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] pages The maximum number of dirty pages, at least 65536
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the environment is already open.
+	 * </ul>
+	 */
+int  mdb_env_set_maxdirty(MDB_env *env, unsigned int pages);
+
+	/** @brief Get the maximum number of dirty pages in a write transaction.
+	 *
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[out] pages Address of an integer to store the number of pages
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_env_get_maxdirty(MDB_env *env, unsigned int *pages);
+
+	/** @brief Set the memory budget of the page mapping cache.
+	 *
+	 * Only builds with \b MDB_VL32 use this. They map the data file in
+	 * chunks as pages are read, and keep the chunks mapped for reuse.
+	 * Once the mapped chunks exceed this many bytes, those that no
+	 * transaction is using are unmapped, least recently used first.
+	 * Chunks in use stay mapped, so the budget can be exceeded while
+	 * many transactions are active. The default is 256MB.
+	 * This function may only be called after #mdb_env_create() and before #mdb_env_open().
+	 * Other builds accept and ignore the setting.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] size The budget in bytes
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the environment is already open.
+	 * </ul>
+	 */
+int  mdb_env_set_rpage_budget(MDB_env *env, mdb_size_t size);
+
+	/** @brief Return the counters of the page mapping cache.
+	 *
+	 * See #mdb_env_set_rpage_budget(). Builds without \b MDB_VL32 have
+	 * no such cache and return all zeroes.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[out] info The address of an #MDB_rpageinfo structure
+	 * 	where the counters will be copied
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_env_rpage_info(MDB_env *env, MDB_rpageinfo *info);
+
 	/** @brief Get the maximum size of keys and #MDB_DUPSORT data we can write.
 	 *
 	 * Depends on the compile-time constant #MDB_MAXKEYSIZE. Default 511.
@@ -1051,6 +1618,79 @@ mdb_size_t mdb_txn_id(MDB_txn *txn);
 	 */
 int  mdb_txn_commit(MDB_txn *txn);
 
+/** @brief Where the time of a write transaction commit went.
+ *
+ *	Filled in by #mdb_txn_commit_ex() and passed to an #MDB_commitinfo_func.
+ *	Times are wall clock microseconds. The phases run in the order listed;
+ *	anything not covered by them, such as updating the named DBs' records
+ *	in the main DB, only counts in \b ci_total_usec.
+ *	With #MDB_GROUPCOMMIT, \b ci_sync_usec covers waiting for and taking
+ *	part in the group sync, which also writes the meta page, and
+ *	\b ci_meta_usec is 0.
+ */
+typedef struct MDB_commitinfo {
+	mdb_size_t	ci_txnid;			/**< ID of the committed transaction */
+	mdb_size_t	ci_total_usec;		/**< The whole commit */
+	mdb_size_t	ci_freelist_usec;	/**< Saving the freelist into the free DB */
+	mdb_size_t	ci_flush_usec;		/**< Writing the dirty pages */
+	mdb_size_t	ci_sync_usec;		/**< Syncing the data pages */
+	mdb_size_t	ci_meta_usec;		/**< Writing and syncing the meta page */
+	/** Dirty pages written by the commit, counting each page of
+	 *	an overflow value
+	 */
+	mdb_size_t	ci_dirty_pages;
+	mdb_size_t	ci_write_bytes;		/**< Bytes written for those pages */
+	mdb_size_t	ci_writes;			/**< Write calls for those pages */
+	/** Pages the transaction took over from free DB records, for reuse */
+	mdb_size_t	ci_reclaimed;
+	/** Dirty pages the transaction spilled to the map before the commit,
+	 *	counted the same way. They are not counted in \b ci_dirty_pages.
+	 */
+	mdb_size_t	ci_spilled;
+} MDB_commitinfo;
+
+	/** @brief Commit a transaction, reporting how long each phase took.
+	 *
+	 * This is #mdb_txn_commit(), which also fills in \b info when it
+	 * succeeds. For a read-only or nested transaction, only
+	 * \b ci_txnid and \b ci_total_usec are set.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[out] info The address of an #MDB_commitinfo structure, or NULL.
+	 * @return A non-zero error value on failure and 0 on success, as for
+	 * #mdb_txn_commit().
+	 */
+int  mdb_txn_commit_ex(MDB_txn *txn, MDB_commitinfo *info);
+
+	/** @brief A callback function for commit timings.
+	 *
+	 * Called by #mdb_txn_commit() and #mdb_txn_commit_ex() in the
+	 * committing thread after each successful commit of a top-level write
+	 * transaction, once the writer lock has been released. It should return
+	 * quickly, since the commit call does not return before it does.
+	 * @param[in] env An environment handle returned by #mdb_env_create().
+	 * @param[in] info The timings of the commit.
+	 * @param[in] ctx The context pointer given to #mdb_env_set_commit_timing().
+	 */
+typedef void (MDB_commitinfo_func)(MDB_env *env, const MDB_commitinfo *info,
+	void *ctx);
+
+	/** @brief Set or reset the commit timing callback of the environment.
+	 *
+	 * Commit phases are only timed while this callback is set, or when
+	 * the caller asks for them with #mdb_txn_commit_ex().
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] func An #MDB_commitinfo_func function, or NULL to disable it.
+	 * @param[in] ctx An arbitrary pointer passed to \b func.
+	 * @return A non-zero error value on failure and 0 on success. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the environment
+	 *		has an active write transaction.
+	 * </ul>
+	 */
+int  mdb_env_set_commit_timing(MDB_env *env, MDB_commitinfo_func *func,
+	void *ctx);
+
 	/** @brief Abandon all the operations of the transaction instead of saving them.
 	 *
 	 * The transaction handle is freed. It and its cursors must not be used
@@ -1186,6 +1826,99 @@ int  mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *d
 	 */
 int  mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *stat);
 
+	/** @brief Walk a database and report how its pages are used.
+	 *
+	 * Unlike #mdb_stat(), this reads every branch and leaf page of the DB,
+	 * and the first page of each overflow value. The tree is split into
+	 * subtrees below its top branch levels, like #mdb_range_split() does,
+	 * which the threads walk one at a time. The calling thread is one
+	 * of them. A single thread is used for a write transaction, or when
+	 * built with MDB_VL32 or for Windows.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open(), or 0
+	 * for the free DB
+	 * @param[in] nthreads The number of threads to use.
+	 * @param[out] info The address of an #MDB_pageinfo structure
+	 * 	where the statistics will be copied
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_stat_pages(MDB_txn *txn, MDB_dbi dbi, unsigned int nthreads,
+	MDB_pageinfo *info);
+
+	/** @brief Estimate the size of a range of keys in a database.
+	 *
+	 * This descends the tree once for each bound and reads no other pages,
+	 * so it is cheap enough for choosing between a lookup and a scan. The
+	 * result comes from the positions of the bounds in the pages along both
+	 * paths, scaled by the DB's #MDB_stat counts. It is exact when both
+	 * bounds fall in the same leaf page of a DB without #MDB_DUPSORT.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] lo The lowest key in the range, or NULL for the start of the DB.
+	 * @param[in] hi The first key past the range, or NULL for the end of the DB.
+	 * @param[out] entries If non-NULL, the estimated number of data items
+	 * with keys in [lo, hi).
+	 * @param[out] pages If non-NULL, the estimated number of leaf and overflow
+	 * pages a cursor walk over the range would read.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_estimate_range(MDB_txn *txn, MDB_dbi dbi, MDB_val *lo, MDB_val *hi,
+	mdb_size_t *entries, mdb_size_t *pages);
+
+	/** @brief Split a database into ranges of roughly equal size.
+	 *
+	 * The boundaries are separator keys from the tree's top branch levels,
+	 * so subtrees on one level are divided evenly between the ranges. Fewer
+	 * than \b n branch pages are read per level, and no leaf pages. The
+	 * ranges are [NULL, keys[0]), [keys[0], keys[1]) ... [keys[count-1], NULL).
+	 * Small DBs may give fewer than \b n ranges.
+	 *
+	 * The keys point into the map, like the results of #mdb_get(). They are
+	 * valid until the end of the transaction, or the next update in it.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] n The number of ranges wanted.
+	 * @param[out] keys An array of at least n-1 keys for the boundaries.
+	 * @param[out] count The number of boundaries returned, at most n-1.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_range_split(MDB_txn *txn, MDB_dbi dbi, unsigned int n, MDB_val *keys,
+	unsigned int *count);
+
+	/** @brief Scan a database in parallel.
+	 *
+	 * The DB is split by #mdb_range_split() into a few ranges per thread.
+	 * The threads call \b func for one range at a time until all are done,
+	 * each with its own cursor in the same snapshot. The calling thread is
+	 * one of them. The callback must only use the cursor it is given, since
+	 * this transaction is otherwise not safe to share between threads.
+	 *
+	 * A single thread is used for a write transaction, a DB with a codec
+	 * set by #mdb_set_codec(), or when built with MDB_VL32 or for Windows.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] nthreads The number of threads to use.
+	 * @param[in] func The callback to run on each range.
+	 * @param[in] ctx An arbitrary pointer passed to each call of \b func.
+	 * @return A non-zero error value on failure and 0 on success.
+	 * The first non-zero value returned by \b func stops the scan and
+	 * is returned.
+	 */
+int  mdb_range_scan(MDB_txn *txn, MDB_dbi dbi, unsigned int nthreads,
+	MDB_range_func *func, void *ctx);
+
 	/** @brief Retrieve the DB flags for a database handle.
 	 *
 	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
@@ -1219,7 +1952,13 @@ void mdb_dbi_close(MDB_env *env, MDB_dbi dbi);
 	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
 	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
 	 * @param[in] del 0 to empty the DB, 1 to delete it from the
-	 * environment and close the DB handle.
+	 * environment and close the DB handle. Either may be OR'd with
+	 * #MDB_DROP_LAZY: this takes constant time, since only the root of the
+	 * DB's tree is recorded in the freeDB. Later top-level write transactions
+	 * free its pages a chunk at a time, before growing the map. Until then
+	 * they are not available for reuse, and the file may grow instead.
+	 * Once a lazy drop has been committed, versions of LMDB without this
+	 * feature fail to open the environment with #MDB_VERSION_MISMATCH.
 	 * @return A non-zero error value on failure and 0 on success.
 	 */
 int  mdb_drop(MDB_txn *txn, MDB_dbi dbi, int del);
@@ -1268,6 +2007,47 @@ int  mdb_set_compare(MDB_txn *txn, MDB_dbi dbi, MDB_cmp_func *cmp);
 	 */
 int  mdb_set_dupsort(MDB_txn *txn, MDB_dbi dbi, MDB_cmp_func *cmp);
 
+	/** @brief Set a custom search function for the keys of a database.
+	 *
+	 * Lookups search the keys of each page they visit. With a custom
+	 * comparison function that search calls #mdb_set_compare()'s function
+	 * through a pointer for every probe. An #MDB_search_func searches
+	 * the whole page instead, so it can compare keys inline. The C++
+	 * wrapper in lmdb.hpp instantiates one for a comparator type.
+	 * The search function must order keys exactly like the comparison
+	 * function, which is still used for everything else.
+	 * Setting a comparison function with #mdb_set_compare() clears it.
+	 * The default key orders already have a specialized search.
+	 * @warning This function must be called after #mdb_set_compare(),
+	 * before any data access functions are used.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] search An #MDB_search_func function, or NULL to go
+	 * back to the generic search
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_set_search(MDB_txn *txn, MDB_dbi dbi, MDB_search_func *search);
+
+	/** @brief Set a custom search function for the data items of a #MDB_DUPSORT database.
+	 *
+	 * Like #mdb_set_search(), for the function set by #mdb_set_dupsort().
+	 * Setting a comparison function with #mdb_set_dupsort() clears it.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] search An #MDB_search_func function, or NULL to go
+	 * back to the generic search
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_set_dupsearch(MDB_txn *txn, MDB_dbi dbi, MDB_search_func *search);
+
 	/** @brief Set a relocation function for a #MDB_FIXEDMAP database.
 	 *
 	 * @todo The relocation function is called whenever it is necessary to move the data
@@ -1304,6 +2084,44 @@ int  mdb_set_relfunc(MDB_txn *txn, MDB_dbi dbi, MDB_rel_func *rel);
 	 */
 int  mdb_set_relctx(MDB_txn *txn, MDB_dbi dbi, void *ctx);
 
+	/** @brief Set a compression codec for a database.
+	 *
+	 * Values which are too big to fit in a leaf page are passed through
+	 * \b enc before they are written, and stored compressed when that
+	 * saves space. Smaller values, values written with #MDB_RESERVE
+	 * and records that already exist are stored as they are. Reading
+	 * a compressed value passes it through \b dec into a buffer owned
+	 * by the transaction, which is released when the transaction ends;
+	 * such values are therefore not zero-copy, and a transaction that
+	 * reads many of them holds all of them in memory until it ends.
+	 *
+	 * LMDB provides no codec of its own. Applications typically wrap
+	 * a library such as LZ4 or zstd. Whether a value was compressed is
+	 * recorded with the value, so a database may hold a mix of both,
+	 * and reading a compressed value without a decompressor fails
+	 * with #MDB_INCOMPATIBLE. Like #mdb_set_compare(), the codec must be
+	 * set before the database is used, by every process and every time
+	 * the database is opened, and must always be the same. Once a
+	 * compressed value has been committed, versions of LMDB without
+	 * this feature fail to open the environment with #MDB_VERSION_MISMATCH.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] enc A #MDB_codec_func compressing a value, or NULL to
+	 * store new values uncompressed. The library gives it room for a
+	 * result somewhat smaller than the original value.
+	 * @param[in] dec A #MDB_codec_func restoring a value compressed
+	 * by \b enc. The library gives it room for exactly the original size.
+	 * @param[in] ctx An arbitrary pointer passed to both functions.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>#MDB_INCOMPATIBLE - the database was opened with #MDB_DUPSORT.
+	 * </ul>
+	 */
+int  mdb_set_codec(MDB_txn *txn, MDB_dbi dbi, MDB_codec_func *enc,
+	MDB_codec_func *dec, void *ctx);
+
 	/** @brief Get items from a database.
 	 *
 	 * This function retrieves key/data pairs from the database. The address
@@ -1332,6 +2150,37 @@ int  mdb_set_relctx(MDB_txn *txn, MDB_dbi dbi, void *ctx);
 	 */
 int  mdb_get(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 
+	/** @brief Get several items from a database.
+	 *
+	 * This function is equivalent to calling #mdb_get() for each key,
+	 * but uses a single cursor for all of the lookups, with the
+	 * #MDB_GET_MULTI_SORTED operation. When the keys are in ascending
+	 * order, consecutive keys that fall on the same or nearby leaf
+	 * pages avoid most of the search from the root. Keys in any other
+	 * order are still found, just without that benefit.
+	 *
+	 * @note The same notes as for #mdb_get() apply to the returned values.
+	 * With #MDB_VL32 a large batch may cause earlier values to be unmapped;
+	 * copy them out or use smaller batches.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] keys An array of \b n keys to search for
+	 * @param[in] n The number of keys
+	 * @param[out] vals An array of \b n items to receive the data
+	 * corresponding to each key. Keys which were not found get an
+	 * empty value with a NULL address.
+	 * @param[out] rcs An array of \b n result codes, 0 if the key was
+	 * found or #MDB_NOTFOUND if it was not.
+	 * @return A non-zero error value if the lookups could not be completed,
+	 * and 0 otherwise. A missing key does not count as a failure. Some
+	 * possible errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_get_batch(MDB_txn *txn, MDB_dbi dbi, MDB_val *keys, unsigned int n,
+	MDB_val *vals, int *rcs);
+
 	/** @brief Store items into a database.
 	 *
 	 * This function stores key/data pairs in the database. The default behavior
@@ -1382,6 +2231,67 @@ int  mdb_get(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 int  mdb_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data,
 			    unsigned int flags);
 
+	/** @brief Start loading sorted data into an empty database.
+	 *
+	 * A bulk load builds the B-tree bottom-up: leaf pages are filled in
+	 * key order, and the branch pages above them are filled as each page
+	 * below is finished. Nothing is ever split or searched. Records are
+	 * added with #mdb_bulk_add() and the tree is completed by
+	 * #mdb_bulk_finish(), which must be called before the transaction
+	 * is committed. The database must not be used in any other way by
+	 * this transaction until then.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] fill The percentage of each leaf page to fill, from 1 to
+	 * 100. Leaving room speeds up later random inserts. 0 means 100.
+	 * @param[out] bulk Address where the new #MDB_bulk handle will be stored
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_INCOMPATIBLE - the database is not empty, or uses #MDB_DUPSORT.
+	 *	<li>EACCES - an attempt was made to write in a read-only transaction.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_bulk_begin(MDB_txn *txn, MDB_dbi dbi, unsigned int fill, MDB_bulk **bulk);
+
+	/** @brief Add a record to a bulk load.
+	 *
+	 * Keys must be added in strictly ascending order according to
+	 * the database's comparison function.
+	 * @param[in] bulk A bulk load handle returned by #mdb_bulk_begin()
+	 * @param[in] key The key to store in the database
+	 * @param[in] data The data to store
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_KEYEXIST - the key is not greater than the previous one.
+	 *	The record was not added, but the load may continue.
+	 *	<li>#MDB_BAD_VALSIZE - the key or data has an unsupported size.
+	 *	<li>#MDB_MAP_FULL - the database is full, see #mdb_env_set_mapsize().
+	 *	<li>#MDB_TXN_FULL - the transaction has too many dirty pages.
+	 * </ul>
+	 */
+int  mdb_bulk_add(MDB_bulk *bulk, MDB_val *key, MDB_val *data);
+
+	/** @brief Complete a bulk load.
+	 *
+	 * The branch pages still being filled are finished and the root
+	 * of the new tree is stored in the database record. The handle is
+	 * freed whether or not the call succeeds.
+	 * @param[in] bulk A bulk load handle returned by #mdb_bulk_begin()
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_bulk_finish(MDB_bulk *bulk);
+
+	/** @brief Abandon a bulk load.
+	 *
+	 * The handle is freed. If any records were added, the transaction
+	 * can only be aborted afterward.
+	 * @param[in] bulk A bulk load handle returned by #mdb_bulk_begin()
+	 */
+void mdb_bulk_abort(MDB_bulk *bulk);
+
 	/** @brief Delete items from a database.
 	 *
 	 * This function removes key/data pairs from the database.
@@ -1406,6 +2316,107 @@ int  mdb_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data,
 	 */
 int  mdb_del(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 
+	/** @brief Create a write batch.
+	 *
+	 * A batch collects puts and deletes without a transaction, so a
+	 * thread can prepare them without holding the writer lock. The
+	 * batch copies every key and data item. #mdb_batch_apply() then
+	 * performs them all in a write transaction, in key order. Several
+	 * batches may be applied in the same transaction to commit them
+	 * together. A batch must only be used by one thread at a time.
+	 * @param[in] env An environment handle returned by #mdb_env_create(),
+	 * which must already be open.
+	 * @param[out] batch Address where the new #MDB_batch handle will be stored
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_batch_create(MDB_env *env, MDB_batch **batch);
+
+	/** @brief Add a put to a write batch.
+	 *
+	 * @param[in] batch A batch handle returned by #mdb_batch_create()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open(). It
+	 * must stay open until the batch is applied.
+	 * @param[in] key The key to store
+	 * @param[in] data The data to store
+	 * @param[in] flags 0, or #MDB_NOOVERWRITE and #MDB_NODUPDATA as for
+	 * #mdb_put(). When applied, a put these flags reject is skipped.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_BAD_VALSIZE - the key has an unsupported size.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_batch_put(MDB_batch *batch, MDB_dbi dbi, MDB_val *key, MDB_val *data,
+				unsigned int flags);
+
+	/** @brief Add a delete to a write batch.
+	 *
+	 * The \b key and \b data parameters work as for #mdb_del().
+	 * When applied, a delete of an item which is not in the database
+	 * is skipped.
+	 * @param[in] batch A batch handle returned by #mdb_batch_create()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] key The key to delete
+	 * @param[in] data The data to delete, or NULL
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_batch_del(MDB_batch *batch, MDB_dbi dbi, MDB_val *key, MDB_val *data);
+
+	/** @brief Sort a write batch into the order it will be applied.
+	 *
+	 * Updates are ordered by database handle, and then by key with
+	 * the database's comparison function. Updates of the same key keep
+	 * the order they were added in. #mdb_batch_apply() sorts the batch
+	 * if needed, but calling this first keeps that work outside the
+	 * write transaction. Sorting a batch that was filled in key order
+	 * is cheap.
+	 * @param[in] batch A batch handle returned by #mdb_batch_create()
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_batch_sort(MDB_batch *batch);
+
+	/** @brief Perform the updates of a write batch.
+	 *
+	 * Each database is updated with a single cursor, visiting keys in
+	 * order, so neighbouring keys mostly reuse the cursor's position
+	 * instead of searching from the root. The batch is left unchanged
+	 * and may be applied again, or reset with #mdb_batch_reset().
+	 * If this fails, some updates may already have been made; the
+	 * transaction should then be aborted.
+	 * @param[in] txn A write transaction handle returned by #mdb_txn_begin()
+	 * in the environment the batch was created for.
+	 * @param[in] batch A batch handle returned by #mdb_batch_create()
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_MAP_FULL - the database is full, see #mdb_env_set_mapsize().
+	 *	<li>#MDB_TXN_FULL - the transaction has too many dirty pages.
+	 *	<li>EACCES - an attempt was made to write in a read-only transaction.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_batch_apply(MDB_txn *txn, MDB_batch *batch);
+
+	/** @brief Empty a write batch so it can be filled again.
+	 *
+	 * Its memory is kept for reuse.
+	 * @param[in] batch A batch handle returned by #mdb_batch_create()
+	 */
+void mdb_batch_reset(MDB_batch *batch);
+
+	/** @brief Free a write batch.
+	 *
+	 * @param[in] batch A batch handle returned by #mdb_batch_create()
+	 */
+void mdb_batch_free(MDB_batch *batch);
+
 	/** @brief Create a cursor handle.
 	 *
 	 * A cursor is associated with a specific transaction and database.
@@ -1552,6 +2563,58 @@ int  mdb_cursor_get(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
 int  mdb_cursor_put(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
 				unsigned int flags);
 
+	/** @brief Overwrite part of the data item at a cursor position.
+	 *
+	 * This function replaces \b data->mv_size bytes of the current data item,
+	 * starting at \b offset, with \b data->mv_data. The size of the item
+	 * does not change. Only large items kept on overflow pages benefit:
+	 * the first ranged write to an item written by an earlier transaction
+	 * copies it once into fixed-size segments, and later ones copy only the
+	 * segments the range overlaps instead of the whole item. Other writes
+	 * to the item are not affected, and a later #mdb_put() of the whole
+	 * item stores it as usual again. Once a segmented item has been
+	 * committed, versions of LMDB without this feature fail to open the
+	 * environment with #MDB_VERSION_MISMATCH.
+	 * This function is not valid on databases with #MDB_DUPSORT or on
+	 * items encoded by an #MDB_codec_func.
+	 * @param[in] cursor A cursor handle returned by #mdb_cursor_open()
+	 * @param[in] offset The offset of the range in the current data item.
+	 * @param[in] data The new contents of the range.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_NOTFOUND - the cursor is not on an item.
+	 *	<li>#MDB_INCOMPATIBLE - the database or the item doesn't allow ranged writes.
+	 *	<li>#MDB_TXN_FULL - the transaction has too many dirty pages.
+	 *	<li>EACCES - an attempt was made to write in a read-only transaction.
+	 *	<li>EINVAL - the cursor is not initialized, or the range extends past
+	 *	the end of the item.
+	 * </ul>
+	 */
+int  mdb_cursor_put_range(MDB_cursor *cursor, mdb_size_t offset, MDB_val *data);
+
+	/** @brief Retrieve part of the data item at a cursor position.
+	 *
+	 * This function returns \b data->mv_size bytes of the current data item,
+	 * starting at \b offset, without assembling the rest of an item stored
+	 * by #mdb_cursor_put_range(). A range within one segment of such an item
+	 * is returned in place. One spanning segments is copied into a
+	 * buffer owned by the transaction, valid until it ends.
+	 * This function is not valid on databases with #MDB_DUPSORT.
+	 * @param[in] cursor A cursor handle returned by #mdb_cursor_open()
+	 * @param[in] offset The offset of the range in the current data item.
+	 * @param[in,out] data The size of the range on input, the range on output.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_NOTFOUND - the cursor is not on an item.
+	 *	<li>#MDB_INCOMPATIBLE - the database doesn't allow ranged reads.
+	 *	<li>EINVAL - the cursor is not initialized, or the range extends past
+	 *	the end of the item.
+	 * </ul>
+	 */
+int  mdb_cursor_get_range(MDB_cursor *cursor, mdb_size_t offset, MDB_val *data);
+
 	/** @brief Delete current key/data pair
 	 *
 	 * This function deletes the key/data pair to which the cursor refers.
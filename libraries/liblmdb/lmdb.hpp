@@ -0,0 +1,597 @@
+/** @file lmdb.hpp
+ *	@brief Lightning memory-mapped database library, C++ interface
+ *
+ *	A header-only layer over lmdb.h. It needs C++17, and uses std::span
+ *	when compiled as C++20.
+ *
+ *	- #lmdb::env, #lmdb::txn and #lmdb::cursor own the C handles and
+ *	  release them when they go out of scope.
+ *	- #lmdb::basic_db is a database whose keys and values are converted
+ *	  by codec template parameters. #lmdb::codec provides codecs for
+ *	  std::string_view, std::string, std::span and trivially copyable
+ *	  types. Results decoded as views point straight into the map, so
+ *	  like any #MDB_val they are valid only until a subsequent update
+ *	  operation, or the end of the transaction.
+ *	- A database may take a comparator type. #lmdb::set_compare() installs
+ *	  it with both #mdb_set_compare() and #mdb_set_search(). The page search
+ *	  is instantiated for the comparator, so probes compare keys inline
+ *	  instead of calling through a pointer.
+ *
+ *	Failures throw #lmdb::error. Missing keys are not failures, lookups
+ *	return an empty std::optional for them.
+ */
+/*
+ * Copyright 2011-2019 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+#ifndef _LMDB_HPP_
+#define _LMDB_HPP_
+
+#include "lmdb.h"
+
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#if __cplusplus >= 202002L && defined(__has_include)
+# if __has_include(<span>)
+#  include <span>
+#  define LMDB_HPP_SPAN	1
+# endif
+#endif
+
+namespace lmdb {
+
+/** @brief An error returned by the C interface */
+class error : public std::runtime_error {
+public:
+	explicit error(int rc) : std::runtime_error(mdb_strerror(rc)), rc_(rc) {}
+	/** The LMDB or system error code */
+	int code() const noexcept { return rc_; }
+private:
+	int rc_;
+};
+
+/** Throw an #lmdb::error for a non-zero return code */
+inline void check(int rc)
+{
+	if (rc)
+		throw error(rc);
+}
+
+/** @defgroup codecs Codecs
+ *	A codec converts between a C++ type and the bytes stored in a database.
+ *	It has:
+ *	- \b type, the type encode() accepts;
+ *	- \b fixed_size, the size of every encoded item, or 0 if it varies;
+ *	- <tt>static MDB_val encode(const type &)</tt>, which returns a value
+ *	  pointing at its argument's storage, and doesn't copy;
+ *	- <tt>static R decode(const MDB_val &) noexcept</tt>, which may return
+ *	  a view into the map. It is only given values of \b fixed_size.
+ *
+ *	Specialize #lmdb::codec for other types, or pass any class with these
+ *	members to #lmdb::basic_db.
+ *	@{
+ */
+template<class T, class Enable = void> struct codec;
+
+	/** Variable-size bytes, decoded as a view into the map */
+template<> struct codec<std::string_view> {
+	typedef std::string_view type;
+	static constexpr size_t fixed_size = 0;
+	static MDB_val encode(const std::string_view &v) noexcept
+	{
+		MDB_val val = {v.size(), const_cast<char *>(v.data())};
+		return val;
+	}
+	static std::string_view decode(const MDB_val &v) noexcept
+	{
+		return std::string_view(static_cast<const char *>(v.mv_data), v.mv_size);
+	}
+};
+
+	/** Variable-size bytes, decoded as a copy */
+template<> struct codec<std::string> {
+	typedef std::string type;
+	static constexpr size_t fixed_size = 0;
+	static MDB_val encode(const std::string &v) noexcept
+	{
+		MDB_val val = {v.size(), const_cast<char *>(v.data())};
+		return val;
+	}
+	static std::string decode(const MDB_val &v)
+	{
+		return std::string(static_cast<const char *>(v.mv_data), v.mv_size);
+	}
+};
+
+#ifdef LMDB_HPP_SPAN
+	/** Variable-size bytes, decoded as a view into the map */
+template<> struct codec<std::span<const std::byte>> {
+	typedef std::span<const std::byte> type;
+	static constexpr size_t fixed_size = 0;
+	static MDB_val encode(const type &v) noexcept
+	{
+		MDB_val val = {v.size(), const_cast<std::byte *>(v.data())};
+		return val;
+	}
+	static type decode(const MDB_val &v) noexcept
+	{
+		return type(static_cast<const std::byte *>(v.mv_data), v.mv_size);
+	}
+};
+#endif
+
+	/** Trivially copyable types, in native byte order. Values in the map
+	 *	need not be aligned, so they are decoded as copies.
+	 *	Integers use this with #MDB_INTEGERKEY and #MDB_INTEGERDUP.
+	 */
+template<class T>
+struct codec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+	typedef T type;
+	static constexpr size_t fixed_size = sizeof(T);
+	static MDB_val encode(const T &v) noexcept
+	{
+		MDB_val val = {sizeof(T), const_cast<T *>(&v)};
+		return val;
+	}
+	static T decode(const MDB_val &v) noexcept
+	{
+		T t;
+		std::memcpy(&t, v.mv_data, sizeof(T));
+		return t;
+	}
+};
+/** @} */
+
+namespace detail {
+
+template<class Codec>
+using decoded_t = decltype(Codec::decode(std::declval<const MDB_val &>()));
+
+template<class Codec>
+inline void check_size(const MDB_val &v)
+{
+	if (Codec::fixed_size && v.mv_size != Codec::fixed_size)
+		throw error(MDB_BAD_VALSIZE);
+}
+
+	/** The key at index \b i of an #MDB_keyset */
+inline MDB_val keyset_key(const MDB_keyset *ks, unsigned int i) noexcept
+{
+	MDB_val v;
+	if (!ks->ks_offs) {
+		v.mv_size = ks->ks_ksize;
+		v.mv_data = const_cast<char *>(ks->ks_base + (size_t)i * ks->ks_ksize);
+	} else {
+		const char *node = ks->ks_base + ks->ks_offs[i];
+		unsigned short size;
+		std::memcpy(&size, node + ks->ks_szoff, sizeof(size));
+		v.mv_size = size;
+		v.mv_data = const_cast<char *>(node + ks->ks_koff);
+	}
+	return v;
+}
+
+	/** Compare two items with \b Cmp, if both have the codec's fixed size.
+	 *	Items of another size can only have been stored through the C API.
+	 *	They are not decoded, but sorted by size and then by bytes, before
+	 *	or after all the others. The order stays total either way.
+	 */
+template<class Cmp, class Codec>
+inline int compare_val(Cmp &cmp, const MDB_val &a, const MDB_val &b) noexcept
+{
+	if (Codec::fixed_size &&
+		(a.mv_size != Codec::fixed_size || b.mv_size != Codec::fixed_size)) {
+		if (a.mv_size != b.mv_size)
+			return a.mv_size < b.mv_size ? -1 : 1;
+		return std::memcmp(a.mv_data, b.mv_data, a.mv_size);
+	}
+	return cmp(Codec::decode(a), Codec::decode(b));
+}
+
+	/** An #MDB_cmp_func for a comparator type */
+template<class Cmp, class Codec>
+int compare(const MDB_val *a, const MDB_val *b) noexcept
+{
+	Cmp cmp;
+	return compare_val<Cmp, Codec>(cmp, *a, *b);
+}
+
+	/** Binary search of an #MDB_keyset, comparing with \b f(key).
+	 *	Keys in a page are unique, so it can stop at the first equal key.
+	 */
+template<class F>
+inline unsigned int keyset_search(const MDB_keyset *ks, int *exact, F f) noexcept
+{
+	unsigned int low = ks->ks_low, high = ks->ks_high, i;
+	int rc;
+
+	while (low < high) {
+		i = (low + high) >> 1;
+		rc = f(keyset_key(ks, i));
+		if (rc == 0) {
+			*exact = 1;
+			return i;
+		}
+		if (rc > 0)
+			low = i + 1;
+		else
+			high = i;
+	}
+	*exact = 0;
+	return low;
+}
+
+	/** An #MDB_search_func for a comparator type: a binary search
+	 *	with the comparator inlined, ordered like #detail::compare().
+	 */
+template<class Cmp, class Codec>
+unsigned int search(const MDB_keyset *ks, const MDB_val *key, int *exact) noexcept
+{
+	Cmp cmp;
+
+	if (Codec::fixed_size && key->mv_size != Codec::fixed_size) {
+		return keyset_search(ks, exact, [&](const MDB_val &v) -> int {
+			return compare_val<Cmp, Codec>(cmp, *key, v);
+		});
+	}
+	/* Decode the key only once */
+	auto k = Codec::decode(*key);
+	return keyset_search(ks, exact, [&](const MDB_val &v) -> int {
+		if (Codec::fixed_size && v.mv_size != Codec::fixed_size)
+			return v.mv_size < Codec::fixed_size ? 1 : -1;
+		return cmp(k, Codec::decode(v));
+	});
+}
+
+} // namespace detail
+
+/** @brief Order the keys of a database by a comparator type.
+ *
+ *	\b Cmp is default constructible, and its call operator compares two
+ *	keys decoded by \b Codec, returning <0, 0 or >0 like #MDB_cmp_func.
+ *	It must not throw. Both #mdb_set_compare() and #mdb_set_search() are
+ *	called, with functions instantiated for \b Cmp.
+ */
+template<class Cmp, class Codec = codec<std::string_view>>
+inline void set_compare(MDB_txn *txn, MDB_dbi dbi)
+{
+	check(mdb_set_compare(txn, dbi, &detail::compare<Cmp, Codec>));
+	check(mdb_set_search(txn, dbi, &detail::search<Cmp, Codec>));
+}
+
+/** @brief Order the data items of a #MDB_DUPSORT database by a comparator type.
+ *
+ *	Like #lmdb::set_compare(), with #mdb_set_dupsort() and #mdb_set_dupsearch().
+ */
+template<class Cmp, class Codec = codec<std::string_view>>
+inline void set_dupsort(MDB_txn *txn, MDB_dbi dbi)
+{
+	check(mdb_set_dupsort(txn, dbi, &detail::compare<Cmp, Codec>));
+	check(mdb_set_dupsearch(txn, dbi, &detail::search<Cmp, Codec>));
+}
+
+/** @brief An environment handle, closed when destroyed */
+class env {
+public:
+	env() { check(mdb_env_create(&env_)); }
+	~env() { close(); }
+	env(env &&o) noexcept : env_(o.env_) { o.env_ = nullptr; }
+	env &operator=(env &&o) noexcept
+	{
+		if (this != &o) {
+			close();
+			env_ = o.env_;
+			o.env_ = nullptr;
+		}
+		return *this;
+	}
+	env(const env &) = delete;
+	env &operator=(const env &) = delete;
+
+	env &set_mapsize(mdb_size_t size) { check(mdb_env_set_mapsize(env_, size)); return *this; }
+	env &set_maxdbs(MDB_dbi dbs) { check(mdb_env_set_maxdbs(env_, dbs)); return *this; }
+	env &set_maxreaders(unsigned int readers) { check(mdb_env_set_maxreaders(env_, readers)); return *this; }
+	env &open(const char *path, unsigned int flags = 0, mdb_mode_t mode = 0644)
+	{
+		check(mdb_env_open(env_, path, flags, mode));
+		return *this;
+	}
+	void sync(bool force = true) { check(mdb_env_sync(env_, force)); }
+	void close() noexcept
+	{
+		if (env_) {
+			mdb_env_close(env_);
+			env_ = nullptr;
+		}
+	}
+	MDB_env *handle() const noexcept { return env_; }
+	operator MDB_env *() const noexcept { return env_; }
+
+private:
+	MDB_env *env_;
+};
+
+/** @brief A transaction handle, aborted when destroyed unless committed */
+class txn {
+public:
+	explicit txn(MDB_env *env, unsigned int flags = 0, MDB_txn *parent = nullptr)
+		: rdonly_((flags & MDB_RDONLY) != 0)
+	{
+		check(mdb_txn_begin(env, parent, flags, &txn_));
+	}
+	~txn() { abort(); }
+	txn(txn &&o) noexcept : txn_(o.txn_), rdonly_(o.rdonly_) { o.txn_ = nullptr; }
+	txn &operator=(txn &&o) noexcept
+	{
+		if (this != &o) {
+			abort();
+			txn_ = o.txn_;
+			rdonly_ = o.rdonly_;
+			o.txn_ = nullptr;
+		}
+		return *this;
+	}
+	txn(const txn &) = delete;
+	txn &operator=(const txn &) = delete;
+
+	void commit()
+	{
+		MDB_txn *t = txn_;
+		txn_ = nullptr;
+		check(mdb_txn_commit(t));
+	}
+	void abort() noexcept
+	{
+		if (txn_) {
+			mdb_txn_abort(txn_);
+			txn_ = nullptr;
+		}
+	}
+	/** Release a read-only transaction's snapshot, see #mdb_txn_reset() */
+	void reset() noexcept { mdb_txn_reset(txn_); }
+	/** Take a new snapshot after #reset() */
+	void renew() { check(mdb_txn_renew(txn_)); }
+	bool rdonly() const noexcept { return rdonly_; }
+	MDB_txn *handle() const noexcept { return txn_; }
+	operator MDB_txn *() const noexcept { return txn_; }
+
+private:
+	MDB_txn *txn_;
+	bool rdonly_;
+};
+
+/** @brief A database handle with typed keys and values.
+ *
+ *	@tparam KeyCodec The codec for keys.
+ *	@tparam ValueCodec The codec for values, or data items of a #MDB_DUPSORT database.
+ *	@tparam Cmp If not void, the comparator type for the keys, see #lmdb::set_compare().
+ *	@tparam DupCmp If not void, the comparator type for the data items, see #lmdb::set_dupsort().
+ *
+ *	The handle is a plain #MDB_dbi, see #mdb_dbi_open() for how long it stays valid.
+ */
+template<class KeyCodec, class ValueCodec, class Cmp = void, class DupCmp = void>
+class basic_db {
+public:
+	typedef typename KeyCodec::type key_arg;
+	typedef typename ValueCodec::type value_arg;
+	typedef detail::decoded_t<KeyCodec> key_type;
+	typedef detail::decoded_t<ValueCodec> value_type;
+	typedef KeyCodec key_codec;
+	typedef ValueCodec value_codec;
+
+	basic_db() noexcept : dbi_(0) {}
+	explicit basic_db(MDB_dbi dbi) noexcept : dbi_(dbi) {}
+
+	/** Open a database, see #mdb_dbi_open(), and install its comparators */
+	static basic_db open(MDB_txn *txn, const char *name = nullptr, unsigned int flags = 0)
+	{
+		MDB_dbi dbi;
+		check(mdb_dbi_open(txn, name, flags, &dbi));
+		if constexpr (!std::is_void<Cmp>::value)
+			set_compare<Cmp, KeyCodec>(txn, dbi);
+		if constexpr (!std::is_void<DupCmp>::value)
+			set_dupsort<DupCmp, ValueCodec>(txn, dbi);
+		return basic_db(dbi);
+	}
+
+	/** Look up a key. Returns nothing if the key is not in the database. */
+	std::optional<value_type> get(MDB_txn *txn, const key_arg &key) const
+	{
+		MDB_val k = KeyCodec::encode(key), v;
+		int rc = mdb_get(txn, dbi_, &k, &v);
+		if (rc == MDB_NOTFOUND)
+			return std::nullopt;
+		check(rc);
+		detail::check_size<ValueCodec>(v);
+		return ValueCodec::decode(v);
+	}
+
+	/** Store a key/value pair, see #mdb_put(). Returns false if
+	 *	#MDB_NOOVERWRITE or #MDB_NODUPDATA found it already exists.
+	 */
+	bool put(MDB_txn *txn, const key_arg &key, const value_arg &value, unsigned int flags = 0)
+	{
+		MDB_val k = KeyCodec::encode(key), v = ValueCodec::encode(value);
+		int rc = mdb_put(txn, dbi_, &k, &v, flags);
+		if (rc == MDB_KEYEXIST)
+			return false;
+		check(rc);
+		return true;
+	}
+
+	/** Delete a key, see #mdb_del(). Returns false if it wasn't there. */
+	bool del(MDB_txn *txn, const key_arg &key)
+	{
+		MDB_val k = KeyCodec::encode(key);
+		int rc = mdb_del(txn, dbi_, &k, nullptr);
+		if (rc == MDB_NOTFOUND)
+			return false;
+		check(rc);
+		return true;
+	}
+
+	/** Delete one data item of a #MDB_DUPSORT key. Returns false if it wasn't there. */
+	bool del(MDB_txn *txn, const key_arg &key, const value_arg &value)
+	{
+		MDB_val k = KeyCodec::encode(key), v = ValueCodec::encode(value);
+		int rc = mdb_del(txn, dbi_, &k, &v);
+		if (rc == MDB_NOTFOUND)
+			return false;
+		check(rc);
+		return true;
+	}
+
+	MDB_stat stat(MDB_txn *txn) const
+	{
+		MDB_stat st;
+		check(mdb_stat(txn, dbi_, &st));
+		return st;
+	}
+
+	MDB_dbi handle() const noexcept { return dbi_; }
+	operator MDB_dbi() const noexcept { return dbi_; }
+
+private:
+	MDB_dbi dbi_;
+};
+
+/** A #lmdb::basic_db using the #lmdb::codec of each type */
+template<class Key, class Value, class Cmp = void, class DupCmp = void>
+using db = basic_db<codec<Key>, codec<Value>, Cmp, DupCmp>;
+
+/** @brief A cursor on a #lmdb::basic_db.
+ *
+ *	Cursors in write transactions are closed by LMDB when the transaction
+ *	ends, so such a cursor must not outlive its #lmdb::txn object. Cursors
+ *	in read-only transactions may, like #mdb_cursor_close() allows.
+ */
+template<class DB>
+class cursor {
+public:
+	typedef typename DB::key_arg key_arg;
+	typedef typename DB::value_arg value_arg;
+	typedef std::pair<typename DB::key_type, typename DB::value_type> entry;
+
+	cursor(txn &t, const DB &db) : txn_(&t), rdonly_(t.rdonly())
+	{
+		check(mdb_cursor_open(t.handle(), db.handle(), &mc_));
+	}
+	~cursor() { close(); }
+	cursor(cursor &&o) noexcept : mc_(o.mc_), txn_(o.txn_), rdonly_(o.rdonly_) { o.mc_ = nullptr; }
+	cursor(const cursor &) = delete;
+	cursor &operator=(const cursor &) = delete;
+
+	void close() noexcept
+	{
+		if (mc_ && (rdonly_ || txn_->handle()))
+			mdb_cursor_close(mc_);
+		mc_ = nullptr;
+	}
+
+	/** Position the cursor, see #mdb_cursor_get(). Returns nothing
+	 *	if there is no such item.
+	 */
+	std::optional<entry> get(MDB_cursor_op op)
+	{
+		MDB_val k, v;
+		return fetch(op, k, v);
+	}
+	std::optional<entry> first() { return get(MDB_FIRST); }
+	std::optional<entry> last() { return get(MDB_LAST); }
+	std::optional<entry> next() { return get(MDB_NEXT); }
+	std::optional<entry> prev() { return get(MDB_PREV); }
+	std::optional<entry> current() { return get(MDB_GET_CURRENT); }
+	std::optional<entry> next_dup() { return get(MDB_NEXT_DUP); }
+	std::optional<entry> next_nodup() { return get(MDB_NEXT_NODUP); }
+
+	/** Position at \b key */
+	std::optional<entry> find(const key_arg &key)
+	{
+		MDB_val k = DB::key_codec::encode(key), v;
+		return fetch(MDB_SET_KEY, k, v);
+	}
+	/** Position at the first key not less than \b key */
+	std::optional<entry> lower_bound(const key_arg &key)
+	{
+		MDB_val k = DB::key_codec::encode(key), v;
+		return fetch(MDB_SET_RANGE, k, v);
+	}
+	/** Position at the first data item of \b key not less than \b value */
+	std::optional<entry> lower_bound(const key_arg &key, const value_arg &value)
+	{
+		MDB_val k = DB::key_codec::encode(key), v = DB::value_codec::encode(value);
+		return fetch(MDB_GET_BOTH_RANGE, k, v);
+	}
+
+	/** Store a key/value pair, see #mdb_cursor_put(). Returns false if
+	 *	#MDB_NOOVERWRITE or #MDB_NODUPDATA found it already exists.
+	 */
+	bool put(const key_arg &key, const value_arg &value, unsigned int flags = 0)
+	{
+		MDB_val k = DB::key_codec::encode(key), v = DB::value_codec::encode(value);
+		int rc = mdb_cursor_put(mc_, &k, &v, flags);
+		if (rc == MDB_KEYEXIST)
+			return false;
+		check(rc);
+		return true;
+	}
+	/** Overwrite bytes of the current item, see #mdb_cursor_put_range() */
+	void put_range(mdb_size_t offset, std::string_view bytes)
+	{
+		MDB_val v = codec<std::string_view>::encode(bytes);
+		check(mdb_cursor_put_range(mc_, offset, &v));
+	}
+	/** Read bytes of the current item, see #mdb_cursor_get_range() */
+	std::string_view get_range(mdb_size_t offset, size_t len)
+	{
+		MDB_val v;
+		v.mv_size = len;
+		check(mdb_cursor_get_range(mc_, offset, &v));
+		return codec<std::string_view>::decode(v);
+	}
+	/** Delete the current item, see #mdb_cursor_del() */
+	void del(unsigned int flags = 0) { check(mdb_cursor_del(mc_, flags)); }
+	/** The number of data items of the current key, see #mdb_cursor_count() */
+	mdb_size_t count()
+	{
+		mdb_size_t n;
+		check(mdb_cursor_count(mc_, &n));
+		return n;
+	}
+
+	MDB_cursor *handle() const noexcept { return mc_; }
+
+private:
+	std::optional<entry> fetch(MDB_cursor_op op, MDB_val &k, MDB_val &v)
+	{
+		int rc = mdb_cursor_get(mc_, &k, &v, op);
+		if (rc == MDB_NOTFOUND)
+			return std::nullopt;
+		check(rc);
+		detail::check_size<typename DB::key_codec>(k);
+		detail::check_size<typename DB::value_codec>(v);
+		return entry(DB::key_codec::decode(k), DB::value_codec::decode(v));
+	}
+
+	MDB_cursor *mc_;
+	txn *txn_;
+	bool rdonly_;
+};
+
+} // namespace lmdb
+
+#endif /* _LMDB_HPP_ */
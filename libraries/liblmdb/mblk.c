@@ -0,0 +1,72 @@
+/**	@file mblk.c
+ *	@brief Block framing for the binary dump format.
+ *
+ *	Shared by mdb_dump and mdb_load.
+ */
+/*
+ * Copyright 2011-2019 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+#include "mblk.h"
+
+static unsigned int crctab[256];
+
+void mblk_crcinit(void)
+{
+	unsigned int c, i, k;
+
+	for (i=0; i<256; i++) {
+		c = i;
+		for (k=0; k<8; k++)
+			c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		crctab[i] = c;
+	}
+}
+
+unsigned int mblk_sum(const unsigned char *p, size_t len)
+{
+	unsigned int c = 0xffffffffU;
+
+	while (len--)
+		c = crctab[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffffU;
+}
+
+void mblk_put32(unsigned char *p, size_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+size_t mblk_get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (size_t)p[3] << 24;
+}
+
+void mblk_puthdr(unsigned char *p, const mblk_hdr *h)
+{
+	mblk_put32(p, BLK_MAGIC);
+	mblk_put32(p+4, h->bh_len);
+	mblk_put32(p+8, h->bh_db);
+	mblk_put32(p+12, h->bh_sum);
+}
+
+int mblk_gethdr(const unsigned char *p, mblk_hdr *h)
+{
+	if (mblk_get32(p) != BLK_MAGIC)
+		return -1;
+	h->bh_len = mblk_get32(p+4);
+	h->bh_db = mblk_get32(p+8);
+	h->bh_sum = mblk_get32(p+12);
+	return 0;
+}
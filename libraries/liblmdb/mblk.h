@@ -0,0 +1,71 @@
+/**	@file mblk.h
+ *	@brief Block framing for the binary dump format.
+ *
+ *	Shared by mdb_dump and mdb_load. These definitions are not
+ *	part of the library.
+ */
+/*
+ * Copyright 2011-2019 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+#ifndef _MDB_MBLK_H_
+#define _MDB_MBLK_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* In the binary format of mdb_dump -b the header is followed by blocks
+ * of records. Each block starts with four little-endian words: BLK_MAGIC,
+ * the length of the rest of the block, the index of the database's header
+ * in the stream, and the CRC32 of the rest if checksum=crc32 is set,
+ * else 0. The rest is a series of records, each a key length and a data
+ * length followed by the key and data bytes. An empty block ends the data
+ * of a database. Blocks of different databases may be interleaved, after
+ * all of their headers, when they are dumped in parallel.
+ */
+#define BLK_MAGIC	0x424b444d	/* "MDKB" */
+#define BLK_HDRSIZE	16
+
+	/** A block header, in host order */
+typedef struct mblk_hdr {
+	size_t bh_len;			/**< length of the rest of the block */
+	unsigned int bh_db;		/**< index of the database's header */
+	unsigned int bh_sum;	/**< CRC32 of the rest, or 0 */
+} mblk_hdr;
+
+	/** Build the CRC32 table. Must be called before #mblk_sum(). */
+void mblk_crcinit(void);
+
+	/** Return the CRC32 of \b len bytes at \b p. */
+unsigned int mblk_sum(const unsigned char *p, size_t len);
+
+	/** Store \b v as a little-endian 32 bit word. */
+void mblk_put32(unsigned char *p, size_t v);
+
+	/** Fetch a little-endian 32 bit word. */
+size_t mblk_get32(const unsigned char *p);
+
+	/** Write the header \b h into the first #BLK_HDRSIZE bytes of \b p. */
+void mblk_puthdr(unsigned char *p, const mblk_hdr *h);
+
+	/** Read a block header.
+	 * @return 0 on success, -1 if the magic number is wrong.
+	 */
+int mblk_gethdr(const unsigned char *p, mblk_hdr *h);
+
+#ifdef __cplusplus
+}
+#endif
+#endif	/* _MDB_MBLK_H_ */
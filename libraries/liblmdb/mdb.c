@@ -128,6 +128,20 @@ extern int cacheflush(char *addr, int nbytes, int cache);
 #define	BROKEN_FDATASYNC
 #endif
 
+#if defined(MDB_USE_IO_URING) && !defined(__linux)
+#undef MDB_USE_IO_URING
+#endif
+#ifdef MDB_USE_IO_URING
+/** Write out dirty pages through an io_uring, so that all the runs
+ *	of a commit are in flight together instead of one writev() each.
+ *	Needs Linux 5.1 or newer; if the ring can't be set up at runtime
+ *	we quietly fall back to the regular write path.
+ */
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 #include <errno.h>
 #include <limits.h>
 #include <stddef.h>
@@ -285,6 +299,27 @@ union semun {
 #else
 /* If a debug message says <mdb_unknown>(), update the #if statements above */
 # define mdb_func_	"<mdb_unknown>"
+#endif
+
+	/** Hint the CPU to start loading memory we expect to read soon */
+#ifdef __GNUC__
+# define MDB_PREFETCH(addr)	__builtin_prefetch(addr)
+#else
+# define MDB_PREFETCH(addr)	((void)0)
+#endif
+
+	/** Reverse the byte order of a 64-bit integer */
+#if (__GNUC__ * 100 + __GNUC_MINOR__ >= 403)
+# define MDB_BSWAP64(x)	__builtin_bswap64(x)
+#else
+# define MDB_BSWAP64(x)	mdb_bswap64(x)
+static uint64_t
+mdb_bswap64(uint64_t x)
+{
+	x = (x >> 32) | (x << 32);
+	x = ((x >> 16) & 0x0000ffff0000ffffULL) | ((x & 0x0000ffff0000ffffULL) << 16);
+	return ((x >> 8) & 0x00ff00ff00ff00ffULL) | ((x & 0x00ff00ff00ff00ffULL) << 8);
+}
 #endif
 
 /* Internal error codes, not exposed outside liblmdb */
@@ -540,6 +575,24 @@ static int mdb_mutex_failed(MDB_env *env, mdb_mutexref_t mutex, int rc);
 
 #ifndef MS_ASYNC
 #define	MS_ASYNC	0
+#endif
+
+/** Atomically change the pid \b pp points to from \b o to \b n, if it
+ *	still is \b o. Evaluates to nonzero on success. Readers use this to
+ *	claim free reader slots without the reader table mutex. Without
+ *	a usable compare-and-swap, #MDB_RSLOT_LOCKED is defined and all
+ *	claims take the mutex.
+ */
+#ifndef MDB_PID_CAS
+# if defined(_WIN32)
+#  define MDB_PID_CAS(pp, o, n) \
+	(InterlockedCompareExchange((volatile LONG *)(pp), n, o) == (o))
+# elif (__GNUC__ * 100 + __GNUC_MINOR__ >= 401)
+#  define MDB_PID_CAS(pp, o, n)	__sync_bool_compare_and_swap(pp, o, n)
+# else
+#  define MDB_PID_CAS(pp, o, n)	(*(pp) = (n), 1)
+#  define MDB_RSLOT_LOCKED	1
+# endif
 #endif
 
 	/** A page number in the database.
@@ -630,6 +683,13 @@ static txnid_t mdb_debug_start;
 
 	/**	The version number for a database's datafile format. */
 #define MDB_DATA_VERSION	 ((MDB_DEVEL) ? 999 : 1)
+	/**	The datafile version once a txn has committed records that older
+	 *	versions can't read, see #MDB_TXN_EXTFMT. A datafile never goes
+	 *	back to #MDB_DATA_VERSION.
+	 */
+#define MDB_DATA_VERSION_EXT	 (MDB_DATA_VERSION + 1)
+	/**	True if a datafile of version \b v can be used. */
+#define MDB_DATA_VERSION_OK(v)	 ((v) == MDB_DATA_VERSION || (v) == MDB_DATA_VERSION_EXT)
 	/**	The version number for a database's lockfile format. */
 #define MDB_LOCK_VERSION	 ((MDB_DEVEL) ? 999 : 2)
 	/** Number of bits representing #MDB_LOCK_VERSION in #MDB_LOCK_FORMAT.
@@ -1056,6 +1116,7 @@ typedef struct MDB_page {
 	 * data part is the page number of an overflow page with actual data.
 	 * #F_DUPDATA and #F_SUBDATA can be combined giving duplicate data in
 	 * a sub-page/sub-database, and named databases (just #F_SUBDATA).
+	 * #F_SEGMENTS says the data is a table of overflow runs instead.
 	 */
 typedef struct MDB_node {
 	/** part of data size or pgno
@@ -1074,9 +1135,11 @@ typedef struct MDB_node {
 #define F_BIGDATA	 0x01			/**< data put on overflow page */
 #define F_SUBDATA	 0x02			/**< data is a sub-database */
 #define F_DUPDATA	 0x04			/**< data has duplicates */
+#define F_COMPRESSED	 0x08		/**< data was encoded by the DB's #MDB_codec_func */
+#define F_SEGMENTS	 0x80		/**< data is a table of overflow segments, see @ref segments */
 
 /** valid flags for #mdb_node_add() */
-#define	NODE_ADD_FLAGS	(F_DUPDATA|F_SUBDATA|MDB_RESERVE|MDB_APPEND)
+#define	NODE_ADD_FLAGS	(F_DUPDATA|F_SUBDATA|F_COMPRESSED|F_SEGMENTS|MDB_RESERVE|MDB_APPEND)
 
 /** @} */
 	unsigned short	mn_flags;		/**< @ref mdb_node */
@@ -1199,7 +1262,8 @@ typedef struct MDB_meta {
 		/** Stamp identifying this as an LMDB file. It must be set
 		 *	to #MDB_MAGIC. */
 	uint32_t	mm_magic;
-		/** Version number of this file. Must be set to #MDB_DATA_VERSION. */
+		/** Version number of this file. Must be set to #MDB_DATA_VERSION
+		 *	or #MDB_DATA_VERSION_EXT. */
 	uint32_t	mm_version;
 #ifdef MDB_VL32
 	union {		/* always zero since we don't support fixed mapping in MDB_VL32 */
@@ -1244,8 +1308,13 @@ typedef struct MDB_dbx {
 	MDB_val		md_name;		/**< name of the database */
 	MDB_cmp_func	*md_cmp;	/**< function for comparing keys */
 	MDB_cmp_func	*md_dcmp;	/**< function for comparing data items */
+	MDB_search_func	*md_search;	/**< user function for searching a page's keys */
+	MDB_search_func	*md_dsearch;	/**< user function for searching a page's data items */
 	MDB_rel_func	*md_rel;	/**< user relocate function */
 	void		*md_relctx;		/**< user-provided context for md_rel */
+	MDB_codec_func	*md_enc;	/**< user compression function */
+	MDB_codec_func	*md_dec;	/**< user decompression function */
+	void		*md_codecctx;	/**< user-provided context for md_enc/md_dec */
 } MDB_dbx;
 
 	/** A database transaction.
@@ -1280,7 +1349,7 @@ struct MDB_txn {
 	 */
 	MDB_IDL		mt_spill_pgs;
 	union {
-		/** For write txns: Modified pages. Sorted when not MDB_WRITEMAP. */
+		/** For write txns: Modified pages. See @ref dlist. */
 		MDB_ID2L	dirty_list;
 		/** For read txns: This thread/txn's reader table slot, or NULL. */
 		MDB_reader	*reader;
@@ -1319,6 +1388,10 @@ struct MDB_txn {
 #define MDB_TRPAGE_MAX	(MDB_TRPAGE_SIZE-1)	/**< maximum chunk index */
 	unsigned int mt_rpcheck;	/**< threshold for reclaiming unref'd chunks */
 #endif
+	/** Chain of buffers holding values decompressed in this txn.
+	 *	The first word of each buffer links to the next one.
+	 */
+	void		**mt_zbufs;
 	/**	Number of DB records in use, or 0 when the txn is finished.
 	 *	This number only ever increments until the txn finishes; we
 	 *	don't decrement it when individual DB handles are closed.
@@ -1341,6 +1414,10 @@ struct MDB_txn {
 #define MDB_TXN_DIRTY		0x04		/**< must write, even if dirty list is empty */
 #define MDB_TXN_SPILLS		0x08		/**< txn or a parent has spilled pages */
 #define MDB_TXN_HAS_CHILD	0x10		/**< txn has an #MDB_txn.%mt_child */
+	/** txn wrote #F_COMPRESSED or #F_SEGMENTS nodes or #MDB_RCL_BIT records,
+	 *	so its meta must say #MDB_DATA_VERSION_EXT to keep older versions out
+	 */
+#define MDB_TXN_EXTFMT		0x20
 	/** most operations on the txn are currently illegal */
 #define MDB_TXN_BLOCKED		(MDB_TXN_FINISHED|MDB_TXN_ERROR|MDB_TXN_HAS_CHILD)
 /** @} */
@@ -1351,6 +1428,13 @@ struct MDB_txn {
 	 *	dirty_list into mt_parent after freeing hidden mt_parent pages.
 	 */
 	unsigned int	mt_dirty_room;
+	/** Number of leading #dirty_list entries which are sorted by pgno */
+	unsigned int	mt_dirty_sorted;
+	/** Allocated size of #dirty_list, including the length slot */
+	unsigned int	mt_dirty_size;
+	/** Hash of the unsorted #dirty_list tail, #mt_dirty_hmask+1 slots */
+	unsigned int	*mt_dirty_hash;
+	unsigned int	mt_dirty_hmask;
 };
 
 /** Enough space for 2^32 nodes with minimum of 2 keys per node. I.e., plenty.
@@ -1359,6 +1443,56 @@ struct MDB_txn {
  */
 #define CURSOR_STACK		 32
 
+	/** Max number of upcoming leaf pages a scanning cursor prefetches.
+	 *	The window starts small and doubles with each leaf page the
+	 *	cursor moves to in the same direction. Define as 0 to disable.
+	 */
+#ifndef MDB_RA_PAGES
+#define MDB_RA_PAGES	16
+#endif
+#if defined(_WIN32) || defined(MDB_VL32) || \
+	!(defined(MADV_WILLNEED) || defined(POSIX_MADV_WILLNEED))
+#undef MDB_RA_PAGES
+#define MDB_RA_PAGES	0
+#endif
+
+	/** Store shortened separator keys in branch pages when splitting
+	 *	leaf pages of databases using the default key order, so more
+	 *	of them fit per branch page. The tree format is unchanged.
+	 *	Define as 0 to always copy the first key of the right page.
+	 */
+#ifndef MDB_SUFFIX_TRUNC
+#define MDB_SUFFIX_TRUNC	1
+#endif
+
+	/** Size in bytes of the address space reserved per env for multi-page
+	 *	dirty buffers. Overflow buffers of up to the largest size in
+	 *	#mdb_dpclass are carved from it, rounded up to that size class, and
+	 *	recycled per class instead of going through malloc() and free().
+	 *	Memory is only used as the buffers are first carved, and is all
+	 *	released when the env is closed. Define as 0 to disable.
+	 */
+#ifndef MDB_DPAGE_ARENA
+#define MDB_DPAGE_ARENA	(64*1024*1024)
+#endif
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+#if defined(_WIN32) || !defined(MAP_ANONYMOUS)
+#undef MDB_DPAGE_ARENA
+#define MDB_DPAGE_ARENA	0
+#endif
+
+#if MDB_DPAGE_ARENA
+	/** Page counts of the #MDB_DPAGE_ARENA size classes. Each is at most
+	 *	1.5 times the previous one, to bound the rounding waste.
+	 */
+static const unsigned short mdb_dpclass[] = {
+	2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64
+};
+#define MDB_DPCLASSES	(sizeof(mdb_dpclass) / sizeof(mdb_dpclass[0]))
+#endif
+
 struct MDB_xcursor;
 
 	/** Cursors are used for all DB operations.
@@ -1397,6 +1531,7 @@ struct MDB_cursor {
 #define C_EOF	0x02			/**< No more data */
 #define C_SUB	0x04			/**< Cursor is a sub-cursor */
 #define C_DEL	0x08			/**< last op was a cursor_del */
+#define C_RAWDATA	0x10		/**< don't decode #F_COMPRESSED or #F_SEGMENTS data */
 #define C_UNTRACK	0x40		/**< Un-track cursor when closing */
 #define C_WRITEMAP	MDB_TXN_WRITEMAP /**< Copy of txn flag */
 /** Read-only cursor into the txn's original snapshot in the map.
@@ -1408,6 +1543,17 @@ struct MDB_cursor {
 	unsigned int	mc_flags;	/**< @ref mdb_cursor */
 	MDB_page	*mc_pg[CURSOR_STACK];	/**< stack of pushed pages */
 	indx_t		mc_ki[CURSOR_STACK];	/**< stack of page indices */
+#if MDB_RA_PAGES
+	/** Number of consecutive moves to the next (> 0) or previous (< 0)
+	 *	leaf page, for #mdb_cursor_readahead()
+	 */
+	short		mc_ra;
+	indx_t		mc_ra_ki;	/**< furthest index in mc_ra_pgno prefetched */
+	pgno_t		mc_ra_pgno;	/**< parent page of the prefetched leaves */
+#	define MC_RA_RESET(mc)	((mc)->mc_ra = 0)
+#else
+#	define MC_RA_RESET(mc)	((void)0)
+#endif
 #ifdef MDB_VL32
 	MDB_page	*mc_ovpg;		/**< a referenced overflow page */
 #	define MC_OVPG(mc)			((mc)->mc_ovpg)
@@ -1457,6 +1603,110 @@ typedef struct MDB_pgstate {
 	txnid_t		mf_pglast;	/**< ID of last used record, or 0 if !mf_pghead */
 } MDB_pgstate;
 
+	/**	@brief Smallest me_pghead[] worth indexing by contiguous runs.
+	 *
+	 *	#mdb_page_alloc() normally scans me_pghead[] for a range of
+	 *	pages when allocating overflow pages. Once the list has at
+	 *	least this many entries, it instead keeps an index of the
+	 *	contiguous runs in the list, sorted by run length, and uses
+	 *	a binary search to find the smallest run that fits.
+	 *	Define as 0 to always use the linear scan.
+	 */
+#ifndef MDB_PGRUN_MIN
+#define MDB_PGRUN_MIN	1024
+#endif
+
+	/**	@brief freeDB key bit for DBs dropped with #MDB_DROP_LAZY.
+	 *
+	 *	Such a record holds a stack of the subtree roots of the
+	 *	dropped trees, keyed by the dropping txnid with this bit set.
+	 *	The keys sort after all freelist records, so #mdb_page_alloc()
+	 *	never reads them as page lists. Each stack entry is a pair of
+	 *	a page number and (depth << 2 | #MDB_RCL_SCAN etc).
+	 */
+#define MDB_RCL_BIT	((txnid_t)1 << (sizeof(txnid_t) * CHAR_BIT - 1))
+	/** Stack entry flag: the leaves of the subtree must be read,
+	 *	for their overflow pages or sub-DBs.
+	 */
+#define MDB_RCL_SCAN	1
+	/** Stack entry flag: the sub-DBs in the leaves are DUPSORT data */
+#define MDB_RCL_SUBS	2
+	/** Pages to free in one #mdb_rcl_step() */
+#ifndef MDB_RCL_CHUNK
+#define MDB_RCL_CHUNK	1024
+#endif
+	/** States of #MDB_env.%me_rcl_state */
+enum { MDB_RCL_IDLE, MDB_RCL_BUSY, MDB_RCL_DONE };
+
+	/** A run of consecutive page numbers in me_pghead[] */
+typedef struct MDB_pgrun {
+	pgno_t		pr_pgno;	/**< lowest page number in the run */
+	pgno_t		pr_len;		/**< number of pages in the run, at least 2 */
+} MDB_pgrun;
+
+#ifdef MDB_USE_IO_URING
+	/** number of writes #mdb_page_flush() keeps in flight on the ring */
+#ifndef MDB_URING_DEPTH
+#define MDB_URING_DEPTH	256
+#endif
+	/** number of iovecs available to the writes in flight */
+#define MDB_URING_IOVS	(MDB_URING_DEPTH * 4)
+
+	/** An io_uring used by #mdb_page_flush() to submit page writes */
+typedef struct MDB_uring {
+	int			ur_fd;		/**< ring descriptor, or -1 if unusable */
+	int			ur_err;		/**< first error from a completed write */
+	unsigned	ur_queued;	/**< writes not yet submitted */
+	unsigned	ur_inflight;	/**< writes not yet completed */
+	unsigned	ur_entries;	/**< size of the submission queue */
+	unsigned	ur_niov;	/**< iovecs of #ur_iov in use */
+	unsigned	*ur_sqhead, *ur_sqtail, *ur_sqarray, ur_sqmask;
+	unsigned	*ur_cqhead, *ur_cqtail, ur_cqmask;
+	struct io_uring_sqe	*ur_sqes;
+	struct io_uring_cqe	*ur_cqes;
+	void		*ur_sqmap, *ur_cqmap;
+	size_t		ur_sqlen, ur_cqlen, ur_sqeslen;
+	struct iovec	ur_iov[MDB_URING_IOVS];
+} MDB_uring;
+#endif
+
+#ifdef MDB_VL32
+	/** A chunk of the data file mapped by #mdb_rpage_get(), shared
+	 *	by all transactions of the environment.
+	 */
+typedef struct MDB_rpent {
+	struct MDB_rpent *re_next;	/**< next entry in the same hash bucket */
+	pgno_t		re_pgno;	/**< first page of the chunk */
+	void		*re_ptr;	/**< address of the mapping */
+	unsigned	re_cnt;		/**< number of pages mapped */
+	unsigned	re_ref;		/**< number of txns using the chunk */
+	int			re_used;	/**< referenced since the last eviction sweep */
+} MDB_rpent;
+
+	/** A lock for the hash buckets of the chunk cache, with the
+	 *	counters of the lookups done under it. Padded to a cache line
+	 *	so that stripes taken by different readers don't share one.
+	 */
+typedef struct MDB_rplock {
+	union {
+		struct {
+			pthread_mutex_t	rlb_mutex;
+			mdb_size_t	rlb_hits;
+			mdb_size_t	rlb_misses;
+		} rlx;
+#define rl_mutex	rlu.rlx.rlb_mutex
+#define rl_hits	rlu.rlx.rlb_hits
+#define rl_misses	rlu.rlx.rlb_misses
+		char pad[(sizeof(pthread_mutex_t)+2*sizeof(mdb_size_t)+CACHELINE-1) & ~(CACHELINE-1)];
+	} rlu;
+} MDB_rplock;
+
+	/** Number of locks striped over the chunk cache's hash buckets */
+#define MDB_RPLOCKS	16
+	/** Default for #mdb_env_set_rpage_budget() */
+#define MDB_RPBUDGET_DEFAULT	(256*1024*1024)
+#endif
+
 	/** The database environment. */
 struct MDB_env {
 	HANDLE		me_fd;		/**< The main data file */
@@ -1487,6 +1737,8 @@ struct MDB_env {
 	MDB_txninfo	*me_txns;		/**< the memory map of the lock file or NULL */
 	MDB_meta	*me_metas[NUM_METAS];	/**< pointers to the two meta pages */
 	void		*me_pbuf;		/**< scratch area for DUPSORT put() */
+	char		*me_zbuf;		/**< scratch area for compressing put() data */
+	size_t		me_zsize;		/**< size of #me_zbuf */
 	MDB_txn		*me_txn;		/**< current write transaction */
 	MDB_txn		*me_txn0;		/**< prealloc'd write transaction */
 	mdb_size_t	me_mapsize;		/**< size of the data memory map */
@@ -1497,14 +1749,44 @@ struct MDB_env {
 	unsigned int	*me_dbiseqs;	/**< array of dbi sequence numbers */
 	pthread_key_t	me_txkey;	/**< thread-key for readers */
 	txnid_t		me_pgoldest;	/**< ID of oldest reader last time we looked */
+	int			me_oldest_slot;	/**< reader slot holding me_pgoldest, or -1 */
 	MDB_pgstate	me_pgstate;		/**< state of old pages from freeDB */
 #	define		me_pglast	me_pgstate.mf_pglast
 #	define		me_pghead	me_pgstate.mf_pghead
+	/** Pages the current write txn merged into me_pghead[] from freeDB records */
+	mdb_size_t	me_pgreclaimed;
+	/** Runs of length >= 2 in me_pghead[], by length and then page number */
+	MDB_pgrun	*me_pgruns;
+	unsigned	me_pgrun_cnt;	/**< number of entries in me_pgruns */
+	unsigned	me_pgrun_max;	/**< allocated size of me_pgruns */
+	int			me_pgrun_ok;	/**< me_pgruns matches me_pghead[] */
+	/** While #mdb_env_shrink() relocates pages, the page number they
+	 *	are moved below. #mdb_page_alloc() then takes the lowest pages
+	 *	from me_pghead[] instead of the best fitting run.
+	 */
+	pgno_t		me_pgceil;
+	/** The stack of a lazily dropped DB whose pages
+	 *	#mdb_page_alloc() is freeing, see #MDB_RCL_BIT.
+	 */
+	pgno_t		*me_rcl;
+	txnid_t		me_rcl_key;		/**< freeDB key of me_rcl, or 0 */
+	int			me_rcl_state;	/**< #MDB_RCL_IDLE etc. */
+	MDB_metrics	me_metrics;		/**< hot-path counters of this process */
 	MDB_page	*me_dpages;		/**< list of malloc'd blocks for re-use */
+#if MDB_DPAGE_ARENA
+	char		*me_arena;		/**< #MDB_DPAGE_ARENA region, or MAP_FAILED */
+	char		*me_arena_next;	/**< first byte of #me_arena not carved yet */
+	char		*me_arena_end;	/**< end of #me_arena */
+	MDB_page	*me_dpclass[MDB_DPCLASSES];	/**< freed arena buffers by size class */
+#endif
 	/** IDL of pages that became unused in a write txn */
 	MDB_IDL		me_free_pgs;
-	/** ID2L of pages written during a write txn. Length MDB_IDL_UM_SIZE. */
+	/** ID2L of pages written during a write txn. Length #me_dirty_size. */
 	MDB_ID2L	me_dirty_list;
+	unsigned int	me_dirty_size;	/**< allocated size of #me_dirty_list */
+	unsigned int	me_dirty_max;	/**< max number of dirty pages per txn */
+	unsigned int	*me_dirty_hash;	/**< #me_txn0's #MDB_txn.%mt_dirty_hash */
+	unsigned int	me_dirty_hmask;	/**< #me_txn0's #MDB_txn.%mt_dirty_hmask */
 	/** Max number of freelist items that can fit in a single overflow page */
 	int			me_maxfree_1pg;
 	/** Max size of a node on a page */
@@ -1528,22 +1810,75 @@ struct MDB_env {
 # endif
 #endif
 #ifdef MDB_VL32
-	MDB_ID3L	me_rpages;	/**< like #mt_rpages, but global to env */
-	pthread_mutex_t	me_rpmutex;	/**< control access to #me_rpages */
-#define MDB_ERPAGE_SIZE	16384
-#define MDB_ERPAGE_MAX	(MDB_ERPAGE_SIZE-1)
-	unsigned int me_rpcheck;
+	MDB_rpent	**me_rphash;	/**< chunk cache, hashed by chunk number */
+	unsigned	me_rphmask;		/**< number of hash buckets, minus 1 */
+	unsigned	me_rphand;		/**< next bucket for the eviction sweep */
+	/** control access to #me_rpbytes, #me_rphand and #me_rpevicts.
+	 *	Never held together with a #me_rplocks stripe.
+	 */
+	pthread_mutex_t	me_rpmutex;
+	mdb_size_t	me_rpbudget;	/**< bytes the cache may keep mapped */
+	mdb_size_t	me_rpbytes;		/**< bytes the cache has mapped */
+	mdb_size_t	me_rpevicts;	/**< chunks unmapped by #mdb_rpage_evict() */
+	MDB_rplock	me_rplocks[MDB_RPLOCKS];	/**< stripes of #me_rphash */
+#define MDB_RPHASH(env, pgno)	((unsigned)((pgno) / MDB_RPAGE_CHUNK) & (env)->me_rphmask)
+#define MDB_RPLOCK(env, b)	(&(env)->me_rplocks[(b) % MDB_RPLOCKS].rl_mutex)
+#endif
+#ifndef _WIN32
+	/** Metas of committed txns not yet synced, by txnid parity. #MDB_GROUPCOMMIT */
+	MDB_meta	me_gc_metas[NUM_METAS];
+	txnid_t		me_gc_txnid;	/**< newest txn in #me_gc_metas */
+	txnid_t		me_gc_synced;	/**< newest txn known to be durable */
+	int			me_gc_leader;	/**< a committer is syncing for the group */
+	/** Error from a failed group sync. It is fatal like #MDB_FATAL_ERROR,
+	 *	but set without the writer lock, so it is kept apart from me_flags.
+	 */
+	int			me_gc_rc;
+	pthread_mutex_t	me_gc_mutex;	/**< control access to the me_gc_* fields */
+	pthread_cond_t	me_gc_cond;		/**< signalled after each group sync */
+#endif
+#ifdef MDB_USE_IO_URING
+	MDB_uring	*me_uring;	/**< ring for #mdb_page_flush(), set up on first use */
 #endif
+	MDB_commit_func	*me_commit_func;	/**< Callback for committed write txns */
+	void		*me_commit_ctx;	/**< context for #me_commit_func */
+	/** Pages written by the current write txn, while #me_commit_func is set */
+	MDB_IDL		me_commit_pgs;
+	MDB_pageset	*me_commit_sets;	/**< runs of #me_commit_pgs for the callback */
+	mdb_size_t	me_commit_max;	/**< allocated size of #me_commit_sets */
+	MDB_page	*me_commit_meta;	/**< image of the new meta page for the callback */
+	MDB_commitinfo_func	*me_cinfo_func;	/**< Callback for commit timings */
+	void		*me_cinfo_ctx;	/**< context for #me_cinfo_func */
 	void		*me_userctx;	 /**< User-settable context */
 	MDB_assert_func *me_assert_func; /**< Callback for assertion failures */
 };
 
-	/** Nested transaction */
+	/** True if the environment must not be written anymore:
+	 *	#MDB_FATAL_ERROR is set, or a group sync failed.
+	 */
+#ifdef _WIN32
+#define MDB_ENV_FATAL(env)	((env)->me_flags & MDB_FATAL_ERROR)
+#else
+#define MDB_ENV_FATAL(env)	(((env)->me_flags & MDB_FATAL_ERROR) || \
+	__atomic_load_n(&(env)->me_gc_rc, __ATOMIC_ACQUIRE))
+#endif
+
+	/** Nested transaction.
+	 *	A child works on the parent's me_pghead[] in place, and logs
+	 *	what it changed so #mdb_txn_abort() can undo it. That way
+	 *	starting a child costs nothing for a large freelist.
+	 */
 typedef struct MDB_ntxn {
 	MDB_txn		mnt_txn;		/**< the transaction */
-	MDB_pgstate	mnt_pgstate;	/**< parent transaction's saved freestate */
+	txnid_t		mnt_pglast;		/**< parent transaction's me_pglast */
+	int			mnt_pgnew;		/**< parent transaction had no me_pghead */
+	MDB_IDL		mnt_pgtaken;	/**< pages taken from me_pghead, or NULL */
+	MDB_IDL		mnt_pgadded;	/**< pages merged into me_pghead, or NULL */
 } MDB_ntxn;
 
+	/** Initial size of a nested txn's IDLs, they grow as needed */
+#define MDB_NTXN_IDL	1024
+
 	/** max number of pages to commit in one writev() call */
 #define MDB_COMMIT_PAGES	 64
 #if defined(IOV_MAX) && IOV_MAX < MDB_COMMIT_PAGES
@@ -1579,6 +1914,10 @@ enum {
 #define MDB_END_SLOT MDB_NOTLS	/**< release any reader slot if #MDB_NOTLS */
 static void mdb_txn_end(MDB_txn *txn, unsigned mode);
 
+#ifdef MDB_VL32
+static void mdb_rpage_release(MDB_env *env, MDB_ID3 *id3);
+static void mdb_rpage_evict(MDB_env *env, int force);
+#endif
 static int  mdb_page_get(MDB_cursor *mc, pgno_t pgno, MDB_page **mp, int *lvl);
 static int  mdb_page_search_root(MDB_cursor *mc,
 			    MDB_val *key, int modify);
@@ -1597,6 +1936,10 @@ static int	mdb_page_split(MDB_cursor *mc, MDB_val *newkey, MDB_val *newdata,
 static int  mdb_env_read_header(MDB_env *env, int prev, MDB_meta *meta);
 static MDB_meta *mdb_env_pick_meta(const MDB_env *env);
 static int  mdb_env_write_meta(MDB_txn *txn);
+static void mdb_txn_meta(MDB_txn *txn, MDB_meta *meta);
+#ifndef _WIN32
+static int  mdb_env_gc_sync(MDB_env *env, txnid_t txnid);
+#endif
 #ifdef MDB_USE_POSIX_MUTEX /* Drop unused excl arg */
 # define mdb_env_close0(env, excl) mdb_env_close1(env)
 #endif
@@ -1609,6 +1952,7 @@ static void mdb_node_del(MDB_cursor *mc, int ksize);
 static void mdb_node_shrink(MDB_page *mp, indx_t indx);
 static int	mdb_node_move(MDB_cursor *csrc, MDB_cursor *cdst, int fromleft);
 static int  mdb_node_read(MDB_cursor *mc, MDB_node *leaf, MDB_val *data);
+static void mdb_zbufs_free(MDB_txn *txn);
 static size_t	mdb_leaf_size(MDB_env *env, MDB_val *key, MDB_val *data);
 static size_t	mdb_branch_size(MDB_env *env, MDB_val *key);
 
@@ -1634,6 +1978,9 @@ static void	mdb_xcursor_init1(MDB_cursor *mc, MDB_node *node);
 static void	mdb_xcursor_init2(MDB_cursor *mc, MDB_xcursor *src_mx, int force);
 
 static int	mdb_drop0(MDB_cursor *mc, int subs);
+static int	mdb_rcl_step(MDB_cursor *mc);
+static int	mdb_rcl_save(MDB_txn *txn);
+static int	mdb_rcl_count(MDB_txn *txn, MDB_ID *count);
 static void mdb_default_cmp(MDB_txn *txn, MDB_dbi dbi);
 static int mdb_reader_check0(MDB_env *env, int rlocked, int *dead);
 
@@ -1929,8 +2276,11 @@ static void mdb_audit(MDB_txn *txn)
 	freecount = 0;
 	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
 	while ((rc = mdb_cursor_get(&mc, &key, &data, MDB_NEXT)) == 0)
-		freecount += *(MDB_ID *)data.mv_data;
+		if (!(*(txnid_t *)key.mv_data & MDB_RCL_BIT))
+			freecount += *(MDB_ID *)data.mv_data;
 	mdb_tassert(txn, rc == MDB_NOTFOUND);
+	rc = mdb_rcl_count(txn, &freecount);
+	mdb_tassert(txn, rc == MDB_SUCCESS);
 
 	count = 0;
 	for (i = 0; i<txn->mt_numdbs; i++) {
@@ -1985,8 +2335,73 @@ mdb_dcmp(MDB_txn *txn, MDB_dbi dbi, const MDB_val *a, const MDB_val *b)
 	return dcmp(a, b);
 }
 
+#if MDB_DPAGE_ARENA
+/** Return the #mdb_dpclass index for a buffer of \b num pages,
+ * or #MDB_DPCLASSES if it is too big for the arena.
+ */
+static unsigned
+mdb_dpclass_of(unsigned num)
+{
+	unsigned c;
+	for (c = 0; c < MDB_DPCLASSES && mdb_dpclass[c] < num; c++) ;
+	return c;
+}
+
+/** Is \b mp an #MDB_DPAGE_ARENA buffer? */
+#define MDB_IN_ARENA(env, mp) \
+	((char *)(mp) >= (env)->me_arena && (char *)(mp) < (env)->me_arena_end)
+
+/** Get a multi-page buffer from the arena.
+ * Re-use a freed buffer of the size class if there is one, else carve
+ * a new one.
+ * @return the buffer, or NULL if the arena cannot supply it.
+ */
+static MDB_page *
+mdb_arena_get(MDB_env *env, unsigned num)
+{
+	MDB_page *ret;
+	size_t sz;
+	unsigned c = mdb_dpclass_of(num);
+
+	if (c == MDB_DPCLASSES)
+		return NULL;
+	if ((ret = env->me_dpclass[c]) != NULL) {
+		VGMEMP_DEFINED(&ret->mp_next, sizeof(ret->mp_next));
+		env->me_dpclass[c] = ret->mp_next;
+		env->me_metrics.mm_dpage_hits++;
+		return ret;
+	}
+	if (!env->me_arena) {
+		/* Reserve it on first use. Backing it with huge pages keeps
+		 * TLB misses down when large values churn through it.
+		 */
+		int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+		flags |= MAP_NORESERVE;
+#endif
+		env->me_arena = mmap(NULL, MDB_DPAGE_ARENA, PROT_READ|PROT_WRITE,
+			flags, -1, 0);
+		if (env->me_arena == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		(void) madvise(env->me_arena, MDB_DPAGE_ARENA, MADV_HUGEPAGE);
+#endif
+		env->me_arena_next = env->me_arena;
+		env->me_arena_end = env->me_arena + MDB_DPAGE_ARENA;
+	}
+	sz = (size_t)mdb_dpclass[c] * env->me_psize;
+	if ((size_t)(env->me_arena_end - env->me_arena_next) < sz)
+		return NULL;
+	ret = (MDB_page *)env->me_arena_next;
+	env->me_arena_next += sz;
+	env->me_metrics.mm_dpage_carved++;
+	return ret;
+}
+#endif
+
 /** Allocate memory for a page.
- * Re-use old malloc'd pages first for singletons, otherwise just malloc.
+ * Re-use old malloc'd pages first for singletons. Multi-page buffers
+ * come from the #MDB_DPAGE_ARENA if possible, otherwise just malloc.
  * Set #MDB_TXN_ERROR on failure.
  */
 static MDB_page *
@@ -2005,14 +2420,22 @@ mdb_page_malloc(MDB_txn *txn, unsigned num)
 			VGMEMP_ALLOC(env, ret, sz);
 			VGMEMP_DEFINED(ret, sizeof(ret->mp_next));
 			env->me_dpages = ret->mp_next;
+			env->me_metrics.mm_dpage_hits++;
 			return ret;
 		}
 		psize -= off = PAGEHDRSZ;
 	} else {
 		sz *= num;
 		off = sz - psize;
+#if MDB_DPAGE_ARENA
+		ret = mdb_arena_get(env, num);
+#else
+		ret = NULL;
+#endif
 	}
-	if ((ret = malloc(sz)) != NULL) {
+	if (!ret && (ret = malloc(sz)) != NULL)
+		env->me_metrics.mm_dpage_mallocs++;
+	if (ret) {
 		VGMEMP_ALLOC(env, ret, sz);
 		if (!(env->me_flags & MDB_NOMEMINIT)) {
 			memset((char *)ret + off, 0, psize);
@@ -2041,6 +2464,13 @@ mdb_dpage_free(MDB_env *env, MDB_page *dp)
 {
 	if (!IS_OVERFLOW(dp) || dp->mp_pages == 1) {
 		mdb_page_free(env, dp);
+#if MDB_DPAGE_ARENA
+	} else if (MDB_IN_ARENA(env, dp)) {
+		unsigned c = mdb_dpclass_of(dp->mp_pages);
+		dp->mp_next = env->me_dpclass[c];
+		VGMEMP_FREE(env, dp);
+		env->me_dpclass[c] = dp;
+#endif
 	} else {
 		/* large pages just get freed directly */
 		VGMEMP_FREE(env, dp);
@@ -2048,6 +2478,226 @@ mdb_dpage_free(MDB_env *env, MDB_page *dp)
 	}
 }
 
+/** @defgroup dlist Dirty Page Index
+ *	@{
+ *	A write txn's dirty list is an #MDB_ID2L whose first
+ *	#MDB_txn.%mt_dirty_sorted entries are sorted by pgno. Pages
+ *	dirtied in ascending order simply extend that prefix. Any other
+ *	page is appended to an unsorted tail, and its position is recorded
+ *	in a small open-addressed hash so lookups stay cheap. The list is
+ *	only sorted when the tail fills half the hash, or when an operation
+ *	needs it in order: spilling, flushing, and merging into a parent.
+ *	Since the hash grows along with the list, this costs O(log n) per
+ *	insert instead of the memmove of #mdb_mid2l_insert().
+ *
+ *	The array itself is grown on demand, up to #MDB_env.%me_dirty_max
+ *	entries, which #mdb_env_set_maxdirty() can raise.
+ */
+	/** Initial size of a nested txn's dirty list */
+#define MDB_DLIST_INIT	1024
+	/** Minimum number of slots in a dirty list tail hash */
+#define MDB_DLIST_HMIN	1024
+	/** Starting slot for pgno in a dirty list tail hash */
+#define MDB_DLIST_HASH(pgno, mask)	((unsigned)(pgno) * 2654435761U & (mask))
+
+/** Empty the tail hash of a txn's dirty list, leaving the tail unindexed.
+ *	Only the slots used by the tail are cleared, so this is cheap even
+ *	if the hash is large.
+ */
+static void
+mdb_dlist_unhash(MDB_txn *txn)
+{
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	unsigned *hash = txn->mt_dirty_hash, mask = txn->mt_dirty_hmask;
+	unsigned i, h, n = dl[0].mid;
+
+	for (i = hash ? txn->mt_dirty_sorted + 1 : n + 1; i <= n; i++) {
+		for (h = MDB_DLIST_HASH(dl[i].mid, mask); hash[h] != i; h = (h+1) & mask) ;
+		hash[h] = 0;
+	}
+	txn->mt_dirty_sorted = n;
+}
+
+static int
+mdb_dlist_cmp(const void *a, const void *b)
+{
+	MDB_ID x = ((const MDB_ID2 *)a)->mid, y = ((const MDB_ID2 *)b)->mid;
+	return (x > y) - (x < y);
+}
+
+/** Sort a txn's dirty list, folding its unsorted tail into the prefix. */
+static void
+mdb_dlist_sort(MDB_txn *txn)
+{
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	unsigned i, j, k, s = txn->mt_dirty_sorted, n = dl[0].mid, t = n - s;
+
+	if (!t)
+		return;
+	mdb_dlist_unhash(txn);
+	qsort(dl + s + 1, t, sizeof(MDB_ID2), mdb_dlist_cmp);
+	if (s && dl[s].mid > dl[s+1].mid) {
+		if (n + t < txn->mt_dirty_size) {
+			/* Merge backward, with the tail moved out of the way */
+			memcpy(dl + n + 1, dl + s + 1, t * sizeof(MDB_ID2));
+			i = s, j = n + t, k = n;
+			while (j > n) {
+				if (i && dl[i].mid > dl[j].mid)
+					dl[k--] = dl[i--];
+				else
+					dl[k--] = dl[j--];
+			}
+		} else {
+			qsort(dl + 1, n, sizeof(MDB_ID2), mdb_dlist_cmp);
+		}
+	}
+	txn->mt_dirty_sorted = n;
+}
+
+/** Sort a txn's dirty list and make sure its tail hash can hold
+ *	as many entries as the list currently has.
+ *	Failing to grow the hash is harmless, it only makes the next
+ *	out-of-order insert sort the list again.
+ */
+static void
+mdb_dlist_rehash(MDB_txn *txn)
+{
+	unsigned *hash, size = MDB_DLIST_HMIN;
+
+	mdb_dlist_sort(txn);
+	while (size < txn->mt_u.dirty_list[0].mid)
+		size <<= 1;
+	if (txn->mt_dirty_hash && size <= txn->mt_dirty_hmask + 1)
+		return;
+	if ((hash = calloc(size, sizeof(unsigned))) == NULL)
+		return;
+	free(txn->mt_dirty_hash);
+	txn->mt_dirty_hash = hash;
+	txn->mt_dirty_hmask = size - 1;
+	if (!txn->mt_parent) {
+		txn->mt_env->me_dirty_hash = hash;
+		txn->mt_env->me_dirty_hmask = size - 1;
+	}
+}
+
+/** Make sure a txn's dirty list has room for \b num more entries. */
+static int
+mdb_dlist_grow(MDB_txn *txn, unsigned num)
+{
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	unsigned size = txn->mt_dirty_size;
+
+	if (dl[0].mid + num < size)
+		return MDB_SUCCESS;
+	while (dl[0].mid + num >= size)
+		size <<= 1;
+	if ((dl = realloc(dl, size * sizeof(MDB_ID2))) == NULL)
+		return ENOMEM;
+	txn->mt_u.dirty_list = dl;
+	txn->mt_dirty_size = size;
+	if (!txn->mt_parent) {
+		txn->mt_env->me_dirty_list = dl;
+		txn->mt_env->me_dirty_size = size;
+	}
+	return MDB_SUCCESS;
+}
+
+/** Add a page to a txn's dirty list.
+ *	The caller must make sure the page is not already there.
+ */
+static int
+mdb_dlist_insert(MDB_txn *txn, MDB_ID2 *id)
+{
+	MDB_ID2L dl;
+	unsigned h, mask, n;
+	int rc;
+
+	if ((rc = mdb_dlist_grow(txn, 1)) != MDB_SUCCESS)
+		return rc;
+	dl = txn->mt_u.dirty_list;
+	n = dl[0].mid + 1;
+	if (txn->mt_dirty_sorted == n-1 && (n == 1 || dl[n-1].mid < id->mid)) {
+		dl[n] = *id;
+		dl[0].mid = n;
+		txn->mt_dirty_sorted = n;
+		return MDB_SUCCESS;
+	}
+	if (!txn->mt_dirty_hash ||
+		n - txn->mt_dirty_sorted > (txn->mt_dirty_hmask >> 1))
+		mdb_dlist_rehash(txn);
+	dl[n] = *id;
+	dl[0].mid = n;
+	if (txn->mt_dirty_hash) {
+		mask = txn->mt_dirty_hmask;
+		for (h = MDB_DLIST_HASH(id->mid, mask); txn->mt_dirty_hash[h]; h = (h+1) & mask) ;
+		txn->mt_dirty_hash[h] = n;
+	} else {
+		/* No hash, we could not allocate one */
+		mdb_dlist_sort(txn);
+	}
+	return MDB_SUCCESS;
+}
+
+/** Find a page in a txn's dirty list.
+ * @return The index of the page in the list, or 0 if not present.
+ */
+static unsigned
+mdb_dlist_find(MDB_txn *txn, pgno_t pgno)
+{
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	unsigned base = 0, pivot, x, n = txn->mt_dirty_sorted;
+
+	while (n) {
+		pivot = n >> 1;
+		x = base + pivot + 1;
+		if (pgno < dl[x].mid) {
+			n = pivot;
+		} else if (pgno > dl[x].mid) {
+			base = x;
+			n -= pivot + 1;
+		} else {
+			return x;
+		}
+	}
+	if (dl[0].mid > txn->mt_dirty_sorted) {
+		unsigned *hash = txn->mt_dirty_hash, mask = txn->mt_dirty_hmask;
+		for (x = MDB_DLIST_HASH(pgno, mask); hash[x]; x = (x+1) & mask)
+			if (dl[hash[x]].mid == pgno)
+				return hash[x];
+	}
+	return 0;
+}
+
+/** Remove entry \b x from a txn's dirty list, keeping the order of the rest. */
+static void
+mdb_dlist_remove(MDB_txn *txn, unsigned x)
+{
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	unsigned i, h, mask, s = txn->mt_dirty_sorted, n = dl[0].mid;
+
+	mdb_dlist_unhash(txn);
+	for (i = x; i < n; i++)
+		dl[i] = dl[i+1];
+	dl[0].mid = --n;
+	if (x <= s)
+		s--;
+	txn->mt_dirty_sorted = s;
+	/* Indices past x have shifted, so index the tail again */
+	mask = txn->mt_dirty_hmask;
+	for (i = s + 1; i <= n; i++) {
+		for (h = MDB_DLIST_HASH(dl[i].mid, mask); txn->mt_dirty_hash[h]; h = (h+1) & mask) ;
+		txn->mt_dirty_hash[h] = i;
+	}
+}
+
+/** Free a nested txn's dirty list and its tail hash. */
+static void
+mdb_dlist_close(MDB_txn *txn)
+{
+	free(txn->mt_u.dirty_list);
+	free(txn->mt_dirty_hash);
+}
+
 /**	Return all dirty pages to dpage list */
 static void
 mdb_dlist_free(MDB_txn *txn)
@@ -2059,8 +2709,11 @@ mdb_dlist_free(MDB_txn *txn)
 	for (i = 1; i <= n; i++) {
 		mdb_dpage_free(env, dl[i].mptr);
 	}
+	mdb_dlist_unhash(txn);
 	dl[0].mid = 0;
+	txn->mt_dirty_sorted = 0;
 }
+/** @} */
 
 #ifdef MDB_VL32
 static void
@@ -2133,8 +2786,8 @@ mdb_page_loose(MDB_cursor *mc, MDB_page *mp)
 			 * dirty list.
 			 */
 			if (dl[0].mid) {
-				unsigned x = mdb_mid2l_search(dl, pgno);
-				if (x <= dl[0].mid && dl[x].mid == pgno) {
+				unsigned x = mdb_dlist_find(txn, pgno);
+				if (x) {
 					if (mp != dl[x].mptr) { /* bad cursor? */
 						mc->mc_flags &= ~(C_INITIALIZED|C_EOF);
 						txn->mt_flags |= MDB_TXN_ERROR;
@@ -2155,6 +2808,7 @@ mdb_page_loose(MDB_cursor *mc, MDB_page *mp)
 		txn->mt_loose_pgs = mp;
 		txn->mt_loose_count++;
 		mp->mp_flags |= P_LOOSE;
+		txn->mt_env->me_metrics.mm_loosened++;
 	} else {
 		int rc = mdb_midl_append(&txn->mt_free_pgs, pgno);
 		if (rc)
@@ -2316,11 +2970,12 @@ mdb_page_spill(MDB_cursor *m0, MDB_val *key, MDB_val *data)
 	 * of the dirty pages. Testing revealed this to be a good tradeoff,
 	 * better than 1/2, 1/4, or 1/10.
 	 */
-	if (need < MDB_IDL_UM_MAX / 8)
-		need = MDB_IDL_UM_MAX / 8;
+	if (need < txn->mt_env->me_dirty_max / 8)
+		need = txn->mt_env->me_dirty_max / 8;
 
 	/* Save the page IDs of all the pages we're flushing */
 	/* flush from the tail forward, this saves a lot of shifting later on. */
+	mdb_dlist_sort(txn);
 	for (i=dl[0].mid; i && need; i--) {
 		MDB_ID pn = dl[i].mid << 1;
 		dp = dl[i].mptr;
@@ -2345,6 +3000,7 @@ mdb_page_spill(MDB_cursor *m0, MDB_val *key, MDB_val *data)
 		}
 		if ((rc = mdb_midl_append(&txn->mt_spill_pgs, pn)))
 			goto done;
+		txn->mt_env->me_metrics.mm_spilled++;
 		need--;
 	}
 	mdb_midl_sort(txn->mt_spill_pgs);
@@ -2361,104 +3017,353 @@ done:
 	return rc;
 }
 
-/** Find oldest txnid still referenced. Expects txn->mt_txnid > 0. */
+/** Find oldest txnid still referenced. Expects txn->mt_txnid > 0.
+ *
+ * New readers start at the latest txnid, so no reader can be older
+ * than the result of a previous call, #MDB_env.%me_pgoldest.  Thus
+ * the slot that held the oldest reader last time is checked first,
+ * and the scan stops at any reader still at that txnid.
+ */
 static txnid_t
 mdb_find_oldest(MDB_txn *txn)
 {
-	int i;
-	txnid_t mr, oldest = txn->mt_txnid - 1;
-	if (txn->mt_env->me_txns) {
-		MDB_reader *r = txn->mt_env->me_txns->mti_readers;
-		for (i = txn->mt_env->me_txns->mti_numreaders; --i >= 0; ) {
-			if (r[i].mr_pid) {
-				mr = r[i].mr_txnid;
-				if (oldest > mr)
-					oldest = mr;
+	MDB_env *env = txn->mt_env;
+	int i, n, slot = -1;
+	txnid_t mr, oldest = txn->mt_txnid - 1, bound = env->me_pgoldest;
+	if (env->me_txns) {
+		MDB_reader *r = env->me_txns->mti_readers;
+		n = env->me_txns->mti_numreaders;
+		env->me_metrics.mm_oldest_scans++;
+		i = env->me_oldest_slot;
+		if (bound && i >= 0 && i < n && r[i].mr_pid && r[i].mr_txnid == bound) {
+			env->me_metrics.mm_oldest_slots++;
+			if (oldest > bound)
+				oldest = bound;
+		} else {
+			for (i = n; --i >= 0; ) {
+				if (r[i].mr_pid) {
+					mr = r[i].mr_txnid;
+					if (oldest > mr) {
+						oldest = mr;
+						slot = i;
+						if (mr <= bound)
+							break;
+					}
+				}
 			}
+			env->me_metrics.mm_oldest_slots += n - (i > 0 ? i : 0);
+			env->me_oldest_slot = slot;
 		}
 	}
+#ifndef _WIN32
+	if (env->me_flags & MDB_GROUPCOMMIT) {
+		/* Until the group sync, a crash falls back to the last
+		 * durable txn, so keep its snapshot and its predecessor's.
+		 */
+		pthread_mutex_lock(&env->me_gc_mutex);
+		if (env->me_gc_txnid > env->me_gc_synced && oldest > env->me_gc_synced)
+			oldest = env->me_gc_synced;
+		pthread_mutex_unlock(&env->me_gc_mutex);
+	}
+#endif
 	return oldest;
 }
 
-/** Add a page to the txn's dirty list */
+/** Add a page to the txn's dirty list.
+ *	The caller must have made room with #mdb_dlist_grow().
+ */
 static void
 mdb_page_dirty(MDB_txn *txn, MDB_page *mp)
 {
 	MDB_ID2 mid;
-	int rc, (*insert)(MDB_ID2L, MDB_ID2 *);
+	int rc;
 
-	if (txn->mt_flags & MDB_TXN_WRITEMAP) {
-		insert = mdb_mid2l_append;
-	} else {
-		insert = mdb_mid2l_insert;
-	}
 	mid.mid = mp->mp_pgno;
 	mid.mptr = mp;
-	rc = insert(txn->mt_u.dirty_list, &mid);
+	rc = mdb_dlist_insert(txn, &mid);
 	mdb_tassert(txn, rc == 0);
 	txn->mt_dirty_room--;
 }
 
-/** Allocate page numbers and memory for writing.  Maintain me_pglast,
- * me_pghead and mt_next_pgno.  Set #MDB_TXN_ERROR on failure.
- *
- * If there are free pages available from older transactions, they
- * are re-used first. Otherwise allocate a new page at mt_next_pgno.
- * Do not modify the freedB, just merge freeDB records into me_pghead[]
- * and move me_pglast to say which records were consumed.  Only this
- * function can create me_pghead and move me_pglast/mt_next_pgno.
- * When #MDB_DEVEL & 2, it is not affected by #mdb_freelist_save(): it
- * then uses the transaction's original snapshot of the freeDB.
- * @param[in] mc cursor A cursor handle identifying the transaction and
- *	database for which we are allocating.
- * @param[in] num the number of pages to allocate.
- * @param[out] mp Address of the allocated page(s). Requests for multiple pages
- *  will always be satisfied by a single contiguous chunk of memory.
- * @return 0 on success, non-zero on failure.
+/** Find the first run in the freelist run index which is not
+ * less than {\b len, \b pgno}.
+ * @param[in] env the environment handle.
+ * @param[in] len the run length to search for.
+ * @param[in] pgno the lowest page number of the run to search for.
+ * @return The index of the first such run, or me_pgrun_cnt if none.
  */
-static int
-mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
+static unsigned
+mdb_pgrun_search(MDB_env *env, pgno_t len, pgno_t pgno)
 {
-#ifdef MDB_PARANOID	/* Seems like we can ignore this now */
-	/* Get at most <Max_retries> more freeDB records once me_pghead
-	 * has enough pages.  If not enough, use new pages from the map.
-	 * If <Paranoid> and mc is updating the freeDB, only get new
-	 * records if me_pghead is empty. Then the freelist cannot play
-	 * catch-up with itself by growing while trying to save it.
-	 */
-	enum { Paranoid = 1, Max_retries = 500 };
-#else
-	enum { Paranoid = 0, Max_retries = INT_MAX /*infinite*/ };
-#endif
-	int rc, retry = num * 60;
-	MDB_txn *txn = mc->mc_txn;
-	MDB_env *env = txn->mt_env;
-	pgno_t pgno, *mop = env->me_pghead;
-	unsigned i, j, mop_len = mop ? mop[0] : 0, n2 = num-1;
-	MDB_page *np;
-	txnid_t oldest = 0, last;
-	MDB_cursor_op op;
-	MDB_cursor m2;
-	int found_old = 0;
-
-	/* If there are any loose pages, just use them */
-	if (num == 1 && txn->mt_loose_pgs) {
-		np = txn->mt_loose_pgs;
-		txn->mt_loose_pgs = NEXT_LOOSE_PAGE(np);
-		txn->mt_loose_count--;
-		DPRINTF(("db %d use loose page %"Yu, DDBI(mc), np->mp_pgno));
-		*mp = np;
-		return MDB_SUCCESS;
+	MDB_pgrun *runs = env->me_pgruns;
+	unsigned base = 0, n = env->me_pgrun_cnt, pivot;
+
+	while (n) {
+		pivot = n >> 1;
+		if (runs[base+pivot].pr_len < len ||
+			(runs[base+pivot].pr_len == len && runs[base+pivot].pr_pgno < pgno)) {
+			base += pivot + 1;
+			n -= pivot + 1;
+		} else {
+			n = pivot;
+		}
 	}
+	return base;
+}
 
-	*mp = NULL;
+#if MDB_PGRUN_MIN
+/** qsort() comparator for #MDB_pgrun, by length and then page number */
+static int
+mdb_pgrun_cmp(const void *a, const void *b)
+{
+	const MDB_pgrun *ra = a, *rb = b;
+
+	if (ra->pr_len != rb->pr_len)
+		return ra->pr_len < rb->pr_len ? -1 : 1;
+	return ra->pr_pgno < rb->pr_pgno ? -1 : ra->pr_pgno > rb->pr_pgno;
+}
+
+/** Rebuild the freelist run index from me_pghead[].
+ * @param[in] env the environment handle.
+ * @return 0 on success, ENOMEM on failure.
+ */
+static int
+mdb_pgrun_build(MDB_env *env)
+{
+	pgno_t *mop = env->me_pghead, pgno;
+	unsigned i, j, n = 0, max = mop[0] / 2;
+	MDB_pgrun *runs = env->me_pgruns;
+
+	if (max > env->me_pgrun_max) {
+		if (!(runs = realloc(runs, max * sizeof(MDB_pgrun))))
+			return ENOMEM;
+		env->me_pgruns = runs;
+		env->me_pgrun_max = max;
+	}
+	/* me_pghead[] is sorted in descending order, walk it upwards */
+	for (i = mop[0]; i; i = j) {
+		pgno = mop[i];
+		for (j = i-1; j && mop[j] == pgno + (i-j); j--) ;
+		if (i - j > 1) {
+			runs[n].pr_pgno = pgno;
+			runs[n++].pr_len = i - j;
+		}
+	}
+	qsort(runs, n, sizeof(MDB_pgrun), mdb_pgrun_cmp);
+	env->me_pgrun_cnt = n;
+	env->me_pgrun_ok = 1;
+	env->me_metrics.mm_run_builds++;
+	return MDB_SUCCESS;
+}
+
+/** Look for a run of free pages through the pages of a freeDB
+ * record just merged into me_pghead[]. Any run that was not there
+ * before the merge must contain one of them.
+ * @param[in] mop me_pghead[].
+ * @param[in] idl the merged record.
+ * @param[in] num the number of pages in the run.
+ * @return The index in \b mop of the run's lowest page, or 0 if none.
+ */
+static unsigned
+mdb_pgrun_near(pgno_t *mop, pgno_t *idl, int num)
+{
+	unsigned i, k, x, n2 = num-1;
+
+	for (i = 1; i <= idl[0]; i++) {
+		/* The runs through mop[x] end at mop[x] to mop[x+n2] */
+		x = mdb_midl_search(mop, idl[i]);
+		for (k = x > n2 ? x : n2+1; k <= x+n2 && k <= mop[0]; k++)
+			if (mop[k-n2] == mop[k] + n2)
+				return k;
+	}
+	return 0;
+}
+#endif
+
+/** Update the freelist run index for pages about to be removed
+ * from me_pghead[]. Must be called before me_pghead[] is changed.
+ * @param[in] env the environment handle.
+ * @param[in] i the index in me_pghead[] of the lowest page to remove.
+ * @param[in] num the number of consecutive pages to remove.
+ */
+static void
+mdb_pgrun_take(MDB_env *env, unsigned i, int num)
+{
+	pgno_t *mop = env->me_pghead, pgno = mop[i];
+	MDB_pgrun *runs = env->me_pgruns, run;
+	unsigned lo, hi, mid, r, x;
+
+	if (!env->me_pgrun_ok)
+		return;
+	if (i < mop[0] && mop[i+1] == pgno-1) {
+		/* Not the start of a run, give up on the index */
+		env->me_pgrun_ok = 0;
+		return;
+	}
+	/* Find the run length. me_pghead[] is strictly descending,
+	 * so mop[i-k] == pgno+k iff the run has more than k pages.
+	 */
+	lo = num-1;
+	hi = i-1;
+	while (lo < hi) {
+		mid = hi - ((hi - lo) >> 1);
+		if (mop[i-mid] == pgno + mid)
+			lo = mid;
+		else
+			hi = mid-1;
+	}
+	if (lo == 0)	/* single pages are not indexed */
+		return;
+	r = mdb_pgrun_search(env, lo+1, pgno);
+	mdb_eassert(env, r < env->me_pgrun_cnt && runs[r].pr_pgno == pgno);
+	run.pr_pgno = pgno + num;
+	run.pr_len = lo+1 - num;
+	if (run.pr_len < 2) {
+		env->me_pgrun_cnt--;
+		memmove(runs + r, runs + r + 1, (env->me_pgrun_cnt - r) * sizeof(MDB_pgrun));
+	} else {
+		/* The run got shorter, move it down */
+		x = mdb_pgrun_search(env, run.pr_len, run.pr_pgno);
+		memmove(runs + x + 1, runs + x, (r - x) * sizeof(MDB_pgrun));
+		runs[x] = run;
+	}
+}
+
+/** Make room for \b num more entries in a nested txn's freelist undo log.
+ * @param[in,out] idp Address of #MDB_ntxn.%mnt_pgtaken or %mnt_pgadded.
+ * @param[in] num the number of entries to make room for.
+ * @return 0 on success, ENOMEM on failure.
+ */
+static int
+mdb_pglog_need(MDB_IDL *idp, unsigned num)
+{
+	if (!*idp && !(*idp = mdb_midl_alloc(MDB_NTXN_IDL)))
+		return ENOMEM;
+	return mdb_midl_need(idp, num);
+}
+
+/** Remove the IDs in \b b from \b a. Both lists are sorted. */
+static void
+mdb_pglog_remove(MDB_IDL a, MDB_IDL b)
+{
+	unsigned i, j = 1, k = 0, n = b[0];
+
+	for (i = 1; i <= a[0]; i++) {
+		while (j <= n && b[j] > a[i])
+			j++;
+		if (j <= n && b[j] == a[i])
+			continue;
+		a[++k] = a[i];
+	}
+	a[0] = k;
+}
+
+/** Undo a nested txn's changes to me_pghead[] and me_pglast.
+ *	Pages it took from me_pghead[] go back, pages it merged in
+ *	from the freeDB are removed again. A page can only be merged
+ *	in and later taken out, never the other way around.
+ * @param[in] ntxn the nested transaction being aborted.
+ */
+static void
+mdb_pglog_undo(MDB_ntxn *ntxn)
+{
+	MDB_env *env = ntxn->mnt_txn.mt_env;
+	MDB_IDL mop = env->me_pghead, taken = ntxn->mnt_pgtaken, added = ntxn->mnt_pgadded;
+
+	if (ntxn->mnt_pgnew) {
+		mdb_midl_free(mop);
+		env->me_pghead = NULL;
+		env->me_pgrun_ok = 0;
+	} else if ((taken && taken[0]) || (added && added[0])) {
+		if (added && added[0]) {
+			mdb_midl_sort(added);
+			mdb_pglog_remove(mop, added);
+		}
+		if (taken && taken[0]) {
+			mdb_midl_sort(taken);
+			if (added && added[0])
+				mdb_pglog_remove(taken, added);
+			/* Fits: me_pghead[] never shrinks its allocation */
+			mdb_midl_xmerge(mop, taken);
+		}
+		env->me_pgrun_ok = 0;
+	}
+	env->me_pglast = ntxn->mnt_pglast;
+	mdb_midl_free(taken);
+	mdb_midl_free(added);
+}
+
+/** Allocate page numbers and memory for writing.  Maintain me_pglast,
+ * me_pghead and mt_next_pgno.  Set #MDB_TXN_ERROR on failure.
+ *
+ * If there are free pages available from older transactions, they
+ * are re-used first. Otherwise allocate a new page at mt_next_pgno.
+ * Do not modify the freedB, just merge freeDB records into me_pghead[]
+ * and move me_pglast to say which records were consumed.  Only this
+ * function can create me_pghead and move me_pglast/mt_next_pgno.
+ * When #MDB_DEVEL & 2, it is not affected by #mdb_freelist_save(): it
+ * then uses the transaction's original snapshot of the freeDB.
+ * @param[in] mc cursor A cursor handle identifying the transaction and
+ *	database for which we are allocating.
+ * @param[in] num the number of pages to allocate.
+ * @param[out] mp Address of the allocated page(s). Requests for multiple pages
+ *  will always be satisfied by a single contiguous chunk of memory.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
+{
+#ifdef MDB_PARANOID	/* Seems like we can ignore this now */
+	/* Get at most <Max_retries> more freeDB records once me_pghead
+	 * has enough pages.  If not enough, use new pages from the map.
+	 * If <Paranoid> and mc is updating the freeDB, only get new
+	 * records if me_pghead is empty. Then the freelist cannot play
+	 * catch-up with itself by growing while trying to save it.
+	 */
+	enum { Paranoid = 1, Max_retries = 500 };
+#else
+	enum { Paranoid = 0, Max_retries = INT_MAX /*infinite*/ };
+#endif
+	int rc, retry = num * 60;
+	MDB_txn *txn = mc->mc_txn;
+	MDB_env *env = txn->mt_env;
+	pgno_t pgno, *mop = env->me_pghead;
+	unsigned i, j, mop_len = mop ? mop[0] : 0, n2 = num-1;
+	MDB_page *np;
+	txnid_t oldest = 0, last;
+	MDB_cursor_op op;
+	MDB_cursor m2;
+	int found_old = 0, tries = 0, reclaimed = 0, indexed = 0;
+	/* A child txn logs its changes to an older me_pghead[] */
+	MDB_ntxn *ntxn = txn->mt_parent && !((MDB_ntxn *)txn)->mnt_pgnew ?
+		(MDB_ntxn *)txn : NULL;
+
+	env->me_metrics.mm_allocs++;
+	if (num > 1)
+		env->me_metrics.mm_allocs_multi++;
+
+	/* If there are any loose pages, just use them */
+	if (num == 1 && txn->mt_loose_pgs) {
+		np = txn->mt_loose_pgs;
+		txn->mt_loose_pgs = NEXT_LOOSE_PAGE(np);
+		txn->mt_loose_count--;
+		env->me_metrics.mm_loose_reused++;
+		DPRINTF(("db %d use loose page %"Yu, DDBI(mc), np->mp_pgno));
+		*mp = np;
+		return MDB_SUCCESS;
+	}
+
+	*mp = NULL;
 
 	/* If our dirty list is already full, we can't do anything */
 	if (txn->mt_dirty_room == 0) {
 		rc = MDB_TXN_FULL;
 		goto fail;
 	}
+	if ((rc = mdb_dlist_grow(txn, 1)) != MDB_SUCCESS)
+		goto fail;
 
+again:
 	for (op = MDB_FIRST;; op = MDB_NEXT) {
 		MDB_val key, data;
 		MDB_node *leaf;
@@ -2468,14 +3373,40 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 		 * pages at the tail, just truncating the list.
 		 */
 		if (mop_len > n2) {
-			i = mop_len;
-			do {
-				pgno = mop[i];
-				if (mop[i-n2] == pgno+n2)
-					goto search_done;
-			} while (--i > n2);
-			if (--retry < 0)
+#if MDB_PGRUN_MIN
+			if (n2 && (indexed || (mop_len >= MDB_PGRUN_MIN &&
+				!env->me_pgceil &&
+				(env->me_pgrun_ok || !mdb_pgrun_build(env))))) {
+				/* Use the smallest run that fits. The records merged
+				 * in after that are checked by mdb_pgrun_near(), so
+				 * the index is not rebuilt for each of them.
+				 */
+				if (!indexed) {
+					indexed = 1;
+					j = mdb_pgrun_search(env, num, 0);
+					if (j < env->me_pgrun_cnt) {
+						pgno = env->me_pgruns[j].pr_pgno;
+						i = mdb_midl_search(mop, pgno);
+						mdb_cassert(mc, i <= mop_len && mop[i] == pgno &&
+							mop[i-n2] == pgno+n2);
+						goto search_done;
+					}
+				}
+			} else
+#endif
+			{
+				i = mop_len;
+				do {
+					pgno = mop[i];
+					if (mop[i-n2] == pgno+n2)
+						goto search_done;
+				} while (--i > n2);
+			}
+			tries++;
+			if (--retry < 0) {
+				env->me_metrics.mm_retry_limit++;
 				break;
+			}
 		}
 
 		if (op == MDB_FIRST) {	/* 1st iteration */
@@ -2510,8 +3441,10 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 				env->me_pgoldest = oldest;
 				found_old = 1;
 			}
-			if (oldest <= last)
+			if (oldest <= last) {
+				env->me_metrics.mm_reader_limit++;
 				break;
+			}
 		}
 		rc = mdb_cursor_get(&m2, &key, NULL, op);
 		if (rc) {
@@ -2526,8 +3459,10 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 				env->me_pgoldest = oldest;
 				found_old = 1;
 			}
-			if (oldest <= last)
+			if (oldest <= last) {
+				env->me_metrics.mm_reader_limit++;
 				break;
+			}
 		}
 		np = m2.mc_pg[m2.mc_top];
 		leaf = NODEPTR(np, m2.mc_ki[m2.mc_top]);
@@ -2536,6 +3471,7 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 
 		idl = (MDB_ID *) data.mv_data;
 		i = idl[0];
+		env->me_metrics.mm_free_reads++;
 		if (!mop) {
 			if (!(env->me_pghead = mop = mdb_midl_alloc(i))) {
 				rc = ENOMEM;
@@ -2546,6 +3482,14 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 				goto fail;
 			mop = env->me_pghead;
 		}
+		if (ntxn) {
+			MDB_IDL added;
+			if ((rc = mdb_pglog_need(&ntxn->mnt_pgadded, i)) != 0)
+				goto fail;
+			added = ntxn->mnt_pgadded;
+			memcpy(added + added[0] + 1, idl + 1, i * sizeof(MDB_ID));
+			added[0] += i;
+		}
 		env->me_pglast = last;
 #if (MDB_DEBUG) > 1
 		DPRINTF(("IDL read txn %"Yu" root %"Yu" num %u",
@@ -2556,6 +3500,30 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 		/* Merge in descending sorted order */
 		mdb_midl_xmerge(mop, idl);
 		mop_len = mop[0];
+		env->me_pgreclaimed += i;
+		env->me_pgrun_ok = 0;
+#if MDB_PGRUN_MIN
+		if (indexed && (i = mdb_pgrun_near(mop, idl, num)) != 0) {
+			pgno = mop[i];
+			goto search_done;
+		}
+#endif
+	}
+
+	/* Free some pages of a lazily dropped DB before growing the map */
+	if (!reclaimed && !txn->mt_parent && !env->me_pgceil &&
+		env->me_rcl_state != MDB_RCL_DONE) {
+		reclaimed = 1;
+		rc = mdb_rcl_step(mc);
+		if (rc == MDB_SUCCESS) {
+			mop = env->me_pghead;
+			mop_len = mop[0];
+			retry = num * 60;
+			indexed = 0;
+			goto again;
+		}
+		if (rc != MDB_NOTFOUND)
+			goto fail;
 	}
 
 	/* Use new pages from the map when nothing suitable in the freeDB */
@@ -2580,8 +3548,14 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 		}
 	}
 #endif
+	env->me_metrics.mm_grows++;
+	if (num > 1)
+		env->me_metrics.mm_grows_multi++;
+	env->me_metrics.mm_grow_retries += tries;
 
 search_done:
+	if (i && ntxn && (rc = mdb_pglog_need(&ntxn->mnt_pgtaken, num)) != 0)
+		goto fail;
 	if (env->me_flags & MDB_WRITEMAP) {
 		np = (MDB_page *)(env->me_map + env->me_psize * pgno);
 	} else {
@@ -2591,6 +3565,12 @@ search_done:
 		}
 	}
 	if (i) {
+		env->me_metrics.mm_free_reused++;
+		if (ntxn) {
+			for (j = 0; j < (unsigned)num; j++)
+				mdb_midl_xappend(ntxn->mnt_pgtaken, pgno + j);
+		}
+		mdb_pgrun_take(env, i, num);
 		mop[0] = mop_len -= num;
 		/* Move any stragglers down */
 		for (j = i-num; j < mop_len; )
@@ -2658,6 +3638,8 @@ mdb_page_unspill(MDB_txn *txn, MDB_page *mp, MDB_page **ret)
 			int num;
 			if (txn->mt_dirty_room == 0)
 				return MDB_TXN_FULL;
+			if (mdb_dlist_grow(txn, 1))
+				return ENOMEM;
 			if (IS_OVERFLOW(mp))
 				num = mp->mp_pages;
 			else
@@ -2688,6 +3670,7 @@ mdb_page_unspill(MDB_txn *txn, MDB_page *mp, MDB_page **ret)
 
 			mdb_page_dirty(txn, np);
 			np->mp_flags |= P_DIRTY;
+			env->me_metrics.mm_unspilled++;
 			*ret = np;
 			break;
 		}
@@ -2741,8 +3724,8 @@ mdb_page_touch(MDB_cursor *mc)
 		 * dirty list.
 		 */
 		if (dl[0].mid) {
-			unsigned x = mdb_mid2l_search(dl, pgno);
-			if (x <= dl[0].mid && dl[x].mid == pgno) {
+			unsigned x = mdb_dlist_find(txn, pgno);
+			if (x) {
 				if (mp != dl[x].mptr) { /* bad cursor? */
 					mc->mc_flags &= ~(C_INITIALIZED|C_EOF);
 					txn->mt_flags |= MDB_TXN_ERROR;
@@ -2751,14 +3734,15 @@ mdb_page_touch(MDB_cursor *mc)
 				return 0;
 			}
 		}
-		mdb_cassert(mc, dl[0].mid < MDB_IDL_UM_MAX);
 		/* No - copy it */
+		if (mdb_dlist_grow(txn, 1))
+			return ENOMEM;
 		np = mdb_page_malloc(txn, 1);
 		if (!np)
 			return ENOMEM;
 		mid.mid = pgno;
 		mid.mptr = np;
-		rc = mdb_mid2l_insert(dl, &mid);
+		rc = mdb_dlist_insert(txn, &mid);
 		mdb_cassert(mc, rc == 0);
 	} else {
 		return 0;
@@ -2798,13 +3782,51 @@ fail:
 	return rc;
 }
 
+/** Return a monotonic timestamp in microseconds. */
+static uint64_t
+mdb_clock_usec(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER c, f;
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return (uint64_t)(c.QuadPart / f.QuadPart) * 1000000 +
+		(uint64_t)(c.QuadPart % f.QuadPart) * 1000000 / f.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/** Count a sync call in the environment's metrics.
+ * @param[in] env the environment
+ * @param[in] start the #mdb_clock_usec() time the call started
+ */
+static void
+mdb_sync_count(MDB_env *env, uint64_t start)
+{
+	MDB_metrics *mm = &env->me_metrics;
+	uint64_t usec = mdb_clock_usec() - start, u;
+	int i;
+
+	/* Bucket by the bit length of the latency */
+	for (i = 0, u = usec; u && i < MDB_SYNC_HIST-1; i++)
+		u >>= 1;
+	mm->mm_syncs++;
+	mm->mm_sync_usec += usec;
+	mm->mm_sync_hist[i]++;
+}
+
 int
 mdb_env_sync0(MDB_env *env, int force, pgno_t numpgs)
 {
 	int rc = 0;
+	uint64_t start;
 	if (env->me_flags & MDB_RDONLY)
 		return EACCES;
 	if (force || !F_ISSET(env->me_flags, MDB_NOSYNC)) {
+		start = mdb_clock_usec();
 		if (env->me_flags & MDB_WRITEMAP) {
 			int flags = ((env->me_flags & MDB_MAPASYNC) && !force)
 				? MS_ASYNC : MS_SYNC;
@@ -2824,6 +3846,7 @@ mdb_env_sync0(MDB_env *env, int force, pgno_t numpgs)
 			if (MDB_FDATASYNC(env->me_fd))
 				rc = ErrCode();
 		}
+		mdb_sync_count(env, start);
 	}
 	return rc;
 }
@@ -3004,32 +4027,61 @@ mdb_txn_renew0(MDB_txn *txn)
 						return rc;
 					env->me_live_reader = 1;
 				}
-
-				if (LOCK_MUTEX(rc, env, rmutex))
-					return rc;
-				nr = ti->mti_numreaders;
-				for (i=0; i<nr; i++)
-					if (ti->mti_readers[i].mr_pid == 0)
+#ifndef MDB_RSLOT_LOCKED
+				/* Try to claim a free slot without the mutex.  Only
+				 * look below me_close_readers, which mdb_env_close()
+				 * already checks.  So a process's first claim always
+				 * takes the mutex, which also keeps mdb_reader_check()
+				 * from mistaking it for a stale reader of a previous
+				 * process with our pid.
+				 */
+				nr = env->me_close_readers;
+				for (i=0; i<nr; i++) {
+					r = &ti->mti_readers[i];
+					if (r->mr_pid == 0 && MDB_PID_CAS(&r->mr_pid, 0, pid))
 						break;
-				if (i == env->me_maxreaders) {
+				}
+				if (i < nr) {
+					/* Until this store, the slot may show a txnid of
+					 * its previous owner, which only makes writers
+					 * keep more pages than needed.
+					 */
+					r->mr_txnid = (txnid_t)-1;
+					r->mr_tid = tid;
+				} else
+#endif
+				{
+					if (LOCK_MUTEX(rc, env, rmutex))
+						return rc;
+					nr = ti->mti_numreaders;
+					for (i=0; i<nr; i++) {
+						r = &ti->mti_readers[i];
+						if (r->mr_pid == 0 && MDB_PID_CAS(&r->mr_pid, 0, pid))
+							break;
+					}
+					if (i == env->me_maxreaders) {
+						UNLOCK_MUTEX(rmutex);
+						return MDB_READERS_FULL;
+					}
+					r = &ti->mti_readers[i];
+					/* Claim the reader slot, carefully since other code
+					 * uses the reader table un-mutexed: A free slot was
+					 * claimed above by swapping in our pid.  A new slot
+					 * is reset and claimed before publishing it in
+					 * mti_numreaders, since other threads may claim any
+					 * published slot without the mutex.  After that, it
+					 * is safe for mdb_env_close() to touch it.
+					 */
+					r->mr_txnid = (txnid_t)-1;
+					r->mr_tid = tid;
+					if (i == nr) {
+						r->mr_pid = 0;
+						(void)MDB_PID_CAS(&r->mr_pid, 0, pid);
+						ti->mti_numreaders = ++nr;
+					}
+					env->me_close_readers = nr;
 					UNLOCK_MUTEX(rmutex);
-					return MDB_READERS_FULL;
 				}
-				r = &ti->mti_readers[i];
-				/* Claim the reader slot, carefully since other code
-				 * uses the reader table un-mutexed: First reset the
-				 * slot, next publish it in mti_numreaders.  After
-				 * that, it is safe for mdb_env_close() to touch it.
-				 * When it will be closed, we can finally claim it.
-				 */
-				r->mr_pid = 0;
-				r->mr_txnid = (txnid_t)-1;
-				r->mr_tid = tid;
-				if (i == nr)
-					ti->mti_numreaders = ++nr;
-				env->me_close_readers = nr;
-				r->mr_pid = pid;
-				UNLOCK_MUTEX(rmutex);
 
 				new_notls = (env->me_flags & MDB_NOTLS);
 				if (!new_notls && (rc=pthread_setspecific(env->me_txkey, r))) {
@@ -3056,6 +4108,13 @@ mdb_txn_renew0(MDB_txn *txn)
 			meta = mdb_env_pick_meta(env);
 			txn->mt_txnid = meta->mm_txnid;
 		}
+#ifndef _WIN32
+		/* Build on the last commit even if its group sync is pending */
+		if ((env->me_flags & MDB_GROUPCOMMIT) && env->me_gc_txnid > txn->mt_txnid) {
+			txn->mt_txnid = env->me_gc_txnid;
+			meta = &env->me_gc_metas[txn->mt_txnid & 1];
+		}
+#endif
 		txn->mt_txnid++;
 #if MDB_DEBUG
 		if (txn->mt_txnid == mdb_debug_start)
@@ -3064,9 +4123,13 @@ mdb_txn_renew0(MDB_txn *txn)
 		txn->mt_child = NULL;
 		txn->mt_loose_pgs = NULL;
 		txn->mt_loose_count = 0;
-		txn->mt_dirty_room = MDB_IDL_UM_MAX;
+		txn->mt_dirty_room = env->me_dirty_max;
 		txn->mt_u.dirty_list = env->me_dirty_list;
 		txn->mt_u.dirty_list[0].mid = 0;
+		txn->mt_dirty_sorted = 0;
+		txn->mt_dirty_size = env->me_dirty_size;
+		txn->mt_dirty_hash = env->me_dirty_hash;
+		txn->mt_dirty_hmask = env->me_dirty_hmask;
 		txn->mt_free_pgs = env->me_free_pgs;
 		txn->mt_free_pgs[0] = 0;
 		txn->mt_spill_pgs = NULL;
@@ -3095,7 +4158,7 @@ mdb_txn_renew0(MDB_txn *txn)
 	txn->mt_dbflags[MAIN_DBI] = DB_VALID|DB_USRVALID;
 	txn->mt_dbflags[FREE_DBI] = DB_VALID;
 
-	if (env->me_flags & MDB_FATAL_ERROR) {
+	if (MDB_ENV_FATAL(env)) {
 		DPUTS("environment had fatal error, must shutdown!");
 		rc = MDB_PANIC;
 	} else if (env->me_maxpg < txn->mt_next_pgno) {
@@ -3143,7 +4206,7 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 		if (flags & (MDB_RDONLY|MDB_WRITEMAP|MDB_TXN_BLOCKED)) {
 			return (parent->mt_flags & MDB_TXN_RDONLY) ? EINVAL : MDB_BAD_TXN;
 		}
-		/* Child txns save MDB_pgstate and use own copy of cursors */
+		/* Child txns log me_pghead changes and use own copy of cursors */
 		size = env->me_maxdbs * (sizeof(MDB_db)+sizeof(MDB_cursor *)+1);
 		size += tsize = sizeof(MDB_ntxn);
 	} else if (flags & MDB_RDONLY) {
@@ -3181,9 +4244,9 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 		unsigned int i;
 		txn->mt_cursors = (MDB_cursor **)(txn->mt_dbs + env->me_maxdbs);
 		txn->mt_dbiseqs = parent->mt_dbiseqs;
-		txn->mt_u.dirty_list = malloc(sizeof(MDB_ID2)*MDB_IDL_UM_SIZE);
+		txn->mt_u.dirty_list = malloc(sizeof(MDB_ID2)*MDB_DLIST_INIT);
 		if (!txn->mt_u.dirty_list ||
-			!(txn->mt_free_pgs = mdb_midl_alloc(MDB_IDL_UM_MAX)))
+			!(txn->mt_free_pgs = mdb_midl_alloc(MDB_NTXN_IDL)))
 		{
 			free(txn->mt_u.dirty_list);
 			free(txn);
@@ -3192,6 +4255,10 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 		txn->mt_txnid = parent->mt_txnid;
 		txn->mt_dirty_room = parent->mt_dirty_room;
 		txn->mt_u.dirty_list[0].mid = 0;
+		txn->mt_dirty_sorted = 0;
+		txn->mt_dirty_size = MDB_DLIST_INIT;
+		txn->mt_dirty_hash = NULL;
+		txn->mt_dirty_hmask = 0;
 		txn->mt_spill_pgs = NULL;
 		txn->mt_next_pgno = parent->mt_next_pgno;
 		parent->mt_flags |= MDB_TXN_HAS_CHILD;
@@ -3205,19 +4272,10 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 		/* Copy parent's mt_dbflags, but clear DB_NEW */
 		for (i=0; i<txn->mt_numdbs; i++)
 			txn->mt_dbflags[i] = parent->mt_dbflags[i] & ~DB_NEW;
-		rc = 0;
 		ntxn = (MDB_ntxn *)txn;
-		ntxn->mnt_pgstate = env->me_pgstate; /* save parent me_pghead & co */
-		if (env->me_pghead) {
-			size = MDB_IDL_SIZEOF(env->me_pghead);
-			env->me_pghead = mdb_midl_alloc(env->me_pghead[0]);
-			if (env->me_pghead)
-				memcpy(env->me_pghead, ntxn->mnt_pgstate.mf_pghead, size);
-			else
-				rc = ENOMEM;
-		}
-		if (!rc)
-			rc = mdb_cursor_shadow(parent, txn);
+		ntxn->mnt_pglast = env->me_pglast;
+		ntxn->mnt_pgnew = !env->me_pghead;
+		rc = mdb_cursor_shadow(parent, txn);
 		if (rc)
 			mdb_txn_end(txn, MDB_END_FAIL_BEGINCHILD);
 	} else { /* MDB_RDONLY */
@@ -3321,12 +4379,12 @@ mdb_txn_end(MDB_txn *txn, unsigned mode)
 		txn->mt_flags |= MDB_TXN_FINISHED;
 
 	} else if (!F_ISSET(txn->mt_flags, MDB_TXN_FINISHED)) {
-		pgno_t *pghead = env->me_pghead;
-
 		if (!(mode & MDB_END_UPDATE)) /* !(already closed cursors) */
 			mdb_cursors_close(txn, 0);
 		if (!(env->me_flags & MDB_WRITEMAP)) {
 			mdb_dlist_free(txn);
+		} else {
+			mdb_dlist_unhash(txn);
 		}
 
 		txn->mt_numdbs = 0;
@@ -3336,8 +4394,17 @@ mdb_txn_end(MDB_txn *txn, unsigned mode)
 			mdb_midl_shrink(&txn->mt_free_pgs);
 			env->me_free_pgs = txn->mt_free_pgs;
 			/* me_pgstate: */
+			mdb_midl_free(env->me_pghead);
 			env->me_pghead = NULL;
 			env->me_pglast = 0;
+			env->me_pgreclaimed = 0;
+			env->me_pgrun_ok = 0;
+			env->me_rcl_key = 0;
+			env->me_rcl_state = MDB_RCL_IDLE;
+			if (env->me_commit_pgs) {
+				env->me_commit_pgs[0] = 0;
+				mdb_midl_shrink(&env->me_commit_pgs);
+			}
 
 			env->me_txn = NULL;
 			mode = 0;	/* txn == env->me_txn0, do not free() it */
@@ -3348,39 +4415,25 @@ mdb_txn_end(MDB_txn *txn, unsigned mode)
 		} else {
 			txn->mt_parent->mt_child = NULL;
 			txn->mt_parent->mt_flags &= ~MDB_TXN_HAS_CHILD;
-			env->me_pgstate = ((MDB_ntxn *)txn)->mnt_pgstate;
+			mdb_pglog_undo((MDB_ntxn *)txn);
 			mdb_midl_free(txn->mt_free_pgs);
 			mdb_midl_free(txn->mt_spill_pgs);
-			free(txn->mt_u.dirty_list);
+			mdb_dlist_close(txn);
 		}
-
-		mdb_midl_free(pghead);
 	}
 #ifdef MDB_VL32
 	if (!txn->mt_parent) {
-		MDB_ID3L el = env->me_rpages, tl = txn->mt_rpages;
-		unsigned i, x, n = tl[0].mid;
-		pthread_mutex_lock(&env->me_rpmutex);
-		for (i = 1; i <= n; i++) {
-			if (tl[i].mid & (MDB_RPAGE_CHUNK-1)) {
-				/* tmp overflow pages that we didn't share in env */
-				munmap(tl[i].mptr, tl[i].mcnt * env->me_psize);
-			} else {
-				x = mdb_mid3l_search(el, tl[i].mid);
-				if (tl[i].mptr == el[x].mptr) {
-					el[x].mref--;
-				} else {
-					/* another tmp overflow page */
-					munmap(tl[i].mptr, tl[i].mcnt * env->me_psize);
-				}
-			}
-		}
-		pthread_mutex_unlock(&env->me_rpmutex);
+		MDB_ID3L tl = txn->mt_rpages;
+		unsigned i, n = tl[0].mid;
+		for (i = 1; i <= n; i++)
+			mdb_rpage_release(env, &tl[i]);
 		tl[0].mid = 0;
+		mdb_rpage_evict(env, 0);
 		if (mode & MDB_END_FREE)
 			free(tl);
 	}
 #endif
+	mdb_zbufs_free(txn);
 	if (mode & MDB_END_FREE)
 		free(txn);
 }
@@ -3448,18 +4501,12 @@ mdb_freelist_save(MDB_txn *txn)
 		unsigned x;
 		if ((rc = mdb_midl_need(&txn->mt_free_pgs, txn->mt_loose_count)) != 0)
 			return rc;
+		mdb_dlist_sort(txn);
 		for (; mp; mp = NEXT_LOOSE_PAGE(mp)) {
 			mdb_midl_xappend(txn->mt_free_pgs, mp->mp_pgno);
 			/* must also remove from dirty list */
-			if (txn->mt_flags & MDB_TXN_WRITEMAP) {
-				for (x=1; x<=dl[0].mid; x++)
-					if (dl[x].mid == mp->mp_pgno)
-						break;
-				mdb_tassert(txn, x <= dl[0].mid);
-			} else {
-				x = mdb_mid2l_search(dl, mp->mp_pgno);
-				mdb_tassert(txn, dl[x].mid == mp->mp_pgno);
-			}
+			x = mdb_dlist_find(txn, mp->mp_pgno);
+			mdb_tassert(txn, x != 0);
 			dl[x].mptr = NULL;
 			mdb_dpage_free(env, mp);
 		}
@@ -3478,6 +4525,7 @@ mdb_freelist_save(MDB_txn *txn)
 				/* all slots freed */
 				dl[0].mid = 0;
 			}
+			txn->mt_dirty_sorted = dl[0].mid;
 		}
 		txn->mt_loose_pgs = NULL;
 		txn->mt_loose_count = 0;
@@ -3601,6 +4649,7 @@ mdb_freelist_save(MDB_txn *txn)
 		loose[0] = count;
 		mdb_midl_sort(loose);
 		mdb_midl_xmerge(mop, loose);
+		env->me_pgrun_ok = 0;
 		txn->mt_loose_pgs = NULL;
 		txn->mt_loose_count = 0;
 		mop_len = mop[0];
@@ -3636,6 +4685,206 @@ mdb_freelist_save(MDB_txn *txn)
 	return rc;
 }
 
+#ifdef MDB_USE_IO_URING
+/** Set up the io_uring for #mdb_page_flush().
+ * On failure the ring is marked unusable, so it isn't retried
+ * and the pages are written with writev() instead.
+ * @param[in] env the environment handle
+ */
+static void ESECT
+mdb_uring_init(MDB_env *env)
+{
+	MDB_uring *ur;
+	struct io_uring_params p;
+	char *sq, *cq;
+	int fd;
+
+	if ((ur = calloc(1, sizeof(MDB_uring))) == NULL)
+		return;
+	ur->ur_fd = -1;
+	env->me_uring = ur;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, MDB_URING_DEPTH, &p);
+	if (fd < 0) {
+		DPRINTF(("io_uring_setup: %s", strerror(ErrCode())));
+		return;
+	}
+	ur->ur_sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->ur_cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_sqlen < ur->ur_cqlen)
+			ur->ur_sqlen = ur->ur_cqlen;
+		ur->ur_cqlen = 0;
+	}
+	ur->ur_sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq = mmap(NULL, ur->ur_sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	ur->ur_sqmap = sq;
+	if (ur->ur_cqlen) {
+		cq = mmap(NULL, ur->ur_cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+		ur->ur_cqmap = cq;
+	} else {
+		cq = sq;
+	}
+	ur->ur_sqes = mmap(NULL, ur->ur_sqeslen, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED) {
+		ur->ur_sqes = NULL;
+		goto fail;
+	}
+	ur->ur_sqhead = (unsigned *)(sq + p.sq_off.head);
+	ur->ur_sqtail = (unsigned *)(sq + p.sq_off.tail);
+	ur->ur_sqarray = (unsigned *)(sq + p.sq_off.array);
+	ur->ur_sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ur->ur_cqhead = (unsigned *)(cq + p.cq_off.head);
+	ur->ur_cqtail = (unsigned *)(cq + p.cq_off.tail);
+	ur->ur_cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ur->ur_entries = p.sq_entries;
+	ur->ur_fd = fd;
+	return;
+
+fail:
+	DPRINTF(("io_uring mmap: %s", strerror(ErrCode())));
+	if (ur->ur_sqmap)
+		munmap(ur->ur_sqmap, ur->ur_sqlen);
+	if (ur->ur_cqmap)
+		munmap(ur->ur_cqmap, ur->ur_cqlen);
+	ur->ur_sqmap = ur->ur_cqmap = NULL;
+	close(fd);
+}
+
+/** Release the io_uring of an environment. */
+static void ESECT
+mdb_uring_close(MDB_env *env)
+{
+	MDB_uring *ur = env->me_uring;
+
+	if (ur->ur_fd >= 0) {
+		munmap(ur->ur_sqes, ur->ur_sqeslen);
+		if (ur->ur_cqmap)
+			munmap(ur->ur_cqmap, ur->ur_cqlen);
+		munmap(ur->ur_sqmap, ur->ur_sqlen);
+		close(ur->ur_fd);
+	}
+	free(ur);
+	env->me_uring = NULL;
+}
+
+/** Submit all queued writes and wait for every write in flight.
+ * This only returns once the kernel is done with every buffer it
+ * was given, even on failure, so the caller may release the pages.
+ * Writes the kernel never took are withdrawn if submitting fails.
+ * @param[in] ur the ring
+ * @return 0 on success, or the first error any of the writes got.
+ */
+static int
+mdb_uring_wait(MDB_uring *ur)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int rc;
+
+	while (ur->ur_inflight) {
+		rc = syscall(__NR_io_uring_enter, ur->ur_fd, ur->ur_queued, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (rc < 0) {
+			rc = ErrCode();
+			/* EBUSY: completions must be reaped before more can be submitted */
+			if (rc != EINTR && rc != EAGAIN && rc != EBUSY) {
+				DPRINTF(("io_uring_enter: %s", strerror(rc)));
+				if (!ur->ur_err)
+					ur->ur_err = rc;
+				if (ur->ur_queued) {
+					/* Take back the writes the kernel hasn't consumed */
+					head = __atomic_load_n(ur->ur_sqhead, __ATOMIC_ACQUIRE);
+					ur->ur_inflight -= *ur->ur_sqtail - head;
+					__atomic_store_n(ur->ur_sqtail, head, __ATOMIC_RELEASE);
+					ur->ur_queued = 0;
+				} else {
+					/* Can't wait in the kernel; the writes it has
+					 * still complete into the ring, so poll for them.
+					 */
+					sched_yield();
+				}
+			}
+		} else {
+			ur->ur_queued -= rc;
+		}
+		head = *ur->ur_cqhead;
+		tail = __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ur->ur_cqes[head & ur->ur_cqmask];
+			if (cqe->res != (int)cqe->user_data && !ur->ur_err) {
+				if (cqe->res < 0) {
+					ur->ur_err = -cqe->res;
+					DPRINTF(("Write error: %s", strerror(ur->ur_err)));
+				} else {
+					ur->ur_err = EIO;
+					DPUTS("short write, filesystem full?");
+				}
+			}
+			ur->ur_inflight--;
+		}
+		__atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+	}
+	ur->ur_queued = 0;
+	ur->ur_niov = 0;
+	rc = ur->ur_err;
+	ur->ur_err = 0;
+	return rc;
+}
+
+/** Queue a gathered write on the ring.
+ * If the ring is full, wait for the writes already in flight first.
+ * @param[in] ur the ring
+ * @param[in] fd the file to write
+ * @param[in] iov the buffers to write, copied by this function
+ * @param[in] n the number of buffers
+ * @param[in] pos the file offset to write to
+ * @param[in] size the total size of the buffers
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_uring_write(MDB_uring *ur, HANDLE fd, struct iovec *iov, int n,
+	off_t pos, size_t size)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+	int rc;
+
+	if (ur->ur_inflight == ur->ur_entries || ur->ur_niov + n > MDB_URING_IOVS) {
+		if ((rc = mdb_uring_wait(ur)) != 0)
+			return rc;
+	}
+	memcpy(&ur->ur_iov[ur->ur_niov], iov, n * sizeof(struct iovec));
+
+	tail = *ur->ur_sqtail;
+	idx = tail & ur->ur_sqmask;
+	sqe = &ur->ur_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&ur->ur_iov[ur->ur_niov];
+	sqe->len = n;
+	sqe->off = pos;
+	sqe->user_data = size;
+	ur->ur_sqarray[idx] = idx;
+	__atomic_store_n(ur->ur_sqtail, tail + 1, __ATOMIC_RELEASE);
+
+	ur->ur_niov += n;
+	ur->ur_queued++;
+	ur->ur_inflight++;
+	return MDB_SUCCESS;
+}
+#endif	/* MDB_USE_IO_URING */
+
 /** Flush (some) dirty pages to the map, after clearing their dirty flag.
  * @param[in] txn the transaction that's being committed
  * @param[in] keep number of initial pages in dirty_list to keep dirty.
@@ -3660,8 +4909,12 @@ mdb_page_flush(MDB_txn *txn, int keep)
 	off_t		wpos = 0, next_pos = 1; /* impossible pos, so pos != next_pos */
 	int			n = 0;
 #endif
+#ifdef MDB_USE_IO_URING
+	MDB_uring	*ur;
+#endif
 
 	j = i = keep;
+	mdb_dlist_sort(txn);
 
 	if (env->me_flags & MDB_WRITEMAP) {
 		/* Clear dirty flags */
@@ -3674,10 +4927,19 @@ mdb_page_flush(MDB_txn *txn, int keep)
 				continue;
 			}
 			dp->mp_flags &= ~P_DIRTY;
+			if (env->me_commit_pgs && (rc = mdb_midl_append_range(&env->me_commit_pgs,
+				dl[i].mid, IS_OVERFLOW(dp) ? dp->mp_pages : 1)))
+				return rc;
 		}
 		goto done;
 	}
 
+#ifdef MDB_USE_IO_URING
+	if (!env->me_uring)
+		mdb_uring_init(env);
+	ur = (env->me_uring && env->me_uring->ur_fd >= 0) ? env->me_uring : NULL;
+#endif
+
 	/* Write the pages */
 	for (;;) {
 		if (++i <= pagecount) {
@@ -3714,12 +4976,23 @@ mdb_page_flush(MDB_txn *txn, int keep)
 			DPRINTF(("WriteFile: %d", rc));
 			return rc;
 		}
+		env->me_metrics.mm_flush_writes++;
+		env->me_metrics.mm_flush_bytes += size;
 #else
 		/* Write up to MDB_COMMIT_PAGES dirty pages at a time. */
 		if (pos!=next_pos || n==MDB_COMMIT_PAGES || wsize+size>MAX_WRITE) {
 			if (n) {
-retry_write:
-				/* Write previous page(s) */
+#ifdef MDB_USE_IO_URING
+				if (ur) {
+					/* On failure nothing is left in flight */
+					rc = mdb_uring_write(ur, env->me_fd, iov, n, wpos, wsize);
+					if (rc)
+						return rc;
+					goto written;
+				}
+#endif
+retry_write:
+				/* Write previous page(s) */
 #ifdef MDB_USE_PWRITEV
 				wres = pwritev(env->me_fd, iov, n, wpos);
 #else
@@ -3749,6 +5022,11 @@ retry_seek:
 					}
 					return rc;
 				}
+#ifdef MDB_USE_IO_URING
+written:
+#endif
+				env->me_metrics.mm_flush_writes++;
+				env->me_metrics.mm_flush_bytes += wsize;
 				n = 0;
 			}
 			if (i > pagecount)
@@ -3764,6 +5042,22 @@ retry_seek:
 		n++;
 #endif	/* _WIN32 */
 	}
+#ifdef MDB_USE_IO_URING
+	/* The pages can't be released until the kernel is done with them */
+	if (ur && (rc = mdb_uring_wait(ur)))
+		return rc;
+#endif
+	/* Only now, so that a failure leaves no writes in flight */
+	if (env->me_commit_pgs) {
+		for (i = keep; ++i <= pagecount; ) {
+			if (!dl[i].mid)
+				continue;
+			dp = dl[i].mptr;
+			if ((rc = mdb_midl_append_range(&env->me_commit_pgs,
+				dl[i].mid, IS_OVERFLOW(dp) ? dp->mp_pages : 1)))
+				return rc;
+		}
+	}
 #ifdef MDB_VL32
 	if (pgno > txn->mt_last_pgno)
 		txn->mt_last_pgno = pgno;
@@ -3790,20 +5084,123 @@ done:
 	i--;
 	txn->mt_dirty_room += i - j;
 	dl[0].mid = j;
+	txn->mt_dirty_sorted = j;
+	return MDB_SUCCESS;
+}
+
+/** Gather the pages written by a txn for #MDB_env.%me_commit_func.
+ * Coalesces #MDB_env.%me_commit_pgs into runs in #MDB_env.%me_commit_sets,
+ * followed by an image of the new meta page. This is done before the
+ * meta page is written, so a failure can still abort the commit.
+ * @param[in] txn the transaction that's being committed
+ * @param[out] countp the number of entries in #MDB_env.%me_commit_sets
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_commit_pages(MDB_txn *txn, mdb_size_t *countp)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_IDL pgs = env->me_commit_pgs;
+	MDB_pageset *ps;
+	MDB_page *mp = env->me_commit_meta;
+	mdb_size_t i, n, max;
+
+	/* Spilled pages can be written more than once. The IDL sorts
+	 * descending, so walk it backward to get ascending runs.
+	 */
+	mdb_midl_sort(pgs);
+	n = 1;
+	for (i = pgs[0]; i; i--)
+		if (i == pgs[0] || pgs[i] > pgs[i+1] + 1)
+			n++;
+	if (n > env->me_commit_max) {
+		max = n + n/4;
+		if ((ps = realloc(env->me_commit_sets, max * sizeof(MDB_pageset))) == NULL)
+			return ENOMEM;
+		env->me_commit_sets = ps;
+		env->me_commit_max = max;
+	}
+	ps = env->me_commit_sets;
+	n = 0;
+	for (i = pgs[0]; i; i--) {
+		if (i < pgs[0] && pgs[i] <= pgs[i+1] + 1) {
+			ps[n-1].ps_count = pgs[i] - ps[n-1].ps_pgno + 1;
+			continue;
+		}
+		ps[n].ps_pgno = pgs[i];
+		ps[n].ps_count = 1;
+		ps[n].ps_data = env->me_map + pgs[i] * env->me_psize;
+		n++;
+	}
+	mp->mp_pgno = txn->mt_txnid & 1;
+	mp->mp_flags = P_META;
+	mdb_txn_meta(txn, METADATA(mp));
+	ps[n].ps_pgno = mp->mp_pgno;
+	ps[n].ps_count = 1;
+	ps[n].ps_data = mp;
+	*countp = n + 1;
 	return MDB_SUCCESS;
 }
 
 static int ESECT mdb_env_share_locks(MDB_env *env, int *excl);
 
-int
-mdb_txn_commit(MDB_txn *txn)
+/** Count the dirty pages a commit writes and the pages the txn
+ *	spilled, for #MDB_commitinfo. An overflow page counts for all
+ *	the pages it spans, as the dirty and spill lists hold only its
+ *	first page.
+ * @param[in] txn the top-level write transaction being committed.
+ * @param[out] ci where to add the counts.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_commit_count(MDB_txn *txn, MDB_commitinfo *ci)
+{
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	MDB_IDL sl = txn->mt_spill_pgs;
+	MDB_cursor mc;
+	MDB_page *mp;
+	unsigned i;
+	int rc;
+
+	for (i = 1; i <= dl[0].mid; i++) {
+		mp = dl[i].mptr;
+		if (!(mp->mp_flags & (P_LOOSE|P_KEEP)))
+			ci->ci_dirty_pages += IS_OVERFLOW(mp) ? mp->mp_pages : 1;
+	}
+	if (!sl)
+		return MDB_SUCCESS;
+	/* Spilled pages are only in the map now */
+	mc.mc_txn = txn;
+	mc.mc_flags = 0;
+	for (i = 1; i <= sl[0]; i++) {
+		/* Odd entries are spilled pages made dirty again */
+		if (sl[i] & 1)
+			continue;
+		if ((rc = mdb_page_get(&mc, sl[i] >> 1, &mp, NULL)))
+			return rc;
+		ci->ci_spilled += IS_OVERFLOW(mp) ? mp->mp_pages : 1;
+		MDB_PAGE_UNREF(txn, mp);
+	}
+	return MDB_SUCCESS;
+}
+
+/** Commit a transaction.
+ * @param[in] txn the transaction to commit
+ * @param[in,out] ci the phase timings and counters to fill in, or NULL.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_txn_commit0(MDB_txn *txn, MDB_commitinfo *ci)
 {
 	int		rc;
 	unsigned int i, end_mode;
 	MDB_env	*env;
-
-	if (txn == NULL)
-		return EINVAL;
+	mdb_size_t ncommit = 0;
+	mdb_size_t writes = 0, bytes = 0;
+	uint64_t start = 0;
+#ifndef _WIN32
+	txnid_t	gc_txnid = 0;
+#endif
 
 	/* mdb_txn_end() mode for a commit which writes nothing */
 	end_mode = MDB_END_EMPTY_COMMIT|MDB_END_UPDATE|MDB_END_SLOT|MDB_END_FREE;
@@ -3833,8 +5230,26 @@ mdb_txn_commit(MDB_txn *txn)
 		MDB_page **lp;
 		MDB_ID2L dst, src;
 		MDB_IDL pspill;
+		MDB_ntxn *ntxn = (MDB_ntxn *)txn, *nparent = (MDB_ntxn *)parent;
 		unsigned x, y, len, ps_len;
 
+		/* Make room to merge our dirty list into parent's */
+		rc = mdb_dlist_grow(parent, txn->mt_u.dirty_list[0].mid);
+		if (rc)
+			goto fail;
+
+		/* A nested parent must be able to undo our freelist changes.
+		 * Reserve one extra slot so mdb_midl_append_list() won't grow.
+		 */
+		if (parent->mt_parent && !nparent->mnt_pgnew) {
+			if (ntxn->mnt_pgtaken && (rc = mdb_pglog_need(&nparent->mnt_pgtaken,
+				ntxn->mnt_pgtaken[0] + 1)))
+				goto fail;
+			if (ntxn->mnt_pgadded && (rc = mdb_pglog_need(&nparent->mnt_pgadded,
+				ntxn->mnt_pgadded[0] + 1)))
+				goto fail;
+		}
+
 		/* Append our free list to parent's */
 		rc = mdb_midl_append_list(&parent->mt_free_pgs, txn->mt_free_pgs);
 		if (rc)
@@ -3861,6 +5276,7 @@ mdb_txn_commit(MDB_txn *txn)
 			parent->mt_dbflags[i] = txn->mt_dbflags[i] | x;
 		}
 
+		mdb_dlist_sort(txn);
 		dst = parent->mt_u.dirty_list;
 		src = txn->mt_u.dirty_list;
 		/* Remove anything in our dirty list from parent's spill list */
@@ -3891,48 +5307,26 @@ mdb_txn_commit(MDB_txn *txn)
 				if (pn & 1)
 					continue;	/* deleted spillpg */
 				pn >>= 1;
-				y = mdb_mid2l_search(dst, pn);
-				if (y <= dst[0].mid && dst[y].mid == pn) {
-					free(dst[y].mptr);
-					while (y < dst[0].mid) {
-						dst[y] = dst[y+1];
-						y++;
-					}
-					dst[0].mid--;
+				if ((y = mdb_dlist_find(parent, pn)) != 0) {
+					mdb_dpage_free(env, dst[y].mptr);
+					mdb_dlist_remove(parent, y);
 				}
 			}
 		}
 
-		/* Find len = length of merging our dirty list with parent's */
-		x = dst[0].mid;
-		dst[0].mid = 0;		/* simplify loops */
-		if (parent->mt_parent) {
-			len = x + src[0].mid;
-			y = mdb_mid2l_search(src, dst[x].mid + 1) - 1;
-			for (i = x; y && i; y--) {
-				pgno_t yp = src[y].mid;
-				while (yp < dst[i].mid)
-					i--;
-				if (yp == dst[i].mid) {
-					i--;
-					len--;
-				}
+		/* Merge our dirty list with parent's. This costs about
+		 * O(log n) per page of ours, no matter how big parent's is.
+		 */
+		for (i=1, len=src[0].mid; i <= len; i++) {
+			if ((y = mdb_dlist_find(parent, src[i].mid)) != 0) {
+				mdb_dpage_free(env, dst[y].mptr);
+				dst[y].mptr = src[i].mptr;
+			} else {
+				x = mdb_dlist_insert(parent, &src[i]);
+				mdb_tassert(txn, x == 0);	/* we made room above */
 			}
-		} else { /* Simplify the above for single-ancestor case */
-			len = MDB_IDL_UM_MAX - txn->mt_dirty_room;
-		}
-		/* Merge our dirty list with parent's */
-		y = src[0].mid;
-		for (i = len; y; dst[i--] = src[y--]) {
-			pgno_t yp = src[y].mid;
-			while (yp < dst[x].mid)
-				dst[i--] = dst[x--];
-			if (yp == dst[x].mid)
-				free(dst[x--].mptr);
-		}
-		mdb_tassert(txn, i == x);
-		dst[0].mid = len;
-		free(txn->mt_u.dirty_list);
+		}
+		mdb_dlist_close(txn);
 		parent->mt_dirty_room = txn->mt_dirty_room;
 		if (txn->mt_spill_pgs) {
 			if (parent->mt_spill_pgs) {
@@ -3953,8 +5347,25 @@ mdb_txn_commit(MDB_txn *txn)
 		*lp = txn->mt_loose_pgs;
 		parent->mt_loose_count += txn->mt_loose_count;
 
+		/* Values read in this txn stay valid in the parent */
+		if (txn->mt_zbufs) {
+			void **zb;
+			for (zb = txn->mt_zbufs; *zb; zb = *zb)
+				;
+			*zb = parent->mt_zbufs;
+			parent->mt_zbufs = txn->mt_zbufs;
+		}
+
+		if (parent->mt_parent && !nparent->mnt_pgnew) {
+			if (ntxn->mnt_pgtaken)
+				mdb_midl_append_list(&nparent->mnt_pgtaken, ntxn->mnt_pgtaken);
+			if (ntxn->mnt_pgadded)
+				mdb_midl_append_list(&nparent->mnt_pgadded, ntxn->mnt_pgadded);
+		}
+		mdb_midl_free(ntxn->mnt_pgtaken);
+		mdb_midl_free(ntxn->mnt_pgadded);
+
 		parent->mt_child = NULL;
-		mdb_midl_free(((MDB_ntxn *)txn)->mnt_pgstate.mf_pghead);
 		free(txn);
 		return rc;
 	}
@@ -3997,9 +5408,18 @@ mdb_txn_commit(MDB_txn *txn)
 		}
 	}
 
+	if (env->me_rcl_key && (rc = mdb_rcl_save(txn)))
+		goto fail;
+
+	if (ci)
+		start = mdb_clock_usec();
 	rc = mdb_freelist_save(txn);
 	if (rc)
 		goto fail;
+	if (ci) {
+		ci->ci_freelist_usec = mdb_clock_usec() - start;
+		ci->ci_reclaimed = env->me_pgreclaimed;
+	}
 
 	mdb_midl_free(env->me_pghead);
 	env->me_pghead = NULL;
@@ -4009,13 +5429,52 @@ mdb_txn_commit(MDB_txn *txn)
 	mdb_audit(txn);
 #endif
 
+	if (ci) {
+		if ((rc = mdb_commit_count(txn, ci)))
+			goto fail;
+		writes = env->me_metrics.mm_flush_writes;
+		bytes = env->me_metrics.mm_flush_bytes;
+		start = mdb_clock_usec();
+	}
 	if ((rc = mdb_page_flush(txn, 0)))
 		goto fail;
+	if (ci) {
+		ci->ci_flush_usec = mdb_clock_usec() - start;
+		ci->ci_writes = env->me_metrics.mm_flush_writes - writes;
+		ci->ci_write_bytes = env->me_metrics.mm_flush_bytes - bytes;
+	}
+	if (env->me_commit_func && (rc = mdb_commit_pages(txn, &ncommit)))
+		goto fail;
+#ifndef _WIN32
+	if ((env->me_flags & (MDB_GROUPCOMMIT|MDB_PREVSNAPSHOT)) == MDB_GROUPCOMMIT) {
+		/* Queue the meta for the group sync, which happens after
+		 * the write lock is released so the next writer can proceed.
+		 */
+		gc_txnid = txn->mt_txnid;
+		pthread_mutex_lock(&env->me_gc_mutex);
+		if (env->me_gc_txnid <= env->me_gc_synced)
+			env->me_gc_synced = gc_txnid - 1;
+		mdb_txn_meta(txn, &env->me_gc_metas[gc_txnid & 1]);
+		env->me_gc_txnid = gc_txnid;
+		pthread_mutex_unlock(&env->me_gc_mutex);
+		end_mode = MDB_END_COMMITTED|MDB_END_UPDATE;
+		goto done;
+	}
+#endif
+	if (ci)
+		start = mdb_clock_usec();
 	if (!F_ISSET(txn->mt_flags, MDB_TXN_NOSYNC) &&
 		(rc = mdb_env_sync0(env, 0, txn->mt_next_pgno)))
 		goto fail;
+	if (ci) {
+		uint64_t now = mdb_clock_usec();
+		ci->ci_sync_usec = now - start;
+		start = now;
+	}
 	if ((rc = mdb_env_write_meta(txn)))
 		goto fail;
+	if (ci)
+		ci->ci_meta_usec = mdb_clock_usec() - start;
 	end_mode = MDB_END_COMMITTED|MDB_END_UPDATE;
 	if (env->me_flags & MDB_PREVSNAPSHOT) {
 		if (!(env->me_flags & MDB_NOLOCK)) {
@@ -4028,7 +5487,20 @@ mdb_txn_commit(MDB_txn *txn)
 	}
 
 done:
+	if (ncommit)
+		env->me_commit_func(env, txn->mt_txnid, env->me_commit_sets, ncommit,
+			env->me_commit_ctx);
 	mdb_txn_end(txn, end_mode);
+#ifndef _WIN32
+	if (gc_txnid) {
+		if (ci)
+			start = mdb_clock_usec();
+		rc = mdb_env_gc_sync(env, gc_txnid);
+		if (ci)
+			ci->ci_sync_usec = mdb_clock_usec() - start;
+		return rc;
+	}
+#endif
 	return MDB_SUCCESS;
 
 fail:
@@ -4036,6 +5508,59 @@ fail:
 	return rc;
 }
 
+int
+mdb_txn_commit(MDB_txn *txn)
+{
+	return mdb_txn_commit_ex(txn, NULL);
+}
+
+int
+mdb_txn_commit_ex(MDB_txn *txn, MDB_commitinfo *info)
+{
+	MDB_commitinfo ci;
+	MDB_commitinfo_func *func;
+	MDB_env *env;
+	void *ctx;
+	uint64_t start;
+	int rc;
+
+	if (txn == NULL)
+		return EINVAL;
+
+	/* Only top-level write txns are reported to the callback.
+	 * It can't change while this txn is active, but the txn
+	 * is gone by the time it is called.
+	 */
+	env = txn->mt_env;
+	func = (txn->mt_flags & MDB_TXN_RDONLY) || txn->mt_parent ?
+		NULL : env->me_cinfo_func;
+	ctx = env->me_cinfo_ctx;
+	if (!info) {
+		if (!func)
+			return mdb_txn_commit0(txn, NULL);
+		info = &ci;
+	}
+
+	memset(info, 0, sizeof(*info));
+	info->ci_txnid = txn->mt_txnid;
+	start = mdb_clock_usec();
+	rc = mdb_txn_commit0(txn, info);
+	info->ci_total_usec = mdb_clock_usec() - start;
+	if (!rc && func)
+		func(env, info, ctx);
+	return rc;
+}
+
+int ESECT
+mdb_env_set_commit_timing(MDB_env *env, MDB_commitinfo_func *func, void *ctx)
+{
+	if (!env || env->me_txn)
+		return EINVAL;
+	env->me_cinfo_func = func;
+	env->me_cinfo_ctx = ctx;
+	return MDB_SUCCESS;
+}
+
 /** Read the environment parameters of a DB environment before
  * mapping it into memory.
  * @param[in] env the environment handle
@@ -4089,7 +5614,7 @@ mdb_env_read_header(MDB_env *env, int prev, MDB_meta *meta)
 			return MDB_INVALID;
 		}
 
-		if (m->mm_version != MDB_DATA_VERSION) {
+		if (!MDB_DATA_VERSION_OK(m->mm_version)) {
 			DPRINTF(("database is version %u, expected version %u",
 				m->mm_version, MDB_DATA_VERSION));
 			return MDB_VERSION_MISMATCH;
@@ -4169,17 +5694,49 @@ mdb_env_init_meta(MDB_env *env, MDB_meta *meta)
 	return rc;
 }
 
-/** Update the environment info to commit a transaction.
+/** Fill in the meta page contents for committing a transaction.
  * @param[in] txn the transaction that's being committed
+ * @param[out] meta the meta to fill in
+ */
+static void
+mdb_txn_meta(MDB_txn *txn, MDB_meta *meta)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_meta *prev;
+	int toggle = txn->mt_txnid & 1;
+
+	prev = env->me_metas[toggle ^ 1];
+#ifndef _WIN32
+	if ((env->me_flags & MDB_GROUPCOMMIT) && env->me_gc_txnid == txn->mt_txnid - 1)
+		prev = &env->me_gc_metas[toggle ^ 1];
+#endif
+	*meta = *env->me_metas[toggle];
+	if (meta->mm_version < prev->mm_version)
+		meta->mm_version = prev->mm_version;
+	if (txn->mt_flags & MDB_TXN_EXTFMT)
+		meta->mm_version = MDB_DATA_VERSION_EXT;
+	meta->mm_mapsize = prev->mm_mapsize;
+	/* Persist any increases of mapsize config */
+	if (meta->mm_mapsize < env->me_mapsize)
+		meta->mm_mapsize = env->me_mapsize;
+	meta->mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
+	meta->mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
+	meta->mm_last_pg = txn->mt_next_pgno - 1;
+	meta->mm_txnid = txn->mt_txnid;
+}
+
+/** Write a meta page to the slot for its txnid.
+ * The caller publishes the new txnid to readers afterward. On failure,
+ * the caller must also mark the environment with #MDB_FATAL_ERROR.
+ * @param[in] env the environment handle
+ * @param[in] meta the meta contents, as filled in by #mdb_txn_meta()
+ * @param[in] flags txn and env flags controlling the sync of the meta page
  * @return 0 on success, non-zero on failure.
  */
 static int
-mdb_env_write_meta(MDB_txn *txn)
+mdb_env_write_meta0(MDB_env *env, MDB_meta *meta, unsigned flags)
 {
-	MDB_env *env;
-	MDB_meta	meta, metab, *mp;
-	unsigned flags;
-	mdb_size_t mapsize;
+	MDB_meta	metab, *mp;
 	off_t off;
 	int rc, len, toggle;
 	char *ptr;
@@ -4190,31 +5747,27 @@ mdb_env_write_meta(MDB_txn *txn)
 	int r2;
 #endif
 
-	toggle = txn->mt_txnid & 1;
+	toggle = meta->mm_txnid & 1;
 	DPRINTF(("writing meta page %d for root page %"Yu,
-		toggle, txn->mt_dbs[MAIN_DBI].md_root));
+		toggle, meta->mm_dbs[MAIN_DBI].md_root));
 
-	env = txn->mt_env;
-	flags = txn->mt_flags | env->me_flags;
 	mp = env->me_metas[toggle];
-	mapsize = env->me_metas[toggle ^ 1]->mm_mapsize;
-	/* Persist any increases of mapsize config */
-	if (mapsize < env->me_mapsize)
-		mapsize = env->me_mapsize;
 
 	if (flags & MDB_WRITEMAP) {
-		mp->mm_mapsize = mapsize;
-		mp->mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
-		mp->mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
-		mp->mm_last_pg = txn->mt_next_pgno - 1;
+		mp->mm_version = meta->mm_version;
+		mp->mm_mapsize = meta->mm_mapsize;
+		mp->mm_dbs[FREE_DBI] = meta->mm_dbs[FREE_DBI];
+		mp->mm_dbs[MAIN_DBI] = meta->mm_dbs[MAIN_DBI];
+		mp->mm_last_pg = meta->mm_last_pg;
 #if (__GNUC__ * 100 + __GNUC_MINOR__ >= 404) && /* TODO: portability */	\
 	!(defined(__i386__) || defined(__x86_64__))
 		/* LY: issue a memory barrier, if not x86. ITS#7969 */
 		__sync_synchronize();
 #endif
-		mp->mm_txnid = txn->mt_txnid;
+		mp->mm_txnid = meta->mm_txnid;
 		if (!(flags & (MDB_NOMETASYNC|MDB_NOSYNC))) {
 			unsigned meta_size = env->me_psize;
+			uint64_t start;
 			rc = (env->me_flags & MDB_MAPASYNC) ? MS_ASYNC : MS_SYNC;
 			ptr = (char *)mp - PAGEHDRSZ;
 #ifndef _WIN32	/* POSIX msync() requires ptr = start of OS page */
@@ -4222,24 +5775,21 @@ mdb_env_write_meta(MDB_txn *txn)
 			ptr -= r2;
 			meta_size += r2;
 #endif
+			start = mdb_clock_usec();
 			if (MDB_MSYNC(ptr, meta_size, rc)) {
 				rc = ErrCode();
 				goto fail;
 			}
+			mdb_sync_count(env, start);
 		}
 		goto done;
 	}
+	metab.mm_version = mp->mm_version;
 	metab.mm_txnid = mp->mm_txnid;
 	metab.mm_last_pg = mp->mm_last_pg;
 
-	meta.mm_mapsize = mapsize;
-	meta.mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
-	meta.mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
-	meta.mm_last_pg = txn->mt_next_pgno - 1;
-	meta.mm_txnid = txn->mt_txnid;
-
-	off = offsetof(MDB_meta, mm_mapsize);
-	ptr = (char *)&meta + off;
+	off = offsetof(MDB_meta, mm_version);
+	ptr = (char *)meta + off;
 	len = sizeof(MDB_meta) - off;
 	off += (char *)mp - env->me_map;
 
@@ -4270,8 +5820,9 @@ retry_write:
 		 * Write some old data back, to prevent it from being used.
 		 * Use the non-SYNC fd; we know it will fail anyway.
 		 */
-		meta.mm_last_pg = metab.mm_last_pg;
-		meta.mm_txnid = metab.mm_txnid;
+		meta->mm_version = metab.mm_version;
+		meta->mm_last_pg = metab.mm_last_pg;
+		meta->mm_txnid = metab.mm_txnid;
 #ifdef _WIN32
 		memset(&ov, 0, sizeof(ov));
 		ov.Offset = off;
@@ -4281,12 +5832,31 @@ retry_write:
 		(void)r2;	/* Silence warnings. We don't care about pwrite's return value */
 #endif
 fail:
-		env->me_flags |= MDB_FATAL_ERROR;
 		return rc;
 	}
 	/* MIPS has cache coherency issues, this is a no-op everywhere else */
 	CACHEFLUSH(env->me_map + off, len, DCACHE);
 done:
+	return MDB_SUCCESS;
+}
+
+/** Update the environment info to commit a transaction.
+ * @param[in] txn the transaction that's being committed
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_env_write_meta(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_meta meta;
+	int rc;
+
+	mdb_txn_meta(txn, &meta);
+	rc = mdb_env_write_meta0(env, &meta, txn->mt_flags | env->me_flags);
+	if (rc) {
+		env->me_flags |= MDB_FATAL_ERROR;
+		return rc;
+	}
 	/* Memory ordering issues are irrelevant; since the entire writer
 	 * is wrapped by wmutex, all of these changes will become visible
 	 * after the wmutex is unlocked. Since the DB is multi-version,
@@ -4299,6 +5869,72 @@ done:
 	return MDB_SUCCESS;
 }
 
+#ifndef _WIN32
+/** Wait until a transaction committed under #MDB_GROUPCOMMIT is durable.
+ * If no other committer is already syncing, sync the data file and
+ * write the pending meta pages on behalf of every transaction that
+ * has been committed so far, then wake up the rest of the group.
+ * @param[in] env the environment handle
+ * @param[in] txnid the committed transaction to wait for
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_env_gc_sync(MDB_env *env, txnid_t txnid)
+{
+	MDB_meta metas[NUM_METAS], *m;
+	txnid_t target, synced;
+	unsigned flags;
+	int rc = MDB_SUCCESS;
+
+	pthread_mutex_lock(&env->me_gc_mutex);
+	while (env->me_gc_synced < txnid && !(rc = env->me_gc_rc)) {
+		if (env->me_gc_leader) {
+			pthread_cond_wait(&env->me_gc_cond, &env->me_gc_mutex);
+			continue;
+		}
+		env->me_gc_leader = 1;
+		target = env->me_gc_txnid;
+		synced = env->me_gc_synced;
+		memcpy(metas, env->me_gc_metas, sizeof(metas));
+		pthread_mutex_unlock(&env->me_gc_mutex);
+
+		/* One sync for the data pages of the whole group, then
+		 * the metas, with the newest written last. Both slots may
+		 * be overwritten, so the previous durable txn must only be
+		 * replaced by txns whose pages are already on disk.
+		 * Commits don't sync in this mode, so the sync metrics
+		 * are only updated by the leader of the moment.
+		 */
+		flags = env->me_flags | MDB_NOMETASYNC;
+		rc = mdb_env_sync0(env, 0, metas[target & 1].mm_last_pg+1);
+		m = &metas[(target - 1) & 1];
+		if (!rc && m->mm_txnid > synced)
+			rc = mdb_env_write_meta0(env, m, flags);
+		m = &metas[target & 1];
+		if (!rc)
+			rc = mdb_env_write_meta0(env, m, flags);
+		if (!rc && !(env->me_flags & MDB_NOMETASYNC))
+			rc = mdb_env_sync0(env, 0, m->mm_last_pg+1);
+		if (!rc && env->me_txns)
+			env->me_txns->mti_txnid = target;
+
+		pthread_mutex_lock(&env->me_gc_mutex);
+		env->me_gc_leader = 0;
+		if (rc) {
+			/* Not MDB_FATAL_ERROR: me_flags belongs to the writer,
+			 * whose lock we no longer hold. See #MDB_ENV_FATAL().
+			 */
+			__atomic_store_n(&env->me_gc_rc, rc, __ATOMIC_RELEASE);
+		} else {
+			env->me_gc_synced = target;
+		}
+		pthread_cond_broadcast(&env->me_gc_cond);
+	}
+	pthread_mutex_unlock(&env->me_gc_mutex);
+	return rc;
+}
+#endif
+
 /** Check both meta pages to see which one is newer.
  * @param[in] env the environment handle
  * @return newest #MDB_meta.
@@ -4322,6 +5958,10 @@ mdb_env_create(MDB_env **env)
 
 	e->me_maxreaders = DEFAULT_READERS;
 	e->me_maxdbs = e->me_numdbs = CORE_DBS;
+	e->me_dirty_max = MDB_IDL_UM_MAX;
+#ifdef MDB_VL32
+	e->me_rpbudget = MDB_RPBUDGET_DEFAULT;
+#endif
 	e->me_fd = INVALID_HANDLE_VALUE;
 	e->me_lfd = INVALID_HANDLE_VALUE;
 	e->me_mfd = INVALID_HANDLE_VALUE;
@@ -4496,6 +6136,35 @@ mdb_env_set_maxdbs(MDB_env *env, MDB_dbi dbs)
 	return MDB_SUCCESS;
 }
 
+int ESECT
+mdb_env_set_maxdirty(MDB_env *env, unsigned int pages)
+{
+	if (env->me_map || pages < MDB_IDL_DB_SIZE)
+		return EINVAL;
+	env->me_dirty_max = pages;
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_get_maxdirty(MDB_env *env, unsigned int *pages)
+{
+	if (!env || !pages)
+		return EINVAL;
+	*pages = env->me_dirty_max;
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_set_rpage_budget(MDB_env *env, mdb_size_t size)
+{
+	if (env->me_map || !size)
+		return EINVAL;
+#ifdef MDB_VL32
+	env->me_rpbudget = size;
+#endif
+	return MDB_SUCCESS;
+}
+
 int ESECT
 mdb_env_set_maxreaders(MDB_env *env, unsigned int readers)
 {
@@ -5403,7 +7072,8 @@ fail:
 	 */
 #define	CHANGEABLE	(MDB_NOSYNC|MDB_NOMETASYNC|MDB_MAPASYNC|MDB_NOMEMINIT)
 #define	CHANGELESS	(MDB_FIXEDMAP|MDB_NOSUBDIR|MDB_RDONLY| \
-	MDB_WRITEMAP|MDB_NOTLS|MDB_NOLOCK|MDB_NORDAHEAD|MDB_PREVSNAPSHOT)
+	MDB_WRITEMAP|MDB_NOTLS|MDB_NOLOCK|MDB_NORDAHEAD|MDB_PREVSNAPSHOT| \
+	MDB_GROUPCOMMIT)
 
 #if VALID_FLAGS & PERSISTENT_FLAGS & (CHANGEABLE|CHANGELESS)
 # error "Persistent DB flags & env flags overlap, but both go in mm_flags"
@@ -5446,6 +7116,35 @@ mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_mode_t mode
 	if (rc)
 		goto leave;
 #endif
+	{
+		int i;
+		for (i=0; i<MDB_RPLOCKS; i++) {
+#ifdef _WIN32
+			env->me_rplocks[i].rl_mutex = CreateMutex(NULL, FALSE, NULL);
+			if (!env->me_rplocks[i].rl_mutex) {
+				rc = ErrCode();
+				goto leave;
+			}
+#else
+			rc = pthread_mutex_init(&env->me_rplocks[i].rl_mutex, NULL);
+			if (rc)
+				goto leave;
+#endif
+		}
+	}
+#endif
+#ifdef _WIN32
+	/* silently ignore GROUPCOMMIT, it needs a broadcast condvar */
+	flags &= ~MDB_GROUPCOMMIT;
+#else
+	if (flags & MDB_GROUPCOMMIT) {
+		if ((rc = pthread_mutex_init(&env->me_gc_mutex, NULL)) != 0)
+			goto leave;
+		if ((rc = pthread_cond_init(&env->me_gc_cond, NULL)) != 0) {
+			pthread_mutex_destroy(&env->me_gc_mutex);
+			goto leave;
+		}
+	}
 #endif
 	flags |= MDB_ENV_ACTIVE;	/* tell mdb_env_close0() to clean up */
 
@@ -5453,8 +7152,10 @@ mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_mode_t mode
 		/* silently ignore WRITEMAP when we're only getting read access */
 		flags &= ~MDB_WRITEMAP;
 	} else {
+		env->me_dirty_size = env->me_dirty_max < MDB_IDL_UM_MAX ?
+			env->me_dirty_max + 1 : MDB_IDL_UM_SIZE;
 		if (!((env->me_free_pgs = mdb_midl_alloc(MDB_IDL_UM_MAX)) &&
-			  (env->me_dirty_list = calloc(MDB_IDL_UM_SIZE, sizeof(MDB_ID2)))))
+			  (env->me_dirty_list = calloc(env->me_dirty_size, sizeof(MDB_ID2)))))
 			rc = ENOMEM;
 	}
 
@@ -5464,13 +7165,17 @@ mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_mode_t mode
 
 #ifdef MDB_VL32
 	{
-		env->me_rpages = malloc(MDB_ERPAGE_SIZE * sizeof(MDB_ID3));
-		if (!env->me_rpages) {
+		/* about one chunk per bucket when the budget is used up */
+		mdb_size_t chunks = env->me_rpbudget / (MDB_RPAGE_CHUNK * env->me_os_psize);
+		unsigned n = 64;
+		while (n < chunks && n < (1U << 30))
+			n <<= 1;
+		env->me_rphash = calloc(n, sizeof(MDB_rpent *));
+		if (!env->me_rphash) {
 			rc = ENOMEM;
 			goto leave;
 		}
-		env->me_rpages[0].mid = 0;
-		env->me_rpcheck = MDB_ERPAGE_SIZE/2;
+		env->me_rphmask = n - 1;
 	}
 #endif
 
@@ -5578,23 +7283,36 @@ mdb_env_close0(MDB_env *env, int excl)
 	}
 
 	free(env->me_pbuf);
+	free(env->me_zbuf);
 	free(env->me_dbiseqs);
 	free(env->me_dbflags);
 	free(env->me_path);
 	free(env->me_dirty_list);
+	free(env->me_dirty_hash);
 #ifdef MDB_VL32
 	if (env->me_txn0 && env->me_txn0->mt_rpages)
 		free(env->me_txn0->mt_rpages);
-	if (env->me_rpages) {
-		MDB_ID3L el = env->me_rpages;
+	if (env->me_rphash) {
+		MDB_rpent *re, *next;
 		unsigned int x;
-		for (x=1; x<=el[0].mid; x++)
-			munmap(el[x].mptr, el[x].mcnt * env->me_psize);
-		free(el);
+		for (x=0; x<=env->me_rphmask; x++) {
+			for (re = env->me_rphash[x]; re; re = next) {
+				next = re->re_next;
+				munmap(re->re_ptr, re->re_cnt * env->me_psize);
+				free(re);
+			}
+		}
+		free(env->me_rphash);
+		env->me_rphash = NULL;
 	}
 #endif
 	free(env->me_txn0);
 	mdb_midl_free(env->me_free_pgs);
+	free(env->me_pgruns);
+	mdb_midl_free(env->me_rcl);
+	mdb_midl_free(env->me_commit_pgs);
+	free(env->me_commit_sets);
+	free(env->me_commit_meta);
 
 	if (env->me_flags & MDB_ENV_TXKEY) {
 		pthread_key_delete(env->me_txkey);
@@ -5683,9 +7401,29 @@ mdb_env_close0(MDB_env *env, int excl)
 #ifdef _WIN32
 	if (env->me_fmh) CloseHandle(env->me_fmh);
 	if (env->me_rpmutex) CloseHandle(env->me_rpmutex);
+	{
+		int i;
+		for (i=0; i<MDB_RPLOCKS; i++)
+			if (env->me_rplocks[i].rl_mutex) CloseHandle(env->me_rplocks[i].rl_mutex);
+	}
 #else
 	pthread_mutex_destroy(&env->me_rpmutex);
+	{
+		int i;
+		for (i=0; i<MDB_RPLOCKS; i++)
+			pthread_mutex_destroy(&env->me_rplocks[i].rl_mutex);
+	}
+#endif
 #endif
+#ifdef MDB_USE_IO_URING
+	if (env->me_uring)
+		mdb_uring_close(env);
+#endif
+#ifndef _WIN32
+	if (env->me_flags & MDB_GROUPCOMMIT) {
+		pthread_cond_destroy(&env->me_gc_cond);
+		pthread_mutex_destroy(&env->me_gc_mutex);
+	}
 #endif
 
 	env->me_flags &= ~(MDB_ENV_ACTIVE|MDB_ENV_TXKEY);
@@ -5705,6 +7443,10 @@ mdb_env_close(MDB_env *env)
 		env->me_dpages = dp->mp_next;
 		free(dp);
 	}
+#if MDB_DPAGE_ARENA
+	if (env->me_arena && env->me_arena != MAP_FAILED)
+		munmap(env->me_arena, MDB_DPAGE_ARENA);
+#endif
 
 	mdb_env_close0(env, 0);
 	free(env);
@@ -5805,26 +7547,141 @@ mdb_cmp_memnr(const MDB_val *a, const MDB_val *b)
 	return len_diff<0 ? -1 : len_diff;
 }
 
-/** Search for key within a page, using binary search.
- * Returns the smallest entry larger or equal to the key.
- * If exactp is non-null, stores whether the found entry was an exact match
- * in *exactp (1 or 0).
- * Updates the cursor index with the index of the found entry.
- * If no entry larger or equal to the key is found, returns NULL.
+/** Address of the key at index \b i of a leaf or branch page */
+#define PAGEKEY(mp, i, ks) \
+	(IS_LEAF2(mp) ? (void *)LEAF2KEY(mp, i, ks) : NODEKEY(NODEPTR(mp, i)))
+
+/** Size of the key at index \b i of a leaf or branch page */
+#define PAGEKSZ(mp, i, ks) \
+	(IS_LEAF2(mp) ? (size_t)(ks) : (size_t)NODEKSZ(NODEPTR(mp, i)))
+
+/** Load an unsigned integer key of 4 or 8 bytes, of any alignment */
+static uint64_t
+mdb_intkey(const void *ptr, unsigned int size)
+{
+	if (size == sizeof(uint32_t)) {
+		uint32_t u;
+		memcpy(&u, ptr, sizeof(u));
+		return u;
+	} else {
+		uint64_t u;
+		memcpy(&u, ptr, sizeof(u));
+		return u;
+	}
+}
+
+/** Load the first 8 bytes of a key, zero padded, as a big-endian integer.
+ *	If the prefixes of two keys differ, they order the keys the
+ *	same way #mdb_cmp_memn() does.
  */
-static MDB_node *
-mdb_node_search(MDB_cursor *mc, MDB_val *key, int *exactp)
+static uint64_t
+mdb_keyprefix(const void *ptr, size_t size)
 {
-	unsigned int	 i = 0, nkeys;
-	int		 low, high;
-	int		 rc = 0;
-	MDB_page *mp = mc->mc_pg[mc->mc_top];
-	MDB_node	*node = NULL;
-	MDB_val	 nodekey;
-	MDB_cmp_func *cmp;
-	DKBUF;
+	const unsigned char *c = ptr;
+	uint64_t x = 0;
+	unsigned int i;
 
-	nkeys = NUMKEYS(mp);
+	if (size >= sizeof(x)) {
+		memcpy(&x, ptr, sizeof(x));
+#if BYTE_ORDER == LITTLE_ENDIAN
+		x = MDB_BSWAP64(x);
+#endif
+		return x;
+	}
+	for (i = 0; i < sizeof(x); i++)
+		x = (x << 8) | (i < size ? c[i] : 0);
+	return x;
+}
+
+/** Branchless lower bound search for an integer key.
+ *	Only for #mdb_cmp_int, #mdb_cmp_long and #mdb_cmp_cint.
+ * @param[in] mp The page to search.
+ * @param[in] key The key to search for.
+ * @param[in] low The first index to search, 0 or 1.
+ * @param[in] n The number of indices to search, at least 1.
+ * @param[in] size The integer size, 4 or 8 bytes.
+ * @param[in] ks The key size for #P_LEAF2 pages.
+ * @param[out] rcp Set to 0 for an exact match, otherwise -1
+ * @return The index of the first key not less than \b key.
+ */
+static unsigned int
+mdb_node_search_int(MDB_page *mp, MDB_val *key, unsigned int low,
+	unsigned int n, unsigned int size, unsigned int ks, int *rcp)
+{
+	uint64_t k = mdb_intkey(key->mv_data, size);
+	unsigned int base = low, half, end = low + n;
+
+	while (n > 1) {
+		half = n >> 1;
+		base += (mdb_intkey(PAGEKEY(mp, base + half, ks), size) < k) ? half : 0;
+		n -= half;
+	}
+	if (mdb_intkey(PAGEKEY(mp, base, ks), size) < k)
+		base++;
+	*rcp = (base < end && mdb_intkey(PAGEKEY(mp, base, ks), size) == k) ? 0 : -1;
+	return base;
+}
+
+/** Lower bound search for a key in a #mdb_cmp_memn() database.
+ *	Compares 8-byte prefixes inline, and calls #mdb_cmp_memn()
+ *	only when they are equal.
+ *	The parameters are like #mdb_node_search_int()'s.
+ */
+static unsigned int
+mdb_node_search_memn(MDB_page *mp, MDB_val *key, unsigned int low,
+	unsigned int n, unsigned int ks, int *rcp)
+{
+	uint64_t k = mdb_keyprefix(key->mv_data, key->mv_size), x;
+	unsigned int base = low, half, end = low + n;
+	MDB_val nodekey;
+
+	while (n > 1) {
+		half = n >> 1;
+		nodekey.mv_data = PAGEKEY(mp, base + half, ks);
+		nodekey.mv_size = PAGEKSZ(mp, base + half, ks);
+		x = mdb_keyprefix(nodekey.mv_data, nodekey.mv_size);
+		if (x < k || (x == k && mdb_cmp_memn(&nodekey, key) < 0))
+			base += half;
+		n -= half;
+	}
+	nodekey.mv_data = PAGEKEY(mp, base, ks);
+	nodekey.mv_size = PAGEKSZ(mp, base, ks);
+	*rcp = mdb_cmp_memn(key, &nodekey);
+	if (*rcp > 0) {
+		base++;
+		if (base < end) {
+			nodekey.mv_data = PAGEKEY(mp, base, ks);
+			nodekey.mv_size = PAGEKSZ(mp, base, ks);
+			*rcp = mdb_cmp_memn(key, &nodekey) ? -1 : 0;
+		} else {
+			*rcp = -1;
+		}
+	} else if (*rcp < 0) {
+		*rcp = -1;
+	}
+	return base;
+}
+
+/** Search for key within a page, using binary search.
+ * Returns the smallest entry larger or equal to the key.
+ * If exactp is non-null, stores whether the found entry was an exact match
+ * in *exactp (1 or 0).
+ * Updates the cursor index with the index of the found entry.
+ * If no entry larger or equal to the key is found, returns NULL.
+ */
+static MDB_node *
+mdb_node_search(MDB_cursor *mc, MDB_val *key, int *exactp)
+{
+	unsigned int	 i = 0, nkeys, isize = 0;
+	int		 low, high;
+	int		 rc = 0;
+	MDB_page *mp = mc->mc_pg[mc->mc_top];
+	MDB_node	*node = NULL;
+	MDB_val	 nodekey;
+	MDB_cmp_func *cmp;
+	DKBUF;
+
+	nkeys = NUMKEYS(mp);
 
 	DPRINTF(("searching %u keys in %s %spage %"Yu,
 	    nkeys, IS_LEAF(mp) ? "leaf" : "branch", IS_SUBP(mp) ? "sub-" : "",
@@ -5844,7 +7701,50 @@ mdb_node_search(MDB_cursor *mc, MDB_val *key, int *exactp)
 			cmp = mdb_cmp_int;
 	}
 
-	if (IS_LEAF2(mp)) {
+	/* Integer keys and the default lexical order get a specialized
+	 * search which does not call cmp for every probe.
+	 */
+	if (low <= high) {
+		if (cmp == mdb_cmp_int)
+			isize = sizeof(unsigned int);
+		else if (cmp == mdb_cmp_long)
+			isize = sizeof(mdb_size_t);
+		else if (cmp == mdb_cmp_cint &&
+			(key->mv_size == sizeof(uint32_t) || key->mv_size == sizeof(uint64_t)))
+			isize = key->mv_size;
+	}
+
+	if (low <= high && mc->mc_dbx->md_search) {
+		MDB_keyset ks;
+		if (IS_LEAF2(mp)) {
+			ks.ks_base = LEAF2KEY(mp, 0, 0);
+			ks.ks_offs = NULL;
+		} else {
+			ks.ks_base = (char *)mp + PAGEBASE;
+			ks.ks_offs = mp->mp_ptrs;
+		}
+		ks.ks_koff = NODESIZE;
+		ks.ks_szoff = offsetof(MDB_node, mn_ksize);
+		ks.ks_ksize = mc->mc_db->md_pad;
+		ks.ks_low = low;
+		ks.ks_high = high + 1;
+		i = mc->mc_dbx->md_search(&ks, key, &rc);
+		rc = rc ? 0 : -1;
+		node = NODEPTR(mp, (IS_LEAF2(mp) || i >= nkeys) ? 0 : i);
+		DPRINTF(("found %s index %u, rc = %i",
+			IS_LEAF(mp) ? "leaf" : "branch", i, rc));
+	} else if (isize || (low <= high && cmp == mdb_cmp_memn)) {
+		if (isize)
+			i = mdb_node_search_int(mp, key, low, high - low + 1,
+				isize, mc->mc_db->md_pad, &rc);
+		else
+			i = mdb_node_search_memn(mp, key, low, high - low + 1,
+				mc->mc_db->md_pad, &rc);
+		/* rc is 0 or -1, i is already the result */
+		node = NODEPTR(mp, (IS_LEAF2(mp) || i >= nkeys) ? 0 : i);
+		DPRINTF(("found %s index %u, rc = %i",
+			IS_LEAF(mp) ? "leaf" : "branch", i, rc));
+	} else if (IS_LEAF2(mp)) {
 		nodekey.mv_size = mc->mc_db->md_pad;
 		node = NODEPTR(mp, 0);	/* fake */
 		while (low <= high) {
@@ -5956,31 +7856,155 @@ mdb_cursor_push(MDB_cursor *mc, MDB_page *mp)
 }
 
 #ifdef MDB_VL32
+/** Find a chunk in the env's cache.
+ * The caller must hold the lock of the chunk's hash bucket.
+ * @param[in] env the environment.
+ * @param[in] b the hash bucket of the chunk.
+ * @param[in] pgno the first page of the chunk.
+ * @return the cache entry, or NULL if the chunk isn't mapped.
+ */
+static MDB_rpent *
+mdb_rpage_find(MDB_env *env, unsigned b, pgno_t pgno)
+{
+	MDB_rpent *re;
+	for (re = env->me_rphash[b]; re; re = re->re_next)
+		if (re->re_pgno == pgno)
+			break;
+	return re;
+}
+
+/** Drop a txn's use of a chunk.
+ * A chunk shared in the env's cache stays mapped until
+ * #mdb_rpage_evict() finds it unused. Temporary overflow mappings
+ * that were never shared are unmapped right away.
+ * @param[in] env the environment.
+ * @param[in] id3 the chunk's entry in the txn's list.
+ */
+static void
+mdb_rpage_release(MDB_env *env, MDB_ID3 *id3)
+{
+	if (!(id3->mid & (MDB_RPAGE_CHUNK-1))) {
+		unsigned b = MDB_RPHASH(env, id3->mid);
+		MDB_rpent *re;
+		pthread_mutex_lock(MDB_RPLOCK(env, b));
+		re = mdb_rpage_find(env, b, id3->mid);
+		if (re && re->re_ptr == id3->mptr) {
+			re->re_ref--;
+			pthread_mutex_unlock(MDB_RPLOCK(env, b));
+			return;
+		}
+		pthread_mutex_unlock(MDB_RPLOCK(env, b));
+	}
+	/* tmp overflow pages that we didn't share in env */
+	munmap(id3->mptr, id3->mcnt * env->me_psize);
+}
+
+/** Remove the chunks a txn no longer references from its list.
+ * @param[in] txn the transaction.
+ * @return the number of chunks removed.
+ */
+static unsigned
+mdb_rpage_purge(MDB_txn *txn)
+{
+	MDB_ID3L tl = txn->mt_rpages;
+	unsigned i, y = 0, n = (unsigned)tl[0].mid;
+
+	for (i=1; i<=n; i++) {
+		if (tl[i].mref)
+			tl[++y] = tl[i];
+		else
+			mdb_rpage_release(txn->mt_env, &tl[i]);
+	}
+	tl[0].mid = y;
+	return n - y;
+}
+
+	/** Number of hash buckets one #mdb_rpage_evict() call may sweep */
+#define MDB_RPSWEEP	64
+
+/** Unmap unused chunks until the env's cache is within its budget.
+ * This is a CLOCK sweep over the hash buckets. Chunks used since the
+ * hand last passed them get a second chance, and chunks which any txn
+ * is using are skipped. A single call sweeps a bounded number of
+ * buckets, so the budget can stay exceeded until enough chunks are
+ * released.
+ * @param[in] env the environment.
+ * @param[in] force ignore the budget and the second chances, and unmap
+ * every unused chunk. Used when the address space runs out.
+ */
+static void
+mdb_rpage_evict(MDB_env *env, int force)
+{
+	MDB_rpent *re, **prev, *victims = NULL;
+	mdb_size_t freed;
+	unsigned b, cnt, sweep;
+
+	sweep = force ? env->me_rphmask + 1 : MDB_RPSWEEP;
+	pthread_mutex_lock(&env->me_rpmutex);
+	while (sweep && (force || env->me_rpbytes > env->me_rpbudget)) {
+		b = env->me_rphand;
+		env->me_rphand = (b + 1) & env->me_rphmask;
+		pthread_mutex_unlock(&env->me_rpmutex);
+		freed = 0;
+		cnt = 0;
+		pthread_mutex_lock(MDB_RPLOCK(env, b));
+		for (prev = &env->me_rphash[b]; (re = *prev) != NULL; ) {
+			if (re->re_ref || (re->re_used && !force)) {
+				re->re_used = 0;
+				prev = &re->re_next;
+				continue;
+			}
+			*prev = re->re_next;
+			re->re_next = victims;
+			victims = re;
+			freed += (mdb_size_t)re->re_cnt * env->me_psize;
+			cnt++;
+		}
+		pthread_mutex_unlock(MDB_RPLOCK(env, b));
+		pthread_mutex_lock(&env->me_rpmutex);
+		env->me_rpbytes -= freed;
+		env->me_rpevicts += cnt;
+		sweep--;
+	}
+	pthread_mutex_unlock(&env->me_rpmutex);
+
+	while ((re = victims) != NULL) {
+		victims = re->re_next;
+		munmap(re->re_ptr, re->re_cnt * env->me_psize);
+		free(re);
+	}
+}
+
 /** Map a read-only page.
- * There are two levels of tracking in use, a per-txn list and a per-env list.
+ * There are two levels of tracking in use, a per-txn list and a per-env cache.
  * ref'ing and unref'ing the per-txn list is faster since it requires no
- * locking. Pages are cached in the per-env list for global reuse, and a lock
- * is required. Pages are not immediately unmapped when their refcnt goes to
- * zero; they hang around in case they will be reused again soon.
+ * locking. Chunks are cached per-env for global reuse, in a hash table
+ * whose buckets are guarded by a small set of striped locks, so readers
+ * looking up different chunks rarely wait on each other. Chunks are not
+ * immediately unmapped when no txn uses them any more; they hang around
+ * in case they will be reused again soon.
  *
- * When the per-txn list gets full, all pages with refcnt=0 are purged from the
- * list and their refcnts in the per-env list are decremented.
+ * When the per-txn list gets full, all chunks with refcnt=0 are purged from
+ * the list and released to the env.
  *
- * When the per-env list gets full, all pages with refcnt=0 are purged from the
- * list and their pages are unmapped.
+ * The env's cache is sized by a memory budget, see #mdb_env_set_rpage_budget().
+ * When the mapped chunks exceed it, #mdb_rpage_evict() unmaps chunks that no
+ * txn is using, least recently used first. Chunks in use are never unmapped,
+ * so the budget is soft. If mmap itself fails, every unused chunk is unmapped
+ * and the mapping is tried once more.
  *
- * @note "full" means the list has reached its respective rpcheck threshold.
+ * @note "full" means the per-txn list has reached its rpcheck threshold.
  * This threshold slowly raises if no pages could be purged on a given check,
  * and returns to its original value when enough pages were purged.
  *
  * If purging doesn't free any slots, filling the per-txn list will return
- * MDB_TXN_FULL, and filling the per-env list returns MDB_MAP_FULL.
+ * MDB_TXN_FULL.
  *
  * Reference tracking in a txn is imperfect, pages can linger with non-zero
  * refcnt even without active references. It was deemed to be too invasive
  * to add unrefs in every required location. However, all pages are unref'd
  * at the end of the transaction. This guarantees that no stale references
- * linger in the per-env list.
+ * linger in the per-env cache.
  *
  * Usually we map chunks of 16 pages at a time, but if an overflow page begins
  * at the tail of the chunk we extend the chunk to include the entire overflow
@@ -6011,9 +8035,11 @@ mdb_rpage_get(MDB_txn *txn, pgno_t pg0, MDB_page **ret)
 	MDB_env *env = txn->mt_env;
 	MDB_page *p;
 	MDB_ID3L tl = txn->mt_rpages;
-	MDB_ID3L el = env->me_rpages;
 	MDB_ID3 id3;
-	unsigned x, rem;
+	MDB_rpent *re, *nre;
+	MDB_rplock *rl;
+	mdb_size_t grown = 0;
+	unsigned x, rem, b;
 	pgno_t pgno;
 	int rc, retries = 1;
 #ifdef _WIN32
@@ -6065,24 +8091,30 @@ mdb_rpage_get(MDB_txn *txn, pgno_t pg0, MDB_page **ret)
 				goto notlocal;
 			} else {
 				/* ignore the mapping we got from env, use new one */
+				void *old = tl[x].mptr;
+				unsigned oldcnt = tl[x].mcnt;
+				int unmap = !tl[x].mref;
 				tl[x].mptr = id3.mptr;
 				tl[x].mcnt = id3.mcnt;
 				/* if no active ref, see if we can replace in env */
-				if (!tl[x].mref) {
-					unsigned i;
-					pthread_mutex_lock(&env->me_rpmutex);
-					i = mdb_mid3l_search(el, tl[x].mid);
-					if (el[i].mref == 1) {
+				b = MDB_RPHASH(env, pgno);
+				pthread_mutex_lock(MDB_RPLOCK(env, b));
+				re = mdb_rpage_find(env, b, pgno);
+				if (unmap && re && re->re_ptr == old) {
+					if (re->re_ref == 1) {
 						/* just us, replace it */
-						munmap(el[i].mptr, el[i].mcnt * env->me_psize);
-						el[i].mptr = tl[x].mptr;
-						el[i].mcnt = tl[x].mcnt;
+						grown = (mdb_size_t)(id3.mcnt - re->re_cnt) * env->me_psize;
+						re->re_ptr = id3.mptr;
+						re->re_cnt = id3.mcnt;
 					} else {
 						/* there are others, remove ourself */
-						el[i].mref--;
+						re->re_ref--;
+						unmap = 0;
 					}
-					pthread_mutex_unlock(&env->me_rpmutex);
 				}
+				pthread_mutex_unlock(MDB_RPLOCK(env, b));
+				if (unmap)
+					munmap(old, oldcnt * env->me_psize);
 			}
 		}
 		id3.mptr = tl[x].mptr;
@@ -6093,40 +8125,21 @@ mdb_rpage_get(MDB_txn *txn, pgno_t pg0, MDB_page **ret)
 
 notlocal:
 	if (tl[0].mid >= MDB_TRPAGE_MAX - txn->mt_rpcheck) {
-		unsigned i, y;
-		/* purge unref'd pages from our list and unref in env */
-		pthread_mutex_lock(&env->me_rpmutex);
-retry:
-		y = 0;
-		for (i=1; i<=tl[0].mid; i++) {
-			if (!tl[i].mref) {
-				if (!y) y = i;
-				/* tmp overflow pages don't go to env */
-				if (tl[i].mid & (MDB_RPAGE_CHUNK-1)) {
-					munmap(tl[i].mptr, tl[i].mcnt * env->me_psize);
-					continue;
-				}
-				x = mdb_mid3l_search(el, tl[i].mid);
-				el[x].mref--;
-			}
-		}
-		pthread_mutex_unlock(&env->me_rpmutex);
-		if (!y) {
+		/* purge unref'd pages from our list and release them to env */
+		if (!mdb_rpage_purge(txn)) {
 			/* we didn't find any unref'd chunks.
 			 * if we're out of room, fail.
 			 */
-			if (tl[0].mid >= MDB_TRPAGE_MAX)
+			if (tl[0].mid >= MDB_TRPAGE_MAX) {
+				if (id3.mid)
+					munmap(id3.mptr, id3.mcnt * env->me_psize);
 				return MDB_TXN_FULL;
+			}
 			/* otherwise, raise threshold for next time around
 			 * and let this go.
 			 */
 			txn->mt_rpcheck /= 2;
 		} else {
-			/* we found some unused; consolidate the list */
-			for (i=y+1; i<= tl[0].mid; i++)
-				if (tl[i].mref)
-					tl[y++] = tl[i];
-			tl[0].mid = y-1;
 			/* decrease the check threshold toward its original value */
 			if (!txn->mt_rpcheck)
 				txn->mt_rpcheck = 1;
@@ -6138,6 +8151,9 @@ retry:
 		id3.mref = 1;
 		if (id3.mid)
 			goto found;
+		b = MDB_RPHASH(env, pgno);
+		rl = &env->me_rplocks[b % MDB_RPLOCKS];
+again:
 		/* don't map past last written page in read-only envs */
 		if ((env->me_flags & MDB_RDONLY) && pgno + MDB_RPAGE_CHUNK-1 > txn->mt_last_pgno)
 			id3.mcnt = txn->mt_last_pgno + 1 - pgno;
@@ -6147,11 +8163,12 @@ retry:
 		id3.mid = pgno;
 
 		/* search for page in env */
-		pthread_mutex_lock(&env->me_rpmutex);
-		x = mdb_mid3l_search(el, pgno);
-		if (x <= el[0].mid && el[x].mid == pgno) {
-			id3.mptr = el[x].mptr;
-			id3.mcnt = el[x].mcnt;
+		pthread_mutex_lock(&rl->rl_mutex);
+		re = mdb_rpage_find(env, b, pgno);
+		if (re) {
+			rl->rl_hits++;
+			id3.mptr = re->re_ptr;
+			id3.mcnt = re->re_cnt;
 			/* check for overflow size */
 			p = (MDB_page *)((char *)id3.mptr + rem * env->me_psize);
 			if (IS_OVERFLOW(p) && p->mp_pages + rem > id3.mcnt) {
@@ -6159,61 +8176,35 @@ retry:
 				len = id3.mcnt * env->me_psize;
 				SET_OFF(off, pgno * env->me_psize);
 				MAP(rc, env, id3.mptr, len, off);
-				if (rc)
+				if (rc) {
+					pthread_mutex_unlock(&rl->rl_mutex);
 					goto fail;
-				if (!el[x].mref) {
-					munmap(el[x].mptr, env->me_psize * el[x].mcnt);
-					el[x].mptr = id3.mptr;
-					el[x].mcnt = id3.mcnt;
+				}
+				if (!re->re_ref) {
+					munmap(re->re_ptr, env->me_psize * re->re_cnt);
+					grown = (mdb_size_t)(id3.mcnt - re->re_cnt) * env->me_psize;
+					re->re_ptr = id3.mptr;
+					re->re_cnt = id3.mcnt;
 				} else {
 					id3.mid = pg0;
-					pthread_mutex_unlock(&env->me_rpmutex);
+					pthread_mutex_unlock(&rl->rl_mutex);
 					goto found;
 				}
 			}
-			el[x].mref++;
-			pthread_mutex_unlock(&env->me_rpmutex);
+			re->re_ref++;
+			re->re_used = 1;
+			pthread_mutex_unlock(&rl->rl_mutex);
 			goto found;
 		}
-		if (el[0].mid >= MDB_ERPAGE_MAX - env->me_rpcheck) {
-			/* purge unref'd pages */
-			unsigned i, y = 0;
-			for (i=1; i<=el[0].mid; i++) {
-				if (!el[i].mref) {
-					if (!y) y = i;
-					munmap(el[i].mptr, env->me_psize * el[i].mcnt);
-				}
-			}
-			if (!y) {
-				if (retries) {
-					/* see if we can unref some local pages */
-					retries--;
-					id3.mid = 0;
-					goto retry;
-				}
-				if (el[0].mid >= MDB_ERPAGE_MAX) {
-					pthread_mutex_unlock(&env->me_rpmutex);
-					return MDB_MAP_FULL;
-				}
-				env->me_rpcheck /= 2;
-			} else {
-				for (i=y+1; i<= el[0].mid; i++)
-					if (el[i].mref)
-						el[y++] = el[i];
-				el[0].mid = y-1;
-				if (!env->me_rpcheck)
-					env->me_rpcheck = 1;
-				while (env->me_rpcheck < el[0].mid && env->me_rpcheck < MDB_ERPAGE_SIZE/2)
-					env->me_rpcheck *= 2;
-			}
-		}
+		pthread_mutex_unlock(&rl->rl_mutex);
+
+		/* map it without holding the lock, other readers of this
+		 * bucket shouldn't wait on the system call.
+		 */
 		SET_OFF(off, pgno * env->me_psize);
 		MAP(rc, env, id3.mptr, len, off);
-		if (rc) {
-fail:
-			pthread_mutex_unlock(&env->me_rpmutex);
-			return rc;
-		}
+		if (rc)
+			goto fail;
 		/* check for overflow size */
 		p = (MDB_page *)((char *)id3.mptr + rem * env->me_psize);
 		if (IS_OVERFLOW(p) && p->mp_pages + rem > id3.mcnt) {
@@ -6224,14 +8215,43 @@ fail:
 			if (rc)
 				goto fail;
 		}
-		mdb_mid3l_insert(el, &id3);
-		pthread_mutex_unlock(&env->me_rpmutex);
+		if ((nre = malloc(sizeof(MDB_rpent))) == NULL) {
+			munmap(id3.mptr, len);
+			return ENOMEM;
+		}
+		pthread_mutex_lock(&rl->rl_mutex);
+		if (mdb_rpage_find(env, b, pgno)) {
+			/* another txn mapped it meanwhile, use theirs */
+			pthread_mutex_unlock(&rl->rl_mutex);
+			munmap(id3.mptr, len);
+			free(nre);
+			goto again;
+		}
+		rl->rl_misses++;
+		nre->re_pgno = pgno;
+		nre->re_ptr = id3.mptr;
+		nre->re_cnt = id3.mcnt;
+		nre->re_ref = 1;
+		nre->re_used = 1;
+		nre->re_next = env->me_rphash[b];
+		env->me_rphash[b] = nre;
+		pthread_mutex_unlock(&rl->rl_mutex);
+		grown = len;
 found:
 		mdb_mid3l_insert(tl, &id3);
 	} else {
 		return MDB_TXN_FULL;
 	}
 ok:
+	if (grown) {
+		int over;
+		pthread_mutex_lock(&env->me_rpmutex);
+		env->me_rpbytes += grown;
+		over = env->me_rpbytes > env->me_rpbudget;
+		pthread_mutex_unlock(&env->me_rpmutex);
+		if (over)
+			mdb_rpage_evict(env, 0);
+	}
 	p = (MDB_page *)((char *)id3.mptr + rem * env->me_psize);
 #if MDB_DEBUG	/* we don't need this check any more */
 	if (IS_OVERFLOW(p)) {
@@ -6240,6 +8260,18 @@ ok:
 #endif
 	*ret = p;
 	return MDB_SUCCESS;
+
+fail:
+	if (retries) {
+		/* probably out of address space. Give back every
+		 * chunk that nobody is using and try once more.
+		 */
+		retries--;
+		mdb_rpage_purge(txn);
+		mdb_rpage_evict(env, 1);
+		goto again;
+	}
+	return rc;
 }
 #endif
 
@@ -6277,8 +8309,8 @@ mdb_page_get(MDB_cursor *mc, pgno_t pgno, MDB_page **ret, int *lvl)
 				}
 			}
 			if (dl[0].mid) {
-				unsigned x = mdb_mid2l_search(dl, pgno);
-				if (x <= dl[0].mid && dl[x].mid == pgno) {
+				unsigned x = mdb_dlist_find(tx2, pgno);
+				if (x) {
 					p = dl[x].mptr;
 					goto done;
 				}
@@ -6438,6 +8470,7 @@ mdb_page_search(MDB_cursor *mc, MDB_val *key, int flags)
 	int		 rc;
 	pgno_t		 root;
 
+	MC_RA_RESET(mc);
 	/* Make sure the txn is still viable, then find the root from
 	 * the txn's db table and set it as the root of the cursor's stack.
 	 */
@@ -6547,7 +8580,7 @@ mdb_ovpage_free(MDB_cursor *mc, MDB_page *mp)
 	{
 		unsigned i, j;
 		pgno_t *mop;
-		MDB_ID2 *dl, ix, iy;
+		MDB_ID2 *dl;
 		rc = mdb_midl_need(&env->me_pghead, ovpages);
 		if (rc)
 			return rc;
@@ -6561,20 +8594,13 @@ mdb_ovpage_free(MDB_cursor *mc, MDB_page *mp)
 		}
 		/* Remove from dirty list */
 		dl = txn->mt_u.dirty_list;
-		x = dl[0].mid--;
-		for (ix = dl[x]; ix.mptr != mp; ix = iy) {
-			if (x > 1) {
-				x--;
-				iy = dl[x];
-				dl[x] = ix;
-			} else {
-				mdb_cassert(mc, x > 1);
-				j = ++(dl[0].mid);
-				dl[j] = ix;		/* Unsorted. OK when MDB_TXN_ERROR. */
-				txn->mt_flags |= MDB_TXN_ERROR;
-				return MDB_PROBLEM;
-			}
+		x = mdb_dlist_find(txn, pg);
+		if (!x || dl[x].mptr != mp) {
+			mdb_cassert(mc, x && dl[x].mptr == mp);
+			txn->mt_flags |= MDB_TXN_ERROR;
+			return MDB_PROBLEM;
 		}
+		mdb_dlist_remove(txn, x);
 		txn->mt_dirty_room++;
 		if (!(env->me_flags & MDB_WRITEMAP))
 			mdb_dpage_free(env, mp);
@@ -6587,6 +8613,7 @@ release:
 		while (j>i)
 			mop[j--] = pg++;
 		mop[0] += ovpages;
+		env->me_pgrun_ok = 0;
 	} else {
 		rc = mdb_midl_append_range(&txn->mt_free_pgs, pg, ovpages);
 		if (rc)
@@ -6600,6 +8627,259 @@ release:
 	return 0;
 }
 
+/** @defgroup codec Value compression
+ *	@ingroup internal
+ *	Values of databases with an #MDB_codec_func which would otherwise
+ *	need overflow pages are stored encoded, in a node marked with
+ *	#F_COMPRESSED. The record holds the original size as a 32 bit
+ *	integer, followed by the output of the encoder.
+ *	@{
+ */
+
+/** Compress a value which is about to be stored.
+ *	The result lives in the env's scratch buffer, which is reused
+ *	by the next put.
+ * @param[in] mc The cursor for this operation.
+ * @param[in] data The value to compress.
+ * @param[out] zdata Set to the record to store instead of \b data.
+ * @return 0 on success, #MDB_NOTFOUND if \b data should be stored
+ * as is, or another non-zero error.
+ */
+static int
+mdb_node_encode(MDB_cursor *mc, MDB_val *data, MDB_val *zdata)
+{
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_dbx *dbx = mc->mc_dbx;
+	MDB_val dst;
+	uint32_t size;
+
+#if SIZE_MAX > UINT32_MAX
+	/* The original size must fit the record's header */
+	if (data->mv_size > UINT32_MAX)
+		return MDB_NOTFOUND;
+#endif
+	size = data->mv_size;
+	if (env->me_zsize < data->mv_size) {
+		char *buf = realloc(env->me_zbuf, data->mv_size);
+		if (!buf)
+			return ENOMEM;
+		env->me_zbuf = buf;
+		env->me_zsize = data->mv_size;
+	}
+	/* Only use the result if it actually saves space */
+	dst.mv_size = data->mv_size - sizeof(size) - 1;
+	dst.mv_data = env->me_zbuf + sizeof(size);
+	if (dbx->md_enc(data, &dst, dbx->md_codecctx) ||
+		dst.mv_size >= data->mv_size - sizeof(size))
+		return MDB_NOTFOUND;
+	memcpy(env->me_zbuf, &size, sizeof(size));
+	zdata->mv_size = dst.mv_size + sizeof(size);
+	zdata->mv_data = env->me_zbuf;
+	mc->mc_txn->mt_flags |= MDB_TXN_EXTFMT;
+	return MDB_SUCCESS;
+}
+
+/** Decompress a value read from an #F_COMPRESSED node.
+ *	The result is kept in a buffer owned by the transaction,
+ *	so it stays valid until the transaction ends like any other value.
+ * @param[in] mc The cursor for this operation.
+ * @param[in,out] data The stored record, replaced by the original value.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_node_decode(MDB_cursor *mc, MDB_val *data)
+{
+	MDB_txn *txn = mc->mc_txn;
+	MDB_dbx *dbx = mc->mc_dbx;
+	MDB_val src, dst;
+	uint32_t size;
+	void **buf;
+
+	if (!dbx->md_dec)
+		return MDB_INCOMPATIBLE;
+	if (data->mv_size <= sizeof(size))
+		return MDB_CORRUPTED;
+	memcpy(&size, data->mv_data, sizeof(size));
+	if ((buf = malloc(sizeof(void *) + size)) == NULL)
+		return ENOMEM;
+	src.mv_size = data->mv_size - sizeof(size);
+	src.mv_data = (char *)data->mv_data + sizeof(size);
+	dst.mv_size = size;
+	dst.mv_data = buf + 1;
+	if (dbx->md_dec(&src, &dst, dbx->md_codecctx) || dst.mv_size != size) {
+		free(buf);
+		return MDB_CORRUPTED;
+	}
+	*buf = txn->mt_zbufs;
+	txn->mt_zbufs = buf;
+	*data = dst;
+	return MDB_SUCCESS;
+}
+
+/** Release the buffers of values decompressed in a transaction.
+ * @param[in] txn the transaction handle.
+ */
+static void
+mdb_zbufs_free(MDB_txn *txn)
+{
+	void **buf, **next;
+
+	for (buf = txn->mt_zbufs; buf; buf = next) {
+		next = *buf;
+		free(buf);
+	}
+	txn->mt_zbufs = NULL;
+}
+/** @} */
+
+/** @defgroup segments Segmented values
+ *	@ingroup internal
+ *	A large value updated by #mdb_cursor_put_range() is stored as a
+ *	series of overflow runs instead of one, so that later ranged writes
+ *	only copy the runs they touch. The node is marked with #F_SEGMENTS
+ *	and its data is an #MDB_seghead followed by the first page number
+ *	of each run. All runs but the last have #MDB_seghead.%sh_segpages
+ *	pages, and each holds as much of the value as fits after its page
+ *	header, like any overflow run.
+ *	@{
+ */
+typedef struct MDB_seghead {
+	mdb_size_t	sh_size;		/**< size of the value */
+	uint32_t	sh_segpages;	/**< pages per segment */
+	uint32_t	sh_count;		/**< number of segments */
+} MDB_seghead;
+
+	/** Size of the header of a segment table */
+#define SEGHDRSZ	sizeof(MDB_seghead)
+	/** Offset of entry \b i in a segment table */
+#define SEGTABSZ(i)	(SEGHDRSZ + (size_t)(i) * sizeof(pgno_t))
+	/** Bytes of the value held by a segment of \b n pages */
+#define SEGDATASZ(env, n)	((mdb_size_t)(n) * (env)->me_psize - PAGEHDRSZ)
+
+/** Return the first page of segment \b i of a segmented value. */
+static pgno_t
+mdb_seg_pgno(MDB_node *node, unsigned i)
+{
+	pgno_t pg;
+	memcpy(&pg, (char *)NODEDATA(node) + SEGTABSZ(i), sizeof(pg));
+	return pg;
+}
+
+/** Return the number of pages of segment \b i of a segmented value. */
+static unsigned
+mdb_seg_pages(MDB_env *env, MDB_seghead *sh, unsigned i)
+{
+	if (i + 1 < sh->sh_count)
+		return sh->sh_segpages;
+	return OVPAGES(sh->sh_size - i * SEGDATASZ(env, sh->sh_segpages),
+		env->me_psize);
+}
+
+/** Read part of a segmented value.
+ *	A range within one segment is returned in place. A range spanning
+ *	segments is copied into a buffer owned by the transaction, like a
+ *	decompressed value.
+ * @param[in] mc The cursor for this operation.
+ * @param[in] node The value's node.
+ * @param[in] off Offset of the range in the value.
+ * @param[in,out] data The size of the range in, its location out.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_seg_read(MDB_cursor *mc, MDB_node *node, mdb_size_t off, MDB_val *data)
+{
+	MDB_txn *txn = mc->mc_txn;
+	MDB_seghead sh;
+	MDB_page *omp;
+	mdb_size_t segsz, n;
+	size_t len = data->mv_size;
+	unsigned i;
+	char *ptr;
+	void **buf;
+	int rc;
+
+	if (!len)
+		return MDB_SUCCESS;
+	memcpy(&sh, NODEDATA(node), SEGHDRSZ);
+	segsz = SEGDATASZ(txn->mt_env, sh.sh_segpages);
+	i = off / segsz;
+	off -= i * segsz;
+	if (off + len <= segsz) {
+		if ((rc = mdb_page_get(mc, mdb_seg_pgno(node, i), &omp, NULL)) != 0)
+			return rc;
+		data->mv_data = (char *)METADATA(omp) + off;
+		MC_SET_OVPG(mc, omp);
+		return MDB_SUCCESS;
+	}
+	if ((buf = malloc(sizeof(void *) + len)) == NULL)
+		return ENOMEM;
+	data->mv_data = ptr = (char *)(buf + 1);
+	for (; len; i++, off = 0) {
+		if ((rc = mdb_page_get(mc, mdb_seg_pgno(node, i), &omp, NULL)) != 0) {
+			free(buf);
+			return rc;
+		}
+		n = segsz - off;
+		if (n > len)
+			n = len;
+		memcpy(ptr, (char *)METADATA(omp) + off, n);
+		MDB_PAGE_UNREF(txn, omp);
+		ptr += n;
+		len -= n;
+	}
+	*buf = txn->mt_zbufs;
+	txn->mt_zbufs = buf;
+	return MDB_SUCCESS;
+}
+
+/** Free the segments of a value being deleted or replaced.
+ * @param[in] mc The cursor for this operation.
+ * @param[in] node The value's node.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_seg_free(MDB_cursor *mc, MDB_node *node)
+{
+	MDB_seghead sh;
+	MDB_page *omp;
+	unsigned i;
+	int rc;
+
+	memcpy(&sh, NODEDATA(node), SEGHDRSZ);
+	for (i = 0; i < sh.sh_count; i++) {
+		if ((rc = mdb_page_get(mc, mdb_seg_pgno(node, i), &omp, NULL)) ||
+			(rc = mdb_ovpage_free(mc, omp)))
+			return rc;
+	}
+	return MDB_SUCCESS;
+}
+
+/** Append the pages of a segmented value to a list, without reading them.
+ * @param[in] env The environment handle.
+ * @param[in] node The value's node.
+ * @param[in,out] idl The list to append to.
+ * @param[out] count Set to the number of pages appended.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_seg_list(MDB_env *env, MDB_node *node, MDB_IDL *idl, unsigned *count)
+{
+	MDB_seghead sh;
+	unsigned i, n;
+	int rc;
+
+	memcpy(&sh, NODEDATA(node), SEGHDRSZ);
+	*count = 0;
+	for (i = 0; i < sh.sh_count; i++) {
+		n = mdb_seg_pages(env, &sh, i);
+		if ((rc = mdb_midl_append_range(idl, mdb_seg_pgno(node, i), n)) != 0)
+			return rc;
+		*count += n;
+	}
+	return MDB_SUCCESS;
+}
+/** @} */
+
 /** Return the data associated with a given node.
  * @param[in] mc The cursor for this operation.
  * @param[in] leaf The node being read.
@@ -6620,19 +8900,27 @@ mdb_node_read(MDB_cursor *mc, MDB_node *leaf, MDB_val *data)
 	if (!F_ISSET(leaf->mn_flags, F_BIGDATA)) {
 		data->mv_size = NODEDSZ(leaf);
 		data->mv_data = NODEDATA(leaf);
-		return MDB_SUCCESS;
+	} else {
+		/* Read overflow data.
+		 */
+		data->mv_size = NODEDSZ(leaf);
+		memcpy(&pgno, NODEDATA(leaf), sizeof(pgno));
+		if ((rc = mdb_page_get(mc, pgno, &omp, NULL)) != 0) {
+			DPRINTF(("read overflow page %"Yu" failed", pgno));
+			return rc;
+		}
+		data->mv_data = METADATA(omp);
+		MC_SET_OVPG(mc, omp);
 	}
 
-	/* Read overflow data.
-	 */
-	data->mv_size = NODEDSZ(leaf);
-	memcpy(&pgno, NODEDATA(leaf), sizeof(pgno));
-	if ((rc = mdb_page_get(mc, pgno, &omp, NULL)) != 0) {
-		DPRINTF(("read overflow page %"Yu" failed", pgno));
-		return rc;
+	if ((leaf->mn_flags & F_SEGMENTS) && !(mc->mc_flags & C_RAWDATA)) {
+		MDB_seghead sh;
+		memcpy(&sh, data->mv_data, SEGHDRSZ);
+		data->mv_size = sh.sh_size;
+		return mdb_seg_read(mc, leaf, 0, data);
 	}
-	data->mv_data = METADATA(omp);
-	MC_SET_OVPG(mc, omp);
+	if ((leaf->mn_flags & F_COMPRESSED) && !(mc->mc_flags & C_RAWDATA))
+		return mdb_node_decode(mc, data);
 
 	return MDB_SUCCESS;
 }
@@ -6663,6 +8951,39 @@ mdb_get(MDB_txn *txn, MDB_dbi dbi,
 	return rc;
 }
 
+int
+mdb_get_batch(MDB_txn *txn, MDB_dbi dbi,
+    MDB_val *keys, unsigned int n, MDB_val *vals, int *rcs)
+{
+	MDB_cursor	mc;
+	MDB_xcursor	mx;
+	unsigned int i;
+	int exact, rc = MDB_SUCCESS;
+
+	if ((n && (!keys || !vals || !rcs)) || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	for (i = 0; i < n; i++) {
+		exact = 0;
+		rcs[i] = mdb_cursor_set(&mc, &keys[i], &vals[i],
+			MDB_GET_MULTI_SORTED, &exact);
+		if (rcs[i] != MDB_SUCCESS) {
+			vals[i].mv_size = 0;
+			vals[i].mv_data = NULL;
+			if (rcs[i] != MDB_NOTFOUND) {
+				rc = rcs[i];
+				break;
+			}
+		}
+	}
+	MDB_CURSOR_UNREF(&mc, 1);
+	return rc;
+}
+
 /** Find a sibling for a page.
  * Replaces the page at the top of the cursor's stack with the
  * specified sibling, if one exists.
@@ -6728,16 +9049,113 @@ mdb_cursor_sibling(MDB_cursor *mc, int move_right)
 	return MDB_SUCCESS;
 }
 
-/** Move the cursor to the next data item. */
-static int
-mdb_cursor_next(MDB_cursor *mc, MDB_val *key, MDB_val *data, MDB_cursor_op op)
+#if MDB_RA_PAGES
+/** Advise the OS that some pages will be needed soon.
+ * @param[in] env the environment
+ * @param[in] pgno the first page
+ * @param[in] num the number of pages
+ */
+static void
+mdb_page_willneed(MDB_env *env, pgno_t pgno, pgno_t num)
 {
-	MDB_page	*mp;
-	MDB_node	*leaf;
-	int rc;
+	size_t off = (size_t)env->me_psize * pgno, len = (size_t)env->me_psize * num;
+	size_t adj = off & (env->me_os_psize - 1);	/* madvise wants OS page alignment */
 
-	if ((mc->mc_flags & C_DEL && op == MDB_NEXT_DUP))
-		return MDB_NOTFOUND;
+	off -= adj;
+	len += adj;
+#ifdef MADV_WILLNEED
+	(void) madvise(env->me_map + off, len, MADV_WILLNEED);
+#else
+	(void) posix_madvise(env->me_map + off, len, POSIX_MADV_WILLNEED);
+#endif
+}
+
+/** Prefetch pages for a cursor that is scanning through leaf pages.
+ * Called after the cursor moved to the next or previous leaf. From the
+ * second move in the same direction on, prefetch the leaves after it in
+ * the parent page, doubling their number with each move up to
+ * #MDB_RA_PAGES, and the overflow pages of the new leaf. Positioning
+ * the cursor any other way resets this, so lookups are not affected.
+ * @param[in] mc the cursor, with its top page just moved to
+ * @param[in] move_right Non-zero if the cursor moved to the right.
+ */
+static void
+mdb_cursor_readahead(MDB_cursor *mc, int move_right)
+{
+	MDB_env		*env = mc->mc_txn->mt_env;
+	MDB_page	*mp, *pp;
+	MDB_node	*node;
+	pgno_t		 pgno;
+	unsigned	 i, end, win, nkeys, run;
+	int			 dir = move_right ? 1 : -1;
+
+	if (mc->mc_ra * dir > 0) {
+		if (mc->mc_ra * dir < 16)
+			mc->mc_ra += dir;
+	} else {
+		mc->mc_ra = dir;
+		mc->mc_ra_pgno = P_INVALID;
+		return;
+	}
+	run = mc->mc_ra * dir;
+	win = run > 5 ? MDB_RA_PAGES : 1U << (run-1);
+	if (win > MDB_RA_PAGES)
+		win = MDB_RA_PAGES;
+
+	pp = mc->mc_pg[mc->mc_top-1];
+	i = mc->mc_ki[mc->mc_top-1];
+	nkeys = NUMKEYS(pp);
+	if (pp->mp_pgno != mc->mc_ra_pgno) {
+		mc->mc_ra_pgno = pp->mp_pgno;
+		mc->mc_ra_ki = i;
+	}
+	/* Only prefetch what earlier calls did not */
+	if (move_right) {
+		end = i + win < nkeys ? i + win : nkeys - 1;
+		for (i = i > mc->mc_ra_ki ? i : mc->mc_ra_ki; i < end; ) {
+			node = NODEPTR(pp, ++i);
+			mdb_page_willneed(env, NODEPGNO(node), 1);
+		}
+	} else {
+		end = i > win ? i - win : 0;
+		for (i = i < mc->mc_ra_ki ? i : mc->mc_ra_ki; i > end; ) {
+			node = NODEPTR(pp, --i);
+			mdb_page_willneed(env, NODEPGNO(node), 1);
+		}
+	}
+	mc->mc_ra_ki = i;
+
+	mp = mc->mc_pg[mc->mc_top];
+	if (IS_LEAF2(mp))
+		return;
+	for (i = 0, nkeys = NUMKEYS(mp); i < nkeys; i++) {
+		node = NODEPTR(mp, i);
+		if (F_ISSET(node->mn_flags, F_BIGDATA)) {
+			memcpy(&pgno, NODEDATA(node), sizeof(pgno));
+			mdb_page_willneed(env, pgno, OVPAGES(NODEDSZ(node), env->me_psize));
+		} else if (F_ISSET(node->mn_flags, F_SEGMENTS)) {
+			MDB_seghead sh;
+			unsigned j;
+			memcpy(&sh, NODEDATA(node), SEGHDRSZ);
+			for (j = 0; j < sh.sh_count; j++)
+				mdb_page_willneed(env, mdb_seg_pgno(node, j), mdb_seg_pages(env, &sh, j));
+		}
+	}
+}
+#else
+#define mdb_cursor_readahead(mc, move_right)	((void)0)
+#endif
+
+/** Move the cursor to the next data item. */
+static int
+mdb_cursor_next(MDB_cursor *mc, MDB_val *key, MDB_val *data, MDB_cursor_op op)
+{
+	MDB_page	*mp;
+	MDB_node	*leaf;
+	int rc;
+
+	if ((mc->mc_flags & C_DEL && op == MDB_NEXT_DUP))
+		return MDB_NOTFOUND;
 
 	if (!(mc->mc_flags & C_INITIALIZED))
 		return mdb_cursor_first(mc, key, data);
@@ -6784,6 +9202,7 @@ mdb_cursor_next(MDB_cursor *mc, MDB_val *key, MDB_val *data, MDB_cursor_op op)
 			mc->mc_flags |= C_EOF;
 			return rc;
 		}
+		mdb_cursor_readahead(mc, 1);
 		mp = mc->mc_pg[mc->mc_top];
 		DPRINTF(("next page is %"Yu", key index %u", mp->mp_pgno, mc->mc_ki[mc->mc_top]));
 	} else
@@ -6870,6 +9289,7 @@ mdb_cursor_prev(MDB_cursor *mc, MDB_val *key, MDB_val *data, MDB_cursor_op op)
 		if ((rc = mdb_cursor_sibling(mc, 0)) != MDB_SUCCESS) {
 			return rc;
 		}
+		mdb_cursor_readahead(mc, 0);
 		mp = mc->mc_pg[mc->mc_top];
 		mc->mc_ki[mc->mc_top] = NUMKEYS(mp) - 1;
 		DPRINTF(("prev page is %"Yu", key index %u", mp->mp_pgno, mc->mc_ki[mc->mc_top]));
@@ -6906,6 +9326,66 @@ mdb_cursor_prev(MDB_cursor *mc, MDB_val *key, MDB_val *data, MDB_cursor_op op)
 	return MDB_SUCCESS;
 }
 
+/** Move an initialized cursor forward to the leaf page for a key.
+ * Instead of searching from the root, climb only as far as the
+ * lowest branch page whose next separator is above the key and
+ * search down from there. The key must be greater than the first
+ * key on the cursor's current leaf page.
+ * @param[in] mc The cursor for this operation.
+ * @param[in] key The key to search for.
+ * @return 0 on success, MDB_NO_ROOT if the search must start at
+ * the root, or another non-zero error.
+ */
+static int
+mdb_cursor_climb(MDB_cursor *mc, MDB_val *key)
+{
+	MDB_node	*node;
+	MDB_page	*mp;
+	MDB_val		 nodekey;
+	unsigned int i, top = mc->mc_top;
+	int rc;
+
+	for (i = top; i-- > 0; ) {
+		mp = mc->mc_pg[i];
+		if (mc->mc_ki[i] + 1u < NUMKEYS(mp)) {
+			node = NODEPTR(mp, mc->mc_ki[i] + 1);
+			nodekey.mv_size = NODEKSZ(node);
+			nodekey.mv_data = NODEKEY(node);
+			if (mc->mc_dbx->md_cmp(key, &nodekey) < 0)
+				break;
+		}
+	}
+	if (i == (unsigned int)-1)
+		return MDB_NO_ROOT;
+
+	/* The key is under the current child of page i */
+#ifdef MDB_VL32
+	{
+		unsigned int j;
+		for (j = i+2; j < mc->mc_snum; j++)
+			MDB_PAGE_UNREF(mc->mc_txn, mc->mc_pg[j]);
+	}
+#endif
+	mc->mc_snum = i+2;
+	mc->mc_top = i+1;
+	if (mc->mc_top == top)
+		return MDB_SUCCESS;		/* same leaf */
+	if ((rc = mdb_page_search_root(mc, key, 0)) != MDB_SUCCESS)
+		return rc;
+
+#ifndef MDB_VL32
+	/* Ascending keys will likely want the next leaf soon */
+	mp = mc->mc_pg[mc->mc_top-1];
+	if ((mc->mc_txn->mt_flags & MDB_TXN_RDONLY) &&
+		mc->mc_ki[mc->mc_top-1] + 1u < NUMKEYS(mp)) {
+		node = NODEPTR(mp, mc->mc_ki[mc->mc_top-1] + 1);
+		MDB_PREFETCH(mc->mc_txn->mt_env->me_map +
+			mc->mc_txn->mt_env->me_psize * NODEPGNO(node));
+	}
+#endif
+	return MDB_SUCCESS;
+}
+
 /** Set the cursor on a specific data item. */
 static int
 mdb_cursor_set(MDB_cursor *mc, MDB_val *key, MDB_val *data,
@@ -7004,6 +9484,15 @@ mdb_cursor_set(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 				mc->mc_ki[mc->mc_top] = nkeys;
 				return MDB_NOTFOUND;
 			}
+			if (op == MDB_GET_MULTI_SORTED) {
+				rc = mdb_cursor_climb(mc, key);
+				if (rc != MDB_NO_ROOT) {
+					if (rc != MDB_SUCCESS)
+						return rc;
+					mp = mc->mc_pg[mc->mc_top];
+					goto set2;
+				}
+			}
 		}
 		if (!mc->mc_top) {
 			/* There are no other pages */
@@ -7060,7 +9549,8 @@ set1:
 	}
 	if (data) {
 		if (F_ISSET(leaf->mn_flags, F_DUPDATA)) {
-			if (op == MDB_SET || op == MDB_SET_KEY || op == MDB_SET_RANGE) {
+			if (op == MDB_SET || op == MDB_SET_KEY || op == MDB_SET_RANGE ||
+				op == MDB_GET_MULTI_SORTED) {
 				rc = mdb_cursor_first(&mc->mc_xcursor->mx_cursor, data, NULL);
 			} else {
 				int ex2, *ex2p;
@@ -7254,6 +9744,7 @@ mdb_cursor_get(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 	case MDB_SET:
 	case MDB_SET_KEY:
 	case MDB_SET_RANGE:
+	case MDB_GET_MULTI_SORTED:
 		if (key == NULL) {
 			rc = EINVAL;
 		} else {
@@ -7426,7 +9917,7 @@ mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 	MDB_node	*leaf = NULL;
 	MDB_page	*fp, *mp, *sub_root = NULL;
 	uint16_t	fp_flags;
-	MDB_val		xdata, *rdata, dkey, olddata;
+	MDB_val		xdata, *rdata, dkey, olddata, zdata;
 	MDB_db dummy;
 	int do_sub = 0, insert_key, insert_data;
 	unsigned int mcount = 0, dcount = 0, nospill;
@@ -7485,6 +9976,9 @@ mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 	} else {
 		int exact = 0;
 		MDB_val d2;
+		/* The old value is only needed for MDB_NOOVERWRITE */
+		if (!(flags & MDB_NOOVERWRITE))
+			mc->mc_flags |= C_RAWDATA;
 		if (flags & MDB_APPEND) {
 			MDB_val k2;
 			rc = mdb_cursor_last(mc, &k2, &d2);
@@ -7501,6 +9995,7 @@ mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 		} else {
 			rc = mdb_cursor_set(mc, key, &d2, MDB_SET, &exact);
 		}
+		mc->mc_flags &= ~C_RAWDATA;
 		if ((flags & MDB_NOOVERWRITE) && rc == 0) {
 			DPRINTF(("duplicate key [%s]", DKEY(key)));
 			*data = d2;
@@ -7513,6 +10008,18 @@ mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 	if (mc->mc_flags & C_DEL)
 		mc->mc_flags ^= C_DEL;
 
+	/* Compress values which would need overflow pages */
+	if (mc->mc_dbx->md_enc && !(flags & (MDB_RESERVE|F_SUBDATA)) &&
+		LEAFSIZE(key, data) > env->me_nodemax) {
+		rc2 = mdb_node_encode(mc, data, &zdata);
+		if (rc2 == MDB_SUCCESS) {
+			data = &zdata;
+			flags |= F_COMPRESSED;
+		} else if (rc2 != MDB_NOTFOUND) {
+			return rc2;
+		}
+	}
+
 	/* Cursor is positioned, check for room in the dirty list */
 	if (!nospill) {
 		if (flags & MDB_MULTIPLE) {
@@ -7744,8 +10251,8 @@ current:
 				return rc2;
 			ovpages = omp->mp_pages;
 
-			/* Is the ov page large enough? */
-			if (ovpages >= dpages) {
+			/* Is the ov page large enough? A segment table goes in the node */
+			if (ovpages >= dpages && !(flags & F_SEGMENTS)) {
 			  if (!(omp->mp_flags & P_DIRTY) &&
 				  (level || (env->me_flags & MDB_WRITEMAP)))
 			  {
@@ -7763,14 +10270,17 @@ current:
 				if (level > 1) {
 					/* It is writable only in a parent txn */
 					size_t sz = (size_t) env->me_psize * ovpages, off;
-					MDB_page *np = mdb_page_malloc(mc->mc_txn, ovpages);
+					MDB_page *np;
 					MDB_ID2 id2;
+					if (mdb_dlist_grow(mc->mc_txn, 1))
+						return ENOMEM;
+					np = mdb_page_malloc(mc->mc_txn, ovpages);
 					if (!np)
 						return ENOMEM;
 					id2.mid = pg;
 					id2.mptr = np;
 					/* Note - this page is already counted in parent's dirty_room */
-					rc2 = mdb_mid2l_insert(mc->mc_txn->mt_u.dirty_list, &id2);
+					rc2 = mdb_dlist_insert(mc->mc_txn, &id2);
 					mdb_cassert(mc, rc2 == 0);
 					/* Currently we make the page look as with put() in the
 					 * parent txn, in case the user peeks at MDB_RESERVEd
@@ -7789,6 +10299,8 @@ current:
 					memcpy(np, omp, sz); /* Copy beginning of page */
 					omp = np;
 				}
+				leaf->mn_flags = (leaf->mn_flags & ~F_COMPRESSED) |
+					(flags & F_COMPRESSED);
 				SETDSZ(leaf, data->mv_size);
 				if (F_ISSET(flags, MDB_RESERVE))
 					data->mv_data = METADATA(omp);
@@ -7799,11 +10311,16 @@ current:
 			}
 			if ((rc2 = mdb_ovpage_free(mc, omp)) != MDB_SUCCESS)
 				return rc2;
+		} else if (F_ISSET(leaf->mn_flags, F_SEGMENTS)) {
+			if ((rc2 = mdb_seg_free(mc, leaf)) != MDB_SUCCESS)
+				return rc2;
 		} else if (data->mv_size == olddata.mv_size) {
 			/* same size, just replace it. Note that we could
 			 * also reuse this node if the new data is smaller,
 			 * but instead we opt to shrink the node in that case.
 			 */
+			leaf->mn_flags = (leaf->mn_flags & ~F_COMPRESSED) |
+				(flags & F_COMPRESSED);
 			if (F_ISSET(flags, MDB_RESERVE))
 				data->mv_data = olddata.mv_data;
 			else if (!(mc->mc_flags & C_SUB))
@@ -7945,6 +10462,281 @@ bad_sub:
 	return rc;
 }
 
+/** Get a writable copy of an overflow run for a ranged write.
+ * @param[in] mc The cursor for this operation.
+ * @param[in,out] pg The run's first page, updated if the run was moved.
+ * @param[out] ret The writable run, or NULL if it is visible to older
+ * snapshots and \b copy is zero.
+ * @param[in] copy If non-zero, copy such a run to new pages and free
+ * the old ones.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_seg_touch(MDB_cursor *mc, pgno_t *pg, MDB_page **ret, int copy)
+{
+	MDB_txn *txn = mc->mc_txn;
+	MDB_env *env = txn->mt_env;
+	MDB_page *omp, *np;
+	unsigned ovpages;
+	int rc, level;
+
+	*ret = NULL;
+	if ((rc = mdb_page_get(mc, *pg, &omp, &level)) != 0)
+		return rc;
+	ovpages = omp->mp_pages;
+	if (!(omp->mp_flags & P_DIRTY) &&
+		(level || (env->me_flags & MDB_WRITEMAP)))
+	{
+		if ((rc = mdb_page_unspill(txn, omp, &omp)) != 0)
+			return rc;
+		level = 0;		/* dirty in this txn or clean */
+	}
+	if (omp->mp_flags & P_DIRTY) {
+		if (level > 1) {
+			/* It is writable only in a parent txn */
+			MDB_ID2 id2;
+			if (mdb_dlist_grow(txn, 1))
+				return ENOMEM;
+			if ((np = mdb_page_malloc(txn, ovpages)) == NULL)
+				return ENOMEM;
+			id2.mid = *pg;
+			id2.mptr = np;
+			/* Note - this page is already counted in parent's dirty_room */
+			rc = mdb_dlist_insert(txn, &id2);
+			mdb_cassert(mc, rc == 0);
+			memcpy(np, omp, (size_t)env->me_psize * ovpages);
+			omp = np;
+		}
+		*ret = omp;
+		return MDB_SUCCESS;
+	}
+	if (!copy)
+		return MDB_SUCCESS;
+	if ((rc = mdb_page_new(mc, P_OVERFLOW, ovpages, &np)) != 0)
+		return rc;
+	memcpy(METADATA(np), METADATA(omp),
+		(size_t)env->me_psize * ovpages - PAGEHDRSZ);
+	if ((rc = mdb_ovpage_free(mc, omp)) != 0)
+		return rc;
+	*pg = np->mp_pgno;
+	*ret = np;
+	return MDB_SUCCESS;
+}
+
+/** Rewrite the overflow value at the cursor as a segmented value,
+ *	applying a ranged write on the way.
+ *	The segments are as small as a table which fits easily in a node
+ *	allows, so that leaves still hold several such nodes.
+ * @param[in] mc The cursor for this operation.
+ * @param[in] key The key of the current node.
+ * @param[in] old The current value.
+ * @param[in] off Offset of the range in the value.
+ * @param[in] data The data of the range.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_seg_split(MDB_cursor *mc, MDB_val *key, MDB_val *old,
+	mdb_size_t off, MDB_val *data)
+{
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_seghead sh;
+	MDB_page *np;
+	MDB_val k2, tab;
+	mdb_size_t segsz, pos, lo, hi, n;
+	unsigned i, max;
+	char *buf;
+	int rc = MDB_SUCCESS;
+
+	max = (env->me_nodemax - NODESIZE - key->mv_size - SEGHDRSZ) /
+		sizeof(pgno_t) / 2;
+	if (!max)
+		max = 1;
+	n = OVPAGES(old->mv_size, env->me_psize);
+	sh.sh_size = old->mv_size;
+	sh.sh_segpages = (n + max - 1) / max;
+	segsz = SEGDATASZ(env, sh.sh_segpages);
+	sh.sh_count = (old->mv_size + segsz - 1) / segsz;
+
+	/* The key must not point into the page the put rewrites */
+	tab.mv_size = SEGTABSZ(sh.sh_count);
+	if ((buf = malloc(tab.mv_size + key->mv_size)) == NULL)
+		return ENOMEM;
+	tab.mv_data = buf;
+	k2.mv_size = key->mv_size;
+	k2.mv_data = buf + tab.mv_size;
+	memcpy(k2.mv_data, key->mv_data, key->mv_size);
+	memcpy(buf, &sh, SEGHDRSZ);
+
+	for (i = 0, pos = 0; i < sh.sh_count; i++, pos += segsz) {
+		if ((rc = mdb_page_new(mc, P_OVERFLOW, mdb_seg_pages(env, &sh, i), &np)) != 0)
+			goto done;
+		n = old->mv_size - pos;
+		if (n > segsz)
+			n = segsz;
+		memcpy(METADATA(np), (char *)old->mv_data + pos, n);
+		lo = off > pos ? off : pos;
+		hi = off + data->mv_size;
+		if (hi > pos + n)
+			hi = pos + n;
+		if (lo < hi)
+			memcpy((char *)METADATA(np) + (lo - pos),
+				(char *)data->mv_data + (lo - off), hi - lo);
+		memcpy(buf + SEGTABSZ(i), &np->mp_pgno, sizeof(pgno_t));
+	}
+	rc = mdb_cursor_put(mc, &k2, &tab, MDB_CURRENT|F_SEGMENTS);
+	if (rc == MDB_SUCCESS)
+		mc->mc_txn->mt_flags |= MDB_TXN_EXTFMT;
+done:
+	free(buf);
+	return rc;
+}
+
+int
+mdb_cursor_put_range(MDB_cursor *mc, mdb_size_t offset, MDB_val *data)
+{
+	MDB_txn *txn;
+	MDB_env *env;
+	MDB_page *mp, *omp;
+	MDB_node *leaf;
+	MDB_seghead sh;
+	MDB_val key, old;
+	mdb_size_t size, segsz, n;
+	size_t len;
+	unsigned i;
+	pgno_t pg;
+	char *src;
+	int rc;
+
+	if (mc == NULL || data == NULL)
+		return EINVAL;
+
+	txn = mc->mc_txn;
+	if (txn->mt_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
+		return (txn->mt_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
+
+	if (!(mc->mc_flags & C_INITIALIZED))
+		return EINVAL;
+	if (mc->mc_db->md_flags & MDB_DUPSORT)
+		return MDB_INCOMPATIBLE;
+	mp = mc->mc_pg[mc->mc_top];
+	if (IS_LEAF2(mp))
+		return MDB_INCOMPATIBLE;
+	if (mc->mc_ki[mc->mc_top] >= NUMKEYS(mp))
+		return MDB_NOTFOUND;
+	leaf = NODEPTR(mp, mc->mc_ki[mc->mc_top]);
+	if (leaf->mn_flags & (F_SUBDATA|F_COMPRESSED))
+		return MDB_INCOMPATIBLE;
+	if (leaf->mn_flags & F_SEGMENTS) {
+		memcpy(&sh, NODEDATA(leaf), SEGHDRSZ);
+		size = sh.sh_size;
+	} else {
+		size = NODEDSZ(leaf);
+	}
+	if (offset > size || data->mv_size > size - offset)
+		return EINVAL;
+	if (!data->mv_size)
+		return MDB_SUCCESS;
+
+	env = txn->mt_env;
+	MDB_GET_KEY(leaf, &key);
+	if ((rc = mdb_page_spill(mc, &key, data)) != 0)
+		return rc;
+	if ((rc = mdb_cursor_touch(mc)) != 0)
+		return rc;
+	leaf = NODEPTR(mc->mc_pg[mc->mc_top], mc->mc_ki[mc->mc_top]);
+	MDB_GET_KEY(leaf, &key);
+
+	if (F_ISSET(leaf->mn_flags, F_BIGDATA)) {
+		memcpy(&pg, NODEDATA(leaf), sizeof(pg));
+		if ((rc = mdb_seg_touch(mc, &pg, &omp, 0)) != 0)
+			goto fail;
+		if (omp) {
+			/* Written in this txn, nobody else can see it */
+			memcpy((char *)METADATA(omp) + offset, data->mv_data, data->mv_size);
+			return MDB_SUCCESS;
+		}
+		/* Copy it once into segments, later writes copy only what they touch */
+		if ((rc = mdb_page_get(mc, pg, &omp, NULL)) != 0)
+			goto fail;
+		old.mv_size = size;
+		old.mv_data = METADATA(omp);
+		if ((rc = mdb_seg_split(mc, &key, &old, offset, data)) != 0)
+			goto fail;
+		return MDB_SUCCESS;
+	}
+	if (!F_ISSET(leaf->mn_flags, F_SEGMENTS)) {
+		memcpy((char *)NODEDATA(leaf) + offset, data->mv_data, data->mv_size);
+		return MDB_SUCCESS;
+	}
+
+	segsz = SEGDATASZ(env, sh.sh_segpages);
+	i = offset / segsz;
+	offset -= i * segsz;
+	src = data->mv_data;
+	for (len = data->mv_size; len; i++, offset = 0) {
+		pg = mdb_seg_pgno(leaf, i);
+		if ((rc = mdb_seg_touch(mc, &pg, &omp, 1)) != 0)
+			goto fail;
+		memcpy((char *)NODEDATA(leaf) + SEGTABSZ(i), &pg, sizeof(pg));
+		n = segsz - offset;
+		if (n > len)
+			n = len;
+		memcpy((char *)METADATA(omp) + offset, src, n);
+		src += n;
+		len -= n;
+	}
+	return MDB_SUCCESS;
+
+fail:
+	txn->mt_flags |= MDB_TXN_ERROR;
+	return rc;
+}
+
+int
+mdb_cursor_get_range(MDB_cursor *mc, mdb_size_t offset, MDB_val *data)
+{
+	MDB_page *mp;
+	MDB_node *leaf;
+	MDB_val val;
+	int rc;
+
+	if (mc == NULL || data == NULL)
+		return EINVAL;
+
+	if (mc->mc_txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	if (!(mc->mc_flags & C_INITIALIZED))
+		return EINVAL;
+	if (mc->mc_db->md_flags & MDB_DUPSORT)
+		return MDB_INCOMPATIBLE;
+	mp = mc->mc_pg[mc->mc_top];
+	if (IS_LEAF2(mp))
+		return MDB_INCOMPATIBLE;
+	if (mc->mc_ki[mc->mc_top] >= NUMKEYS(mp))
+		return MDB_NOTFOUND;
+	leaf = NODEPTR(mp, mc->mc_ki[mc->mc_top]);
+	if (leaf->mn_flags & F_SUBDATA)
+		return MDB_INCOMPATIBLE;
+	if (leaf->mn_flags & F_SEGMENTS) {
+		MDB_seghead sh;
+		memcpy(&sh, NODEDATA(leaf), SEGHDRSZ);
+		if (offset > sh.sh_size || data->mv_size > sh.sh_size - offset)
+			return EINVAL;
+		if (MC_OVPG(mc)) {
+			MDB_PAGE_UNREF(mc->mc_txn, MC_OVPG(mc));
+			MC_SET_OVPG(mc, NULL);
+		}
+		return mdb_seg_read(mc, leaf, offset, data);
+	}
+	if ((rc = mdb_node_read(mc, leaf, &val)) != 0)
+		return rc;
+	if (offset > val.mv_size || data->mv_size > val.mv_size - offset)
+		return EINVAL;
+	data->mv_data = (char *)val.mv_data + offset;
+	return MDB_SUCCESS;
+}
+
 int
 mdb_cursor_del(MDB_cursor *mc, unsigned int flags)
 {
@@ -8036,6 +10828,9 @@ mdb_cursor_del(MDB_cursor *mc, unsigned int flags)
 		if ((rc = mdb_page_get(mc, pg, &omp, NULL)) ||
 			(rc = mdb_ovpage_free(mc, omp)))
 			goto fail;
+	} else if (F_ISSET(leaf->mn_flags, F_SEGMENTS)) {
+		if ((rc = mdb_seg_free(mc, leaf)))
+			goto fail;
 	}
 
 del_key:
@@ -8395,12 +11190,17 @@ mdb_xcursor_init0(MDB_cursor *mc)
 	mx->mx_cursor.mc_snum = 0;
 	mx->mx_cursor.mc_top = 0;
 	MC_SET_OVPG(&mx->mx_cursor, NULL);
+	MC_RA_RESET(&mx->mx_cursor);
 	mx->mx_cursor.mc_flags = C_SUB | (mc->mc_flags & (C_ORIG_RDONLY|C_WRITEMAP));
 	mx->mx_dbx.md_name.mv_size = 0;
 	mx->mx_dbx.md_name.mv_data = NULL;
 	mx->mx_dbx.md_cmp = mc->mc_dbx->md_dcmp;
 	mx->mx_dbx.md_dcmp = NULL;
+	mx->mx_dbx.md_search = mc->mc_dbx->md_dsearch;
+	mx->mx_dbx.md_dsearch = NULL;
 	mx->mx_dbx.md_rel = mc->mc_dbx->md_rel;
+	mx->mx_dbx.md_enc = NULL;
+	mx->mx_dbx.md_dec = NULL;
 }
 
 /** Final setup of a sorted-dups cursor.
@@ -8497,6 +11297,7 @@ mdb_cursor_init(MDB_cursor *mc, MDB_txn *txn, MDB_dbi dbi, MDB_xcursor *mx)
 	mc->mc_pg[0] = 0;
 	mc->mc_ki[0] = 0;
 	MC_SET_OVPG(mc, NULL);
+	MC_RA_RESET(mc);
 	mc->mc_flags = txn->mt_flags & (C_ORIG_RDONLY|C_WRITEMAP);
 	if (txn->mt_dbs[dbi].md_flags & MDB_DUPSORT) {
 		mdb_tassert(txn, mx != NULL);
@@ -8982,6 +11783,7 @@ mdb_page_merge(MDB_cursor *csrc, MDB_cursor *cdst)
 
 	/* get dst page again now that we've touched it. */
 	pdst = cdst->mc_pg[cdst->mc_top];
+	csrc->mc_txn->mt_env->me_metrics.mm_merges++;
 
 	/* Move all nodes from src to dst.
 	 */
@@ -9145,6 +11947,7 @@ mdb_rebalance(MDB_cursor *mc)
 	    IS_LEAF(mc->mc_pg[mc->mc_top]) ? "leaf" : "branch",
 	    mdb_dbg_pgno(mc->mc_pg[mc->mc_top]), NUMKEYS(mc->mc_pg[mc->mc_top]),
 		(float)PAGEFILL(mc->mc_txn->mt_env, mc->mc_pg[mc->mc_top]) / 10));
+	mc->mc_txn->mt_env->me_metrics.mm_rebalances++;
 
 	if (PAGEFILL(mc->mc_txn->mt_env, mc->mc_pg[mc->mc_top]) >= thresh &&
 		NUMKEYS(mc->mc_pg[mc->mc_top]) >= minkeys) {
@@ -9466,6 +12269,32 @@ mdb_del0(MDB_txn *txn, MDB_dbi dbi,
 	return rc;
 }
 
+#if MDB_SUFFIX_TRUNC
+/** Shorten the separator key between two leaf pages.
+ *	A branch key only has to sort after the last key of the left
+ *	page and not after the first key of the right page. In the
+ *	default #mdb_cmp_memn() order, the shortest such key is the
+ *	prefix of the right key which is one byte longer than the
+ *	prefix it shares with the left key.
+ * @param[in] mc The cursor for this operation.
+ * @param[in] left The last key of the left page.
+ * @param[in,out] sepkey The first key of the right page, truncated.
+ */
+static void
+mdb_sepkey_trunc(MDB_cursor *mc, MDB_val *left, MDB_val *sepkey)
+{
+	unsigned char *l = left->mv_data, *r = sepkey->mv_data;
+	size_t i, n = MIN(left->mv_size, sepkey->mv_size);
+
+	if (mc->mc_dbx->md_cmp != mdb_cmp_memn || (mc->mc_flags & C_SUB))
+		return;
+	for (i = 0; i < n && l[i] == r[i]; i++)
+		;
+	if (i < sepkey->mv_size)
+		sepkey->mv_size = i + 1;
+}
+#endif
+
 /** Split a page and insert a new node.
  * Set #MDB_TXN_ERROR on failure.
  * @param[in,out] mc Cursor pointing to the page and desired insertion index.
@@ -9508,6 +12337,7 @@ mdb_page_split(MDB_cursor *mc, MDB_val *newkey, MDB_val *newdata, pgno_t newpgno
 		return rc;
 	rp->mp_pad = mp->mp_pad;
 	DPRINTF(("new right sibling: page %"Yu, rp->mp_pgno));
+	env->me_metrics.mm_splits++;
 
 	/* Usually when splitting the root page, the cursor
 	 * height is 1. But when called from mdb_update_key,
@@ -9554,6 +12384,14 @@ mdb_page_split(MDB_cursor *mc, MDB_val *newkey, MDB_val *newdata, pgno_t newpgno
 		mn.mc_ki[mn.mc_top] = 0;
 		sepkey = *newkey;
 		split_indx = newindx;
+#if MDB_SUFFIX_TRUNC
+		if (IS_LEAF(mp) && !IS_LEAF2(mp) && nkeys) {
+			node = NODEPTR(mp, nkeys-1);
+			rkey.mv_size = node->mn_ksize;
+			rkey.mv_data = NODEKEY(node);
+			mdb_sepkey_trunc(mc, &rkey, &sepkey);
+		}
+#endif
 		nkeys = 0;
 	} else {
 
@@ -9680,6 +12518,18 @@ mdb_page_split(MDB_cursor *mc, MDB_val *newkey, MDB_val *newdata, pgno_t newpgno
 				sepkey.mv_size = node->mn_ksize;
 				sepkey.mv_data = NODEKEY(node);
 			}
+#if MDB_SUFFIX_TRUNC
+			if (IS_LEAF(mp) && split_indx > 0) {
+				if (split_indx-1 == newindx) {
+					rkey = *newkey;
+				} else {
+					node = (MDB_node *)((char *)mp + copy->mp_ptrs[split_indx-1] + PAGEBASE);
+					rkey.mv_size = node->mn_ksize;
+					rkey.mv_data = NODEKEY(node);
+				}
+				mdb_sepkey_trunc(mc, &rkey, &sepkey);
+			}
+#endif
 		}
 	}
 
@@ -9918,839 +12768,3810 @@ mdb_put(MDB_txn *txn, MDB_dbi dbi,
 	return rc;
 }
 
-#ifndef MDB_WBUF
-#define MDB_WBUF	(1024*1024)
-#endif
-#define MDB_EOF		0x10	/**< #mdb_env_copyfd1() is done reading */
-
-	/** State needed for a double-buffering compacting copy. */
-typedef struct mdb_copy {
-	MDB_env *mc_env;
-	MDB_txn *mc_txn;
-	pthread_mutex_t mc_mutex;
-	pthread_cond_t mc_cond;	/**< Condition variable for #mc_new */
-	char *mc_wbuf[2];
-	char *mc_over[2];
-	int mc_wlen[2];
-	int mc_olen[2];
-	pgno_t mc_next_pgno;
-	HANDLE mc_fd;
-	int mc_toggle;			/**< Buffer number in provider */
-	int mc_new;				/**< (0-2 buffers to write) | (#MDB_EOF at end) */
-	/** Error code.  Never cleared if set.  Both threads can set nonzero
-	 *	to fail the copy.  Not mutex-protected, LMDB expects atomic int.
-	 */
-	volatile int mc_error;
-} mdb_copy;
+/** State of a bulk load, see #mdb_bulk_begin().
+ *	The cursor holds one page per level of the tree under construction,
+ *	with the leaf in \b mc_pg[0] and the highest branch in \b mc_pg[mc_snum-1].
+ */
+struct MDB_bulk {
+	MDB_cursor	mb_cursor;	/**< the pages being filled */
+	unsigned	mb_room;	/**< bytes of a leaf page to fill */
+	MDB_val		mb_first[CURSOR_STACK];	/**< first key under each page */
+	MDB_val		mb_last;	/**< last key added */
+};
 
-	/** Dedicated writer thread for compacting copy. */
-static THREAD_RET ESECT CALL_CONV
-mdb_env_copythr(void *arg)
+int
+mdb_bulk_begin(MDB_txn *txn, MDB_dbi dbi, unsigned int fill, MDB_bulk **ret)
 {
-	mdb_copy *my = arg;
+	MDB_env *env;
+	MDB_bulk *mb;
+	size_t ksize;
 	char *ptr;
-	int toggle = 0, wsize, rc;
-#ifdef _WIN32
-	DWORD len;
-#define DO_WRITE(rc, fd, ptr, w2, len)	rc = WriteFile(fd, ptr, w2, &len, NULL)
-#else
-	int len;
-#define DO_WRITE(rc, fd, ptr, w2, len)	len = write(fd, ptr, w2); rc = (len >= 0)
-#ifdef SIGPIPE
-	sigset_t set;
-	sigemptyset(&set);
-	sigaddset(&set, SIGPIPE);
-	if ((rc = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0)
-		my->mc_error = rc;
-#endif
-#endif
+	int i, rc;
 
-	pthread_mutex_lock(&my->mc_mutex);
-	for(;;) {
-		while (!my->mc_new)
-			pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
-		if (my->mc_new == 0 + MDB_EOF) /* 0 buffers, just EOF */
-			break;
-		wsize = my->mc_wlen[toggle];
-		ptr = my->mc_wbuf[toggle];
-again:
-		rc = MDB_SUCCESS;
-		while (wsize > 0 && !my->mc_error) {
-			DO_WRITE(rc, my->mc_fd, ptr, wsize, len);
-			if (!rc) {
-				rc = ErrCode();
-#if defined(SIGPIPE) && !defined(_WIN32)
-				if (rc == EPIPE) {
-					/* Collect the pending SIGPIPE, otherwise at least OS X
-					 * gives it to the process on thread-exit (ITS#8504).
-					 */
-					int tmp;
-					sigwait(&set, &tmp);
-				}
-#endif
-				break;
-			} else if (len > 0) {
-				rc = MDB_SUCCESS;
-				ptr += len;
-				wsize -= len;
-				continue;
-			} else {
-				rc = EIO;
-				break;
-			}
-		}
-		if (rc) {
-			my->mc_error = rc;
-		}
-		/* If there's an overflow page tail, write it too */
-		if (my->mc_olen[toggle]) {
-			wsize = my->mc_olen[toggle];
-			ptr = my->mc_over[toggle];
-			my->mc_olen[toggle] = 0;
-			goto again;
-		}
-		my->mc_wlen[toggle] = 0;
-		toggle ^= 1;
-		/* Return the empty buffer to provider */
-		my->mc_new--;
-		pthread_cond_signal(&my->mc_cond);
+	if (!ret || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID) || fill > 100)
+		return EINVAL;
+
+	if (txn->mt_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
+		return (txn->mt_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
+
+	if (TXN_DBI_CHANGED(txn, dbi))
+		return MDB_BAD_DBI;
+
+	if ((txn->mt_dbs[dbi].md_flags & MDB_DUPSORT) ||
+		txn->mt_dbs[dbi].md_root != P_INVALID)
+		return MDB_INCOMPATIBLE;
+
+	env = txn->mt_env;
+	/* Room for a key per level, plus the last key */
+	ksize = (ENV_MAXKEY(env) + sizeof(size_t) - 1) & -sizeof(size_t);
+	if ((mb = malloc(sizeof(MDB_bulk) + (CURSOR_STACK+1) * ksize)) == NULL)
+		return ENOMEM;
+	mdb_cursor_init(&mb->mb_cursor, txn, dbi, NULL);
+	if ((rc = mdb_cursor_touch(&mb->mb_cursor)) != MDB_SUCCESS) {
+		free(mb);
+		return rc;
 	}
-	pthread_mutex_unlock(&my->mc_mutex);
-	return (THREAD_RET)0;
-#undef DO_WRITE
+	txn->mt_dbflags[dbi] |= DB_DIRTY;
+	/* So #mdb_page_spill() leaves the pages being filled alone */
+	mb->mb_cursor.mc_flags |= C_INITIALIZED;
+	mb->mb_room = (env->me_psize - PAGEHDRSZ) * (fill ? fill : 100) / 100;
+	ptr = (char *)(mb + 1);
+	for (i=0; i<CURSOR_STACK; i++, ptr += ksize)
+		mb->mb_first[i].mv_data = ptr;
+	mb->mb_last.mv_data = ptr;
+	mb->mb_last.mv_size = 0;
+	*ret = mb;
+	return MDB_SUCCESS;
 }
 
-	/** Give buffer and/or #MDB_EOF to writer thread, await unused buffer.
-	 *
-	 * @param[in] my control structure.
-	 * @param[in] adjust (1 to hand off 1 buffer) | (MDB_EOF when ending).
-	 */
-static int ESECT
-mdb_env_cthr_toggle(mdb_copy *my, int adjust)
+/** Start a new page on a level of a bulk load.
+ * @param[in] mb the bulk load.
+ * @param[in] top the level, 0 for a leaf.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_bulk_page(MDB_bulk *mb, int top)
 {
-	pthread_mutex_lock(&my->mc_mutex);
-	my->mc_new += adjust;
-	pthread_cond_signal(&my->mc_cond);
-	while (my->mc_new & 2)		/* both buffers in use */
-		pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
-	pthread_mutex_unlock(&my->mc_mutex);
+	MDB_cursor *mc = &mb->mb_cursor;
+	MDB_page *mp;
+	int rc;
 
-	my->mc_toggle ^= (adjust & 1);
-	/* Both threads reset mc_wlen, to be safe from threading errors */
-	my->mc_wlen[my->mc_toggle] = 0;
-	return my->mc_error;
+	if (top >= CURSOR_STACK)
+		return MDB_CURSOR_FULL;
+	if ((rc = mdb_page_new(mc, top ? P_BRANCH : P_LEAF, 1, &mp)))
+		return rc;
+	mc->mc_pg[top] = mp;
+	if (top >= mc->mc_snum) {
+		mc->mc_snum = top + 1;
+		mc->mc_db->md_depth = mc->mc_snum;
+	}
+	return MDB_SUCCESS;
 }
 
-	/** Depth-first tree traversal for compacting copy.
-	 * @param[in] my control structure.
-	 * @param[in,out] pg database root.
-	 * @param[in] flags includes #F_DUPDATA if it is a sorted-duplicate sub-DB.
+/** Add the current page of a level to the branch page above it.
+ * If the branch page is full, it gets pushed up in turn and
+ * a new one is started.
+ * @param[in] mb the bulk load.
+ * @param[in] lvl the level of the page.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_bulk_push(MDB_bulk *mb, int lvl)
+{
+	MDB_cursor *mc = &mb->mb_cursor;
+	MDB_val *key = &mb->mb_first[lvl];
+	pgno_t pgno = mc->mc_pg[lvl]->mp_pgno;
+	int rc, top = lvl + 1;
+
+	mc->mc_top = top;
+	if (top < mc->mc_snum) {
+		MDB_page *mp = mc->mc_pg[top];
+		if (EVEN(mdb_branch_size(mc->mc_txn->mt_env, key)) <= SIZELEFT(mp))
+			return mdb_node_add(mc, NUMKEYS(mp), key, NULL, pgno, 0);
+		if ((rc = mdb_bulk_push(mb, top)))
+			return rc;
+	}
+	if ((rc = mdb_bulk_page(mb, top)))
+		return rc;
+	/* The first branch index doesn't need key data, but the level
+	 * above needs it as the separator for this page.
 	 */
-static int ESECT
-mdb_env_cwalk(mdb_copy *my, pgno_t *pg, int flags)
+	mc->mc_top = top;
+	if ((rc = mdb_node_add(mc, 0, NULL, NULL, pgno, 0)))
+		return rc;
+	mb->mb_first[top].mv_size = key->mv_size;
+	memcpy(mb->mb_first[top].mv_data, key->mv_data, key->mv_size);
+	return MDB_SUCCESS;
+}
+
+int
+mdb_bulk_add(MDB_bulk *mb, MDB_val *key, MDB_val *data)
 {
-	MDB_cursor mc = {0};
-	MDB_node *ni;
-	MDB_page *mo, *mp, *leaf;
-	char *buf, *ptr;
-	int rc, toggle;
-	unsigned int i;
+	MDB_cursor *mc;
+	MDB_txn *txn;
+	MDB_env *env;
+	MDB_page *mp;
+	MDB_val zdata;
+	size_t need;
+	unsigned int nflags = 0;
+	int rc;
 
-	/* Empty DB, nothing to do */
-	if (*pg == P_INVALID)
-		return MDB_SUCCESS;
+	if (!mb || !key || !data)
+		return EINVAL;
 
-	mc.mc_snum = 1;
-	mc.mc_txn = my->mc_txn;
-	mc.mc_flags = my->mc_txn->mt_flags & (C_ORIG_RDONLY|C_WRITEMAP);
+	mc = &mb->mb_cursor;
+	txn = mc->mc_txn;
+	env = txn->mt_env;
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
 
-	rc = mdb_page_get(&mc, *pg, &mc.mc_pg[0], NULL);
-	if (rc)
-		return rc;
-	rc = mdb_page_search_root(&mc, NULL, MDB_PS_FIRST);
-	if (rc)
-		return rc;
+	if (key->mv_size-1 >= ENV_MAXKEY(env))
+		return MDB_BAD_VALSIZE;
+#if SIZE_MAX > MAXDATASIZE
+	if (data->mv_size > MAXDATASIZE)
+		return MDB_BAD_VALSIZE;
+#endif
+	if (mc->mc_db->md_entries && mc->mc_dbx->md_cmp(key, &mb->mb_last) <= 0)
+		return MDB_KEYEXIST;
 
-	/* Make cursor pages writable */
-	buf = ptr = malloc(my->mc_env->me_psize * mc.mc_snum);
-	if (buf == NULL)
-		return ENOMEM;
+	if (mc->mc_dbx->md_enc && LEAFSIZE(key, data) > env->me_nodemax) {
+		rc = mdb_node_encode(mc, data, &zdata);
+		if (rc == MDB_SUCCESS) {
+			data = &zdata;
+			nflags = F_COMPRESSED;
+		} else if (rc != MDB_NOTFOUND) {
+			goto fail;
+		}
+	}
 
-	for (i=0; i<mc.mc_top; i++) {
-		mdb_page_copy((MDB_page *)ptr, mc.mc_pg[i], my->mc_env->me_psize);
-		mc.mc_pg[i] = (MDB_page *)ptr;
-		ptr += my->mc_env->me_psize;
+	/* Earlier leaves are finished, let them go if the txn gets full */
+	if ((rc = mdb_page_spill(mc, key, data)))
+		goto fail;
+
+	need = mdb_leaf_size(env, key, data);
+	mp = mc->mc_snum ? mc->mc_pg[0] : NULL;
+	if (!mp || (NUMKEYS(mp) && (need > SIZELEFT(mp) ||
+		env->me_psize - PAGEHDRSZ - SIZELEFT(mp) + need > mb->mb_room))) {
+		if (mp && (rc = mdb_bulk_push(mb, 0)))
+			goto fail;
+		if ((rc = mdb_bulk_page(mb, 0)))
+			goto fail;
+		mp = mc->mc_pg[0];
+		mb->mb_first[0].mv_size = key->mv_size;
+		memcpy(mb->mb_first[0].mv_data, key->mv_data, key->mv_size);
+#if MDB_SUFFIX_TRUNC
+		if (mc->mc_db->md_entries)
+			mdb_sepkey_trunc(mc, &mb->mb_last, &mb->mb_first[0]);
+#endif
 	}
+	mc->mc_top = 0;
+	if ((rc = mdb_node_add(mc, NUMKEYS(mp), key, data, 0, nflags)))
+		goto fail;
+	mc->mc_db->md_entries++;
+	mb->mb_last.mv_size = key->mv_size;
+	memcpy(mb->mb_last.mv_data, key->mv_data, key->mv_size);
+	return MDB_SUCCESS;
 
-	/* This is writable space for a leaf page. Usually not needed. */
-	leaf = (MDB_page *)ptr;
+fail:
+	txn->mt_flags |= MDB_TXN_ERROR;
+	return rc;
+}
 
-	toggle = my->mc_toggle;
-	while (mc.mc_snum > 0) {
-		unsigned n;
-		mp = mc.mc_pg[mc.mc_top];
-		n = NUMKEYS(mp);
+int
+mdb_bulk_finish(MDB_bulk *mb)
+{
+	MDB_cursor *mc;
+	int lvl, rc = MDB_SUCCESS;
 
-		if (IS_LEAF(mp)) {
-			if (!IS_LEAF2(mp) && !(flags & F_DUPDATA)) {
-				for (i=0; i<n; i++) {
-					ni = NODEPTR(mp, i);
-					if (ni->mn_flags & F_BIGDATA) {
-						MDB_page *omp;
-						pgno_t pg;
+	if (!mb)
+		return EINVAL;
 
-						/* Need writable leaf */
-						if (mp != leaf) {
-							mc.mc_pg[mc.mc_top] = leaf;
-							mdb_page_copy(leaf, mp, my->mc_env->me_psize);
-							mp = leaf;
-							ni = NODEPTR(mp, i);
-						}
+	mc = &mb->mb_cursor;
+	if (mc->mc_txn->mt_flags & MDB_TXN_BLOCKED) {
+		rc = MDB_BAD_TXN;
+	} else if (mc->mc_snum) {
+		for (lvl = 0; lvl < mc->mc_snum - 1; lvl++)
+			if ((rc = mdb_bulk_push(mb, lvl)))
+				break;
+		if (rc)
+			mc->mc_txn->mt_flags |= MDB_TXN_ERROR;
+		else
+			mc->mc_db->md_root = mc->mc_pg[mc->mc_snum-1]->mp_pgno;
+	}
+	free(mb);
+	return rc;
+}
 
-						memcpy(&pg, NODEDATA(ni), sizeof(pg));
-						memcpy(NODEDATA(ni), &my->mc_next_pgno, sizeof(pgno_t));
-						rc = mdb_page_get(&mc, pg, &omp, NULL);
-						if (rc)
-							goto done;
-						if (my->mc_wlen[toggle] >= MDB_WBUF) {
-							rc = mdb_env_cthr_toggle(my, 1);
-							if (rc)
-								goto done;
-							toggle = my->mc_toggle;
-						}
-						mo = (MDB_page *)(my->mc_wbuf[toggle] + my->mc_wlen[toggle]);
-						memcpy(mo, omp, my->mc_env->me_psize);
-						mo->mp_pgno = my->mc_next_pgno;
-						my->mc_next_pgno += omp->mp_pages;
-						my->mc_wlen[toggle] += my->mc_env->me_psize;
-						if (omp->mp_pages > 1) {
-							my->mc_olen[toggle] = my->mc_env->me_psize * (omp->mp_pages - 1);
-							my->mc_over[toggle] = (char *)omp + my->mc_env->me_psize;
-							rc = mdb_env_cthr_toggle(my, 1);
-							if (rc)
-								goto done;
-							toggle = my->mc_toggle;
-						}
-					} else if (ni->mn_flags & F_SUBDATA) {
-						MDB_db db;
+void
+mdb_bulk_abort(MDB_bulk *mb)
+{
+	if (!mb)
+		return;
+	/* The pages already added are unreachable, don't commit them */
+	if (mb->mb_cursor.mc_snum)
+		mb->mb_cursor.mc_txn->mt_flags |= MDB_TXN_ERROR;
+	free(mb);
+}
 
-						/* Need writable leaf */
-						if (mp != leaf) {
-							mc.mc_pg[mc.mc_top] = leaf;
-							mdb_page_copy(leaf, mp, my->mc_env->me_psize);
-							mp = leaf;
-							ni = NODEPTR(mp, i);
-						}
+/** One update in an #MDB_batch. Keys and data live in #MDB_batch.%bt_buf. */
+typedef struct MDB_bentry {
+	MDB_dbi		be_dbi;
+	unsigned int	be_flags;	/**< put flags, or #MDB_BATCH_DEL */
+	size_t		be_key;		/**< offset of the key in bt_buf */
+	size_t		be_ksize;
+	size_t		be_data;	/**< offset of the data in bt_buf */
+	size_t		be_dsize;
+} MDB_bentry;
+
+	/** #MDB_bentry.%be_flags of a delete */
+#define MDB_BATCH_DEL	0x80000000U
+	/** #MDB_bentry.%be_flags of a delete without data: all of the key's items */
+#define MDB_BATCH_ALL	0x40000000U
+
+/** A list of updates built without a transaction, see #mdb_batch_create(). */
+struct MDB_batch {
+	MDB_env		*bt_env;
+	MDB_bentry	*bt_ents;
+	size_t		bt_count;	/**< number of entries in bt_ents */
+	size_t		bt_size;	/**< allocated size of bt_ents */
+	char		*bt_buf;	/**< copies of the keys and data */
+	size_t		bt_used;	/**< bytes used in bt_buf */
+	size_t		bt_bufsize;	/**< allocated size of bt_buf */
+	int			bt_sorted;	/**< bt_ents is in apply order */
+};
 
-						memcpy(&db, NODEDATA(ni), sizeof(db));
-						my->mc_toggle = toggle;
-						rc = mdb_env_cwalk(my, &db.md_root, ni->mn_flags & F_DUPDATA);
-						if (rc)
-							goto done;
-						toggle = my->mc_toggle;
-						memcpy(NODEDATA(ni), &db, sizeof(db));
-					}
-				}
-			}
-		} else {
-			mc.mc_ki[mc.mc_top]++;
-			if (mc.mc_ki[mc.mc_top] < n) {
-				pgno_t pg;
-again:
-				ni = NODEPTR(mp, mc.mc_ki[mc.mc_top]);
-				pg = NODEPGNO(ni);
-				rc = mdb_page_get(&mc, pg, &mp, NULL);
-				if (rc)
-					goto done;
-				mc.mc_top++;
-				mc.mc_snum++;
-				mc.mc_ki[mc.mc_top] = 0;
-				if (IS_BRANCH(mp)) {
-					/* Whenever we advance to a sibling branch page,
-					 * we must proceed all the way down to its first leaf.
-					 */
-					mdb_page_copy(mc.mc_pg[mc.mc_top], mp, my->mc_env->me_psize);
-					goto again;
-				} else
-					mc.mc_pg[mc.mc_top] = mp;
-				continue;
-			}
-		}
-		if (my->mc_wlen[toggle] >= MDB_WBUF) {
-			rc = mdb_env_cthr_toggle(my, 1);
-			if (rc)
-				goto done;
-			toggle = my->mc_toggle;
-		}
-		mo = (MDB_page *)(my->mc_wbuf[toggle] + my->mc_wlen[toggle]);
-		mdb_page_copy(mo, mp, my->mc_env->me_psize);
-		mo->mp_pgno = my->mc_next_pgno++;
-		my->mc_wlen[toggle] += my->mc_env->me_psize;
-		if (mc.mc_top) {
-			/* Update parent if there is one */
-			ni = NODEPTR(mc.mc_pg[mc.mc_top-1], mc.mc_ki[mc.mc_top-1]);
-			SETPGNO(ni, mo->mp_pgno);
-			mdb_cursor_pop(&mc);
-		} else {
-			/* Otherwise we're done */
-			*pg = mo->mp_pgno;
-			break;
-		}
-	}
-done:
-	free(buf);
-	return rc;
+int
+mdb_batch_create(MDB_env *env, MDB_batch **ret)
+{
+	MDB_batch *bt;
+
+	if (!env || !env->me_dbxs || !ret)
+		return EINVAL;
+	if ((bt = calloc(1, sizeof(MDB_batch))) == NULL)
+		return ENOMEM;
+	bt->bt_env = env;
+	bt->bt_sorted = 1;
+	*ret = bt;
+	return MDB_SUCCESS;
 }
 
-	/** Copy environment with compaction. */
-static int ESECT
-mdb_env_copyfd1(MDB_env *env, HANDLE fd)
+/** Append an update to a batch, copying its key and data. */
+static int
+mdb_batch_add(MDB_batch *bt, MDB_dbi dbi, MDB_val *key, MDB_val *data,
+	unsigned int flags)
 {
-	MDB_meta *mm;
-	MDB_page *mp;
-	mdb_copy my = {0};
-	MDB_txn *txn = NULL;
-	pthread_t thr;
-	pgno_t root, new_root;
-	int rc = MDB_SUCCESS;
-
-#ifdef _WIN32
-	if (!(my.mc_mutex = CreateMutex(NULL, FALSE, NULL)) ||
-		!(my.mc_cond = CreateEvent(NULL, FALSE, FALSE, NULL))) {
-		rc = ErrCode();
-		goto done;
-	}
-	my.mc_wbuf[0] = _aligned_malloc(MDB_WBUF*2, env->me_os_psize);
-	if (my.mc_wbuf[0] == NULL) {
-		/* _aligned_malloc() sets errno, but we use Windows error codes */
-		rc = ERROR_NOT_ENOUGH_MEMORY;
-		goto done;
-	}
-#else
-	if ((rc = pthread_mutex_init(&my.mc_mutex, NULL)) != 0)
-		return rc;
-	if ((rc = pthread_cond_init(&my.mc_cond, NULL)) != 0)
-		goto done2;
-#ifdef HAVE_MEMALIGN
-	my.mc_wbuf[0] = memalign(env->me_os_psize, MDB_WBUF*2);
-	if (my.mc_wbuf[0] == NULL) {
-		rc = errno;
-		goto done;
-	}
-#else
-	{
-		void *p;
-		if ((rc = posix_memalign(&p, env->me_os_psize, MDB_WBUF*2)) != 0)
-			goto done;
-		my.mc_wbuf[0] = p;
-	}
-#endif
-#endif
-	memset(my.mc_wbuf[0], 0, MDB_WBUF*2);
-	my.mc_wbuf[1] = my.mc_wbuf[0] + MDB_WBUF;
-	my.mc_next_pgno = NUM_METAS;
-	my.mc_env = env;
-	my.mc_fd = fd;
-	rc = THREAD_CREATE(thr, mdb_env_copythr, &my);
-	if (rc)
-		goto done;
+	MDB_env *env = bt->bt_env;
+	MDB_bentry *be;
+	size_t dsize = data ? data->mv_size : 0;
+	size_t koff = (bt->bt_used + sizeof(size_t)-1) & -sizeof(size_t);
+	size_t need = koff + key->mv_size + sizeof(size_t) + dsize;
 
-	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
-	if (rc)
-		goto finish;
+	if (dbi >= env->me_maxdbs || !env->me_dbxs[dbi].md_cmp)
+		return EINVAL;
+	if (key->mv_size-1 >= ENV_MAXKEY(env))
+		return MDB_BAD_VALSIZE;
+	if (bt->bt_count == bt->bt_size) {
+		size_t size = bt->bt_size ? bt->bt_size * 2 : 256;
+		if ((be = realloc(bt->bt_ents, size * sizeof(MDB_bentry))) == NULL)
+			return ENOMEM;
+		bt->bt_ents = be;
+		bt->bt_size = size;
+	}
+	if (need > bt->bt_bufsize) {
+		size_t size = bt->bt_bufsize ? bt->bt_bufsize : 64 * 1024;
+		char *buf;
+		while (size < need)
+			size *= 2;
+		if ((buf = realloc(bt->bt_buf, size)) == NULL)
+			return ENOMEM;
+		bt->bt_buf = buf;
+		bt->bt_bufsize = size;
+	}
+	be = &bt->bt_ents[bt->bt_count++];
+	be->be_dbi = dbi;
+	be->be_flags = flags;
+	be->be_key = koff;
+	be->be_ksize = key->mv_size;
+	memcpy(bt->bt_buf + koff, key->mv_data, key->mv_size);
+	/* Keep data aligned too, for integer dup comparisons */
+	be->be_data = (koff + key->mv_size + sizeof(size_t)-1) & -sizeof(size_t);
+	be->be_dsize = dsize;
+	if (dsize)
+		memcpy(bt->bt_buf + be->be_data, data->mv_data, dsize);
+	bt->bt_used = be->be_data + dsize;
+	bt->bt_sorted = 0;
+	return MDB_SUCCESS;
+}
 
-	mp = (MDB_page *)my.mc_wbuf[0];
-	memset(mp, 0, NUM_METAS * env->me_psize);
-	mp->mp_pgno = 0;
-	mp->mp_flags = P_META;
-	mm = (MDB_meta *)METADATA(mp);
-	mdb_env_init_meta0(env, mm);
-	mm->mm_address = env->me_metas[0]->mm_address;
+int
+mdb_batch_put(MDB_batch *bt, MDB_dbi dbi, MDB_val *key, MDB_val *data,
+	unsigned int flags)
+{
+	if (!bt || !key || !data)
+		return EINVAL;
+	if (flags & ~(MDB_NOOVERWRITE|MDB_NODUPDATA))
+		return EINVAL;
+	return mdb_batch_add(bt, dbi, key, data, flags);
+}
 
-	mp = (MDB_page *)(my.mc_wbuf[0] + env->me_psize);
-	mp->mp_pgno = 1;
-	mp->mp_flags = P_META;
-	*(MDB_meta *)METADATA(mp) = *mm;
-	mm = (MDB_meta *)METADATA(mp);
+int
+mdb_batch_del(MDB_batch *bt, MDB_dbi dbi, MDB_val *key, MDB_val *data)
+{
+	if (!bt || !key)
+		return EINVAL;
+	return mdb_batch_add(bt, dbi, key, data,
+		MDB_BATCH_DEL | (data ? 0 : MDB_BATCH_ALL));
+}
 
-	/* Set metapage 1 with current main DB */
-	root = new_root = txn->mt_dbs[MAIN_DBI].md_root;
-	if (root != P_INVALID) {
-		/* Count free pages + freeDB pages.  Subtract from last_pg
-		 * to find the new last_pg, which also becomes the new root.
-		 */
-		MDB_ID freecount = 0;
-		MDB_cursor mc;
-		MDB_val key, data;
-		mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
-		while ((rc = mdb_cursor_get(&mc, &key, &data, MDB_NEXT)) == 0)
-			freecount += *(MDB_ID *)data.mv_data;
-		if (rc != MDB_NOTFOUND)
-			goto finish;
-		freecount += txn->mt_dbs[FREE_DBI].md_branch_pages +
-			txn->mt_dbs[FREE_DBI].md_leaf_pages +
-			txn->mt_dbs[FREE_DBI].md_overflow_pages;
+/** Compare two batch entries by DBI, then by key. */
+static int
+mdb_batch_cmp(MDB_batch *bt, MDB_bentry *a, MDB_bentry *b)
+{
+	MDB_val ka, kb;
+
+	if (a->be_dbi != b->be_dbi)
+		return a->be_dbi < b->be_dbi ? -1 : 1;
+	ka.mv_size = a->be_ksize;
+	ka.mv_data = bt->bt_buf + a->be_key;
+	kb.mv_size = b->be_ksize;
+	kb.mv_data = bt->bt_buf + b->be_key;
+	return bt->bt_env->me_dbxs[a->be_dbi].md_cmp(&ka, &kb);
+}
 
-		new_root = txn->mt_next_pgno - 1 - freecount;
-		mm->mm_last_pg = new_root;
-		mm->mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
-		mm->mm_dbs[MAIN_DBI].md_root = new_root;
-	} else {
-		/* When the DB is empty, handle it specially to
-		 * fix any breakage like page leaks from ITS#8174.
-		 */
-		mm->mm_dbs[MAIN_DBI].md_flags = txn->mt_dbs[MAIN_DBI].md_flags;
-	}
-	if (root != P_INVALID || mm->mm_dbs[MAIN_DBI].md_flags) {
-		mm->mm_txnid = 1;		/* use metapage 1 */
-	}
+/** Stable merge sort of batch entries, so updates of the same key
+ *	keep their order. Runs that are already sorted cost one compare.
+ * @param[in] bt the batch, for the comparison functions.
+ * @param[in,out] ents the entries to sort.
+ * @param[in] tmp scratch space for at least \b n / 2 entries.
+ * @param[in] n the number of entries.
+ */
+static void
+mdb_batch_msort(MDB_batch *bt, MDB_bentry *ents, MDB_bentry *tmp, size_t n)
+{
+	size_t i, j, k, h = n / 2;
 
-	my.mc_wlen[0] = env->me_psize * NUM_METAS;
-	my.mc_txn = txn;
-	rc = mdb_env_cwalk(&my, &root, 0);
-	if (rc == MDB_SUCCESS && root != new_root) {
-		rc = MDB_INCOMPATIBLE;	/* page leak or corrupt DB */
+	if (n < 2)
+		return;
+	mdb_batch_msort(bt, ents, tmp, h);
+	mdb_batch_msort(bt, ents + h, tmp, n - h);
+	if (mdb_batch_cmp(bt, &ents[h-1], &ents[h]) <= 0)
+		return;
+	memcpy(tmp, ents, h * sizeof(MDB_bentry));
+	for (i = 0, j = h, k = 0; i < h; ) {
+		if (j < n && mdb_batch_cmp(bt, &ents[j], &tmp[i]) < 0)
+			ents[k++] = ents[j++];
+		else
+			ents[k++] = tmp[i++];
 	}
+}
 
-finish:
-	if (rc)
-		my.mc_error = rc;
-	mdb_env_cthr_toggle(&my, 1 | MDB_EOF);
-	rc = THREAD_FINISH(thr);
-	mdb_txn_abort(txn);
+int
+mdb_batch_sort(MDB_batch *bt)
+{
+	MDB_bentry *tmp;
 
-done:
-#ifdef _WIN32
-	if (my.mc_wbuf[0]) _aligned_free(my.mc_wbuf[0]);
-	if (my.mc_cond)  CloseHandle(my.mc_cond);
-	if (my.mc_mutex) CloseHandle(my.mc_mutex);
-#else
-	free(my.mc_wbuf[0]);
-	pthread_cond_destroy(&my.mc_cond);
-done2:
-	pthread_mutex_destroy(&my.mc_mutex);
-#endif
-	return rc ? rc : my.mc_error;
+	if (!bt)
+		return EINVAL;
+	if (bt->bt_sorted)
+		return MDB_SUCCESS;
+	if ((tmp = malloc((bt->bt_count / 2 + 1) * sizeof(MDB_bentry))) == NULL)
+		return ENOMEM;
+	mdb_batch_msort(bt, bt->bt_ents, tmp, bt->bt_count);
+	free(tmp);
+	bt->bt_sorted = 1;
+	return MDB_SUCCESS;
 }
 
-	/** Copy environment as-is. */
-static int ESECT
-mdb_env_copyfd0(MDB_env *env, HANDLE fd)
+int
+mdb_batch_apply(MDB_txn *txn, MDB_batch *bt)
 {
-	MDB_txn *txn = NULL;
-	mdb_mutexref_t wmutex = NULL;
+	MDB_cursor *mc = NULL;
+	MDB_bentry *be, *end;
+	MDB_val key, data;
 	int rc;
-	mdb_size_t wsize, w3;
-	char *ptr;
-#ifdef _WIN32
-	DWORD len, w2;
-#define DO_WRITE(rc, fd, ptr, w2, len)	rc = WriteFile(fd, ptr, w2, &len, NULL)
-#else
-	ssize_t len;
-	size_t w2;
-#define DO_WRITE(rc, fd, ptr, w2, len)	len = write(fd, ptr, w2); rc = (len >= 0)
-#endif
 
-	/* Do the lock/unlock of the reader mutex before starting the
-	 * write txn.  Otherwise other read txns could block writers.
-	 */
-	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
-	if (rc)
+	if (!txn || !bt || bt->bt_env != txn->mt_env)
+		return EINVAL;
+	if (txn->mt_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
+		return (txn->mt_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
+	if ((rc = mdb_batch_sort(bt)) != MDB_SUCCESS)
 		return rc;
 
-	if (env->me_txns) {
-		/* We must start the actual read txn after blocking writers */
-		mdb_txn_end(txn, MDB_END_RESET_TMP);
-
-		/* Temporarily block writers until we snapshot the meta pages */
-		wmutex = env->me_wmutex;
-		if (LOCK_MUTEX(rc, env, wmutex))
-			goto leave;
-
-		rc = mdb_txn_renew0(txn);
-		if (rc) {
-			UNLOCK_MUTEX(wmutex);
-			goto leave;
+	/* One cursor per DBI. In key order, most updates land on the
+	 * page the cursor is already on, and mdb_cursor_set() skips
+	 * the descent from the root for them.
+	 */
+	end = bt->bt_ents + bt->bt_count;
+	for (be = bt->bt_ents; be < end; be++) {
+		if (!mc || mc->mc_dbi != be->be_dbi) {
+			if (mc)
+				mdb_cursor_close(mc);
+			if ((rc = mdb_cursor_open(txn, be->be_dbi, &mc)) != MDB_SUCCESS) {
+				mc = NULL;
+				break;
+			}
+		}
+		key.mv_size = be->be_ksize;
+		key.mv_data = bt->bt_buf + be->be_key;
+		data.mv_size = be->be_dsize;
+		data.mv_data = bt->bt_buf + be->be_data;
+		if (be->be_flags & MDB_BATCH_DEL) {
+			if ((be->be_flags & MDB_BATCH_ALL) || !(mc->mc_db->md_flags & MDB_DUPSORT))
+				rc = mdb_cursor_get(mc, &key, NULL, MDB_SET);
+			else
+				rc = mdb_cursor_get(mc, &key, &data, MDB_GET_BOTH);
+			if (rc == MDB_SUCCESS)
+				rc = mdb_cursor_del(mc, (be->be_flags & MDB_BATCH_ALL) ? MDB_NODUPDATA : 0);
+		} else {
+			rc = mdb_cursor_put(mc, &key, &data, be->be_flags);
 		}
+		/* Conditional updates that don't apply are not errors */
+		if (rc == MDB_NOTFOUND || rc == MDB_KEYEXIST)
+			rc = MDB_SUCCESS;
+		else if (rc)
+			break;
 	}
+	if (mc)
+		mdb_cursor_close(mc);
+	return rc;
+}
 
-	wsize = env->me_psize * NUM_METAS;
-	ptr = env->me_map;
-	w2 = wsize;
-	while (w2 > 0) {
-		DO_WRITE(rc, fd, ptr, w2, len);
-		if (!rc) {
-			rc = ErrCode();
+void
+mdb_batch_reset(MDB_batch *bt)
+{
+	if (!bt)
+		return;
+	bt->bt_count = 0;
+	bt->bt_used = 0;
+	bt->bt_sorted = 1;
+}
+
+void
+mdb_batch_free(MDB_batch *bt)
+{
+	if (!bt)
+		return;
+	free(bt->bt_ents);
+	free(bt->bt_buf);
+	free(bt);
+}
+
+#ifndef MDB_WBUF
+#define MDB_WBUF	(1024*1024)
+#endif
+#define MDB_EOF		0x10	/**< #mdb_env_copyfd1() is done reading */
+
+#if !(defined(_WIN32) || defined(MDB_VL32))
+	/** Some read-only operations can split their work among threads:
+	 *	the compacting copy, #mdb_range_scan(), #mdb_stat_pages() and
+	 *	#mdb_env_warmup(). Under #MDB_VL32 even a read-only txn is not
+	 *	thread-safe, and the copy needs a broadcast condvar.
+	 */
+#define MDB_THREADS	1
+#endif
+
+#ifdef MDB_THREADS
+	/** Helper threads of an operation, see #mdb_threads_start(). */
+typedef struct mdb_threads {
+	pthread_t	*th_thr;
+	unsigned	th_count;		/**< number of threads started */
+} mdb_threads;
+
+/** Start threads to share the work of the calling thread.
+ *	Thread \b i is passed \b arg + \b i * \b size, so with \b size 0
+ *	they all get \b arg. If some threads can't be started, the ones
+ *	that were carry on without them.
+ * @param[out] th the threads, for #mdb_threads_join().
+ * @param[in] n the number of threads to start.
+ * @param[in] func the thread function.
+ * @param[in] arg the argument of the first thread.
+ * @param[in] size the distance between the threads' arguments.
+ */
+static void
+mdb_threads_start(mdb_threads *th, unsigned n,
+	THREAD_RET (CALL_CONV *func)(void *), void *arg, size_t size)
+{
+	th->th_count = 0;
+	if (!n || !(th->th_thr = malloc(n * sizeof(pthread_t)))) {
+		th->th_thr = NULL;
+		return;
+	}
+	for (; th->th_count < n; th->th_count++)
+		if (THREAD_CREATE(th->th_thr[th->th_count], func,
+			(char *)arg + th->th_count * size))
 			break;
-		} else if (len > 0) {
-			rc = MDB_SUCCESS;
-			ptr += len;
-			w2 -= len;
-			continue;
-		} else {
-			/* Non-blocking or async handles are not supported */
-			rc = EIO;
+}
+
+/** Wait for the threads of #mdb_threads_start() to finish. */
+static void
+mdb_threads_join(mdb_threads *th)
+{
+	while (th->th_count)
+		THREAD_FINISH(th->th_thr[--th->th_count]);
+	free(th->th_thr);
+	th->th_thr = NULL;
+}
+
+	/** How far, in bytes, the readahead threads may get ahead
+	 *	of the pages the compacting copy has written out.
+	 */
+#ifndef MDB_CP_AHEAD
+#define MDB_CP_AHEAD	(256*1024*1024)
+#endif
+#endif
+
+	/** State needed for a double-buffering compacting copy. */
+typedef struct mdb_copy {
+	MDB_env *mc_env;
+	MDB_txn *mc_txn;
+	pthread_mutex_t mc_mutex;
+	pthread_cond_t mc_cond;	/**< Condition variable for #mc_new */
+	char *mc_wbuf[2];
+	char *mc_over[2];
+	int mc_wlen[2];
+	int mc_olen[2];
+	pgno_t mc_next_pgno;
+	HANDLE mc_fd;
+	int mc_toggle;			/**< Buffer number in provider */
+	int mc_new;				/**< (0-2 buffers to write) | (#MDB_EOF at end) */
+	/** Error code.  Never cleared if set.  Both threads can set nonzero
+	 *	to fail the copy.  Not mutex-protected, LMDB expects atomic int.
+	 */
+	volatile int mc_error;
+#ifdef MDB_THREADS
+	/** @defgroup mdb_copy_ahead Readahead state, see #mdb_env_creadthr().
+	 *	Protected by #mc_mutex.
+	 *	@{
+	 */
+	pgno_t *mc_units;		/**< subtree roots to read ahead, in copy order */
+	unsigned mc_nunits;		/**< number of #mc_units */
+	unsigned mc_unext;		/**< next unit for a readahead thread to claim */
+	pgno_t mc_ahead;		/**< pages read ahead so far */
+	pgno_t mc_done;			/**< #mc_next_pgno at the last buffer handoff */
+	pgno_t mc_window;		/**< max pages #mc_ahead may exceed #mc_done by */
+	int mc_stop;			/**< tells the readahead threads to quit */
+	pthread_cond_t mc_rcond;	/**< signalled when #mc_done advances */
+	/** @} */
+#endif
+} mdb_copy;
+
+	/** Dedicated writer thread for compacting copy. */
+static THREAD_RET ESECT CALL_CONV
+mdb_env_copythr(void *arg)
+{
+	mdb_copy *my = arg;
+	char *ptr;
+	int toggle = 0, wsize, rc;
+#ifdef _WIN32
+	DWORD len;
+#define DO_WRITE(rc, fd, ptr, w2, len)	rc = WriteFile(fd, ptr, w2, &len, NULL)
+#else
+	int len;
+#define DO_WRITE(rc, fd, ptr, w2, len)	len = write(fd, ptr, w2); rc = (len >= 0)
+#ifdef SIGPIPE
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	if ((rc = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0)
+		my->mc_error = rc;
+#endif
+#endif
+
+	pthread_mutex_lock(&my->mc_mutex);
+	for(;;) {
+		while (!my->mc_new)
+			pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
+		if (my->mc_new == 0 + MDB_EOF) /* 0 buffers, just EOF */
+			break;
+		wsize = my->mc_wlen[toggle];
+		ptr = my->mc_wbuf[toggle];
+again:
+		rc = MDB_SUCCESS;
+		while (wsize > 0 && !my->mc_error) {
+			DO_WRITE(rc, my->mc_fd, ptr, wsize, len);
+			if (!rc) {
+				rc = ErrCode();
+#if defined(SIGPIPE) && !defined(_WIN32)
+				if (rc == EPIPE) {
+					/* Collect the pending SIGPIPE, otherwise at least OS X
+					 * gives it to the process on thread-exit (ITS#8504).
+					 */
+					int tmp;
+					sigwait(&set, &tmp);
+				}
+#endif
+				break;
+			} else if (len > 0) {
+				rc = MDB_SUCCESS;
+				ptr += len;
+				wsize -= len;
+				continue;
+			} else {
+				rc = EIO;
+				break;
+			}
+		}
+		if (rc) {
+			my->mc_error = rc;
+		}
+		/* If there's an overflow page tail, write it too */
+		if (my->mc_olen[toggle]) {
+			wsize = my->mc_olen[toggle];
+			ptr = my->mc_over[toggle];
+			my->mc_olen[toggle] = 0;
+			goto again;
+		}
+		my->mc_wlen[toggle] = 0;
+		toggle ^= 1;
+		/* Return the empty buffer to provider */
+		my->mc_new--;
+		pthread_cond_signal(&my->mc_cond);
+	}
+	pthread_mutex_unlock(&my->mc_mutex);
+	return (THREAD_RET)0;
+#undef DO_WRITE
+}
+
+	/** Give buffer and/or #MDB_EOF to writer thread, await unused buffer.
+	 *
+	 * @param[in] my control structure.
+	 * @param[in] adjust (1 to hand off 1 buffer) | (MDB_EOF when ending).
+	 */
+static int ESECT
+mdb_env_cthr_toggle(mdb_copy *my, int adjust)
+{
+	pthread_mutex_lock(&my->mc_mutex);
+	my->mc_new += adjust;
+	pthread_cond_signal(&my->mc_cond);
+#ifdef MDB_THREADS
+	if (my->mc_units) {
+		my->mc_done = my->mc_next_pgno;
+		pthread_cond_broadcast(&my->mc_rcond);
+	}
+#endif
+	while (my->mc_new & 2)		/* both buffers in use */
+		pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
+	pthread_mutex_unlock(&my->mc_mutex);
+
+	my->mc_toggle ^= (adjust & 1);
+	/* Both threads reset mc_wlen, to be safe from threading errors */
+	my->mc_wlen[my->mc_toggle] = 0;
+	return my->mc_error;
+}
+
+#ifdef MDB_THREADS
+	/** Map address of a page, for the readahead threads. */
+#define CP_PAGE(my, pg)	((MDB_page *)((my)->mc_env->me_map + (my)->mc_env->me_psize * (pg)))
+	/** True if \b pg can be dereferenced in the copy's snapshot */
+#define CP_VALID(my, pg)	((pg) >= NUM_METAS && (pg) < (my)->mc_txn->mt_next_pgno)
+
+	/** Account for pages read ahead, and wait if too far ahead of the walker.
+	 * @param[in] my control structure.
+	 * @param[in,out] count pages read since the last call, reset to 0.
+	 * @return 0 to keep going, non-zero if the readahead should stop.
+	 */
+static int ESECT
+mdb_env_cpace(mdb_copy *my, pgno_t *count)
+{
+	int rc;
+
+	pthread_mutex_lock(&my->mc_mutex);
+	my->mc_ahead += *count;
+	*count = 0;
+	while (!my->mc_stop && !my->mc_error &&
+		my->mc_ahead > my->mc_done + my->mc_window)
+		pthread_cond_wait(&my->mc_rcond, &my->mc_mutex);
+	rc = my->mc_stop || my->mc_error;
+	pthread_mutex_unlock(&my->mc_mutex);
+	return rc;
+}
+
+#ifdef MADV_WILLNEED
+	/** Advise the kernel to read an overflow run ahead of #mdb_env_cwalk().
+	 * @param[in] my control structure.
+	 * @param[in] pg first page of the run.
+	 * @param[in] ovpages number of pages in the run.
+	 * @param[in,out] count pages read since #mdb_env_cpace() was last called.
+	 */
+static void ESECT
+mdb_env_cread_ov(mdb_copy *my, pgno_t pg, pgno_t ovpages, pgno_t *count)
+{
+	size_t off, len, pad;
+	unsigned psize = my->mc_env->me_psize;
+
+	if (!CP_VALID(my, pg))
+		return;
+	off = (size_t)pg * psize;
+	pad = off & (my->mc_env->me_os_psize - 1);
+	len = (size_t)ovpages * psize + pad;
+	madvise(my->mc_env->me_map + off - pad, len, MADV_WILLNEED);
+	*count += ovpages;
+}
+#endif
+
+	/** Fault in the pages of a tree ahead of #mdb_env_cwalk().
+	 *	Overflow pages are only advised, since nothing needs their contents.
+	 * @param[in] my control structure.
+	 * @param[in] pg root of the tree.
+	 * @param[in,out] count pages read since #mdb_env_cpace() was last called.
+	 * @return 0 to keep going, non-zero if the readahead should stop.
+	 */
+static int ESECT
+mdb_env_cread(mdb_copy *my, pgno_t pg, pgno_t *count)
+{
+	MDB_page *stack[CURSOR_STACK], *mp;
+	indx_t ki[CURSOR_STACK];
+	MDB_node *ni;
+	MDB_db db;
+	unsigned i, psize = my->mc_env->me_psize;
+	int top = 0;
+
+	if (!CP_VALID(my, pg))
+		return 0;
+	stack[0] = CP_PAGE(my, pg);
+	ki[0] = 0;
+	while (top >= 0) {
+		mp = stack[top];
+		if (IS_BRANCH(mp)) {
+			if (ki[top] < NUMKEYS(mp) && top < CURSOR_STACK-1) {
+				pg = NODEPGNO(NODEPTR(mp, ki[top]));
+				ki[top]++;
+				if (CP_VALID(my, pg)) {
+					stack[++top] = CP_PAGE(my, pg);
+					ki[top] = 0;
+					if (++*count >= MDB_COMMIT_PAGES && mdb_env_cpace(my, count))
+						return 1;
+				}
+				continue;
+			}
+		} else if (IS_LEAF(mp) && !IS_LEAF2(mp)) {
+			for (i=0; i<NUMKEYS(mp); i++) {
+				ni = NODEPTR(mp, i);
+				if (ni->mn_flags & F_BIGDATA) {
+#ifdef MADV_WILLNEED
+					memcpy(&pg, NODEDATA(ni), sizeof(pg));
+					mdb_env_cread_ov(my, pg, OVPAGES(NODEDSZ(ni), psize), count);
+#endif
+				} else if (ni->mn_flags & F_SEGMENTS) {
+#ifdef MADV_WILLNEED
+					MDB_seghead sh;
+					unsigned j;
+					memcpy(&sh, NODEDATA(ni), SEGHDRSZ);
+					for (j = 0; j < sh.sh_count; j++)
+						mdb_env_cread_ov(my, mdb_seg_pgno(ni, j),
+							mdb_seg_pages(my->mc_env, &sh, j), count);
+#endif
+				} else if (ni->mn_flags & F_SUBDATA) {
+					memcpy(&db, NODEDATA(ni), sizeof(db));
+					if (mdb_env_cread(my, db.md_root, count))
+						return 1;
+				}
+			}
+		}
+		top--;
+	}
+	return 0;
+}
+
+	/** Readahead thread for a parallel compacting copy.
+	 *	Each thread claims the next unread subtree in copy order, so
+	 *	the walker mostly finds its pages already in the page cache.
+	 */
+static THREAD_RET ESECT CALL_CONV
+mdb_env_creadthr(void *arg)
+{
+	mdb_copy *my = arg;
+	pgno_t pg, count = 0;
+	int rc;
+
+	pthread_mutex_lock(&my->mc_mutex);
+	while (!my->mc_stop && !my->mc_error && my->mc_unext < my->mc_nunits) {
+		pg = my->mc_units[my->mc_unext++];
+		pthread_mutex_unlock(&my->mc_mutex);
+		rc = mdb_env_cread(my, pg, &count);
+		pthread_mutex_lock(&my->mc_mutex);
+		if (rc)
 			break;
+	}
+	pthread_mutex_unlock(&my->mc_mutex);
+	return (THREAD_RET)0;
+}
+
+	/** Split a tree into subtrees for the readahead threads.
+	 *	Branch pages are replaced by their children, and leaf pages by
+	 *	the sub-DBs they hold, level by level until there are a few
+	 *	subtrees per thread. The units stay in the walker's copy order.
+	 * @param[in] my control structure.
+	 * @param[in] root root of the main DB.
+	 * @param[in] nthreads number of readahead threads.
+	 * @return 0 on success, non-zero on failure.
+	 */
+static int ESECT
+mdb_env_cunits(mdb_copy *my, pgno_t root, unsigned nthreads)
+{
+	pgno_t *cur, *next, *tmp, pg;
+	unsigned i, j, k, l, n, m, max = nthreads * 64;
+	MDB_page *mp;
+	MDB_node *ni;
+	MDB_db db;
+	int grew;
+
+	cur = malloc(max * sizeof(pgno_t));
+	next = malloc(max * sizeof(pgno_t));
+	if (!cur || !next) {
+		free(cur);
+		free(next);
+		return ENOMEM;
+	}
+	cur[0] = root;
+	n = 1;
+	do {
+		grew = 0;
+		for (i = m = 0; i < n; i++) {
+			mp = CP_PAGE(my, cur[i]);
+			k = IS_LEAF2(mp) ? 0 : NUMKEYS(mp);
+			/* Leave the rest as they are when they don't fit */
+			if (m + k + n - i - 1 > max)
+				k = 0;
+			l = m;
+			for (j = 0; j < k; j++) {
+				ni = NODEPTR(mp, j);
+				if (IS_BRANCH(mp)) {
+					pg = NODEPGNO(ni);
+				} else if ((ni->mn_flags & (F_SUBDATA|F_BIGDATA)) == F_SUBDATA) {
+					memcpy(&db, NODEDATA(ni), sizeof(db));
+					pg = db.md_root;
+				} else {
+					continue;
+				}
+				if (CP_VALID(my, pg))
+					next[m++] = pg;
+			}
+			if (m == l)		/* nothing to split it into */
+				next[m++] = cur[i];
+			else
+				grew = 1;
 		}
+		tmp = cur; cur = next; next = tmp;
+		n = m;
+	} while (grew && n < nthreads * 4);
+	free(next);
+	my->mc_units = cur;
+	my->mc_nunits = n;
+	return MDB_SUCCESS;
+}
+#endif	/* MDB_THREADS */
+
+	/** Copy an overflow run for compacting copy, renumbering it
+	 *	to the next page of the output.
+	 * @param[in] my control structure.
+	 * @param[in] mc cursor of the tree being copied.
+	 * @param[in,out] ptr the run's page number, in a writable copy of its leaf.
+	 */
+static int ESECT
+mdb_env_cwalk_ov(mdb_copy *my, MDB_cursor *mc, void *ptr)
+{
+	MDB_page *omp, *mo;
+	pgno_t pg;
+	int rc, toggle = my->mc_toggle;
+
+	memcpy(&pg, ptr, sizeof(pg));
+	memcpy(ptr, &my->mc_next_pgno, sizeof(pgno_t));
+	rc = mdb_page_get(mc, pg, &omp, NULL);
+	if (rc)
+		return rc;
+	if (my->mc_wlen[toggle] >= MDB_WBUF) {
+		rc = mdb_env_cthr_toggle(my, 1);
+		if (rc)
+			return rc;
+		toggle = my->mc_toggle;
+	}
+	mo = (MDB_page *)(my->mc_wbuf[toggle] + my->mc_wlen[toggle]);
+	memcpy(mo, omp, my->mc_env->me_psize);
+	mo->mp_pgno = my->mc_next_pgno;
+	my->mc_next_pgno += omp->mp_pages;
+	my->mc_wlen[toggle] += my->mc_env->me_psize;
+	if (omp->mp_pages > 1) {
+		my->mc_olen[toggle] = my->mc_env->me_psize * (omp->mp_pages - 1);
+		my->mc_over[toggle] = (char *)omp + my->mc_env->me_psize;
+		rc = mdb_env_cthr_toggle(my, 1);
+	}
+	return rc;
+}
+
+	/** Depth-first tree traversal for compacting copy.
+	 * @param[in] my control structure.
+	 * @param[in,out] pg database root.
+	 * @param[in] flags includes #F_DUPDATA if it is a sorted-duplicate sub-DB.
+	 */
+static int ESECT
+mdb_env_cwalk(mdb_copy *my, pgno_t *pg, int flags)
+{
+	MDB_cursor mc = {0};
+	MDB_node *ni;
+	MDB_page *mo, *mp, *leaf;
+	char *buf, *ptr;
+	int rc, toggle;
+	unsigned int i;
+
+	/* Empty DB, nothing to do */
+	if (*pg == P_INVALID)
+		return MDB_SUCCESS;
+
+	mc.mc_snum = 1;
+	mc.mc_txn = my->mc_txn;
+	mc.mc_flags = my->mc_txn->mt_flags & (C_ORIG_RDONLY|C_WRITEMAP);
+
+	rc = mdb_page_get(&mc, *pg, &mc.mc_pg[0], NULL);
+	if (rc)
+		return rc;
+	rc = mdb_page_search_root(&mc, NULL, MDB_PS_FIRST);
+	if (rc)
+		return rc;
+
+	/* Make cursor pages writable */
+	buf = ptr = malloc(my->mc_env->me_psize * mc.mc_snum);
+	if (buf == NULL)
+		return ENOMEM;
+
+	for (i=0; i<mc.mc_top; i++) {
+		mdb_page_copy((MDB_page *)ptr, mc.mc_pg[i], my->mc_env->me_psize);
+		mc.mc_pg[i] = (MDB_page *)ptr;
+		ptr += my->mc_env->me_psize;
+	}
+
+	/* This is writable space for a leaf page. Usually not needed. */
+	leaf = (MDB_page *)ptr;
+
+	toggle = my->mc_toggle;
+	while (mc.mc_snum > 0) {
+		unsigned n;
+		mp = mc.mc_pg[mc.mc_top];
+		n = NUMKEYS(mp);
+
+		if (IS_LEAF(mp)) {
+			if (!IS_LEAF2(mp) && !(flags & F_DUPDATA)) {
+				for (i=0; i<n; i++) {
+					ni = NODEPTR(mp, i);
+					if (ni->mn_flags & (F_BIGDATA|F_SEGMENTS)) {
+						/* Need writable leaf */
+						if (mp != leaf) {
+							mc.mc_pg[mc.mc_top] = leaf;
+							mdb_page_copy(leaf, mp, my->mc_env->me_psize);
+							mp = leaf;
+							ni = NODEPTR(mp, i);
+						}
+
+						my->mc_toggle = toggle;
+						if (ni->mn_flags & F_BIGDATA) {
+							rc = mdb_env_cwalk_ov(my, &mc, NODEDATA(ni));
+						} else {
+							MDB_seghead sh;
+							unsigned j;
+							memcpy(&sh, NODEDATA(ni), SEGHDRSZ);
+							for (j = 0; j < sh.sh_count && !rc; j++)
+								rc = mdb_env_cwalk_ov(my, &mc,
+									(char *)NODEDATA(ni) + SEGTABSZ(j));
+						}
+						if (rc)
+							goto done;
+						toggle = my->mc_toggle;
+					} else if (ni->mn_flags & F_SUBDATA) {
+						MDB_db db;
+
+						/* Need writable leaf */
+						if (mp != leaf) {
+							mc.mc_pg[mc.mc_top] = leaf;
+							mdb_page_copy(leaf, mp, my->mc_env->me_psize);
+							mp = leaf;
+							ni = NODEPTR(mp, i);
+						}
+
+						memcpy(&db, NODEDATA(ni), sizeof(db));
+						my->mc_toggle = toggle;
+						rc = mdb_env_cwalk(my, &db.md_root, ni->mn_flags & F_DUPDATA);
+						if (rc)
+							goto done;
+						toggle = my->mc_toggle;
+						memcpy(NODEDATA(ni), &db, sizeof(db));
+					}
+				}
+			}
+		} else {
+			mc.mc_ki[mc.mc_top]++;
+			if (mc.mc_ki[mc.mc_top] < n) {
+				pgno_t pg;
+again:
+				ni = NODEPTR(mp, mc.mc_ki[mc.mc_top]);
+				pg = NODEPGNO(ni);
+				rc = mdb_page_get(&mc, pg, &mp, NULL);
+				if (rc)
+					goto done;
+				mc.mc_top++;
+				mc.mc_snum++;
+				mc.mc_ki[mc.mc_top] = 0;
+				if (IS_BRANCH(mp)) {
+					/* Whenever we advance to a sibling branch page,
+					 * we must proceed all the way down to its first leaf.
+					 */
+					mdb_page_copy(mc.mc_pg[mc.mc_top], mp, my->mc_env->me_psize);
+					goto again;
+				} else
+					mc.mc_pg[mc.mc_top] = mp;
+				continue;
+			}
+		}
+		if (my->mc_wlen[toggle] >= MDB_WBUF) {
+			rc = mdb_env_cthr_toggle(my, 1);
+			if (rc)
+				goto done;
+			toggle = my->mc_toggle;
+		}
+		mo = (MDB_page *)(my->mc_wbuf[toggle] + my->mc_wlen[toggle]);
+		mdb_page_copy(mo, mp, my->mc_env->me_psize);
+		mo->mp_pgno = my->mc_next_pgno++;
+		my->mc_wlen[toggle] += my->mc_env->me_psize;
+		if (mc.mc_top) {
+			/* Update parent if there is one */
+			ni = NODEPTR(mc.mc_pg[mc.mc_top-1], mc.mc_ki[mc.mc_top-1]);
+			SETPGNO(ni, mo->mp_pgno);
+			mdb_cursor_pop(&mc);
+		} else {
+			/* Otherwise we're done */
+			*pg = mo->mp_pgno;
+			break;
+		}
+	}
+done:
+	free(buf);
+	return rc;
+}
+
+	/** Copy environment with compaction.
+	 *	With \b nthreads > 1, the other threads read ahead of the walker.
+	 */
+static int ESECT
+mdb_env_copyfd1(MDB_env *env, HANDLE fd, unsigned int nthreads)
+{
+	MDB_meta *mm;
+	MDB_page *mp;
+	mdb_copy my = {0};
+	MDB_txn *txn = NULL;
+	pthread_t thr;
+	pgno_t root, new_root;
+	int rc = MDB_SUCCESS;
+#ifdef MDB_THREADS
+	mdb_threads readers = {0};
+#endif
+
+#ifdef _WIN32
+	if (!(my.mc_mutex = CreateMutex(NULL, FALSE, NULL)) ||
+		!(my.mc_cond = CreateEvent(NULL, FALSE, FALSE, NULL))) {
+		rc = ErrCode();
+		goto done;
+	}
+	my.mc_wbuf[0] = _aligned_malloc(MDB_WBUF*2, env->me_os_psize);
+	if (my.mc_wbuf[0] == NULL) {
+		/* _aligned_malloc() sets errno, but we use Windows error codes */
+		rc = ERROR_NOT_ENOUGH_MEMORY;
+		goto done;
+	}
+#else
+	if ((rc = pthread_mutex_init(&my.mc_mutex, NULL)) != 0)
+		return rc;
+	if ((rc = pthread_cond_init(&my.mc_cond, NULL)) != 0)
+		goto done2;
+#ifdef HAVE_MEMALIGN
+	my.mc_wbuf[0] = memalign(env->me_os_psize, MDB_WBUF*2);
+	if (my.mc_wbuf[0] == NULL) {
+		rc = errno;
+		goto done;
+	}
+#else
+	{
+		void *p;
+		if ((rc = posix_memalign(&p, env->me_os_psize, MDB_WBUF*2)) != 0)
+			goto done;
+		my.mc_wbuf[0] = p;
+	}
+#endif
+#endif
+	memset(my.mc_wbuf[0], 0, MDB_WBUF*2);
+	my.mc_wbuf[1] = my.mc_wbuf[0] + MDB_WBUF;
+	my.mc_next_pgno = NUM_METAS;
+	my.mc_env = env;
+	my.mc_fd = fd;
+	rc = THREAD_CREATE(thr, mdb_env_copythr, &my);
+	if (rc)
+		goto done;
+
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+		goto finish;
+
+	mp = (MDB_page *)my.mc_wbuf[0];
+	memset(mp, 0, NUM_METAS * env->me_psize);
+	mp->mp_pgno = 0;
+	mp->mp_flags = P_META;
+	mm = (MDB_meta *)METADATA(mp);
+	mdb_env_init_meta0(env, mm);
+	mm->mm_address = env->me_metas[0]->mm_address;
+	/* The copied records may be in the newer formats */
+	if (mm->mm_version < env->me_metas[0]->mm_version)
+		mm->mm_version = env->me_metas[0]->mm_version;
+	if (mm->mm_version < env->me_metas[1]->mm_version)
+		mm->mm_version = env->me_metas[1]->mm_version;
+
+	mp = (MDB_page *)(my.mc_wbuf[0] + env->me_psize);
+	mp->mp_pgno = 1;
+	mp->mp_flags = P_META;
+	*(MDB_meta *)METADATA(mp) = *mm;
+	mm = (MDB_meta *)METADATA(mp);
+
+	/* Set metapage 1 with current main DB */
+	root = new_root = txn->mt_dbs[MAIN_DBI].md_root;
+	if (root != P_INVALID) {
+		/* Count free pages + freeDB pages.  Subtract from last_pg
+		 * to find the new last_pg, which also becomes the new root.
+		 */
+		MDB_ID freecount = 0;
+		MDB_cursor mc;
+		MDB_val key, data;
+		mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
+		while ((rc = mdb_cursor_get(&mc, &key, &data, MDB_NEXT)) == 0)
+			if (!(*(txnid_t *)key.mv_data & MDB_RCL_BIT))
+				freecount += *(MDB_ID *)data.mv_data;
+		if (rc != MDB_NOTFOUND)
+			goto finish;
+		freecount += txn->mt_dbs[FREE_DBI].md_branch_pages +
+			txn->mt_dbs[FREE_DBI].md_leaf_pages +
+			txn->mt_dbs[FREE_DBI].md_overflow_pages;
+		/* Nor are the pages of lazily dropped DBs */
+		if ((rc = mdb_rcl_count(txn, &freecount)) != MDB_SUCCESS)
+			goto finish;
+
+		new_root = txn->mt_next_pgno - 1 - freecount;
+		mm->mm_last_pg = new_root;
+		mm->mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
+		mm->mm_dbs[MAIN_DBI].md_root = new_root;
+	} else {
+		/* When the DB is empty, handle it specially to
+		 * fix any breakage like page leaks from ITS#8174.
+		 */
+		mm->mm_dbs[MAIN_DBI].md_flags = txn->mt_dbs[MAIN_DBI].md_flags;
+	}
+	if (root != P_INVALID || mm->mm_dbs[MAIN_DBI].md_flags) {
+		mm->mm_txnid = 1;		/* use metapage 1 */
+	}
+
+	my.mc_wlen[0] = env->me_psize * NUM_METAS;
+	my.mc_txn = txn;
+#ifdef MDB_THREADS
+	if (nthreads > 1 && root != P_INVALID) {
+		if ((rc = pthread_cond_init(&my.mc_rcond, NULL)) != 0)
+			goto finish;
+		if ((rc = mdb_env_cunits(&my, root, nthreads - 1)) != 0) {
+			pthread_cond_destroy(&my.mc_rcond);
+			goto finish;
+		}
+		my.mc_window = MDB_CP_AHEAD / env->me_psize;
+		mdb_threads_start(&readers, nthreads - 1, mdb_env_creadthr, &my, 0);
+	}
+#endif
+	rc = mdb_env_cwalk(&my, &root, 0);
+	if (rc == MDB_SUCCESS && root != new_root) {
+		rc = MDB_INCOMPATIBLE;	/* page leak or corrupt DB */
+	}
+
+finish:
+	if (rc)
+		my.mc_error = rc;
+#ifdef MDB_THREADS
+	if (my.mc_units) {
+		pthread_mutex_lock(&my.mc_mutex);
+		my.mc_stop = 1;
+		pthread_cond_broadcast(&my.mc_rcond);
+		pthread_mutex_unlock(&my.mc_mutex);
+		mdb_threads_join(&readers);
+		pthread_cond_destroy(&my.mc_rcond);
+		free(my.mc_units);
+		my.mc_units = NULL;
+	}
+#endif
+	mdb_env_cthr_toggle(&my, 1 | MDB_EOF);
+	rc = THREAD_FINISH(thr);
+	mdb_txn_abort(txn);
+
+done:
+#ifdef _WIN32
+	if (my.mc_wbuf[0]) _aligned_free(my.mc_wbuf[0]);
+	if (my.mc_cond)  CloseHandle(my.mc_cond);
+	if (my.mc_mutex) CloseHandle(my.mc_mutex);
+#else
+	free(my.mc_wbuf[0]);
+	pthread_cond_destroy(&my.mc_cond);
+done2:
+	pthread_mutex_destroy(&my.mc_mutex);
+#endif
+	return rc ? rc : my.mc_error;
+}
+
+	/** Copy environment as-is. */
+static int ESECT
+mdb_env_copyfd0(MDB_env *env, HANDLE fd)
+{
+	MDB_txn *txn = NULL;
+	mdb_mutexref_t wmutex = NULL;
+	int rc;
+	mdb_size_t wsize, w3;
+	char *ptr;
+#ifdef _WIN32
+	DWORD len, w2;
+#define DO_WRITE(rc, fd, ptr, w2, len)	rc = WriteFile(fd, ptr, w2, &len, NULL)
+#else
+	ssize_t len;
+	size_t w2;
+#define DO_WRITE(rc, fd, ptr, w2, len)	len = write(fd, ptr, w2); rc = (len >= 0)
+#endif
+
+	/* Do the lock/unlock of the reader mutex before starting the
+	 * write txn.  Otherwise other read txns could block writers.
+	 */
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+		return rc;
+
+	if (env->me_txns) {
+		/* We must start the actual read txn after blocking writers */
+		mdb_txn_end(txn, MDB_END_RESET_TMP);
+
+		/* Temporarily block writers until we snapshot the meta pages */
+		wmutex = env->me_wmutex;
+		if (LOCK_MUTEX(rc, env, wmutex))
+			goto leave;
+
+		rc = mdb_txn_renew0(txn);
+		if (rc) {
+			UNLOCK_MUTEX(wmutex);
+			goto leave;
+		}
+	}
+
+	wsize = env->me_psize * NUM_METAS;
+	ptr = env->me_map;
+	w2 = wsize;
+	while (w2 > 0) {
+		DO_WRITE(rc, fd, ptr, w2, len);
+		if (!rc) {
+			rc = ErrCode();
+			break;
+		} else if (len > 0) {
+			rc = MDB_SUCCESS;
+			ptr += len;
+			w2 -= len;
+			continue;
+		} else {
+			/* Non-blocking or async handles are not supported */
+			rc = EIO;
+			break;
+		}
+	}
+	if (wmutex)
+		UNLOCK_MUTEX(wmutex);
+
+	if (rc)
+		goto leave;
+
+	w3 = txn->mt_next_pgno * env->me_psize;
+	{
+		mdb_size_t fsize = 0;
+		if ((rc = mdb_fsize(env->me_fd, &fsize)))
+			goto leave;
+		if (w3 > fsize)
+			w3 = fsize;
+	}
+	wsize = w3 - wsize;
+	while (wsize > 0) {
+		if (wsize > MAX_WRITE)
+			w2 = MAX_WRITE;
+		else
+			w2 = wsize;
+		DO_WRITE(rc, fd, ptr, w2, len);
+		if (!rc) {
+			rc = ErrCode();
+			break;
+		} else if (len > 0) {
+			rc = MDB_SUCCESS;
+			ptr += len;
+			wsize -= len;
+			continue;
+		} else {
+			rc = EIO;
+			break;
+		}
+	}
+
+leave:
+	mdb_txn_abort(txn);
+	return rc;
+}
+
+int ESECT
+mdb_env_copyfd3(MDB_env *env, HANDLE fd, unsigned int flags,
+	unsigned int nthreads)
+{
+	if (flags & MDB_CP_COMPACT)
+		return mdb_env_copyfd1(env, fd, nthreads);
+	else
+		return mdb_env_copyfd0(env, fd);
+}
+
+int ESECT
+mdb_env_copyfd2(MDB_env *env, HANDLE fd, unsigned int flags)
+{
+	return mdb_env_copyfd3(env, fd, flags, 1);
+}
+
+int ESECT
+mdb_env_copyfd(MDB_env *env, HANDLE fd)
+{
+	return mdb_env_copyfd2(env, fd, 0);
+}
+
+int ESECT
+mdb_env_copy3(MDB_env *env, const char *path, unsigned int flags,
+	unsigned int nthreads)
+{
+	int rc;
+	MDB_name fname;
+	HANDLE newfd = INVALID_HANDLE_VALUE;
+
+	rc = mdb_fname_init(path, env->me_flags | MDB_NOLOCK, &fname);
+	if (rc == MDB_SUCCESS) {
+		rc = mdb_fopen(env, &fname, MDB_O_COPY, 0666, &newfd);
+		mdb_fname_destroy(fname);
+	}
+	if (rc == MDB_SUCCESS) {
+		rc = mdb_env_copyfd3(env, newfd, flags, nthreads);
+		if (close(newfd) < 0 && rc == MDB_SUCCESS)
+			rc = ErrCode();
+	}
+	return rc;
+}
+
+int ESECT
+mdb_env_copy2(MDB_env *env, const char *path, unsigned int flags)
+{
+	return mdb_env_copy3(env, path, flags, 1);
+}
+
+int ESECT
+mdb_env_copy(MDB_env *env, const char *path)
+{
+	return mdb_env_copy2(env, path, 0);
+}
+
+/** @defgroup delta	Incremental copies
+ *	Written by #mdb_env_copyfd_delta() and read by #mdb_env_apply_delta().
+ *
+ *	The stream consists of whole pages in host byte order, so it can be
+ *	written with the same unbuffered I/O as a regular copy. The first
+ *	page holds an #MDB_delta header. A series of index pages follows,
+ *	each holding a count and that many ascending page numbers and
+ *	followed by those pages. An index page with a zero count ends the
+ *	series, and the #NUM_METAS meta pages of the new snapshot come last.
+ *	@{
+ */
+#define MDB_DELTA_MAGIC		0x4D44454C	/**< "MDEL" */
+#define MDB_DELTA_VERSION	1
+
+	/** Header page of an incremental copy */
+typedef struct MDB_delta {
+	uint32_t	md_magic;		/**< #MDB_DELTA_MAGIC */
+	uint32_t	md_version;		/**< #MDB_DELTA_VERSION */
+	uint32_t	md_psize;		/**< page size of the environment */
+	uint32_t	md_pad;
+	txnid_t		md_base;		/**< txnid of the copy the pages were compared to */
+	txnid_t		md_txnid;		/**< txnid of the snapshot in the stream */
+	pgno_t		md_next_pgno;	/**< first unused page of that snapshot */
+} MDB_delta;
+
+	/** Read from a file until \b size bytes or end of file.
+	 * @param[out] got the number of bytes actually read.
+	 */
+static int ESECT
+mdb_fd_pread(HANDLE fd, char *ptr, size_t size, mdb_size_t pos, size_t *got)
+{
+	size_t done = 0;
+#ifdef _WIN32
+	DWORD len;
+	OVERLAPPED ov;
+#else
+	ssize_t len;
+#endif
+
+	while (done < size) {
+#ifdef _WIN32
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = pos & 0xffffffff;
+		ov.OffsetHigh = pos >> 16 >> 16;
+		if (!ReadFile(fd, ptr, size - done, &len, &ov)) {
+			int rc = ErrCode();
+			if (rc != ERROR_HANDLE_EOF)
+				return rc;
+			len = 0;
+		}
+#else
+		len = pread(fd, ptr, size - done, pos);
+		if (len < 0) {
+			int rc = ErrCode();
+			if (rc == EINTR)
+				continue;
+			return rc;
+		}
+#endif
+		if (len == 0)
+			break;
+		ptr += len;
+		pos += len;
+		done += len;
+	}
+	*got = done;
+	return MDB_SUCCESS;
+}
+
+	/** Read exactly \b size bytes from a stream.
+	 * @return #MDB_INVALID if the stream ends first.
+	 */
+static int ESECT
+mdb_fd_read(HANDLE fd, char *ptr, size_t size)
+{
+#ifdef _WIN32
+	DWORD len;
+#else
+	ssize_t len;
+#endif
+
+	while (size > 0) {
+#ifdef _WIN32
+		if (!ReadFile(fd, ptr, size, &len, NULL)) {
+			int rc = ErrCode();
+			if (rc != ERROR_BROKEN_PIPE && rc != ERROR_HANDLE_EOF)
+				return rc;
+			len = 0;
+		}
+#else
+		len = read(fd, ptr, size);
+		if (len < 0) {
+			int rc = ErrCode();
+			if (rc == EINTR)
+				continue;
+			return rc;
+		}
+#endif
+		if (len == 0)
+			return MDB_INVALID;
+		ptr += len;
+		size -= len;
+	}
+	return MDB_SUCCESS;
+}
+
+	/** Write all of \b size bytes to a stream. */
+static int ESECT
+mdb_fd_write(HANDLE fd, const char *ptr, mdb_size_t size)
+{
+	int rc;
+#ifdef _WIN32
+	DWORD len, w2;
+#else
+	ssize_t len;
+	size_t w2;
+#endif
+
+	while (size > 0) {
+		w2 = size > MAX_WRITE ? MAX_WRITE : size;
+		DO_WRITE(rc, fd, ptr, w2, len);
+		if (!rc)
+			return ErrCode();
+		if (len <= 0)
+			return EIO;	/* Non-blocking or async handles are not supported */
+		ptr += len;
+		size -= len;
+	}
+	return MDB_SUCCESS;
+}
+
+	/** Write all of \b size bytes at file offset \b pos. */
+static int ESECT
+mdb_fd_pwrite(HANDLE fd, const char *ptr, size_t size, mdb_size_t pos)
+{
+	int rc;
+#ifdef _WIN32
+	DWORD len;
+	OVERLAPPED ov;
+#else
+	int len;
+#endif
+
+	while (size > 0) {
+#ifdef _WIN32
+		memset(&ov, 0, sizeof(ov));
+		ov.OffsetHigh = pos >> 16 >> 16;
+#endif
+		DO_PWRITE(rc, fd, ptr, size, len, pos);
+		if (!rc)
+			return ErrCode();
+		if (len <= 0)
+			return EIO;
+		ptr += len;
+		pos += len;
+		size -= len;
+	}
+	return MDB_SUCCESS;
+}
+
+	/** Write an index page and the pages it lists.
+	 *	Runs of adjacent pages are written straight from the map.
+	 */
+static int ESECT
+mdb_delta_flush(MDB_env *env, HANDLE fd, pgno_t *idx, pgno_t n)
+{
+	unsigned int psize = env->me_psize;
+	pgno_t i, j;
+	int rc;
+
+	idx[0] = n;
+	rc = mdb_fd_write(fd, (char *)idx, psize);
+	for (i = 1; i <= n && !rc; i = j) {
+		for (j = i+1; j <= n && idx[j] == idx[j-1]+1; j++) ;
+		rc = mdb_fd_write(fd, env->me_map + idx[i] * psize,
+			(mdb_size_t)(j - i) * psize);
+	}
+	return rc;
+}
+
+int ESECT
+mdb_env_copyfd_delta(MDB_env *env, const char *base, HANDLE fd)
+{
+	MDB_txn *txn = NULL;
+	mdb_mutexref_t wmutex = NULL;
+	MDB_name fname;
+	MDB_delta *hdr;
+	MDB_page *mp;
+	MDB_meta *m;
+	HANDLE bfd = INVALID_HANDLE_VALUE;
+	unsigned int psize = env->me_psize;
+	pgno_t *idx, pg, last, bpages, i, n, nidx, nchunk, chunk;
+	txnid_t btxnid = 0;
+	mdb_size_t fsize = 0;
+	char *buf = NULL, *metas, *bbuf, *ptr;
+	size_t got;
+	int rc;
+
+	rc = mdb_fname_init(base, env->me_flags | MDB_NOLOCK, &fname);
+	if (rc)
+		return rc;
+	rc = mdb_fopen(env, &fname, MDB_O_RDONLY, 0, &bfd);
+	mdb_fname_destroy(fname);
+	if (rc)
+		return rc;
+
+	/* Page 0 is the header and index page, then the new metas,
+	 * then a chunk of the base copy.
+	 */
+	nidx = psize / sizeof(pgno_t) - 1;
+	nchunk = MDB_WBUF / psize;
+	if (!nchunk)
+		nchunk = 1;
+	{
+		size_t bsize = (1 + NUM_METAS + nchunk) * (size_t)psize;
+#ifdef _WIN32
+		buf = _aligned_malloc(bsize, env->me_os_psize);
+		if (!buf) {
+			rc = ERROR_NOT_ENOUGH_MEMORY;
+			goto leave;
+		}
+#elif defined(HAVE_MEMALIGN)
+		buf = memalign(env->me_os_psize, bsize);
+		if (!buf) {
+			rc = errno;
+			goto leave;
+		}
+#else
+		void *p;
+		if ((rc = posix_memalign(&p, env->me_os_psize, bsize)) != 0)
+			goto leave;
+		buf = p;
+#endif
+	}
+	idx = (pgno_t *)buf;
+	metas = buf + psize;
+	bbuf = metas + NUM_METAS * psize;
+
+	rc = mdb_fd_pread(bfd, bbuf, NUM_METAS * psize, 0, &got);
+	if (rc)
+		goto leave;
+	if (got != NUM_METAS * psize) {
+		rc = MDB_INVALID;
+		goto leave;
+	}
+	for (i = 0; i < NUM_METAS; i++) {
+		mp = (MDB_page *)(bbuf + i * psize);
+		m = METADATA(mp);
+		if (!F_ISSET(mp->mp_flags, P_META) || m->mm_magic != MDB_MAGIC ||
+			!MDB_DATA_VERSION_OK(m->mm_version)) {
+			rc = MDB_INVALID;
+			goto leave;
+		}
+		if (m->mm_psize != psize) {
+			rc = EINVAL;
+			goto leave;
+		}
+		if (btxnid < m->mm_txnid)
+			btxnid = m->mm_txnid;
+	}
+	if ((rc = mdb_fsize(bfd, &fsize)))
+		goto leave;
+	bpages = fsize / psize;
+
+	/* Same as #mdb_env_copyfd0(): snapshot the metas with writers blocked */
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+		goto leave;
+	if (env->me_txns) {
+		mdb_txn_end(txn, MDB_END_RESET_TMP);
+		wmutex = env->me_wmutex;
+		if (LOCK_MUTEX(rc, env, wmutex))
+			goto leave;
+		rc = mdb_txn_renew0(txn);
+		if (rc) {
+			UNLOCK_MUTEX(wmutex);
+			goto leave;
+		}
+	}
+	memcpy(metas, env->me_map, NUM_METAS * psize);
+	if (wmutex)
+		UNLOCK_MUTEX(wmutex);
+
+	if (btxnid > txn->mt_txnid) {
+		rc = EINVAL;
+		goto leave;
+	}
+	last = txn->mt_next_pgno;
+	if ((rc = mdb_fsize(env->me_fd, &fsize)))
+		goto leave;
+	if (last > fsize / psize)
+		last = fsize / psize;
+
+	memset(buf, 0, psize);
+	hdr = (MDB_delta *)buf;
+	hdr->md_magic = MDB_DELTA_MAGIC;
+	hdr->md_version = MDB_DELTA_VERSION;
+	hdr->md_psize = psize;
+	hdr->md_base = btxnid;
+	hdr->md_txnid = txn->mt_txnid;
+	hdr->md_next_pgno = txn->mt_next_pgno;
+	if ((rc = mdb_fd_write(fd, buf, psize)))
+		goto leave;
+
+	/* Pages past the end of the base copy always differ. The others are
+	 * read from the base in chunks and compared. Pages which are free in
+	 * this snapshot may change under us, but their contents don't matter.
+	 */
+	n = 0;
+	for (pg = NUM_METAS; pg < last; pg += chunk) {
+		chunk = last - pg < nchunk ? last - pg : nchunk;
+		got = 0;
+		if (pg < bpages) {
+			rc = mdb_fd_pread(bfd, bbuf, chunk * psize,
+				(mdb_size_t)pg * psize, &got);
+			if (rc)
+				goto leave;
+		}
+		ptr = env->me_map + (mdb_size_t)pg * psize;
+		for (i = 0; i < chunk; i++, ptr += psize) {
+			if ((i+1) * psize <= got && !memcmp(ptr, bbuf + i * psize, psize))
+				continue;
+			idx[++n] = pg + i;
+			if (n == nidx) {
+				if ((rc = mdb_delta_flush(env, fd, idx, n)))
+					goto leave;
+				n = 0;
+			}
+		}
+	}
+	if (n && (rc = mdb_delta_flush(env, fd, idx, n)))
+		goto leave;
+	if ((rc = mdb_delta_flush(env, fd, idx, 0)))
+		goto leave;
+	rc = mdb_fd_write(fd, metas, NUM_METAS * psize);
+
+leave:
+	mdb_txn_abort(txn);
+	if (bfd != INVALID_HANDLE_VALUE)
+		(void) close(bfd);
+#ifdef _WIN32
+	if (buf) _aligned_free(buf);
+#else
+	free(buf);
+#endif
+	return rc;
+}
+
+int ESECT
+mdb_env_copy_delta(MDB_env *env, const char *base, const char *path)
+{
+	int rc;
+	MDB_name fname;
+	HANDLE newfd = INVALID_HANDLE_VALUE;
+
+	rc = mdb_fname_init(path, MDB_NOSUBDIR | MDB_NOLOCK, &fname);
+	if (rc == MDB_SUCCESS) {
+		rc = mdb_fopen(env, &fname, MDB_O_COPY, 0666, &newfd);
+		mdb_fname_destroy(fname);
+	}
+	if (rc == MDB_SUCCESS) {
+		rc = mdb_env_copyfd_delta(env, base, newfd);
+		if (close(newfd) < 0 && rc == MDB_SUCCESS)
+			rc = ErrCode();
+	}
+	return rc;
+}
+
+int ESECT
+mdb_env_apply_delta(MDB_env *env, HANDLE fd)
+{
+	MDB_delta hdr;
+	MDB_page *mp;
+	MDB_meta *m;
+	mdb_mutexref_t wmutex = NULL;
+	unsigned int psize = env->me_psize;
+	pgno_t *idx, i, j, n, nidx;
+	txnid_t txnid = 0;
+	char *buf;
+	int rc;
+
+	if (!(env->me_flags & MDB_ENV_ACTIVE))
+		return EINVAL;
+	if (env->me_flags & MDB_RDONLY)
+		return EACCES;
+	if (env->me_txn)
+		return EBUSY;
+
+	nidx = psize / sizeof(pgno_t) - 1;
+	if ((buf = malloc((nidx + 1) * (size_t)psize)) == NULL)
+		return ENOMEM;
+	idx = (pgno_t *)buf;
+
+	if (env->me_txns) {
+		MDB_reader *mr = env->me_txns->mti_readers;
+		wmutex = env->me_wmutex;
+		if (LOCK_MUTEX(rc, env, wmutex))
+			goto leave;
+		n = env->me_txns->mti_numreaders;
+		for (i = 0; i < n; i++) {
+			if (mr[i].mr_pid && mr[i].mr_txnid != (txnid_t)-1) {
+				rc = EBUSY;
+				goto leave;
+			}
+		}
+	}
+
+	if ((rc = mdb_fd_read(fd, buf, psize)))
+		goto leave;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.md_magic != MDB_DELTA_MAGIC || hdr.md_version != MDB_DELTA_VERSION ||
+		hdr.md_psize != psize) {
+		rc = MDB_INVALID;
+		goto leave;
+	}
+	if (hdr.md_base != mdb_env_pick_meta(env)->mm_txnid) {
+		rc = EINVAL;
+		goto leave;
+	}
+
+	for (;;) {
+		if ((rc = mdb_fd_read(fd, buf, psize)))
+			goto leave;
+		n = idx[0];
+		if (!n)
+			break;
+		if (n > nidx) {
+			rc = MDB_INVALID;
+			goto leave;
+		}
+		for (i = 1; i <= n; i++) {
+			if (idx[i] < NUM_METAS || idx[i] >= hdr.md_next_pgno ||
+				(i > 1 && idx[i] <= idx[i-1])) {
+				rc = MDB_INVALID;
+				goto leave;
+			}
+		}
+		if ((rc = mdb_fd_read(fd, buf + psize, n * (size_t)psize)))
+			goto leave;
+		for (i = 1; i <= n; i = j) {
+			for (j = i+1; j <= n && idx[j] == idx[j-1]+1; j++) ;
+			rc = mdb_fd_pwrite(env->me_fd, buf + i * psize,
+				(j - i) * (size_t)psize, (mdb_size_t)idx[i] * psize);
+			if (rc)
+				goto leave;
+		}
+	}
+
+	/* The new metas must not reach the disk before the pages they use */
+	if ((rc = mdb_fd_read(fd, buf, NUM_METAS * psize)))
+		goto leave;
+	for (i = 0; i < NUM_METAS; i++) {
+		mp = (MDB_page *)(buf + i * psize);
+		m = METADATA(mp);
+		if (mp->mp_pgno != i || !F_ISSET(mp->mp_flags, P_META) ||
+			m->mm_magic != MDB_MAGIC || !MDB_DATA_VERSION_OK(m->mm_version)) {
+			rc = MDB_INVALID;
+			goto leave;
+		}
+		if (txnid < m->mm_txnid)
+			txnid = m->mm_txnid;
+	}
+	if (txnid != hdr.md_txnid) {
+		rc = MDB_INVALID;
+		goto leave;
+	}
+	if (MDB_FDATASYNC(env->me_fd)) {
+		rc = ErrCode();
+		goto leave;
+	}
+	if ((rc = mdb_fd_pwrite(env->me_fd, buf, NUM_METAS * psize, 0)))
+		goto leave;
+	if (MDB_FDATASYNC(env->me_fd)) {
+		rc = ErrCode();
+		goto leave;
+	}
+	/* The next writer numbers its txn from here, and must not
+	 * overwrite the meta slot of the txn just applied.
+	 */
+	if (env->me_txns)
+		env->me_txns->mti_txnid = txnid;
+
+leave:
+	if (wmutex)
+		UNLOCK_MUTEX(wmutex);
+	free(buf);
+	return rc;
+}
+/** @} */
+
+/** @defgroup replica	Page-level replication
+ *	#mdb_txn_commit() hands the pages #mdb_page_flush() wrote, and the
+ *	new meta page, to the #MDB_commit_func set by #mdb_env_set_commit_hook().
+ *	#mdb_env_apply_pages() writes them into a plain copy of the environment
+ *	the same way a commit would: data pages first, then the meta page.
+ *	@{
+ */
+int ESECT
+mdb_env_set_commit_hook(MDB_env *env, MDB_commit_func *func, void *ctx)
+{
+	if (!env || !(env->me_flags & MDB_ENV_ACTIVE) || env->me_txn)
+		return EINVAL;
+#ifdef MDB_VL32
+	return MDB_INCOMPATIBLE;
+#endif
+
+	if (!func) {
+		mdb_midl_free(env->me_commit_pgs);
+		env->me_commit_pgs = NULL;
+	} else {
+		if (!env->me_commit_meta &&
+			(env->me_commit_meta = calloc(1, env->me_psize)) == NULL)
+			return ENOMEM;
+		if (!env->me_commit_pgs &&
+			(env->me_commit_pgs = mdb_midl_alloc(MDB_IDL_UM_MAX)) == NULL)
+			return ENOMEM;
+	}
+	env->me_commit_func = func;
+	env->me_commit_ctx = ctx;
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_apply_pages(MDB_env *env, mdb_size_t txnid,
+	MDB_pageset *pages, mdb_size_t count)
+{
+	MDB_meta meta;
+	MDB_page *mp;
+	mdb_mutexref_t wmutex = NULL;
+	unsigned int psize;
+	mdb_size_t i;
+	pgno_t last;
+	int rc = MDB_SUCCESS;
+
+	if (!env || !(env->me_flags & MDB_ENV_ACTIVE) || !pages || !count)
+		return EINVAL;
+	if (env->me_flags & MDB_RDONLY)
+		return EACCES;
+	if (MDB_ENV_FATAL(env))
+		return MDB_PANIC;
+#ifdef MDB_VL32
+	return MDB_INCOMPATIBLE;
+#endif
+	if (env->me_txn)
+		return EBUSY;
+
+	psize = env->me_psize;
+	mp = pages[count-1].ps_data;
+	memcpy(&meta, METADATA(mp), sizeof(meta));
+	if (pages[count-1].ps_count != 1 || mp->mp_pgno != pages[count-1].ps_pgno ||
+		mp->mp_pgno != (txnid & 1) || !F_ISSET(mp->mp_flags, P_META) ||
+		meta.mm_magic != MDB_MAGIC || !MDB_DATA_VERSION_OK(meta.mm_version) ||
+		meta.mm_txnid != txnid)
+		return MDB_INVALID;
+	if (meta.mm_psize != psize)
+		return EINVAL;
+	last = meta.mm_last_pg;
+	for (i = 0; i < count-1; i++) {
+		if (pages[i].ps_pgno < NUM_METAS || pages[i].ps_pgno > last ||
+			!pages[i].ps_count || pages[i].ps_count > last + 1 - pages[i].ps_pgno)
+			return MDB_INVALID;
+	}
+	if (last >= env->me_maxpg)
+		return MDB_MAP_FULL;
+
+	if (env->me_txns) {
+		if (LOCK_MUTEX(rc, env, env->me_wmutex))
+			return rc;
+		wmutex = env->me_wmutex;
+	}
+	if (txnid != mdb_env_pick_meta(env)->mm_txnid + 1) {
+		rc = EINVAL;
+		goto leave;
+	}
+	/* The pages are overwritten in place. That is safe for readers of
+	 * the last applied txn, as for the next writer in the primary.
+	 */
+	if (env->me_txns) {
+		MDB_reader *mr = env->me_txns->mti_readers;
+		unsigned int j, n = env->me_txns->mti_numreaders;
+		for (j = 0; j < n; j++) {
+			if (mr[j].mr_pid && mr[j].mr_txnid < txnid - 1) {
+				rc = EBUSY;
+				goto leave;
+			}
+		}
+	}
+
+	for (i = 0; i < count-1; i++) {
+		rc = mdb_fd_pwrite(env->me_fd, pages[i].ps_data,
+			pages[i].ps_count * psize, (mdb_size_t)pages[i].ps_pgno * psize);
+		if (rc)
+			goto leave;
+	}
+	/* The new meta must not reach the disk before the pages it uses */
+	if (!(env->me_flags & MDB_NOSYNC) && MDB_FDATASYNC(env->me_fd)) {
+		rc = ErrCode();
+		goto leave;
+	}
+	rc = mdb_env_write_meta0(env, &meta, env->me_flags);
+	if (rc)
+		env->me_flags |= MDB_FATAL_ERROR;
+	else if (env->me_txns)
+		env->me_txns->mti_txnid = txnid;
+
+leave:
+	if (wmutex)
+		UNLOCK_MUTEX(wmutex);
+	return rc;
+}
+/** @} */
+
+/** @defgroup shrink Online file shrinking
+ *	@ingroup internal
+ *	#mdb_env_shrink() walks every tree and copies the pages at or above
+ *	a ceiling, the number of pages in use, into free pages below it.
+ *	This is the same copy-on-write #mdb_page_touch() does for any
+ *	update, with #MDB_env.%me_pgceil making #mdb_page_alloc() pick the
+ *	lowest free pages. A later step, once no reader can see the old
+ *	copies, drops the free pages at the end of the file.
+ *	@{
+ */
+
+	/** Max nesting of trees: main DB, named DB, sorted-dup sub-DB */
+#define MDB_SHRINK_LEVELS	3
+
+	/** Dirty list entries left free for saving the freeDB on commit */
+#define MDB_SHRINK_DIRTY_ROOM	1024
+
+	/** State of one #mdb_env_shrink() step */
+typedef struct mdb_shrink {
+	MDB_txn		*ms_txn;
+	pgno_t		ms_ceil;		/**< move pages at or above this */
+	mdb_size_t	ms_moved;		/**< pages moved so far */
+	mdb_size_t	ms_max;			/**< pages to move in this step, or 0 */
+	/** freeDB records above the ceiling which the commit deletes */
+	unsigned	ms_freed;
+	/** Cursors of the nested trees being walked, outermost first */
+	MDB_cursor	*ms_mc[MDB_SHRINK_LEVELS];
+} mdb_shrink;
+
+/** Count the pages in the freeDB, and merge the records which
+ *	no reader can see into me_pghead as #mdb_page_alloc() does.
+ * @param[in] txn the write transaction.
+ * @param[out] nfree the number of free pages in the freeDB.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_shrink_load(MDB_txn *txn, pgno_t *nfree)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_cursor m2;
+	MDB_val key, data;
+	MDB_cursor_op op = MDB_FIRST;
+	txnid_t oldest = mdb_find_oldest(txn), id;
+	pgno_t *idl;
+	int rc, merge = 1;
+
+	env->me_pgoldest = oldest;
+	*nfree = 0;
+	mdb_cursor_init(&m2, txn, FREE_DBI, NULL);
+	while ((rc = mdb_cursor_get(&m2, &key, &data, op)) == MDB_SUCCESS) {
+		op = MDB_NEXT;
+		id = *(txnid_t *)key.mv_data;
+		if (id & MDB_RCL_BIT)
+			break;
+		idl = data.mv_data;
+		*nfree += idl[0];
+		/* Only a contiguous run from the oldest record can be taken */
+		if (!merge || id >= oldest) {
+			merge = 0;
+			continue;
+		}
+		if (!env->me_pghead) {
+			if (!(env->me_pghead = mdb_midl_alloc(idl[0])))
+				return ENOMEM;
+		} else if ((rc = mdb_midl_need(&env->me_pghead, idl[0])) != 0) {
+			return rc;
+		}
+		mdb_midl_xmerge(env->me_pghead, idl);
+		env->me_pglast = id;
+		env->me_pgrun_ok = 0;
+	}
+	return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+/** Count the free pages below the ceiling, including loose pages.
+ * @param[in] ms the shrink state.
+ * @return the number of single pages that can be moved.
+ */
+static unsigned
+mdb_shrink_room(mdb_shrink *ms)
+{
+	pgno_t *mop = ms->ms_txn->mt_env->me_pghead;
+	unsigned x, n = ms->ms_txn->mt_loose_count;
+
+	if (mop) {
+		x = mdb_midl_search(mop, ms->ms_ceil);
+		if (x <= mop[0])
+			n += mop[0] - x + (mop[x] != ms->ms_ceil);
+	}
+	return n;
+}
+
+/** Check for a run of free pages below a page.
+ *	Overflow pages may be moved above the ceiling when there is
+ *	no run below it, since moving them lower still lets the file
+ *	shrink further.
+ * @param[in] ms the shrink state.
+ * @param[in] num the length of the run.
+ * @param[in] pgno the first page the run must be below.
+ * @return 1 if #mdb_page_alloc() will find one, otherwise 0.
+ */
+static int
+mdb_shrink_run(mdb_shrink *ms, unsigned num, pgno_t pgno)
+{
+	pgno_t *mop = ms->ms_txn->mt_env->me_pghead;
+	unsigned i, n2 = num-1;
+
+	if (!mop)
+		return 0;
+	for (i = mop[0]; i > n2 && mop[i] + n2 < pgno; i--)
+		if (mop[i-n2] == mop[i] + n2)
+			return 1;
+	return 0;
+}
+
+/** Make the stack of a cursor writable, moving its pages below the ceiling.
+ *	The trees containing this one are touched first, and their nodes
+ *	updated with the new root of the tree inside them.
+ * @param[in] ms the shrink state.
+ * @param[in] lvl the nesting level of the cursor in #mdb_shrink.%ms_mc.
+ * @return 0 on success, #MDB_NOTFOUND to end the step, or another error.
+ */
+static int
+mdb_shrink_touch(mdb_shrink *ms, int lvl)
+{
+	MDB_cursor *mc, *pc;
+	MDB_node *node;
+	unsigned need = 0, moved = 0;
+	int i, l, rc;
+
+	for (l = 0; l <= lvl; l++) {
+		mc = ms->ms_mc[l];
+		for (i = 0; i < mc->mc_snum; i++) {
+			if (!(mc->mc_pg[i]->mp_flags & P_DIRTY)) {
+				need++;
+				if (mc->mc_pg[i]->mp_pgno >= ms->ms_ceil)
+					moved++;
+			}
+		}
+	}
+	if (need > mdb_shrink_room(ms) ||
+		need + MDB_SHRINK_DIRTY_ROOM > ms->ms_txn->mt_dirty_room)
+		return MDB_NOTFOUND;
+	for (l = 0; l <= lvl; l++) {
+		mc = ms->ms_mc[l];
+		if ((rc = mdb_cursor_touch(mc)) != MDB_SUCCESS)
+			return rc;
+		if (l) {
+			pc = ms->ms_mc[l-1];
+			node = NODEPTR(pc->mc_pg[pc->mc_top], pc->mc_ki[pc->mc_top]);
+			memcpy(NODEDATA(node), mc->mc_db, sizeof(MDB_db));
+		}
+	}
+	ms->ms_moved += moved;
+	if (ms->ms_max && ms->ms_moved >= ms->ms_max)
+		return MDB_NOTFOUND;
+	return MDB_SUCCESS;
+}
+
+/** Move the overflow pages of the current node lower in the file.
+ * @param[in] ms the shrink state.
+ * @param[in] lvl the nesting level of the cursor in #mdb_shrink.%ms_mc.
+ * @param[in] off where the run's page number is in the node's data.
+ * @return 0 on success, #MDB_NOTFOUND to end the step, or another error.
+ */
+static int
+mdb_shrink_ovpage(mdb_shrink *ms, int lvl, size_t off)
+{
+	MDB_cursor *mc = ms->ms_mc[lvl];
+	MDB_txn *txn = ms->ms_txn;
+	MDB_node *node;
+	MDB_page *omp, *np;
+	txnid_t id;
+	pgno_t pgno;
+	unsigned ovpages;
+	int rc;
+
+	node = NODEPTR(mc->mc_pg[mc->mc_top], mc->mc_ki[mc->mc_top]);
+	memcpy(&pgno, (char *)NODEDATA(node) + off, sizeof(pgno));
+	if (pgno < ms->ms_ceil)
+		return MDB_SUCCESS;
+	if ((rc = mdb_page_get(mc, pgno, &omp, NULL)) != MDB_SUCCESS)
+		return rc;
+	if (omp->mp_flags & P_DIRTY)
+		return MDB_SUCCESS;
+	ovpages = omp->mp_pages;
+	/* Leave the value where it is if there is no run to put it in */
+	if (!mdb_shrink_run(ms, ovpages, pgno))
+		return MDB_SUCCESS;
+	if (mc->mc_dbi == FREE_DBI) {
+		memcpy(&id, NODEKEY(node), sizeof(id));
+		if (id <= txn->mt_env->me_pglast) {
+			/* Merged into me_pghead, so the commit deletes it */
+			ms->ms_freed++;
+			return MDB_SUCCESS;
+		}
+	}
+	if ((rc = mdb_shrink_touch(ms, lvl)) != MDB_SUCCESS)
+		return rc;
+	if (!mdb_shrink_run(ms, ovpages, pgno))
+		return MDB_SUCCESS;
+	if ((rc = mdb_page_alloc(mc, ovpages, &np)) != MDB_SUCCESS)
+		return rc;
+	pgno = np->mp_pgno;
+	memcpy(np, omp, (size_t)txn->mt_env->me_psize * ovpages);
+	np->mp_pgno = pgno;
+	np->mp_flags |= P_DIRTY;
+	node = NODEPTR(mc->mc_pg[mc->mc_top], mc->mc_ki[mc->mc_top]);
+	memcpy((char *)NODEDATA(node) + off, &pgno, sizeof(pgno));
+	if ((rc = mdb_midl_append_range(&txn->mt_free_pgs, omp->mp_pgno, ovpages)))
+		return rc;
+	ms->ms_moved += ovpages;
+	if (ms->ms_max && ms->ms_moved >= ms->ms_max)
+		return MDB_NOTFOUND;
+	return MDB_SUCCESS;
+}
+
+/** Walk a tree and move its pages below the ceiling.
+ *	Trees stored inside its nodes are walked as they are found.
+ * @param[in] ms the shrink state.
+ * @param[in] lvl the nesting level of the tree's cursor.
+ * @return 0 on success, #MDB_NOTFOUND to end the step, or another error.
+ */
+static int
+mdb_shrink_walk(mdb_shrink *ms, int lvl)
+{
+	MDB_cursor *mc = ms->ms_mc[lvl];
+	MDB_xcursor mx, *mx0 = mc->mc_xcursor;
+	MDB_page *mp;
+	MDB_node *node;
+	unsigned i;
+	int rc;
+
+	rc = mdb_page_search(mc, NULL, MDB_PS_FIRST);
+	if (rc)
+		return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+	for (;;) {
+		for (i = 0; i < mc->mc_snum; i++) {
+			if (mc->mc_pg[i]->mp_pgno >= ms->ms_ceil) {
+				if ((rc = mdb_shrink_touch(ms, lvl)) != MDB_SUCCESS)
+					return rc;
+				break;
+			}
+		}
+		mp = mc->mc_pg[mc->mc_top];
+		for (i = 0; !IS_LEAF2(mp) && i < NUMKEYS(mp); i++) {
+			mc->mc_ki[mc->mc_top] = i;
+			node = NODEPTR(mp, i);
+			if (node->mn_flags & F_BIGDATA) {
+				rc = mdb_shrink_ovpage(ms, lvl, 0);
+			} else if (node->mn_flags & F_SEGMENTS) {
+				MDB_seghead sh;
+				unsigned j;
+				memcpy(&sh, NODEDATA(node), SEGHDRSZ);
+				for (j = 0; j < sh.sh_count && !rc; j++)
+					rc = mdb_shrink_ovpage(ms, lvl, SEGTABSZ(j));
+			} else if (node->mn_flags & F_SUBDATA) {
+				if (lvl+1 >= MDB_SHRINK_LEVELS)
+					return MDB_CORRUPTED;
+				mc->mc_xcursor = &mx;
+				mdb_xcursor_init0(mc);
+				mdb_xcursor_init1(mc, node);
+				ms->ms_mc[lvl+1] = &mx.mx_cursor;
+				rc = mdb_shrink_walk(ms, lvl+1);
+				mc->mc_xcursor = mx0;
+			}
+			if (rc)
+				return rc;
+			mp = mc->mc_pg[mc->mc_top];
+		}
+		rc = mdb_cursor_sibling(mc, 1);
+		if (rc)
+			return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+	}
+}
+
+/** Truncate the data file to the pages in use, if no reader may
+ *	still see an older snapshot with more pages.
+ * @param[in] txn a write transaction, which keeps other writers out.
+ * @return 0 if the file was truncated, #MDB_NOTFOUND if not, or an error.
+ */
+static int
+mdb_shrink_trunc(MDB_txn *txn)
+{
+#if defined(_WIN32)
+	/* The file can't be truncated while it is mapped */
+	(void) txn;
+	return MDB_NOTFOUND;
+#else
+	MDB_env *env = txn->mt_env;
+	mdb_size_t size, fsize = 0;
+	int rc;
+
+	if (env->me_flags & MDB_WRITEMAP)
+		return MDB_NOTFOUND;
+	if (mdb_find_oldest(txn) < txn->mt_txnid - 1)
+		return MDB_NOTFOUND;
+	size = (mdb_size_t)txn->mt_next_pgno * env->me_psize;
+	if ((rc = mdb_fsize(env->me_fd, &fsize)) != MDB_SUCCESS)
+		return rc;
+	if (fsize <= size)
+		return MDB_NOTFOUND;
+	if (ftruncate(env->me_fd, size) < 0)
+		return ErrCode();
+	return MDB_SUCCESS;
+#endif
+}
+
+int ESECT
+mdb_env_shrink(MDB_env *env, mdb_size_t maxpages, mdb_size_t *moved)
+{
+	MDB_txn *txn;
+	MDB_cursor mc;
+	mdb_shrink ms;
+	pgno_t nfree, *mop;
+	unsigned i;
+	int rc, rc2, done, advanced = 0;
+
+	if (moved)
+		*moved = 0;
+	if (!env)
+		return EINVAL;
+	if (env->me_flags & MDB_RDONLY)
+		return EACCES;
+#ifdef MDB_VL32
+	return MDB_INCOMPATIBLE;
+#endif
+
+	if ((rc = mdb_txn_begin(env, NULL, 0, &txn)) != MDB_SUCCESS)
+		return rc;
+	/* Catch up with a previous step which could not truncate the file */
+	rc2 = mdb_shrink_trunc(txn);
+	if (rc2 && rc2 != MDB_NOTFOUND) {
+		rc = rc2;
+		goto fail;
+	}
+	done = !rc2;
+
+	for (;;) {
+		if ((rc = mdb_shrink_load(txn, &nfree)) != MDB_SUCCESS)
+			goto fail;
+		if (advanced || nfree == (env->me_pghead ? env->me_pghead[0] : 0))
+			break;
+		/* Some free pages are not reusable yet. When they were freed
+		 * by the last commit, usually the previous step, an empty
+		 * commit makes them reusable unless a reader is still on
+		 * that snapshot. It saves the freeDB from the pages already
+		 * loaded, the lowest first, so it can't undo the last step
+		 * by moving the freeDB back to the pages it just left.
+		 */
+		txn->mt_flags |= MDB_TXN_DIRTY;
+		if ((rc = mdb_txn_commit(txn)) != MDB_SUCCESS)
+			return rc;
+		if ((rc = mdb_txn_begin(env, NULL, 0, &txn)) != MDB_SUCCESS)
+			return rc;
+		advanced = 1;
+	}
+	if (!env->me_pghead) {
+		mdb_txn_abort(txn);
+		if (done)
+			return MDB_SUCCESS;
+		return nfree ? EBUSY : MDB_NOTFOUND;
+	}
+	ms.ms_txn = txn;
+	ms.ms_ceil = txn->mt_next_pgno - nfree;
+	ms.ms_moved = 0;
+	ms.ms_max = maxpages;
+	ms.ms_freed = 0;
+	env->me_pgceil = ms.ms_ceil;
+	for (i = FREE_DBI; i <= MAIN_DBI && !rc; i++) {
+		mdb_cursor_init(&mc, txn, i, NULL);
+		ms.ms_mc[0] = &mc;
+		rc = mdb_shrink_walk(&ms, 0);
+	}
+	if (rc && rc != MDB_NOTFOUND)
+		goto fail;
+
+	/* Drop the free pages at the end of the file */
+	mop = env->me_pghead;
+	for (i = 1; i <= mop[0] && mop[i] == txn->mt_next_pgno-1; i++)
+		txn->mt_next_pgno--;
+	if (i > 1) {
+		memmove(mop+1, mop+i, (mop[0] - i + 1) * sizeof(pgno_t));
+		mop[0] -= i - 1;
+		env->me_pgrun_ok = 0;
+	} else if (!ms.ms_moved && !ms.ms_freed) {
+		/* Don't rewrite the freeDB for nothing */
+		env->me_pgceil = 0;
+		mdb_txn_abort(txn);
+		return done ? MDB_SUCCESS : MDB_NOTFOUND;
+	}
+	/* The freeDB is saved into the lowest free pages, too.
+	 * It must be saved even if no page was moved.
+	 */
+	txn->mt_flags |= MDB_TXN_DIRTY;
+	rc = mdb_txn_commit(txn);
+	env->me_pgceil = 0;
+	if (rc)
+		return rc;
+	if (moved)
+		*moved = ms.ms_moved;
+
+	if (i > 1) {
+		if ((rc = mdb_txn_begin(env, NULL, 0, &txn)) != MDB_SUCCESS)
+			return rc;
+		rc = mdb_shrink_trunc(txn);
+		mdb_txn_abort(txn);
+		if (rc && rc != MDB_NOTFOUND)
+			return rc;
+	}
+	return MDB_SUCCESS;
+
+fail:
+	env->me_pgceil = 0;
+	mdb_txn_abort(txn);
+	return rc;
+}
+/** @} */
+
+int ESECT
+mdb_env_set_flags(MDB_env *env, unsigned int flag, int onoff)
+{
+	if (flag & ~CHANGEABLE)
+		return EINVAL;
+	if (onoff)
+		env->me_flags |= flag;
+	else
+		env->me_flags &= ~flag;
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_get_flags(MDB_env *env, unsigned int *arg)
+{
+	if (!env || !arg)
+		return EINVAL;
+
+	*arg = env->me_flags & (CHANGEABLE|CHANGELESS);
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_set_userctx(MDB_env *env, void *ctx)
+{
+	if (!env)
+		return EINVAL;
+	env->me_userctx = ctx;
+	return MDB_SUCCESS;
+}
+
+void * ESECT
+mdb_env_get_userctx(MDB_env *env)
+{
+	return env ? env->me_userctx : NULL;
+}
+
+int ESECT
+mdb_env_set_assert(MDB_env *env, MDB_assert_func *func)
+{
+	if (!env)
+		return EINVAL;
+#ifndef NDEBUG
+	env->me_assert_func = func;
+#endif
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_get_path(MDB_env *env, const char **arg)
+{
+	if (!env || !arg)
+		return EINVAL;
+
+	*arg = env->me_path;
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_get_fd(MDB_env *env, mdb_filehandle_t *arg)
+{
+	if (!env || !arg)
+		return EINVAL;
+
+	*arg = env->me_fd;
+	return MDB_SUCCESS;
+}
+
+/** Common code for #mdb_stat() and #mdb_env_stat().
+ * @param[in] env the environment to operate in.
+ * @param[in] db the #MDB_db record containing the stats to return.
+ * @param[out] arg the address of an #MDB_stat structure to receive the stats.
+ * @return 0, this function always succeeds.
+ */
+static int ESECT
+mdb_stat0(MDB_env *env, MDB_db *db, MDB_stat *arg)
+{
+	arg->ms_psize = env->me_psize;
+	arg->ms_depth = db->md_depth;
+	arg->ms_branch_pages = db->md_branch_pages;
+	arg->ms_leaf_pages = db->md_leaf_pages;
+	arg->ms_overflow_pages = db->md_overflow_pages;
+	arg->ms_entries = db->md_entries;
+
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_stat(MDB_env *env, MDB_stat *arg)
+{
+	MDB_meta *meta;
+
+	if (env == NULL || arg == NULL)
+		return EINVAL;
+
+	meta = mdb_env_pick_meta(env);
+
+	return mdb_stat0(env, &meta->mm_dbs[MAIN_DBI], arg);
+}
+
+int ESECT
+mdb_env_info(MDB_env *env, MDB_envinfo *arg)
+{
+	MDB_meta *meta;
+
+	if (env == NULL || arg == NULL)
+		return EINVAL;
+
+	meta = mdb_env_pick_meta(env);
+	arg->me_mapaddr = meta->mm_address;
+	arg->me_last_pgno = meta->mm_last_pg;
+	arg->me_last_txnid = meta->mm_txnid;
+
+	arg->me_mapsize = env->me_mapsize;
+	arg->me_maxreaders = env->me_maxreaders;
+	arg->me_numreaders = env->me_txns ? env->me_txns->mti_numreaders : 0;
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_metrics(MDB_env *env, MDB_metrics *arg)
+{
+	if (env == NULL || arg == NULL || !(env->me_flags & MDB_ENV_ACTIVE))
+		return EINVAL;
+
+	*arg = env->me_metrics;
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_rpage_info(MDB_env *env, MDB_rpageinfo *arg)
+{
+	if (env == NULL || arg == NULL)
+		return EINVAL;
+
+	memset(arg, 0, sizeof(*arg));
+#ifdef MDB_VL32
+	if (env->me_rphash) {
+		unsigned i;
+		for (i=0; i<MDB_RPLOCKS; i++) {
+			pthread_mutex_lock(&env->me_rplocks[i].rl_mutex);
+			arg->mr_hits += env->me_rplocks[i].rl_hits;
+			arg->mr_misses += env->me_rplocks[i].rl_misses;
+			pthread_mutex_unlock(&env->me_rplocks[i].rl_mutex);
+		}
+		pthread_mutex_lock(&env->me_rpmutex);
+		arg->mr_evicts = env->me_rpevicts;
+		arg->mr_mapped = env->me_rpbytes;
+		pthread_mutex_unlock(&env->me_rpmutex);
+	}
+	arg->mr_budget = env->me_rpbudget;
+#endif
+	return MDB_SUCCESS;
+}
+
+/** Set the default comparison functions for a database.
+ * Called immediately after a database is opened to set the defaults.
+ * The user can then override them with #mdb_set_compare() or
+ * #mdb_set_dupsort().
+ * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+ * @param[in] dbi A database handle returned by #mdb_dbi_open()
+ */
+static void
+mdb_default_cmp(MDB_txn *txn, MDB_dbi dbi)
+{
+	uint16_t f = txn->mt_dbs[dbi].md_flags;
+
+	txn->mt_dbxs[dbi].md_cmp =
+		(f & MDB_REVERSEKEY) ? mdb_cmp_memnr :
+		(f & MDB_INTEGERKEY) ? mdb_cmp_cint  : mdb_cmp_memn;
+
+	txn->mt_dbxs[dbi].md_dcmp =
+		!(f & MDB_DUPSORT) ? 0 :
+		((f & MDB_INTEGERDUP)
+		 ? ((f & MDB_DUPFIXED)   ? mdb_cmp_int   : mdb_cmp_cint)
+		 : ((f & MDB_REVERSEDUP) ? mdb_cmp_memnr : mdb_cmp_memn));
+
+	txn->mt_dbxs[dbi].md_search = NULL;
+	txn->mt_dbxs[dbi].md_dsearch = NULL;
+}
+
+int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *dbi)
+{
+	MDB_val key, data;
+	MDB_dbi i;
+	MDB_cursor mc;
+	MDB_db dummy;
+	int rc, dbflag, exact;
+	unsigned int unused = 0, seq;
+	char *namedup;
+	size_t len;
+
+	if (flags & ~VALID_FLAGS)
+		return EINVAL;
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	/* main DB? */
+	if (!name) {
+		*dbi = MAIN_DBI;
+		if (flags & PERSISTENT_FLAGS) {
+			uint16_t f2 = flags & PERSISTENT_FLAGS;
+			/* make sure flag changes get committed */
+			if ((txn->mt_dbs[MAIN_DBI].md_flags | f2) != txn->mt_dbs[MAIN_DBI].md_flags) {
+				txn->mt_dbs[MAIN_DBI].md_flags |= f2;
+				txn->mt_flags |= MDB_TXN_DIRTY;
+			}
+		}
+		mdb_default_cmp(txn, MAIN_DBI);
+		return MDB_SUCCESS;
+	}
+
+	if (txn->mt_dbxs[MAIN_DBI].md_cmp == NULL) {
+		mdb_default_cmp(txn, MAIN_DBI);
+	}
+
+	/* Is the DB already open? */
+	len = strlen(name);
+	for (i=CORE_DBS; i<txn->mt_numdbs; i++) {
+		if (!txn->mt_dbxs[i].md_name.mv_size) {
+			/* Remember this free slot */
+			if (!unused) unused = i;
+			continue;
+		}
+		if (len == txn->mt_dbxs[i].md_name.mv_size &&
+			!strncmp(name, txn->mt_dbxs[i].md_name.mv_data, len)) {
+			*dbi = i;
+			return MDB_SUCCESS;
+		}
+	}
+
+	/* If no free slot and max hit, fail */
+	if (!unused && txn->mt_numdbs >= txn->mt_env->me_maxdbs)
+		return MDB_DBS_FULL;
+
+	/* Cannot mix named databases with some mainDB flags */
+	if (txn->mt_dbs[MAIN_DBI].md_flags & (MDB_DUPSORT|MDB_INTEGERKEY))
+		return (flags & MDB_CREATE) ? MDB_INCOMPATIBLE : MDB_NOTFOUND;
+
+	/* Find the DB info */
+	dbflag = DB_NEW|DB_VALID|DB_USRVALID;
+	exact = 0;
+	key.mv_size = len;
+	key.mv_data = (void *)name;
+	mdb_cursor_init(&mc, txn, MAIN_DBI, NULL);
+	rc = mdb_cursor_set(&mc, &key, &data, MDB_SET, &exact);
+	if (rc == MDB_SUCCESS) {
+		/* make sure this is actually a DB */
+		MDB_node *node = NODEPTR(mc.mc_pg[mc.mc_top], mc.mc_ki[mc.mc_top]);
+		if ((node->mn_flags & (F_DUPDATA|F_SUBDATA)) != F_SUBDATA)
+			return MDB_INCOMPATIBLE;
+	} else {
+		if (rc != MDB_NOTFOUND || !(flags & MDB_CREATE))
+			return rc;
+		if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY))
+			return EACCES;
+	}
+
+	/* Done here so we cannot fail after creating a new DB */
+	if ((namedup = strdup(name)) == NULL)
+		return ENOMEM;
+
+	if (rc) {
+		/* MDB_NOTFOUND and MDB_CREATE: Create new DB */
+		data.mv_size = sizeof(MDB_db);
+		data.mv_data = &dummy;
+		memset(&dummy, 0, sizeof(dummy));
+		dummy.md_root = P_INVALID;
+		dummy.md_flags = flags & PERSISTENT_FLAGS;
+		WITH_CURSOR_TRACKING(mc,
+			rc = mdb_cursor_put(&mc, &key, &data, F_SUBDATA));
+		dbflag |= DB_DIRTY;
 	}
-	if (wmutex)
-		UNLOCK_MUTEX(wmutex);
 
-	if (rc)
-		goto leave;
+	if (rc) {
+		free(namedup);
+	} else {
+		/* Got info, register DBI in this txn */
+		unsigned int slot = unused ? unused : txn->mt_numdbs;
+		txn->mt_dbxs[slot].md_name.mv_data = namedup;
+		txn->mt_dbxs[slot].md_name.mv_size = len;
+		txn->mt_dbxs[slot].md_rel = NULL;
+		txn->mt_dbxs[slot].md_enc = NULL;
+		txn->mt_dbxs[slot].md_dec = NULL;
+		txn->mt_dbflags[slot] = dbflag;
+		/* txn-> and env-> are the same in read txns, use
+		 * tmp variable to avoid undefined assignment
+		 */
+		seq = ++txn->mt_env->me_dbiseqs[slot];
+		txn->mt_dbiseqs[slot] = seq;
 
-	w3 = txn->mt_next_pgno * env->me_psize;
-	{
-		mdb_size_t fsize = 0;
-		if ((rc = mdb_fsize(env->me_fd, &fsize)))
-			goto leave;
-		if (w3 > fsize)
-			w3 = fsize;
-	}
-	wsize = w3 - wsize;
-	while (wsize > 0) {
-		if (wsize > MAX_WRITE)
-			w2 = MAX_WRITE;
-		else
-			w2 = wsize;
-		DO_WRITE(rc, fd, ptr, w2, len);
-		if (!rc) {
-			rc = ErrCode();
-			break;
-		} else if (len > 0) {
-			rc = MDB_SUCCESS;
-			ptr += len;
-			wsize -= len;
-			continue;
-		} else {
-			rc = EIO;
-			break;
+		memcpy(&txn->mt_dbs[slot], data.mv_data, sizeof(MDB_db));
+		*dbi = slot;
+		mdb_default_cmp(txn, slot);
+		if (!unused) {
+			txn->mt_numdbs++;
 		}
 	}
 
-leave:
-	mdb_txn_abort(txn);
 	return rc;
 }
 
 int ESECT
-mdb_env_copyfd2(MDB_env *env, HANDLE fd, unsigned int flags)
+mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *arg)
 {
-	if (flags & MDB_CP_COMPACT)
-		return mdb_env_copyfd1(env, fd);
-	else
-		return mdb_env_copyfd0(env, fd);
+	if (!arg || !TXN_DBI_EXIST(txn, dbi, DB_VALID))
+		return EINVAL;
+
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	if (txn->mt_dbflags[dbi] & DB_STALE) {
+		MDB_cursor mc;
+		MDB_xcursor mx;
+		/* Stale, must read the DB's root. cursor_init does it for us. */
+		mdb_cursor_init(&mc, txn, dbi, &mx);
+	}
+	return mdb_stat0(txn->mt_env, &txn->mt_dbs[dbi], arg);
 }
 
-int ESECT
-mdb_env_copyfd(MDB_env *env, HANDLE fd)
+/** Find where a key falls in a DB, for #mdb_estimate_range().
+ * @param[in] mc an initialized cursor for the DB.
+ * @param[in] key the key, or NULL for the start or end of the DB.
+ * @param[in] flags #MDB_PS_FIRST or #MDB_PS_LAST, for a NULL key.
+ * @param[out] pos the fraction of the DB's keys that sort before key.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_estimate_pos(MDB_cursor *mc, MDB_val *key, int flags, double *pos)
 {
-	return mdb_env_copyfd2(env, fd, 0);
+	double span = 1.0, f = 0.0;
+	unsigned i;
+	int rc, exact;
+
+	if ((rc = mdb_page_search(mc, key, key ? 0 : flags)) != 0)
+		return rc;
+	if (key)
+		mdb_node_search(mc, key, &exact);
+	else
+		mc->mc_ki[mc->mc_top] = flags == MDB_PS_LAST ?
+			NUMKEYS(mc->mc_pg[mc->mc_top]) : 0;
+	/* Each level narrows the span of the page above by its fanout */
+	for (i = 0; i < mc->mc_snum; i++) {
+		span /= NUMKEYS(mc->mc_pg[i]);
+		f += mc->mc_ki[i] * span;
+	}
+	*pos = f;
+	return MDB_SUCCESS;
 }
 
-int ESECT
-mdb_env_copy2(MDB_env *env, const char *path, unsigned int flags)
+int
+mdb_estimate_range(MDB_txn *txn, MDB_dbi dbi, MDB_val *lo, MDB_val *hi,
+	mdb_size_t *entries, mdb_size_t *pages)
 {
+	MDB_cursor mc, m2;
+	MDB_xcursor mx, mx2;
+	MDB_db *db;
+	double plo, phi, n;
+	mdb_size_t ne = 0, np = 0;
 	int rc;
-	MDB_name fname;
-	HANDLE newfd = INVALID_HANDLE_VALUE;
 
-	rc = mdb_fname_init(path, env->me_flags | MDB_NOLOCK, &fname);
-	if (rc == MDB_SUCCESS) {
-		rc = mdb_fopen(env, &fname, MDB_O_COPY, 0666, &newfd);
-		mdb_fname_destroy(fname);
+	if (!TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	mdb_cursor_init(&m2, txn, dbi, &mx2);
+	db = mc.mc_db;
+	rc = mdb_estimate_pos(&mc, lo, MDB_PS_FIRST, &plo);
+	if (rc == MDB_SUCCESS)
+		rc = mdb_estimate_pos(&m2, hi, MDB_PS_LAST, &phi);
+	if (rc == MDB_NOTFOUND) {
+		/* Empty DB */
+		rc = MDB_SUCCESS;
+		goto done;
 	}
-	if (rc == MDB_SUCCESS) {
-		rc = mdb_env_copyfd2(env, newfd, flags);
-		if (close(newfd) < 0 && rc == MDB_SUCCESS)
-			rc = ErrCode();
+	if (rc)
+		goto done;
+	if (phi <= plo)
+		goto done;
+	n = phi - plo;
+	ne = (mdb_size_t)(n * db->md_entries + 0.5);
+	np = (mdb_size_t)(n * (db->md_leaf_pages + db->md_overflow_pages) + 0.5);
+	if (mc.mc_pg[mc.mc_top] == m2.mc_pg[m2.mc_top]) {
+		/* Both bounds on one leaf: count its nodes exactly */
+		if (!(db->md_flags & MDB_DUPSORT))
+			ne = m2.mc_ki[m2.mc_top] - mc.mc_ki[mc.mc_top];
+		if (!np)
+			np = 1;
+	} else if (np < 2) {
+		np = 2;
 	}
+
+done:
+	if (entries)
+		*entries = ne;
+	if (pages)
+		*pages = np;
+	MDB_CURSOR_UNREF(&mc, 1);
+	MDB_CURSOR_UNREF(&m2, 1);
 	return rc;
 }
 
-int ESECT
-mdb_env_copy(MDB_env *env, const char *path)
-{
-	return mdb_env_copy2(env, path, 0);
-}
+	/** A branch page entry for #mdb_range_split(): the child page,
+	 *	and the first key that can be in it, if not the DB's first.
+	 */
+typedef struct MDB_rsplit {
+	pgno_t	rs_pgno;
+	MDB_val	rs_key;
+} MDB_rsplit;
 
-int ESECT
-mdb_env_set_flags(MDB_env *env, unsigned int flag, int onoff)
+int
+mdb_range_split(MDB_txn *txn, MDB_dbi dbi, unsigned int n, MDB_val *keys,
+	unsigned int *count)
 {
-	if (flag & ~CHANGEABLE)
-		return EINVAL;
-	if (onoff)
-		env->me_flags |= flag;
-	else
-		env->me_flags &= ~flag;
-	return MDB_SUCCESS;
-}
+	MDB_cursor mc;
+	MDB_xcursor mx;
+	MDB_page *mp;
+	MDB_node *ni;
+	MDB_rsplit *cur = NULL, *next = NULL, *tmp;
+	unsigned i, j, k, m = 0, mnext, max = 0, level;
+	int rc = MDB_SUCCESS;
 
-int ESECT
-mdb_env_get_flags(MDB_env *env, unsigned int *arg)
-{
-	if (!env || !arg)
+	if (!count || (n > 1 && !keys) || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
 		return EINVAL;
 
-	*arg = env->me_flags & (CHANGEABLE|CHANGELESS);
-	return MDB_SUCCESS;
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	*count = 0;
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	if (n < 2 || mc.mc_db->md_depth < 2)
+		return MDB_SUCCESS;
+
+	/* Widen the set of subtrees one branch level at a time, until
+	 * there are enough of them or the next level is the leaves.
+	 * Fewer than n pages are read on each level but the last.
+	 */
+	if (!(cur = malloc(sizeof(MDB_rsplit))))
+		return ENOMEM;
+	cur[0].rs_pgno = mc.mc_db->md_root;
+	cur[0].rs_key.mv_size = 0;
+	cur[0].rs_key.mv_data = NULL;
+	m = 1;
+	for (level = 1; m < n && level < mc.mc_db->md_depth; level++) {
+		mnext = 0;
+		for (i = 0; i < m; i++) {
+			if ((rc = mdb_page_get(&mc, cur[i].rs_pgno, &mp, NULL)) != 0)
+				goto done;
+			k = NUMKEYS(mp);
+			if (mnext + k > max) {
+				max = (mnext + k) * 2;
+				if (!(tmp = realloc(next, max * sizeof(MDB_rsplit)))) {
+					rc = ENOMEM;
+					goto done;
+				}
+				next = tmp;
+			}
+			for (j = 0; j < k; j++) {
+				ni = NODEPTR(mp, j);
+				next[mnext].rs_pgno = NODEPGNO(ni);
+				if (j) {
+					next[mnext].rs_key.mv_size = NODEKSZ(ni);
+					next[mnext].rs_key.mv_data = NODEKEY(ni);
+				} else {
+					next[mnext].rs_key = cur[i].rs_key;
+				}
+				mnext++;
+			}
+		}
+		tmp = cur; cur = next; next = tmp;
+		m = mnext;
+		max = 0;
+		free(next);
+		next = NULL;
+	}
+
+	/* Split the subtrees of the last level read into n equal groups */
+	if (m > n) {
+		for (i = 1; i < n; i++)
+			keys[i-1] = cur[(mdb_size_t)i * m / n].rs_key;
+		*count = n - 1;
+	} else {
+		for (i = 1; i < m; i++)
+			keys[i-1] = cur[i].rs_key;
+		*count = m - 1;
+	}
+
+done:
+	free(cur);
+	free(next);
+	return rc;
 }
 
-int ESECT
-mdb_env_set_userctx(MDB_env *env, void *ctx)
+	/** Ranges per thread in #mdb_range_scan(), to even out their sizes */
+#ifndef MDB_SCAN_PER_THREAD
+#define MDB_SCAN_PER_THREAD	4
+#endif
+
+	/** State shared by the threads of #mdb_range_scan(). */
+typedef struct mdb_rscan {
+	MDB_range_func	*rs_func;
+	void		*rs_ctx;
+	MDB_val		*rs_keys;		/**< the range boundaries */
+	unsigned	rs_nranges;		/**< number of ranges */
+	unsigned	rs_next;		/**< next range to claim */
+	int			rs_rc;			/**< first error, stops the scan */
+#ifdef MDB_THREADS
+	pthread_mutex_t	rs_mutex;	/**< protects #rs_next and #rs_rc */
+#endif
+} mdb_rscan;
+
+	/** Run #mdb_range_scan() callbacks on ranges until there are none left.
+	 * @param[in] rs the scan state.
+	 * @param[in] mc the cursor to hand to the callback.
+	 * @return 0 on success, non-zero on failure.
+	 */
+static int
+mdb_range_scan0(mdb_rscan *rs, MDB_cursor *mc)
 {
-	if (!env)
-		return EINVAL;
-	env->me_userctx = ctx;
-	return MDB_SUCCESS;
+	unsigned i;
+	int rc;
+
+	for (;;) {
+#ifdef MDB_THREADS
+		pthread_mutex_lock(&rs->rs_mutex);
+#endif
+		i = rs->rs_rc ? rs->rs_nranges : rs->rs_next++;
+#ifdef MDB_THREADS
+		pthread_mutex_unlock(&rs->rs_mutex);
+#endif
+		if (i >= rs->rs_nranges)
+			return MDB_SUCCESS;
+		rc = rs->rs_func(mc, i ? &rs->rs_keys[i-1] : NULL,
+			i < rs->rs_nranges-1 ? &rs->rs_keys[i] : NULL, rs->rs_ctx);
+		if (rc) {
+#ifdef MDB_THREADS
+			pthread_mutex_lock(&rs->rs_mutex);
+#endif
+			if (!rs->rs_rc)
+				rs->rs_rc = rc;
+#ifdef MDB_THREADS
+			pthread_mutex_unlock(&rs->rs_mutex);
+#endif
+			return rc;
+		}
+	}
 }
 
-void * ESECT
-mdb_env_get_userctx(MDB_env *env)
+#ifdef MDB_THREADS
+	/** A worker thread of #mdb_range_scan(). */
+typedef struct mdb_rscan_thr {
+	mdb_rscan	*rt_scan;
+	MDB_cursor	*rt_cursor;
+} mdb_rscan_thr;
+
+static THREAD_RET CALL_CONV
+mdb_range_scanthr(void *arg)
 {
-	return env ? env->me_userctx : NULL;
+	mdb_rscan_thr *rt = arg;
+
+	mdb_range_scan0(rt->rt_scan, rt->rt_cursor);
+	return (THREAD_RET)0;
 }
+#endif
 
-int ESECT
-mdb_env_set_assert(MDB_env *env, MDB_assert_func *func)
+int
+mdb_range_scan(MDB_txn *txn, MDB_dbi dbi, unsigned int nthreads,
+	MDB_range_func *func, void *ctx)
 {
-	if (!env)
-		return EINVAL;
-#ifndef NDEBUG
-	env->me_assert_func = func;
+	mdb_rscan rs;
+	MDB_cursor *mc = NULL;
+	unsigned n;
+	int rc;
+#ifdef MDB_THREADS
+	mdb_rscan_thr *rt = NULL;
+	mdb_threads th;
+	unsigned i;
 #endif
-	return MDB_SUCCESS;
-}
 
-int ESECT
-mdb_env_get_path(MDB_env *env, const char **arg)
-{
-	if (!env || !arg)
+	if (!func || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
 		return EINVAL;
 
-	*arg = env->me_path;
-	return MDB_SUCCESS;
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	/* Cursors of a write txn are tied to it, and values decompressed
+	 * by #mdb_set_codec() are freed through a list in the txn.
+	 * Neither can be shared between threads.
+	 */
+	if (!nthreads || !F_ISSET(txn->mt_flags, MDB_TXN_RDONLY) ||
+		txn->mt_dbxs[dbi].md_dec)
+		nthreads = 1;
+#ifndef MDB_THREADS
+	nthreads = 1;
+#endif
+
+	memset(&rs, 0, sizeof(rs));
+	rs.rs_func = func;
+	rs.rs_ctx = ctx;
+	n = nthreads > 1 ? nthreads * MDB_SCAN_PER_THREAD : 1;
+	if (!(rs.rs_keys = malloc(n * sizeof(MDB_val))))
+		return ENOMEM;
+	if ((rc = mdb_range_split(txn, dbi, n, rs.rs_keys, &n)) != 0)
+		goto leave;
+	rs.rs_nranges = n + 1;
+	if (nthreads > rs.rs_nranges)
+		nthreads = rs.rs_nranges;
+
+	/* Open all the cursors here, the DB's root may need reading */
+	if ((rc = mdb_cursor_open(txn, dbi, &mc)) != 0)
+		goto leave;
+#ifdef MDB_THREADS
+	if (nthreads > 1) {
+		if (!(rt = calloc(nthreads - 1, sizeof(mdb_rscan_thr)))) {
+			rc = ENOMEM;
+			goto leave;
+		}
+		for (i = 0; i < nthreads - 1; i++) {
+			rt[i].rt_scan = &rs;
+			if ((rc = mdb_cursor_open(txn, dbi, &rt[i].rt_cursor)) != 0)
+				goto leave;
+		}
+		if ((rc = pthread_mutex_init(&rs.rs_mutex, NULL)) != 0)
+			goto leave;
+		mdb_threads_start(&th, nthreads - 1, mdb_range_scanthr,
+			rt, sizeof(*rt));
+	}
+#endif
+	mdb_range_scan0(&rs, mc);
+#ifdef MDB_THREADS
+	if (nthreads > 1) {
+		mdb_threads_join(&th);
+		pthread_mutex_destroy(&rs.rs_mutex);
+	}
+#endif
+	rc = rs.rs_rc;
+
+leave:
+#ifdef MDB_THREADS
+	if (rt) {
+		for (i = 0; i < nthreads - 1; i++)
+			mdb_cursor_close(rt[i].rt_cursor);
+		free(rt);
+	}
+#endif
+	mdb_cursor_close(mc);
+	free(rs.rs_keys);
+	return rc;
 }
 
-int ESECT
-mdb_env_get_fd(MDB_env *env, mdb_filehandle_t *arg)
+	/** Return the histogram bucket of \b v: 0 for 0, else the number of
+	 *	significant bits of \b v, limited to the last bucket.
+	 */
+static unsigned
+mdb_hist_bucket(mdb_size_t v)
 {
-	if (!env || !arg)
-		return EINVAL;
+	unsigned i;
 
-	*arg = env->me_fd;
-	return MDB_SUCCESS;
+	for (i = 0; v; v >>= 1)
+		i++;
+	return i < MDB_SIZE_HIST ? i : MDB_SIZE_HIST-1;
 }
 
-/** Common code for #mdb_stat() and #mdb_env_stat().
- * @param[in] env the environment to operate in.
- * @param[in] db the #MDB_db record containing the stats to return.
- * @param[out] arg the address of an #MDB_stat structure to receive the stats.
- * @return 0, this function always succeeds.
- */
-static int ESECT
-mdb_stat0(MDB_env *env, MDB_db *db, MDB_stat *arg)
-{
-	arg->ms_psize = env->me_psize;
-	arg->ms_depth = db->md_depth;
-	arg->ms_branch_pages = db->md_branch_pages;
-	arg->ms_leaf_pages = db->md_leaf_pages;
-	arg->ms_overflow_pages = db->md_overflow_pages;
-	arg->ms_entries = db->md_entries;
+	/** State shared by the threads of #mdb_stat_pages(). */
+typedef struct mdb_pwalk {
+	MDB_txn		*pw_txn;
+	pgno_t		*pw_roots;		/**< subtrees to walk, in key order */
+	pgno_t		*pw_ends;		/**< first and last leaf of each subtree */
+	unsigned	pw_nroots;		/**< number of subtrees */
+	unsigned	pw_next;		/**< next subtree to claim */
+	unsigned	pw_pad;			/**< key size of #MDB_DUPFIXED leaves */
+	int			pw_rc;			/**< first error, stops the walk */
+#ifdef MDB_THREADS
+	pthread_mutex_t	pw_mutex;	/**< protects #pw_next and #pw_rc */
+#endif
+} mdb_pwalk;
+
+	/** A thread of #mdb_stat_pages(), with its own counters. */
+typedef struct mdb_pwalk_thr {
+	mdb_pwalk	*pt_walk;
+	MDB_cursor	pt_mc;			/**< for #mdb_page_get() */
+	MDB_pageinfo	pt_info;
+	pgno_t		pt_first;		/**< first leaf of the current subtree */
+	pgno_t		pt_last;		/**< last leaf seen in the current subtree */
+} mdb_pwalk_thr;
+
+	/** Count the fill of a branch or leaf page. */
+static void
+mdb_pwalk_fill(MDB_env *env, mdb_size_t *hist, mdb_size_t *bytes, MDB_page *mp)
+{
+	unsigned room = env->me_psize - PAGEHDRSZ;
+	unsigned used = room - SIZELEFT(mp), i;
 
-	return MDB_SUCCESS;
+	*bytes += used;
+	i = (mdb_size_t)used * MDB_FILL_HIST / room;
+	hist[i < MDB_FILL_HIST ? i : MDB_FILL_HIST-1]++;
 }
 
-int ESECT
-mdb_env_stat(MDB_env *env, MDB_stat *arg)
+	/** Count the next leaf of the walked tree in key order. */
+static void
+mdb_pwalk_next(mdb_pwalk_thr *pt, pgno_t pg)
 {
-	MDB_meta *meta;
+	if (!pt->pt_last) {
+		pt->pt_first = pg;
+	} else if (pg == pt->pt_last + 1) {
+		pt->pt_info.mi_leaf_dist[0]++;
+	} else {
+		pt->pt_info.mi_leaf_dist[mdb_hist_bucket(pg > pt->pt_last ?
+			pg - pt->pt_last : pt->pt_last - pg)]++;
+	}
+	pt->pt_last = pg;
+}
 
-	if (env == NULL || arg == NULL)
-		return EINVAL;
+	/** Walk a tree or subtree for #mdb_stat_pages().
+	 * @param[in] pt the thread's state.
+	 * @param[in] pg the root of the tree.
+	 * @param[in] pad the key size of #MDB_DUPFIXED leaves.
+	 * @param[in] sub non-zero for the sub-DB of a #MDB_DUPSORT key, whose
+	 * keys are data items and whose leaves are not counted by #mdb_pwalk_next().
+	 * @return 0 on success, non-zero on failure.
+	 */
+static int
+mdb_pwalk_tree(mdb_pwalk_thr *pt, pgno_t pg, unsigned pad, int sub)
+{
+	MDB_txn *txn = pt->pt_mc.mc_txn;
+	MDB_env *env = txn->mt_env;
+	MDB_pageinfo *mi = &pt->pt_info;
+	MDB_page *mp, *omp, *fp;
+	MDB_node *ni;
+	MDB_seghead sh;
+	MDB_db db;
+	mdb_size_t size, room;
+	unsigned i, j, n, nsub;
+	int rc = MDB_SUCCESS;
 
-	meta = mdb_env_pick_meta(env);
+	if ((rc = mdb_page_get(&pt->pt_mc, pg, &mp, NULL)) != 0)
+		return rc;
+	n = NUMKEYS(mp);
+	if (IS_BRANCH(mp)) {
+		mi->mi_branch_pages++;
+		mdb_pwalk_fill(env, mi->mi_branch_fill, &mi->mi_branch_bytes, mp);
+		for (i = 0; i < n && !rc; i++)
+			rc = mdb_pwalk_tree(pt, NODEPGNO(NODEPTR(mp, i)), pad, sub);
+		goto done;
+	}
+	if (!IS_LEAF(mp)) {
+		rc = MDB_CORRUPTED;
+		goto done;
+	}
+	mi->mi_leaf_pages++;
+	mdb_pwalk_fill(env, mi->mi_leaf_fill, &mi->mi_leaf_bytes, mp);
+	if (!sub)
+		mdb_pwalk_next(pt, pg);
+	if (IS_LEAF2(mp)) {
+		mi->mi_entries += n;
+		mi->mi_data_sizes[mdb_hist_bucket(pad)] += n;
+		goto done;
+	}
+	for (i = 0; i < n; i++) {
+		ni = NODEPTR(mp, i);
+		if (sub) {
+			mi->mi_entries++;
+			mi->mi_data_sizes[mdb_hist_bucket(NODEKSZ(ni))]++;
+			continue;
+		}
+		mi->mi_key_sizes[mdb_hist_bucket(NODEKSZ(ni))]++;
+		if (ni->mn_flags & F_DUPDATA) {
+			if (ni->mn_flags & F_SUBDATA) {
+				memcpy(&db, NODEDATA(ni), sizeof(db));
+				if ((rc = mdb_pwalk_tree(pt, db.md_root, db.md_pad, 1)) != 0)
+					goto done;
+				continue;
+			}
+			fp = NODEDATA(ni);
+			nsub = NUMKEYS(fp);
+			mi->mi_entries += nsub;
+			if (IS_LEAF2(fp)) {
+				mi->mi_data_sizes[mdb_hist_bucket(fp->mp_pad)] += nsub;
+			} else {
+				for (j = 0; j < nsub; j++)
+					mi->mi_data_sizes[mdb_hist_bucket(NODEKSZ(NODEPTR(fp, j)))]++;
+			}
+			continue;
+		}
+		mi->mi_entries++;
+		if (ni->mn_flags & F_BIGDATA) {
+			memcpy(&pg, NODEDATA(ni), sizeof(pg));
+			if ((rc = mdb_page_get(&pt->pt_mc, pg, &omp, NULL)) != 0)
+				goto done;
+			size = NODEDSZ(ni);
+			room = (mdb_size_t)omp->mp_pages * env->me_psize - PAGEHDRSZ;
+			mi->mi_overflow_pages += omp->mp_pages;
+			MDB_PAGE_UNREF(txn, omp);
+		} else if (ni->mn_flags & F_SEGMENTS) {
+			memcpy(&sh, NODEDATA(ni), SEGHDRSZ);
+			size = sh.sh_size;
+			room = 0;
+			for (j = 0; j < sh.sh_count; j++) {
+				nsub = mdb_seg_pages(env, &sh, j);
+				room += SEGDATASZ(env, nsub);
+				mi->mi_overflow_pages += nsub;
+			}
+		} else {
+			mi->mi_data_sizes[mdb_hist_bucket(NODEDSZ(ni))]++;
+			continue;
+		}
+		mi->mi_data_sizes[mdb_hist_bucket(size)]++;
+		mi->mi_overflow_values++;
+		mi->mi_overflow_waste += room - size;
+	}
 
-	return mdb_stat0(env, &meta->mm_dbs[MAIN_DBI], arg);
+done:
+	MDB_PAGE_UNREF(txn, mp);
+	return rc;
 }
 
-int ESECT
-mdb_env_info(MDB_env *env, MDB_envinfo *arg)
+	/** Walk subtrees for #mdb_stat_pages() until there are none left.
+	 * @param[in] pt the thread's state.
+	 * @return 0 on success, non-zero on failure.
+	 */
+static int
+mdb_pwalk0(mdb_pwalk_thr *pt)
 {
-	MDB_meta *meta;
-
-	if (env == NULL || arg == NULL)
-		return EINVAL;
+	mdb_pwalk *pw = pt->pt_walk;
+	unsigned i;
+	int rc;
 
-	meta = mdb_env_pick_meta(env);
-	arg->me_mapaddr = meta->mm_address;
-	arg->me_last_pgno = meta->mm_last_pg;
-	arg->me_last_txnid = meta->mm_txnid;
+	for (;;) {
+#ifdef MDB_THREADS
+		pthread_mutex_lock(&pw->pw_mutex);
+#endif
+		i = pw->pw_rc ? pw->pw_nroots : pw->pw_next++;
+#ifdef MDB_THREADS
+		pthread_mutex_unlock(&pw->pw_mutex);
+#endif
+		if (i >= pw->pw_nroots)
+			return MDB_SUCCESS;
+		pt->pt_first = pt->pt_last = 0;
+		rc = mdb_pwalk_tree(pt, pw->pw_roots[i], pw->pw_pad, 0);
+		pw->pw_ends[2*i] = pt->pt_first;
+		pw->pw_ends[2*i+1] = pt->pt_last;
+		if (rc) {
+#ifdef MDB_THREADS
+			pthread_mutex_lock(&pw->pw_mutex);
+#endif
+			if (!pw->pw_rc)
+				pw->pw_rc = rc;
+#ifdef MDB_THREADS
+			pthread_mutex_unlock(&pw->pw_mutex);
+#endif
+			return rc;
+		}
+	}
+}
 
-	arg->me_mapsize = env->me_mapsize;
-	arg->me_maxreaders = env->me_maxreaders;
-	arg->me_numreaders = env->me_txns ? env->me_txns->mti_numreaders : 0;
-	return MDB_SUCCESS;
+#ifdef MDB_THREADS
+static THREAD_RET CALL_CONV
+mdb_pwalkthr(void *arg)
+{
+	mdb_pwalk0(arg);
+	return (THREAD_RET)0;
 }
+#endif
 
-/** Set the default comparison functions for a database.
- * Called immediately after a database is opened to set the defaults.
- * The user can then override them with #mdb_set_compare() or
- * #mdb_set_dupsort().
- * @param[in] txn A transaction handle returned by #mdb_txn_begin()
- * @param[in] dbi A database handle returned by #mdb_dbi_open()
- */
-static void
-mdb_default_cmp(MDB_txn *txn, MDB_dbi dbi)
+	/** Count the runs of consecutive pages in the freeDB's page lists.
+	 *	Lists of one record can continue runs of another, so they are
+	 *	merged first.
+	 * @param[in] txn the transaction.
+	 * @param[in,out] info gets #MDB_pageinfo.%mi_free_runs and
+	 * #MDB_pageinfo.%mi_free_pages.
+	 * @return 0 on success, non-zero on failure.
+	 */
+static int
+mdb_pwalk_free(MDB_txn *txn, MDB_pageinfo *info)
 {
-	uint16_t f = txn->mt_dbs[dbi].md_flags;
+	MDB_cursor mc;
+	MDB_val key, data;
+	MDB_IDL idl, list;
+	txnid_t id;
+	mdb_size_t i, run;
+	int rc;
 
-	txn->mt_dbxs[dbi].md_cmp =
-		(f & MDB_REVERSEKEY) ? mdb_cmp_memnr :
-		(f & MDB_INTEGERKEY) ? mdb_cmp_cint  : mdb_cmp_memn;
+	if ((idl = mdb_midl_alloc(MDB_IDL_UM_MAX)) == NULL)
+		return ENOMEM;
+	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
+	while ((rc = mdb_cursor_get(&mc, &key, &data, MDB_NEXT)) == 0) {
+		memcpy(&id, key.mv_data, sizeof(id));
+		if (id & MDB_RCL_BIT)
+			continue;
+		list = data.mv_data;
+		if ((rc = mdb_midl_append_list(&idl, list)) != 0)
+			goto done;
+	}
+	if (rc != MDB_NOTFOUND)
+		goto done;
+	rc = MDB_SUCCESS;
+	mdb_midl_sort(idl);
+	info->mi_free_pages = idl[0];
+	for (i = 1; i <= idl[0]; i += run) {
+		for (run = 1; i + run <= idl[0] && idl[i+run] == idl[i] - run; run++) ;
+		info->mi_free_runs[mdb_hist_bucket(run) - 1]++;
+	}
 
-	txn->mt_dbxs[dbi].md_dcmp =
-		!(f & MDB_DUPSORT) ? 0 :
-		((f & MDB_INTEGERDUP)
-		 ? ((f & MDB_DUPFIXED)   ? mdb_cmp_int   : mdb_cmp_cint)
-		 : ((f & MDB_REVERSEDUP) ? mdb_cmp_memnr : mdb_cmp_memn));
+done:
+	MDB_CURSOR_UNREF(&mc, 1);
+	mdb_midl_free(idl);
+	return rc;
 }
 
-int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *dbi)
+int
+mdb_stat_pages(MDB_txn *txn, MDB_dbi dbi, unsigned int nthreads,
+	MDB_pageinfo *info)
 {
-	MDB_val key, data;
-	MDB_dbi i;
 	MDB_cursor mc;
-	MDB_db dummy;
-	int rc, dbflag, exact;
-	unsigned int unused = 0, seq;
-	char *namedup;
-	size_t len;
+	MDB_xcursor mx;
+	MDB_db *db;
+	MDB_page *mp;
+	mdb_pwalk pw;
+	mdb_pwalk_thr *pt = NULL;
+	mdb_size_t *sum, *add;
+	pgno_t *cur = NULL, *next = NULL, *tmp, prev;
+	unsigned i, j, k, m, mnext, want, level;
+	int rc = MDB_SUCCESS;
+#ifdef MDB_THREADS
+	mdb_threads th;
+#endif
 
-	if (flags & ~VALID_FLAGS)
+	if (!info || !TXN_DBI_EXIST(txn, dbi, DB_VALID))
 		return EINVAL;
+
 	if (txn->mt_flags & MDB_TXN_BLOCKED)
 		return MDB_BAD_TXN;
 
-	/* main DB? */
-	if (!name) {
-		*dbi = MAIN_DBI;
-		if (flags & PERSISTENT_FLAGS) {
-			uint16_t f2 = flags & PERSISTENT_FLAGS;
-			/* make sure flag changes get committed */
-			if ((txn->mt_dbs[MAIN_DBI].md_flags | f2) != txn->mt_dbs[MAIN_DBI].md_flags) {
-				txn->mt_dbs[MAIN_DBI].md_flags |= f2;
-				txn->mt_flags |= MDB_TXN_DIRTY;
+	/* Pages of a write txn may be dirty, and their lists are not
+	 * safe to share between threads.
+	 */
+	if (!nthreads || !F_ISSET(txn->mt_flags, MDB_TXN_RDONLY))
+		nthreads = 1;
+#ifndef MDB_THREADS
+	nthreads = 1;
+#endif
+
+	memset(info, 0, sizeof(*info));
+	memset(&pw, 0, sizeof(pw));
+	/* Stale, must read the DB's root. cursor_init does it for us. */
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	db = &txn->mt_dbs[dbi];
+	if (db->md_root == P_INVALID)
+		goto freedb;
+	pw.pw_txn = txn;
+	pw.pw_pad = db->md_pad;
+
+	/* Widen the set of subtrees one branch level at a time, like
+	 * #mdb_range_split(), counting the branch pages read on the way.
+	 */
+	want = nthreads > 1 ? nthreads * MDB_SCAN_PER_THREAD : 1;
+	if ((cur = malloc(sizeof(pgno_t))) == NULL) {
+		rc = ENOMEM;
+		goto leave;
+	}
+	cur[0] = db->md_root;
+	m = 1;
+	for (level = 1; m < want && level < db->md_depth; level++) {
+		for (i = 0, mnext = 0; i < m; i++) {
+			if ((rc = mdb_page_get(&mc, cur[i], &mp, NULL)) != 0)
+				goto leave;
+			info->mi_branch_pages++;
+			mdb_pwalk_fill(txn->mt_env, info->mi_branch_fill,
+				&info->mi_branch_bytes, mp);
+			k = NUMKEYS(mp);
+			if ((tmp = realloc(next, (mnext + k) * sizeof(pgno_t))) == NULL) {
+				MDB_PAGE_UNREF(txn, mp);
+				rc = ENOMEM;
+				goto leave;
 			}
+			next = tmp;
+			for (j = 0; j < k; j++)
+				next[mnext++] = NODEPGNO(NODEPTR(mp, j));
+			MDB_PAGE_UNREF(txn, mp);
 		}
-		mdb_default_cmp(txn, MAIN_DBI);
-		return MDB_SUCCESS;
+		free(cur);
+		cur = next;
+		next = NULL;
+		m = mnext;
+	}
+	pw.pw_roots = cur;
+	pw.pw_nroots = m;
+	if (nthreads > m)
+		nthreads = m;
+	if ((pw.pw_ends = calloc(2 * m, sizeof(pgno_t))) == NULL ||
+		(pt = calloc(nthreads, sizeof(mdb_pwalk_thr))) == NULL) {
+		rc = ENOMEM;
+		goto leave;
 	}
-
-	if (txn->mt_dbxs[MAIN_DBI].md_cmp == NULL) {
-		mdb_default_cmp(txn, MAIN_DBI);
+	for (i = 0; i < nthreads; i++) {
+		pt[i].pt_walk = &pw;
+		pt[i].pt_mc.mc_txn = txn;
+		pt[i].pt_mc.mc_flags = txn->mt_flags & (C_ORIG_RDONLY|C_WRITEMAP);
 	}
+#ifdef MDB_THREADS
+	if (nthreads > 1) {
+		if ((rc = pthread_mutex_init(&pw.pw_mutex, NULL)) != 0)
+			goto leave;
+		mdb_threads_start(&th, nthreads - 1, mdb_pwalkthr,
+			pt + 1, sizeof(*pt));
+	}
+#endif
+	mdb_pwalk0(&pt[0]);
+#ifdef MDB_THREADS
+	if (nthreads > 1) {
+		mdb_threads_join(&th);
+		pthread_mutex_destroy(&pw.pw_mutex);
+	}
+#endif
+	if ((rc = pw.pw_rc) != 0)
+		goto leave;
 
-	/* Is the DB already open? */
-	len = strlen(name);
-	for (i=CORE_DBS; i<txn->mt_numdbs; i++) {
-		if (!txn->mt_dbxs[i].md_name.mv_size) {
-			/* Remember this free slot */
-			if (!unused) unused = i;
+	/* All fields are counters */
+	sum = (mdb_size_t *)info;
+	for (i = 0; i < nthreads; i++) {
+		add = (mdb_size_t *)&pt[i].pt_info;
+		for (j = 0; j < sizeof(*info) / sizeof(mdb_size_t); j++)
+			sum[j] += add[j];
+	}
+	/* The leaves where the subtrees meet */
+	for (i = 0, prev = 0; i < m; i++) {
+		if (!pw.pw_ends[2*i])
 			continue;
+		if (prev) {
+			pt[0].pt_last = prev;
+			memset(&pt[0].pt_info, 0, sizeof(pt[0].pt_info));
+			mdb_pwalk_next(&pt[0], pw.pw_ends[2*i]);
+			for (j = 0; j < MDB_SIZE_HIST; j++)
+				info->mi_leaf_dist[j] += pt[0].pt_info.mi_leaf_dist[j];
 		}
-		if (len == txn->mt_dbxs[i].md_name.mv_size &&
-			!strncmp(name, txn->mt_dbxs[i].md_name.mv_data, len)) {
-			*dbi = i;
-			return MDB_SUCCESS;
-		}
+		prev = pw.pw_ends[2*i+1];
 	}
 
-	/* If no free slot and max hit, fail */
-	if (!unused && txn->mt_numdbs >= txn->mt_env->me_maxdbs)
-		return MDB_DBS_FULL;
+freedb:
+	if (dbi == FREE_DBI)
+		rc = mdb_pwalk_free(txn, info);
 
-	/* Cannot mix named databases with some mainDB flags */
-	if (txn->mt_dbs[MAIN_DBI].md_flags & (MDB_DUPSORT|MDB_INTEGERKEY))
-		return (flags & MDB_CREATE) ? MDB_INCOMPATIBLE : MDB_NOTFOUND;
+leave:
+	free(pt);
+	free(pw.pw_ends);
+	free(cur);
+	free(next);
+	MDB_CURSOR_UNREF(&mc, 1);
+	return rc;
+}
 
-	/* Find the DB info */
-	dbflag = DB_NEW|DB_VALID|DB_USRVALID;
-	exact = 0;
-	key.mv_size = len;
-	key.mv_data = (void *)name;
-	mdb_cursor_init(&mc, txn, MAIN_DBI, NULL);
-	rc = mdb_cursor_set(&mc, &key, &data, MDB_SET, &exact);
-	if (rc == MDB_SUCCESS) {
-		/* make sure this is actually a DB */
-		MDB_node *node = NODEPTR(mc.mc_pg[mc.mc_top], mc.mc_ki[mc.mc_top]);
-		if ((node->mn_flags & (F_DUPDATA|F_SUBDATA)) != F_SUBDATA)
-			return MDB_INCOMPATIBLE;
-	} else {
-		if (rc != MDB_NOTFOUND || !(flags & MDB_CREATE))
-			return rc;
-		if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY))
-			return EACCES;
-	}
+	/** Pages a thread of #mdb_env_warmup() claims at a time */
+#ifndef MDB_WARMUP_CHUNK
+#define MDB_WARMUP_CHUNK	64
+#endif
 
-	/* Done here so we cannot fail after creating a new DB */
-	if ((namedup = strdup(name)) == NULL)
-		return ENOMEM;
+	/** State shared by the threads of #mdb_env_warmup(). */
+typedef struct mdb_warmup {
+	MDB_env		*mw_env;
+	MDB_txn		*mw_txn;
+	struct mdb_warmup_thr *mw_main;	/**< the calling thread's state */
+	MDB_warmup_func	*mw_func;
+	void		*mw_ctx;
+	unsigned	mw_flags;
+	MDB_IDL		mw_pgs;			/**< pages of the level being read */
+	pgno_t		mw_next;		/**< next index of #mw_pgs to claim */
+	int			mw_height;		/**< levels below #mw_pgs, 0 for leaves */
+	mdb_size_t	mw_done;		/**< pages read so far */
+	mdb_size_t	mw_total;		/**< pages to read */
+	uint64_t	mw_deadline;	/**< #mdb_clock_usec() to stop at, or 0 */
+	int			mw_rc;			/**< first error, stops the warm-up */
+#ifdef MDB_THREADS
+	pthread_mutex_t	mw_mutex;	/**< protects #mw_next, #mw_done and #mw_rc */
+#endif
+} mdb_warmup;
 
-	if (rc) {
-		/* MDB_NOTFOUND and MDB_CREATE: Create new DB */
-		data.mv_size = sizeof(MDB_db);
-		data.mv_data = &dummy;
-		memset(&dummy, 0, sizeof(dummy));
-		dummy.md_root = P_INVALID;
-		dummy.md_flags = flags & PERSISTENT_FLAGS;
-		WITH_CURSOR_TRACKING(mc,
-			rc = mdb_cursor_put(&mc, &key, &data, F_SUBDATA));
-		dbflag |= DB_DIRTY;
+	/** A thread of #mdb_env_warmup(). */
+typedef struct mdb_warmup_thr {
+	mdb_warmup	*wt_warm;
+	MDB_IDL		wt_next;		/**< children of the branch pages it read */
+	int			wt_populate;	/**< try MADV_POPULATE_READ */
+} mdb_warmup_thr;
+
+	/** Record an error for #mdb_env_warmup(), unless there already is one. */
+static void
+mdb_warmup_fail(mdb_warmup *mw, int rc)
+{
+#ifdef MDB_THREADS
+	pthread_mutex_lock(&mw->mw_mutex);
+#endif
+	if (!mw->mw_rc)
+		mw->mw_rc = rc;
+#ifdef MDB_THREADS
+	pthread_mutex_unlock(&mw->mw_mutex);
+#endif
+}
+
+/** Read one claimed batch of pages for #mdb_env_warmup().
+ * Read-ahead is requested for the whole batch before any of it is
+ * touched, so the reads are queued together.
+ * @param[in] wt the thread's state.
+ * @param[in] first index of the first page in #mdb_warmup.%mw_pgs.
+ * @param[in] last index of the last page in #mdb_warmup.%mw_pgs.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_warmup_batch(mdb_warmup_thr *wt, pgno_t first, pgno_t last)
+{
+	mdb_warmup *mw = wt->wt_warm;
+	MDB_env *env = mw->mw_env;
+	MDB_IDL pgs = mw->mw_pgs;
+	unsigned psize = env->me_psize, os_psize = env->me_os_psize;
+	/* Page and OS page sizes are powers of 2, so only one of them
+	 * can be smaller than the other.
+	 */
+	size_t len = psize > os_psize ? psize : os_psize;
+	MDB_page *mp;
+	MDB_node *node;
+	char *ptr;
+	pgno_t i, pgno, child;
+	indx_t k, nkeys;
+	int rc;
+
+	for (i = first; i <= last; i++) {
+		ptr = env->me_map + (size_t)pgs[i] * psize;
+		ptr -= (size_t)(ptr - env->me_map) & (os_psize - 1);
+#ifdef MADV_WILLNEED
+		(void) madvise(ptr, len, MADV_WILLNEED);
+#elif defined(POSIX_MADV_WILLNEED)
+		(void) posix_madvise(ptr, len, POSIX_MADV_WILLNEED);
+#endif
 	}
 
-	if (rc) {
-		free(namedup);
-	} else {
-		/* Got info, register DBI in this txn */
-		unsigned int slot = unused ? unused : txn->mt_numdbs;
-		txn->mt_dbxs[slot].md_name.mv_data = namedup;
-		txn->mt_dbxs[slot].md_name.mv_size = len;
-		txn->mt_dbxs[slot].md_rel = NULL;
-		txn->mt_dbflags[slot] = dbflag;
-		/* txn-> and env-> are the same in read txns, use
-		 * tmp variable to avoid undefined assignment
-		 */
-		seq = ++txn->mt_env->me_dbiseqs[slot];
-		txn->mt_dbiseqs[slot] = seq;
+	for (i = first; i <= last; i++) {
+		pgno = pgs[i];
+		ptr = env->me_map + (size_t)pgno * psize;
+#ifdef MADV_POPULATE_READ
+		/* Wait for the whole page in one call, if the kernel can */
+		if (wt->wt_populate && psize > os_psize &&
+			madvise(ptr, psize, MADV_POPULATE_READ))
+			wt->wt_populate = 0;
+#endif
+		mp = (MDB_page *)ptr;
+		if (mp->mp_pgno != pgno ||
+			!(mp->mp_flags & (mw->mw_height ? P_BRANCH : P_LEAF)))
+			return MDB_CORRUPTED;
+		if (mw->mw_height) {
+			if (mw->mw_flags & MDB_WARMUP_LOCK) {
+				ptr -= (size_t)(ptr - env->me_map) & (os_psize - 1);
+#ifdef _WIN32
+				if (!VirtualLock(ptr, len))
+#else
+				if (mlock(ptr, len))
+#endif
+					return ErrCode();
+			}
+			if (mw->mw_height == 1 && !(mw->mw_flags & MDB_WARMUP_LEAVES))
+				continue;
+			nkeys = NUMKEYS(mp);
+			for (k = 0; k < nkeys; k++) {
+				node = NODEPTR(mp, k);
+				child = NODEPGNO(node);
+				if (child < NUM_METAS || child >= mw->mw_txn->mt_next_pgno)
+					return MDB_CORRUPTED;
+				if ((rc = mdb_midl_append(&wt->wt_next, child)) != 0)
+					return rc;
+			}
+		} else if (psize > os_psize) {
+#ifdef MADV_POPULATE_READ
+			if (wt->wt_populate)
+				continue;
+#endif
+			/* The header was read above, touch the rest of the page */
+			for (ptr += os_psize; ptr < (char *)mp + psize; ptr += os_psize)
+				(void) *(volatile char *)ptr;
+		}
+	}
+	return MDB_SUCCESS;
+}
 
-		memcpy(&txn->mt_dbs[slot], data.mv_data, sizeof(MDB_db));
-		*dbi = slot;
-		mdb_default_cmp(txn, slot);
-		if (!unused) {
-			txn->mt_numdbs++;
+	/** Read batches of the current level until there are none left.
+	 *	The calling thread also reports the progress.
+	 */
+static void
+mdb_warmup0(mdb_warmup_thr *wt)
+{
+	mdb_warmup *mw = wt->wt_warm;
+	pgno_t first, last, npgs = mw->mw_pgs[0];
+	mdb_size_t done;
+	int rc;
+
+	for (;;) {
+#ifdef MDB_THREADS
+		pthread_mutex_lock(&mw->mw_mutex);
+#endif
+		first = mw->mw_rc ? npgs + 1 : mw->mw_next;
+		mw->mw_next += MDB_WARMUP_CHUNK;
+#ifdef MDB_THREADS
+		pthread_mutex_unlock(&mw->mw_mutex);
+#endif
+		if (first > npgs)
+			return;
+		last = first + MDB_WARMUP_CHUNK - 1;
+		if (last > npgs)
+			last = npgs;
+		if ((rc = mdb_warmup_batch(wt, first, last)) != 0) {
+			mdb_warmup_fail(mw, rc);
+			return;
+		}
+#ifdef MDB_THREADS
+		pthread_mutex_lock(&mw->mw_mutex);
+#endif
+		mw->mw_done += last - first + 1;
+		done = mw->mw_done;
+#ifdef MDB_THREADS
+		pthread_mutex_unlock(&mw->mw_mutex);
+#endif
+		if (mw->mw_deadline && mdb_clock_usec() > mw->mw_deadline) {
+			mdb_warmup_fail(mw, ETIMEDOUT);
+			return;
+		}
+		if (wt == mw->mw_main && mw->mw_func &&
+			(rc = mw->mw_func(mw->mw_env, done, mw->mw_total, mw->mw_ctx)) != 0) {
+			mdb_warmup_fail(mw, rc);
+			return;
 		}
 	}
+}
 
-	return rc;
+#ifdef MDB_THREADS
+static THREAD_RET CALL_CONV
+mdb_warmupthr(void *arg)
+{
+	mdb_warmup0(arg);
+	return (THREAD_RET)0;
 }
+#endif
 
 int ESECT
-mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *arg)
+mdb_env_warmup(MDB_env *env, unsigned int flags, unsigned int nthreads,
+	unsigned int timeout, MDB_warmup_func *func, void *ctx)
 {
-	if (!arg || !TXN_DBI_EXIST(txn, dbi, DB_VALID))
+	mdb_warmup mw;
+	mdb_warmup_thr *wt = NULL;
+	MDB_txn *txn;
+	MDB_db *db;
+	MDB_IDL lv[CURSOR_STACK];
+	MDB_dbi dbi;
+	unsigned i, h, top = 0;
+	int rc;
+#ifdef MDB_THREADS
+	mdb_threads th;
+#endif
+
+	if (!env || (flags & ~(MDB_WARMUP_LEAVES|MDB_WARMUP_LOCK)))
 		return EINVAL;
+#ifdef MDB_VL32
+	return MDB_INCOMPATIBLE;
+#endif
+	if (!nthreads)
+		nthreads = 1;
+#ifndef MDB_THREADS
+	nthreads = 1;
+#endif
 
-	if (txn->mt_flags & MDB_TXN_BLOCKED)
-		return MDB_BAD_TXN;
+	if ((rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn)) != 0)
+		return rc;
+	memset(lv, 0, sizeof(lv));
+	memset(&mw, 0, sizeof(mw));
+	mw.mw_env = env;
+	mw.mw_txn = txn;
+	mw.mw_func = func;
+	mw.mw_ctx = ctx;
+	mw.mw_flags = flags;
+	if (timeout)
+		mw.mw_deadline = mdb_clock_usec() + (uint64_t)timeout * 1000000;
+
+	if (!(wt = calloc(nthreads, sizeof(mdb_warmup_thr)))) {
+		rc = ENOMEM;
+		goto leave;
+	}
+	mw.mw_main = wt;
+	for (i = 0; i < nthreads; i++) {
+		wt[i].wt_warm = &mw;
+		wt[i].wt_populate = 1;
+		if (!(wt[i].wt_next = mdb_midl_alloc(MDB_WARMUP_CHUNK))) {
+			rc = ENOMEM;
+			goto leave;
+		}
+	}
 
-	if (txn->mt_dbflags[dbi] & DB_STALE) {
-		MDB_cursor mc;
-		MDB_xcursor mx;
-		/* Stale, must read the DB's root. cursor_init does it for us. */
-		mdb_cursor_init(&mc, txn, dbi, &mx);
+	/* Sort the roots by their height, so the top levels of all
+	 * the trees are read before any of the lower ones.
+	 */
+	for (dbi = 0; dbi < txn->mt_numdbs; dbi++) {
+		if (dbi >= CORE_DBS) {
+			if (!TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+				continue;
+			if (txn->mt_dbflags[dbi] & DB_STALE) {
+				MDB_cursor mc;
+				MDB_xcursor mx;
+				/* Stale, must read the DB's root. cursor_init does it for us. */
+				mdb_cursor_init(&mc, txn, dbi, &mx);
+			}
+		}
+		db = &txn->mt_dbs[dbi];
+		if (db->md_root == P_INVALID)
+			continue;
+		if (!db->md_depth || db->md_depth > CURSOR_STACK) {
+			rc = MDB_CORRUPTED;
+			goto leave;
+		}
+		h = db->md_depth - 1;
+		mw.mw_total += db->md_branch_pages;
+		if (flags & MDB_WARMUP_LEAVES)
+			mw.mw_total += db->md_leaf_pages;
+		else if (!h)
+			continue;
+		if (!lv[h] && !(lv[h] = mdb_midl_alloc(MDB_WARMUP_CHUNK))) {
+			rc = ENOMEM;
+			goto leave;
+		}
+		if ((rc = mdb_midl_append(&lv[h], db->md_root)) != 0)
+			goto leave;
+		if (top < h)
+			top = h;
 	}
-	return mdb_stat0(txn->mt_env, &txn->mt_dbs[dbi], arg);
+
+#ifdef MDB_THREADS
+	if ((rc = pthread_mutex_init(&mw.mw_mutex, NULL)) != 0)
+		goto leave;
+#endif
+	for (h = top + 1; h-- > 0; ) {
+		if (!lv[h] || (!h && !(flags & MDB_WARMUP_LEAVES)))
+			continue;
+		/* In page order, so each batch is close together on disk */
+		mdb_midl_sort(lv[h]);
+		mw.mw_pgs = lv[h];
+		mw.mw_next = 1;
+		mw.mw_height = h;
+#ifdef MDB_THREADS
+		mdb_threads_start(&th, nthreads - 1, mdb_warmupthr,
+			wt + 1, sizeof(*wt));
+#endif
+		mdb_warmup0(wt);
+#ifdef MDB_THREADS
+		mdb_threads_join(&th);
+#endif
+		if ((rc = mw.mw_rc) != 0)
+			break;
+		if (!h)
+			continue;
+		for (i = 0; i < nthreads; i++) {
+			if (!wt[i].wt_next[0])
+				continue;
+			if (!lv[h-1]) {
+				lv[h-1] = wt[i].wt_next;
+				wt[i].wt_next = mdb_midl_alloc(MDB_WARMUP_CHUNK);
+				if (!wt[i].wt_next) {
+					rc = ENOMEM;
+					break;
+				}
+			} else {
+				if ((rc = mdb_midl_append_list(&lv[h-1], wt[i].wt_next)) != 0)
+					break;
+				wt[i].wt_next[0] = 0;
+			}
+		}
+		if (rc)
+			break;
+	}
+#ifdef MDB_THREADS
+	pthread_mutex_destroy(&mw.mw_mutex);
+#endif
+	if (!rc && func)
+		rc = func(env, mw.mw_done, mw.mw_total, ctx);
+
+leave:
+	for (h = 0; h < CURSOR_STACK; h++)
+		mdb_midl_free(lv[h]);
+	if (wt) {
+		for (i = 0; i < nthreads; i++)
+			mdb_midl_free(wt[i].wt_next);
+		free(wt);
+	}
+	mdb_txn_abort(txn);
+	return rc;
 }
 
 void mdb_dbi_close(MDB_env *env, MDB_dbi dbi)
@@ -10831,6 +16652,14 @@ mdb_drop0(MDB_cursor *mc, int subs)
 						mc->mc_db->md_overflow_pages -= omp->mp_pages;
 						if (!mc->mc_db->md_overflow_pages && !subs)
 							break;
+					} else if (ni->mn_flags & F_SEGMENTS) {
+						unsigned npages;
+						rc = mdb_seg_list(txn->mt_env, ni, &txn->mt_free_pgs, &npages);
+						if (rc)
+							goto done;
+						mc->mc_db->md_overflow_pages -= npages;
+						if (!mc->mc_db->md_overflow_pages && !subs)
+							break;
 					} else if (subs && (ni->mn_flags & F_SUBDATA)) {
 						mdb_xcursor_init1(mc, ni);
 						rc = mdb_drop0(&mc->mc_xcursor->mx_cursor, 0);
@@ -10884,11 +16713,332 @@ done:
 	return rc;
 }
 
+/** Push a subtree onto the stack of a lazily dropped DB.
+ * @param[in,out] stk the stack.
+ * @param[in] db the record of the tree.
+ * @param[in] flags #MDB_RCL_SCAN and #MDB_RCL_SUBS.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_rcl_push(MDB_IDL *stk, MDB_db *db, unsigned flags)
+{
+	pgno_t *s;
+	int rc;
+
+	if (db->md_root == P_INVALID)
+		return MDB_SUCCESS;
+	if ((rc = mdb_midl_need(stk, 2)) != 0)
+		return rc;
+	s = *stk;
+	s[++s[0]] = db->md_root;
+	s[++s[0]] = (pgno_t)db->md_depth << 2 | flags;
+	return MDB_SUCCESS;
+}
+
+/** Free pages of lazily dropped DBs, from the top of their stack.
+ *	Pages whose contents were read must stay as they are until the
+ *	txn commits, since the last committed stack still refers to them.
+ *	The others could be reused at once.
+ * @param[in] mc a cursor of the txn, for reading pages.
+ * @param[in,out] stk the stack.
+ * @param[in,out] unread the freed pages that were not read.
+ * @param[in,out] read the freed pages that were read.
+ * @param[in] limit stop once about this many pages are freed.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_rcl_pop(MDB_cursor *mc, MDB_IDL *stk, MDB_IDL *unread, MDB_IDL *read,
+	unsigned limit)
+{
+	MDB_page *mp, *omp;
+	MDB_node *ni;
+	MDB_db db;
+	pgno_t pg, opg, info, *s;
+	unsigned i, n, depth, freed = 0;
+	int rc;
+
+	while ((*stk)[0] && freed < limit) {
+		s = *stk;
+		info = s[s[0]--];
+		pg = s[s[0]--];
+		depth = info >> 2;
+		if (depth == 1 && !(info & MDB_RCL_SCAN)) {
+			/* A leaf with nothing else in it */
+			if ((rc = mdb_midl_append(unread, pg)) != 0)
+				return rc;
+			freed++;
+			continue;
+		}
+		if ((rc = mdb_page_get(mc, pg, &mp, NULL)) != 0)
+			return rc;
+		n = NUMKEYS(mp);
+		if (IS_BRANCH(mp) && depth > 1) {
+			if (depth == 2 && !(info & MDB_RCL_SCAN)) {
+				if ((rc = mdb_midl_need(unread, n)) != 0)
+					goto done;
+				for (i=0; i<n; i++)
+					mdb_midl_xappend(*unread, NODEPGNO(NODEPTR(mp, i)));
+				freed += n;
+			} else {
+				if ((rc = mdb_midl_need(stk, 2*n)) != 0)
+					goto done;
+				s = *stk;
+				for (i=0; i<n; i++) {
+					s[++s[0]] = NODEPGNO(NODEPTR(mp, i));
+					s[++s[0]] = info - 4;
+				}
+			}
+		} else if (IS_LEAF(mp) && depth == 1) {
+			for (i=0; !IS_LEAF2(mp) && i<n; i++) {
+				ni = NODEPTR(mp, i);
+				if (ni->mn_flags & F_BIGDATA) {
+					memcpy(&opg, NODEDATA(ni), sizeof(opg));
+					if ((rc = mdb_page_get(mc, opg, &omp, NULL)) != 0)
+						goto done;
+					/* Only the first overflow page is read */
+					if ((rc = mdb_midl_append(read, opg)) == 0 && omp->mp_pages > 1)
+						rc = mdb_midl_append_range(unread, opg+1, omp->mp_pages-1);
+					freed += omp->mp_pages;
+					MDB_PAGE_UNREF(mc->mc_txn, omp);
+					if (rc)
+						goto done;
+				} else if (ni->mn_flags & F_SEGMENTS) {
+					unsigned npages;
+					if ((rc = mdb_seg_list(mc->mc_txn->mt_env, ni, unread, &npages)) != 0)
+						goto done;
+					freed += npages;
+				} else if ((ni->mn_flags & F_SUBDATA) && (info & MDB_RCL_SUBS)) {
+					memcpy(&db, NODEDATA(ni), sizeof(db));
+					if ((rc = mdb_rcl_push(stk, &db, 0)) != 0)
+						goto done;
+				}
+			}
+		} else {
+			rc = MDB_CORRUPTED;
+			goto done;
+		}
+		rc = mdb_midl_append(read, pg);
+		freed++;
+done:
+		MDB_PAGE_UNREF(mc->mc_txn, mp);
+		if (rc)
+			return rc;
+	}
+	return MDB_SUCCESS;
+}
+
+/** Load the oldest stack of lazily dropped DBs that no reader can see.
+ * @param[in] mc a cursor of the txn.
+ * @return 0 on success, #MDB_NOTFOUND if there is none, or an error.
+ */
+static int
+mdb_rcl_load(MDB_cursor *mc)
+{
+	MDB_txn *txn = mc->mc_txn;
+	MDB_env *env = txn->mt_env;
+	MDB_cursor m2;
+	MDB_val key, data;
+	txnid_t id = MDB_RCL_BIT;
+	unsigned n;
+	int rc;
+
+	env->me_rcl_state = MDB_RCL_DONE;
+	mdb_cursor_init(&m2, txn, FREE_DBI, NULL);
+	key.mv_size = sizeof(id);
+	key.mv_data = &id;
+	if ((rc = mdb_cursor_get(&m2, &key, &data, MDB_SET_RANGE)) != 0)
+		return rc;
+	memcpy(&id, key.mv_data, sizeof(id));
+	env->me_pgoldest = mdb_find_oldest(txn);
+	if ((id & ~MDB_RCL_BIT) >= env->me_pgoldest)
+		return MDB_NOTFOUND;
+	n = data.mv_size / sizeof(pgno_t);
+	if (!env->me_rcl) {
+		if (!(env->me_rcl = mdb_midl_alloc(n)))
+			return ENOMEM;
+	} else if ((rc = mdb_midl_need(&env->me_rcl, n)) != 0) {
+		return rc;
+	}
+	memcpy(env->me_rcl+1, data.mv_data, data.mv_size);
+	env->me_rcl[0] = n;
+	env->me_rcl_key = id;
+	env->me_rcl_state = MDB_RCL_BUSY;
+	return MDB_SUCCESS;
+}
+
+/** Free a chunk of the pages of lazily dropped DBs, for #mdb_page_alloc().
+ *	Pages that were not read go to me_pghead[] and can be used at once.
+ *	The others go to mt_free_pgs[]. The stack is saved when the txn
+ *	commits, by #mdb_rcl_save().
+ * @param[in] mc the cursor doing the allocation.
+ * @return 0 if pages were added to me_pghead[], #MDB_NOTFOUND if not,
+ * or another error.
+ */
+static int
+mdb_rcl_step(MDB_cursor *mc)
+{
+	MDB_txn *txn = mc->mc_txn;
+	MDB_env *env = txn->mt_env;
+	MDB_IDL idl;
+	int rc;
+
+	if (env->me_rcl_state == MDB_RCL_IDLE && (rc = mdb_rcl_load(mc)) != 0)
+		return rc;
+	if (env->me_rcl_state != MDB_RCL_BUSY || !env->me_rcl[0]) {
+		env->me_rcl_state = MDB_RCL_DONE;
+		return MDB_NOTFOUND;
+	}
+	if (!(idl = mdb_midl_alloc(MDB_RCL_CHUNK)))
+		return ENOMEM;
+	rc = mdb_rcl_pop(mc, &env->me_rcl, &idl, &txn->mt_free_pgs, MDB_RCL_CHUNK);
+	if (rc)
+		goto done;
+	if (!idl[0]) {
+		rc = MDB_NOTFOUND;
+		goto done;
+	}
+	if (!env->me_pglast) {
+		/* With no freeDB record to save me_pghead[] under,
+		 * keep them for the next txns and stop here.
+		 */
+		env->me_rcl_state = MDB_RCL_DONE;
+		rc = mdb_midl_append_list(&txn->mt_free_pgs, idl);
+		if (!rc)
+			rc = MDB_NOTFOUND;
+		goto done;
+	}
+	mdb_midl_sort(idl);
+	if ((rc = mdb_midl_need(&env->me_pghead, idl[0])) != 0)
+		goto done;
+	mdb_midl_xmerge(env->me_pghead, idl);
+	env->me_pgrun_ok = 0;
+done:
+	mdb_midl_free(idl);
+	return rc;
+}
+
+/** Save the stack of lazily dropped DBs that this txn worked on.
+ * @param[in] txn the txn being committed.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_rcl_save(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_cursor mc;
+	MDB_val key, data;
+
+	/* No more pages may be freed from it now */
+	env->me_rcl_state = MDB_RCL_DONE;
+	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
+	key.mv_size = sizeof(env->me_rcl_key);
+	key.mv_data = &env->me_rcl_key;
+	if (!env->me_rcl[0])
+		return mdb_del0(txn, FREE_DBI, &key, NULL, 0);
+	data.mv_size = env->me_rcl[0] * sizeof(pgno_t);
+	data.mv_data = env->me_rcl + 1;
+	return mdb_cursor_put(&mc, &key, &data, 0);
+}
+
+/** Count the pages of lazily dropped DBs not freed yet.
+ * @param[in] txn a txn.
+ * @param[in,out] count the count to add them to.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_rcl_count(MDB_txn *txn, MDB_ID *count)
+{
+	MDB_cursor mc, m2;
+	MDB_val key, data;
+	MDB_IDL stk, a = NULL, b = NULL;
+	txnid_t id = MDB_RCL_BIT;
+	int rc;
+
+	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
+	mdb_cursor_init(&m2, txn, MAIN_DBI, NULL);
+	key.mv_size = sizeof(id);
+	key.mv_data = &id;
+	rc = mdb_cursor_get(&mc, &key, &data, MDB_SET_RANGE);
+	if (rc)
+		return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+	if (!(stk = mdb_midl_alloc(data.mv_size / sizeof(pgno_t))) ||
+		!(a = mdb_midl_alloc(MDB_RCL_CHUNK)) ||
+		!(b = mdb_midl_alloc(MDB_RCL_CHUNK))) {
+		rc = ENOMEM;
+		goto done;
+	}
+	for (; !rc; rc = mdb_cursor_get(&mc, &key, &data, MDB_NEXT)) {
+		stk[0] = 0;
+		if ((rc = mdb_midl_need(&stk, data.mv_size / sizeof(pgno_t))) != 0)
+			goto done;
+		memcpy(stk+1, data.mv_data, data.mv_size);
+		stk[0] = data.mv_size / sizeof(pgno_t);
+		while (stk[0]) {
+			a[0] = b[0] = 0;
+			if ((rc = mdb_rcl_pop(&m2, &stk, &a, &b, MDB_RCL_CHUNK)) != 0)
+				goto done;
+			*count += a[0] + b[0];
+		}
+	}
+	if (rc == MDB_NOTFOUND)
+		rc = MDB_SUCCESS;
+done:
+	mdb_midl_free(stk);
+	mdb_midl_free(a);
+	mdb_midl_free(b);
+	return rc;
+}
+
+/** Detach a DB's tree, to be freed by later txns as they need pages.
+ *	The root is pushed onto the stack recorded for this txn.
+ * @param[in] mc Cursor on the DB to drop.
+ * @param[in] subs non-Zero to check for sub-DBs in this DB.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_drop_lazy(MDB_cursor *mc, int subs)
+{
+	MDB_txn *txn = mc->mc_txn;
+	MDB_cursor m2;
+	MDB_val key, data;
+	MDB_IDL stk;
+	txnid_t id = txn->mt_txnid | MDB_RCL_BIT;
+	unsigned n = 0;
+	int rc;
+
+	if (mc->mc_db->md_root == P_INVALID)
+		return MDB_SUCCESS;
+	mdb_cursor_init(&m2, txn, FREE_DBI, NULL);
+	key.mv_size = sizeof(id);
+	key.mv_data = &id;
+	rc = mdb_cursor_get(&m2, &key, &data, MDB_SET);
+	if (rc == MDB_SUCCESS)
+		n = data.mv_size / sizeof(pgno_t);
+	else if (rc != MDB_NOTFOUND)
+		return rc;
+	if (!(stk = mdb_midl_alloc(n + 2)))
+		return ENOMEM;
+	if (n)
+		memcpy(stk+1, data.mv_data, data.mv_size);
+	stk[0] = n;
+	rc = mdb_rcl_push(&stk, mc->mc_db, subs ? MDB_RCL_SCAN|MDB_RCL_SUBS :
+		mc->mc_db->md_overflow_pages ? MDB_RCL_SCAN : 0);
+	if (!rc) {
+		data.mv_size = stk[0] * sizeof(pgno_t);
+		data.mv_data = stk + 1;
+		rc = mdb_cursor_put(&m2, &key, &data, 0);
+	}
+	mdb_midl_free(stk);
+	txn->mt_flags |= rc ? MDB_TXN_ERROR : MDB_TXN_EXTFMT;
+	return rc;
+}
+
 int mdb_drop(MDB_txn *txn, MDB_dbi dbi, int del)
 {
 	MDB_cursor *mc, *m2;
-	int rc;
+	int rc, lazy = del & MDB_DROP_LAZY;
 
+	del &= ~MDB_DROP_LAZY;
 	if ((unsigned)del > 1 || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
 		return EINVAL;
 
@@ -10902,7 +17052,10 @@ int mdb_drop(MDB_txn *txn, MDB_dbi dbi, int del)
 	if (rc)
 		return rc;
 
-	rc = mdb_drop0(mc, mc->mc_db->md_flags & MDB_DUPSORT);
+	if (lazy)
+		rc = mdb_drop_lazy(mc, mc->mc_db->md_flags & MDB_DUPSORT);
+	else
+		rc = mdb_drop0(mc, mc->mc_db->md_flags & MDB_DUPSORT);
 	/* Invalidate the dropped DB's cursors */
 	for (m2 = txn->mt_cursors[dbi]; m2; m2 = m2->mc_next)
 		m2->mc_flags &= ~(C_INITIALIZED|C_EOF);
@@ -10941,6 +17094,7 @@ int mdb_set_compare(MDB_txn *txn, MDB_dbi dbi, MDB_cmp_func *cmp)
 		return EINVAL;
 
 	txn->mt_dbxs[dbi].md_cmp = cmp;
+	txn->mt_dbxs[dbi].md_search = NULL;
 	return MDB_SUCCESS;
 }
 
@@ -10950,6 +17104,25 @@ int mdb_set_dupsort(MDB_txn *txn, MDB_dbi dbi, MDB_cmp_func *cmp)
 		return EINVAL;
 
 	txn->mt_dbxs[dbi].md_dcmp = cmp;
+	txn->mt_dbxs[dbi].md_dsearch = NULL;
+	return MDB_SUCCESS;
+}
+
+int mdb_set_search(MDB_txn *txn, MDB_dbi dbi, MDB_search_func *search)
+{
+	if (!TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	txn->mt_dbxs[dbi].md_search = search;
+	return MDB_SUCCESS;
+}
+
+int mdb_set_dupsearch(MDB_txn *txn, MDB_dbi dbi, MDB_search_func *search)
+{
+	if (!TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	txn->mt_dbxs[dbi].md_dsearch = search;
 	return MDB_SUCCESS;
 }
 
@@ -10971,6 +17144,21 @@ int mdb_set_relctx(MDB_txn *txn, MDB_dbi dbi, void *ctx)
 	return MDB_SUCCESS;
 }
 
+int mdb_set_codec(MDB_txn *txn, MDB_dbi dbi, MDB_codec_func *enc,
+	MDB_codec_func *dec, void *ctx)
+{
+	if (!TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	if (txn->mt_dbs[dbi].md_flags & MDB_DUPSORT)
+		return MDB_INCOMPATIBLE;
+
+	txn->mt_dbxs[dbi].md_enc = enc;
+	txn->mt_dbxs[dbi].md_dec = dec;
+	txn->mt_dbxs[dbi].md_codecctx = ctx;
+	return MDB_SUCCESS;
+}
+
 int ESECT
 mdb_env_get_maxkeysize(MDB_env *env)
 {
@@ -0,0 +1,743 @@
+/* mdb_bench.c - memory-mapped database benchmark tool */
+/*
+ * Copyright 2011-2018 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "lmdb.h"
+
+#define Z	MDB_FMT_Z
+
+static char *prog;
+static char *envpath;
+static size_t nops = 100000;	/* operations per workload */
+static size_t batch = 1000;		/* operations per transaction */
+static size_t scanlen = 100;	/* records per range scan */
+static size_t ndups = 100;		/* values per key in the DUPSORT workloads */
+static int nreaders = 4;		/* reader threads in the mixed workload */
+static mdb_size_t mapsize;
+static uint64_t seed = 1;
+
+/** One latency sample set, in nanoseconds */
+typedef struct lat {
+	uint64_t *l_ns;
+	size_t l_cnt;		/* samples stored */
+	size_t l_max;		/* room in l_ns */
+} lat;
+
+/** The outcome of one workload run */
+typedef struct result {
+	size_t r_ops;
+	uint64_t r_start;	/* time the measured part began */
+	double r_secs;
+	lat r_op;			/* per operation */
+	lat r_commit;		/* per write txn commit */
+} result;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: %s [-V] [-n ops] [-b batch] [-r readers] "
+		"[-s sizes] [-w workloads] [-m modes] [-M mapsize] [-S seed] envpath\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+static void fail(const char *what, int rc)
+{
+	fprintf(stderr, "%s: %s failed, error %d %s\n", prog, what, rc,
+		mdb_strerror(rc));
+	exit(EXIT_FAILURE);
+}
+
+#define E(expr)	do { int rc_ = (expr); if (rc_) fail(#expr, rc_); } while (0)
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		fail("malloc", ENOMEM);
+	return p;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** xorshift64*, so runs are repeatable for a given seed */
+static uint64_t rnd(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/** Return a random permutation of 0..n-1 */
+static size_t *shuffle(size_t n, uint64_t *state)
+{
+	size_t *perm = xmalloc(n * sizeof(size_t)), i, j, t;
+	for (i = 0; i < n; i++)
+		perm[i] = i;
+	for (i = n; i > 1; i--) {
+		j = rnd(state) % i;
+		t = perm[i-1]; perm[i-1] = perm[j]; perm[j] = t;
+	}
+	return perm;
+}
+
+/** Big-endian keys, so memcmp order is numeric order */
+static void mkkey(unsigned char *buf, uint64_t v)
+{
+	int i;
+	for (i = 7; i >= 0; i--, v >>= 8)
+		buf[i] = (unsigned char)v;
+}
+
+static void lat_init(lat *l, size_t max)
+{
+	l->l_ns = xmalloc(max * sizeof(uint64_t));
+	l->l_cnt = 0;
+	l->l_max = max;
+}
+
+/** Add a sample. When full, overwrite old samples round-robin. */
+static void lat_add(lat *l, size_t seq, uint64_t ns)
+{
+	if (l->l_cnt < l->l_max)
+		l->l_ns[l->l_cnt++] = ns;
+	else
+		l->l_ns[seq % l->l_max] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Time a commit and start the next write txn, if \b next */
+static void commit(MDB_env *env, MDB_txn **txn, result *res, int next)
+{
+	uint64_t t0 = now_ns();
+	E(mdb_txn_commit(*txn));
+	lat_add(&res->r_commit, res->r_commit.l_cnt, now_ns() - t0);
+	if (next)
+		E(mdb_txn_begin(env, NULL, 0, txn));
+}
+
+static char *mkval(size_t vsize)
+{
+	char *val = xmalloc(vsize);
+	size_t i;
+	for (i = 0; i < vsize; i++)
+		val[i] = (char)('a' + i % 26);
+	return val;
+}
+
+/** Fill the main DB with keys 0..n-1, untimed */
+static void populate(MDB_env *env, size_t n, size_t vsize)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	unsigned char kbuf[8];
+	char *val = mkval(vsize);
+	size_t i;
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	key.mv_size = sizeof(kbuf);
+	key.mv_data = kbuf;
+	for (i = 0; i < n; i++) {
+		if (i && i % batch == 0) {
+			E(mdb_txn_commit(txn));
+			E(mdb_txn_begin(env, NULL, 0, &txn));
+		}
+		mkkey(kbuf, i);
+		data.mv_size = vsize;
+		data.mv_data = val;
+		E(mdb_put(txn, dbi, &key, &data, MDB_APPEND));
+	}
+	E(mdb_txn_commit(txn));
+	free(val);
+}
+
+/** Sequential, random or MDB_APPEND puts into an empty DB */
+static void run_put(MDB_env *env, size_t vsize, result *res, int order)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	unsigned char kbuf[8];
+	char *val = mkval(vsize);
+	size_t i, *perm = NULL;
+	uint64_t t0, st = seed;
+	unsigned flags = order == 2 ? MDB_APPEND : 0;
+
+	if (order == 1)
+		perm = shuffle(nops, &st);
+	res->r_start = now_ns();
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	key.mv_size = sizeof(kbuf);
+	key.mv_data = kbuf;
+	for (i = 0; i < nops; i++) {
+		if (i && i % batch == 0)
+			commit(env, &txn, res, 1);
+		mkkey(kbuf, perm ? perm[i] : i);
+		data.mv_size = vsize;
+		data.mv_data = val;
+		t0 = now_ns();
+		E(mdb_put(txn, dbi, &key, &data, flags));
+		lat_add(&res->r_op, i, now_ns() - t0);
+	}
+	commit(env, &txn, res, 0);
+	res->r_ops = nops;
+	free(perm);
+	free(val);
+}
+
+static void run_seqput(MDB_env *env, size_t vsize, result *res)
+{
+	run_put(env, vsize, res, 0);
+}
+
+static void run_randput(MDB_env *env, size_t vsize, result *res)
+{
+	run_put(env, vsize, res, 1);
+}
+
+static void run_append(MDB_env *env, size_t vsize, result *res)
+{
+	run_put(env, vsize, res, 2);
+}
+
+/** Random point lookups, #batch per read txn */
+static void run_get(MDB_env *env, size_t vsize, result *res)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	unsigned char kbuf[8];
+	size_t i;
+	uint64_t t0, st = seed;
+
+	populate(env, nops, vsize);
+	res->r_start = now_ns();
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	key.mv_size = sizeof(kbuf);
+	key.mv_data = kbuf;
+	for (i = 0; i < nops; i++) {
+		if (i && i % batch == 0) {
+			mdb_txn_reset(txn);
+			E(mdb_txn_renew(txn));
+		}
+		mkkey(kbuf, rnd(&st) % nops);
+		t0 = now_ns();
+		E(mdb_get(txn, dbi, &key, &data));
+		lat_add(&res->r_op, i, now_ns() - t0);
+	}
+	mdb_txn_abort(txn);
+	res->r_ops = nops;
+}
+
+/** Cursor range scans of #scanlen records from random start keys */
+static void run_scan(MDB_env *env, size_t vsize, result *res)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_cursor *mc;
+	MDB_val key, data;
+	unsigned char kbuf[8];
+	size_t i, j, nscans = nops / scanlen ? nops / scanlen : 1;
+	uint64_t t0, st = seed;
+	int rc;
+
+	populate(env, nops, vsize);
+	res->r_start = now_ns();
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	E(mdb_cursor_open(txn, dbi, &mc));
+	for (i = 0; i < nscans; i++) {
+		if (i && i % batch == 0) {
+			mdb_txn_reset(txn);
+			E(mdb_txn_renew(txn));
+			E(mdb_cursor_renew(txn, mc));
+		}
+		mkkey(kbuf, rnd(&st) % nops);
+		key.mv_size = sizeof(kbuf);
+		key.mv_data = kbuf;
+		t0 = now_ns();
+		rc = mdb_cursor_get(mc, &key, &data, MDB_SET_RANGE);
+		for (j = 1; rc == MDB_SUCCESS && j < scanlen; j++)
+			rc = mdb_cursor_get(mc, &key, &data, MDB_NEXT);
+		if (rc && rc != MDB_NOTFOUND)
+			fail("mdb_cursor_get", rc);
+		lat_add(&res->r_op, i, now_ns() - t0);
+	}
+	mdb_cursor_close(mc);
+	mdb_txn_abort(txn);
+	res->r_ops = nscans;
+}
+
+/** Random single-value puts into a DUPSORT DB, #ndups values per key */
+static void run_dupsort(MDB_env *env, size_t vsize, result *res)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	unsigned char kbuf[8];
+	char *val = mkval(vsize);
+	size_t i, *perm;
+	uint64_t t0, st = seed;
+
+	perm = shuffle(nops, &st);
+	res->r_start = now_ns();
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, "dups", MDB_CREATE|MDB_DUPSORT, &dbi));
+	key.mv_size = sizeof(kbuf);
+	key.mv_data = kbuf;
+	for (i = 0; i < nops; i++) {
+		if (i && i % batch == 0)
+			commit(env, &txn, res, 1);
+		mkkey(kbuf, perm[i] / ndups);
+		mkkey((unsigned char *)val, perm[i] % ndups);
+		data.mv_size = vsize;
+		data.mv_data = val;
+		t0 = now_ns();
+		E(mdb_put(txn, dbi, &key, &data, 0));
+		lat_add(&res->r_op, i, now_ns() - t0);
+	}
+	commit(env, &txn, res, 0);
+	res->r_ops = nops;
+	free(perm);
+	free(val);
+}
+
+/** MDB_MULTIPLE puts of #ndups values per key into a DUPFIXED DB */
+static void run_dupfixed(MDB_env *env, size_t vsize, result *res)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_cursor *mc;
+	MDB_val key, data[2];
+	unsigned char kbuf[8];
+	char *vals = xmalloc(ndups * vsize), *val = mkval(vsize);
+	size_t i, j, nkeys = nops / ndups ? nops / ndups : 1, *perm;
+	uint64_t t0, st = seed;
+
+	for (j = 0; j < ndups; j++) {
+		memcpy(vals + j * vsize, val, vsize);
+		mkkey((unsigned char *)vals + j * vsize, j);
+	}
+	perm = shuffle(nkeys, &st);
+	res->r_start = now_ns();
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, "dups", MDB_CREATE|MDB_DUPSORT|MDB_DUPFIXED, &dbi));
+	E(mdb_cursor_open(txn, dbi, &mc));
+	key.mv_size = sizeof(kbuf);
+	key.mv_data = kbuf;
+	for (i = 0; i < nkeys; i++) {
+		if (i && i % (batch / ndups ? batch / ndups : 1) == 0) {
+			mdb_cursor_close(mc);
+			commit(env, &txn, res, 1);
+			E(mdb_cursor_open(txn, dbi, &mc));
+		}
+		mkkey(kbuf, perm[i]);
+		data[0].mv_size = vsize;
+		data[0].mv_data = vals;
+		data[1].mv_size = ndups;
+		t0 = now_ns();
+		E(mdb_cursor_put(mc, &key, data, MDB_MULTIPLE));
+		lat_add(&res->r_op, i, now_ns() - t0);
+	}
+	mdb_cursor_close(mc);
+	commit(env, &txn, res, 0);
+	res->r_ops = nkeys;
+	free(perm);
+	free(vals);
+	free(val);
+}
+
+/** State shared with the readers of the mixed workload */
+typedef struct mixed {
+	MDB_env *m_env;
+	MDB_dbi m_dbi;
+	volatile int m_stop;
+	uint64_t m_seed;
+	size_t m_ops;
+	double m_secs;
+	lat m_lat;
+} mixed;
+
+static void *mixed_reader(void *arg)
+{
+	mixed *mx = arg;
+	MDB_txn *txn;
+	MDB_val key, data;
+	unsigned char kbuf[8];
+	size_t i;
+	uint64_t t0, start = now_ns(), st = mx->m_seed;
+
+	E(mdb_txn_begin(mx->m_env, NULL, MDB_RDONLY, &txn));
+	key.mv_size = sizeof(kbuf);
+	key.mv_data = kbuf;
+	for (i = 0; !mx->m_stop; i++) {
+		if (i && i % batch == 0) {
+			mdb_txn_reset(txn);
+			E(mdb_txn_renew(txn));
+		}
+		mkkey(kbuf, rnd(&st) % nops);
+		t0 = now_ns();
+		E(mdb_get(txn, mx->m_dbi, &key, &data));
+		lat_add(&mx->m_lat, i, now_ns() - t0);
+	}
+	mdb_txn_abort(txn);
+	mx->m_ops = i;
+	mx->m_secs = (now_ns() - start) / 1e9;
+	return NULL;
+}
+
+/** One writer doing random overwrites while #nreaders threads
+ *	do random lookups. The readers' results go in \b rres.
+ */
+static void run_mixed(MDB_env *env, size_t vsize, result *res, result *rres)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	unsigned char kbuf[8];
+	char *val = mkval(vsize);
+	mixed *mx;
+	pthread_t *thr;
+	size_t i, j;
+	uint64_t t0, st = seed;
+	int r;
+
+	populate(env, nops, vsize);
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	mdb_txn_abort(txn);
+
+	mx = xmalloc(nreaders * sizeof(mixed));
+	thr = xmalloc(nreaders * sizeof(pthread_t));
+	for (r = 0; r < nreaders; r++) {
+		mx[r].m_env = env;
+		mx[r].m_dbi = dbi;
+		mx[r].m_stop = 0;
+		mx[r].m_seed = seed + r + 1;
+		lat_init(&mx[r].m_lat, nops);
+		if ((errno = pthread_create(&thr[r], NULL, mixed_reader, &mx[r])))
+			fail("pthread_create", errno);
+	}
+
+	res->r_start = now_ns();
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	key.mv_size = sizeof(kbuf);
+	key.mv_data = kbuf;
+	for (i = 0; i < nops; i++) {
+		if (i && i % batch == 0)
+			commit(env, &txn, res, 1);
+		mkkey(kbuf, rnd(&st) % nops);
+		data.mv_size = vsize;
+		data.mv_data = val;
+		t0 = now_ns();
+		E(mdb_put(txn, dbi, &key, &data, 0));
+		lat_add(&res->r_op, i, now_ns() - t0);
+	}
+	commit(env, &txn, res, 0);
+	res->r_ops = nops;
+	res->r_secs = (now_ns() - res->r_start) / 1e9;
+
+	for (r = 0; r < nreaders; r++)
+		mx[r].m_stop = 1;
+	for (r = 0; r < nreaders; r++) {
+		pthread_join(thr[r], NULL);
+		rres->r_ops += mx[r].m_ops;
+		if (rres->r_secs < mx[r].m_secs)
+			rres->r_secs = mx[r].m_secs;
+		for (j = 0; j < mx[r].m_lat.l_cnt; j++)
+			lat_add(&rres->r_op, rres->r_op.l_cnt, mx[r].m_lat.l_ns[j]);
+		free(mx[r].m_lat.l_ns);
+	}
+	free(thr);
+	free(mx);
+	free(val);
+}
+
+typedef struct workload {
+	const char *w_name;
+	void (*w_run)(MDB_env *env, size_t vsize, result *res);
+	unsigned w_dbflags;		/* DB flags that limit the value size */
+} workload;
+
+static workload workloads[] = {
+	{ "seqput", run_seqput, 0 },
+	{ "randput", run_randput, 0 },
+	{ "append", run_append, 0 },
+	{ "get", run_get, 0 },
+	{ "scan", run_scan, 0 },
+	{ "dupsort", run_dupsort, MDB_DUPSORT },
+	{ "dupfixed", run_dupfixed, MDB_DUPSORT },
+	{ "mixed", NULL, 0 },
+	{ NULL }
+};
+
+typedef struct mode {
+	const char *m_name;
+	unsigned m_flags;
+} mode;
+
+static mode modes[] = {
+	{ "sync", 0 },
+	{ "writemap", MDB_WRITEMAP },
+	{ "nosync", MDB_NOSYNC },
+	{ "nometasync", MDB_NOMETASYNC },
+	{ NULL }
+};
+
+/** Create an empty environment in #envpath */
+static MDB_env *bench_open(unsigned flags)
+{
+	MDB_env *env;
+	char *name = xmalloc(strlen(envpath) + sizeof("/lock.mdb"));
+
+	sprintf(name, "%s/data.mdb", envpath);
+	if (unlink(name) && errno != ENOENT)
+		fail(name, errno);
+	sprintf(name, "%s/lock.mdb", envpath);
+	if (unlink(name) && errno != ENOENT)
+		fail(name, errno);
+	free(name);
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, mapsize));
+	E(mdb_env_set_maxdbs(env, 2));
+	E(mdb_env_set_maxreaders(env, nreaders + 8));
+	E(mdb_env_open(env, envpath, flags, 0664));
+	return env;
+}
+
+static void print_lat(const char *name, lat *l)
+{
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	static const char *const tag[] = { "p50", "p90", "p99", "p999" };
+	size_t i;
+
+	qsort(l->l_ns, l->l_cnt, sizeof(uint64_t), cmp_u64);
+	printf(",\n      \"%s\": {", name);
+	for (i = 0; i < sizeof(pct)/sizeof(pct[0]); i++)
+		printf("\"%s\": %llu, ", tag[i], (unsigned long long)
+			l->l_ns[(size_t)(pct[i] / 100 * (l->l_cnt - 1))]);
+	printf("\"max\": %llu}", (unsigned long long)l->l_ns[l->l_cnt - 1]);
+}
+
+static void print_result(const char *wname, const char *mname, size_t vsize,
+	result *res, MDB_metrics *mm, int *first)
+{
+	printf("%s    {\"workload\": \"%s\", \"mode\": \"%s\", \"value_size\": %"Z"u,\n"
+		"      \"ops\": %"Z"u, \"seconds\": %.6f, \"ops_per_sec\": %.1f",
+		*first ? "" : ",\n", wname, mname, vsize, res->r_ops, res->r_secs,
+		res->r_secs > 0 ? res->r_ops / res->r_secs : 0.0);
+	*first = 0;
+	if (res->r_op.l_cnt)
+		print_lat("latency_ns", &res->r_op);
+	if (res->r_commit.l_cnt)
+		print_lat("commit_latency_ns", &res->r_commit);
+	if (mm) {
+		printf(",\n      \"metrics\": {\"splits\": %llu, \"merges\": %llu, "
+			"\"spilled\": %llu, \"free_reads\": %llu, \"flush_writes\": %llu,\n"
+			"        \"flush_bytes\": %llu, \"syncs\": %llu, \"sync_usec\": %llu,\n"
+			"        \"dpage_hits\": %llu, \"dpage_carved\": %llu, \"dpage_mallocs\": %llu}",
+			(unsigned long long)mm->mm_splits, (unsigned long long)mm->mm_merges,
+			(unsigned long long)mm->mm_spilled,
+			(unsigned long long)mm->mm_free_reads,
+			(unsigned long long)mm->mm_flush_writes,
+			(unsigned long long)mm->mm_flush_bytes,
+			(unsigned long long)mm->mm_syncs,
+			(unsigned long long)mm->mm_sync_usec,
+			(unsigned long long)mm->mm_dpage_hits,
+			(unsigned long long)mm->mm_dpage_carved,
+			(unsigned long long)mm->mm_dpage_mallocs);
+	}
+	printf("}");
+}
+
+/** Check \b name against a comma-separated \b list, NULL matching all */
+static int selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (!list)
+		return 1;
+	for (p = list; (p = strstr(p, name)) != NULL; p += len) {
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, first = 1;
+	char *wlist = NULL, *mlist = NULL, *sizes = "100,1000,4000", *ptr, *end;
+	size_t vsize;
+	workload *w;
+	mode *m;
+	MDB_env *env;
+	MDB_metrics mm;
+	result res, rres;
+
+	prog = argv[0];
+	mapsize = sizeof(size_t) > 4 ? (mdb_size_t)1 << 32 : (mdb_size_t)1 << 30;
+
+	/* -n: operations per workload
+	 * -b: operations per transaction
+	 * -r: reader threads in the mixed workload
+	 * -s: comma-separated value sizes
+	 * -w: comma-separated workloads
+	 * -m: comma-separated environment modes
+	 * -M: map size
+	 * -S: random seed
+	 * -V: print version and exit
+	 * (default) run every workload in every mode with every size
+	 */
+	while ((i = getopt(argc, argv, "b:m:n:r:s:w:M:S:V")) != EOF) {
+		switch(i) {
+		case 'V':
+			printf("%s\n", MDB_VERSION_STRING);
+			exit(0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, &end, 0);
+			if (*end || !batch)
+				usage();
+			break;
+		case 'm':
+			mlist = optarg;
+			break;
+		case 'n':
+			nops = strtoul(optarg, &end, 0);
+			if (*end || !nops)
+				usage();
+			break;
+		case 'r':
+			nreaders = strtol(optarg, &end, 0);
+			if (*end || nreaders < 1)
+				usage();
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 'w':
+			wlist = optarg;
+			break;
+		case 'M':
+			mapsize = strtoull(optarg, &end, 0);
+			if (*end || !mapsize)
+				usage();
+			break;
+		case 'S':
+			seed = strtoull(optarg, &end, 0);
+			if (*end || !seed)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+	envpath = argv[optind];
+
+	for (ptr = sizes; *ptr; ptr = end + (*end == ',')) {
+		vsize = strtoul(ptr, &end, 0);
+		if ((*end && *end != ',') || vsize < 8)
+			usage();
+	}
+	for (ptr = wlist; ptr && *ptr; ptr = end + (*end == ',')) {
+		end = ptr + strcspn(ptr, ",");
+		for (w = workloads; w->w_name; w++)
+			if (strlen(w->w_name) == (size_t)(end - ptr) &&
+				!strncmp(w->w_name, ptr, end - ptr))
+				break;
+		if (!w->w_name)
+			usage();
+	}
+	for (ptr = mlist; ptr && *ptr; ptr = end + (*end == ',')) {
+		end = ptr + strcspn(ptr, ",");
+		for (m = modes; m->m_name; m++)
+			if (strlen(m->m_name) == (size_t)(end - ptr) &&
+				!strncmp(m->m_name, ptr, end - ptr))
+				break;
+		if (!m->m_name)
+			usage();
+	}
+
+	printf("{\n  \"version\": \"%s\",\n  \"ops\": %"Z"u, \"batch\": %"Z"u, "
+		"\"readers\": %d, \"seed\": %llu,\n  \"results\": [\n",
+		MDB_VERSION_STRING, nops, batch, nreaders, (unsigned long long)seed);
+	for (w = workloads; w->w_name; w++) {
+		if (!selected(wlist, w->w_name))
+			continue;
+		for (m = modes; m->m_name; m++) {
+			if (!selected(mlist, m->m_name))
+				continue;
+			for (ptr = sizes; *ptr; ptr = end + (*end == ',')) {
+				vsize = strtoul(ptr, &end, 0);
+				env = bench_open(m->m_flags);
+				if ((w->w_dbflags & MDB_DUPSORT) &&
+					vsize > (size_t)mdb_env_get_maxkeysize(env)) {
+					mdb_env_close(env);
+					continue;
+				}
+				memset(&res, 0, sizeof(res));
+				memset(&rres, 0, sizeof(rres));
+				lat_init(&res.r_op, nops);
+				lat_init(&res.r_commit, nops / batch + 1);
+				if (w->w_run) {
+					w->w_run(env, vsize, &res);
+					res.r_secs = (now_ns() - res.r_start) / 1e9;
+				} else {
+					lat_init(&rres.r_op, nops * nreaders);
+					run_mixed(env, vsize, &res, &rres);
+				}
+				E(mdb_env_metrics(env, &mm));
+				print_result(w->w_run ? w->w_name : "mixed-write", m->m_name,
+					vsize, &res, &mm, &first);
+				if (!w->w_run) {
+					print_result("mixed-read", m->m_name, vsize, &rres,
+						NULL, &first);
+					free(rres.r_op.l_ns);
+				}
+				free(res.r_op.l_ns);
+				free(res.r_commit.l_ns);
+				mdb_env_close(env);
+			}
+		}
+	}
+	printf("\n  ]\n}\n");
+	return EXIT_SUCCESS;
+}
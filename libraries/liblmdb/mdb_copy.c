@@ -31,9 +31,11 @@ int main(int argc,char * argv[])
 {
 	int rc;
 	MDB_env *env;
-	const char *progname = argv[0], *act;
+	const char *progname = argv[0], *act, *base = NULL;
 	unsigned flags = MDB_RDONLY;
 	unsigned cpflags = 0;
+	unsigned nthreads = 1;
+	char *ptr;
 
 	for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
 		if (argv[1][1] == 'n' && argv[1][2] == '\0')
@@ -42,6 +44,20 @@ int main(int argc,char * argv[])
 			flags |= MDB_PREVSNAPSHOT;
 		else if (argv[1][1] == 'c' && argv[1][2] == '\0')
 			cpflags |= MDB_CP_COMPACT;
+		else if (argv[1][1] == 'i' && argv[1][2] == '\0' && argc > 2) {
+			base = argv[2];
+			argc--;
+			argv++;
+		}
+		else if (argv[1][1] == 'j' && argv[1][2] == '\0' && argc > 2) {
+			nthreads = strtoul(argv[2], &ptr, 10);
+			if (*ptr || !nthreads)
+				argc = 0;
+			else {
+				argc--;
+				argv++;
+			}
+		}
 		else if (argv[1][1] == 'V' && argv[1][2] == '\0') {
 			printf("%s\n", MDB_VERSION_STRING);
 			exit(0);
@@ -49,8 +65,8 @@ int main(int argc,char * argv[])
 			argc = 0;
 	}
 
-	if (argc<2 || argc>3) {
-		fprintf(stderr, "usage: %s [-V] [-c] [-n] [-v] srcpath [dstpath]\n", progname);
+	if (argc<2 || argc>3 || (base && cpflags)) {
+		fprintf(stderr, "usage: %s [-V] [-c] [-i basepath] [-j threads] [-n] [-v] srcpath [dstpath]\n", progname);
 		exit(EXIT_FAILURE);
 	}
 
@@ -70,10 +86,15 @@ int main(int argc,char * argv[])
 	}
 	if (rc == MDB_SUCCESS) {
 		act = "copying";
-		if (argc == 2)
-			rc = mdb_env_copyfd2(env, MDB_STDOUT, cpflags);
+		if (base) {
+			if (argc == 2)
+				rc = mdb_env_copyfd_delta(env, base, MDB_STDOUT);
+			else
+				rc = mdb_env_copy_delta(env, base, argv[2]);
+		} else if (argc == 2)
+			rc = mdb_env_copyfd3(env, MDB_STDOUT, cpflags, nthreads);
 		else
-			rc = mdb_env_copy2(env, argv[2], cpflags);
+			rc = mdb_env_copy3(env, argv[2], cpflags, nthreads);
 	}
 	if (rc)
 		fprintf(stderr, "%s: %s failed, error %d (%s)\n",
@@ -29,7 +29,7 @@ static void dumpsig( int sig )
 
 static void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s [-V] [-n] [-d] [-s subdb] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-n] [-d] [-l] [-s subdb] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -49,19 +49,23 @@ int main(int argc, char *argv[])
 	}
 
 	/* -d: delete the db, don't just empty it
+	 * -l: free the db's pages lazily, in later write txns
 	 * -s: drop the named subDB
 	 * -n: use NOSUBDIR flag on env_open
 	 * -V: print version and exit
 	 * (default) empty the main DB
 	 */
-	while ((i = getopt(argc, argv, "dns:V")) != EOF) {
+	while ((i = getopt(argc, argv, "dlns:V")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
 			exit(0);
 			break;
 		case 'd':
-			delete = 1;
+			delete |= 1;
+			break;
+		case 'l':
+			delete |= MDB_DROP_LAZY;
 			break;
 		case 'n':
 			envflags |= MDB_NOSUBDIR;
@@ -18,13 +18,28 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include "lmdb.h"
+#include "mblk.h"
 
 #define Yu	MDB_PRIy(u)
 
 #define PRINT	1
+#define BINARY	2
+#define CKSUM	4
 static int mode;
 
+#define BLK_SIZE	(256*1024)	/* Target size of a data block, see mblk.h */
+
+typedef struct dumpblk {
+	unsigned char *b_buf;
+	size_t b_len;
+	size_t b_size;
+	unsigned int b_db;
+} dumpblk;
+
+static pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct flagbit {
 	int bit;
 	char *name;
@@ -74,6 +89,89 @@ static void text(MDB_val *v)
 	putchar('\n');
 }
 
+/* Write out a block, or an end marker if it is empty */
+static int blkflush(dumpblk *b)
+{
+	mblk_hdr h;
+	size_t n;
+
+	h.bh_len = b->b_len - BLK_HDRSIZE;
+	h.bh_db = b->b_db;
+	h.bh_sum = (mode & CKSUM) ? mblk_sum(b->b_buf+BLK_HDRSIZE, h.bh_len) : 0;
+	mblk_puthdr(b->b_buf, &h);
+	pthread_mutex_lock(&outlock);
+	n = fwrite(b->b_buf, 1, b->b_len, stdout);
+	pthread_mutex_unlock(&outlock);
+	if (n != b->b_len)
+		return errno ? errno : EIO;
+	b->b_len = BLK_HDRSIZE;
+	return MDB_SUCCESS;
+}
+
+static int blkput(dumpblk *b, MDB_val *key, MDB_val *data)
+{
+	size_t need = 8 + key->mv_size + data->mv_size;
+	unsigned char *p;
+	int rc;
+
+	if (data->mv_size > 0xffffffffU)
+		return MDB_BAD_VALSIZE;
+	if (b->b_len > BLK_HDRSIZE && b->b_len + need > BLK_SIZE) {
+		rc = blkflush(b);
+		if (rc) return rc;
+	}
+	if (b->b_len + need > b->b_size) {
+		p = realloc(b->b_buf, b->b_len + need);
+		if (!p) return ENOMEM;
+		b->b_buf = p;
+		b->b_size = b->b_len + need;
+	}
+	p = b->b_buf + b->b_len;
+	mblk_put32(p, key->mv_size);
+	mblk_put32(p+4, data->mv_size);
+	memcpy(p+8, key->mv_data, key->mv_size);
+	memcpy(p+8+key->mv_size, data->mv_data, data->mv_size);
+	b->b_len += need;
+	return MDB_SUCCESS;
+}
+
+/* Dump the records of a database in the binary format */
+static int dumpbin(MDB_txn *txn, MDB_dbi dbi, unsigned int db)
+{
+	MDB_cursor *mc;
+	MDB_val key, data;
+	dumpblk b;
+	int rc;
+
+	b.b_size = BLK_SIZE;
+	b.b_buf = malloc(b.b_size);
+	if (!b.b_buf) return ENOMEM;
+	b.b_len = BLK_HDRSIZE;
+	b.b_db = db;
+
+	rc = mdb_cursor_open(txn, dbi, &mc);
+	if (rc) goto leave;
+	while ((rc = mdb_cursor_get(mc, &key, &data, MDB_NEXT)) == MDB_SUCCESS) {
+		if (gotsig) {
+			rc = EINTR;
+			break;
+		}
+		rc = blkput(&b, &key, &data);
+		if (rc) break;
+	}
+	mdb_cursor_close(mc);
+	if (rc == MDB_NOTFOUND) {
+		rc = MDB_SUCCESS;
+		if (b.b_len > BLK_HDRSIZE)
+			rc = blkflush(&b);
+		if (!rc)
+			rc = blkflush(&b);
+	}
+leave:
+	free(b.b_buf);
+	return rc;
+}
+
 static void byte(MDB_val *v)
 {
 	unsigned char *c, *end;
@@ -87,12 +185,10 @@ static void byte(MDB_val *v)
 	putchar('\n');
 }
 
-/* Dump in BDB-compatible format */
-static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
+/* Write the BDB-compatible header of a database */
+static int prhdr(MDB_txn *txn, MDB_dbi dbi, char *name)
 {
-	MDB_cursor *mc;
 	MDB_stat ms;
-	MDB_val key, data;
 	MDB_envinfo info;
 	unsigned int flags;
 	int rc, i;
@@ -107,7 +203,10 @@ static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
 	if (rc) return rc;
 
 	printf("VERSION=3\n");
-	printf("format=%s\n", mode & PRINT ? "print" : "bytevalue");
+	printf("format=%s\n", mode & BINARY ? "binary" :
+		mode & PRINT ? "print" : "bytevalue");
+	if (mode & CKSUM)
+		printf("checksum=crc32\n");
 	if (name)
 		printf("database=%s\n", name);
 	printf("type=btree\n");
@@ -125,6 +224,23 @@ static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
 
 	printf("db_pagesize=%d\n", ms.ms_psize);
 	printf("HEADER=END\n");
+	return MDB_SUCCESS;
+}
+
+/* Number of headers written so far */
+static unsigned int ndumped;
+
+/* Dump in BDB-compatible format */
+static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
+{
+	MDB_cursor *mc;
+	MDB_val key, data;
+	int rc;
+
+	rc = prhdr(txn, dbi, name);
+	if (rc) return rc;
+	if (mode & BINARY)
+		return dumpbin(txn, dbi, ndumped++);
 
 	rc = mdb_cursor_open(txn, dbi, &mc);
 	if (rc) return rc;
@@ -151,10 +267,119 @@ static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
 
 static void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s [-V] [-f output] [-l] [-n] [-p] [-v] [-a|-s subdb] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-f output] [-l] [-n] [-p|-b [-c]] [-v] [-a [-j threads]|-s subdb] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
+typedef struct dumpjob {
+	MDB_env *j_env;
+	MDB_dbi *j_dbis;
+	unsigned int j_ndbs;
+	unsigned int j_next;
+	int j_rc;
+	pthread_mutex_t j_lock;
+} dumpjob;
+
+/* Each thread dumps whole databases, in its own read txn */
+static void *dumpthr(void *arg)
+{
+	dumpjob *job = arg;
+	MDB_txn *txn;
+	unsigned int i;
+	int rc;
+
+	for (;;) {
+		pthread_mutex_lock(&job->j_lock);
+		i = job->j_rc ? job->j_ndbs : job->j_next++;
+		pthread_mutex_unlock(&job->j_lock);
+		if (i >= job->j_ndbs)
+			break;
+		rc = mdb_txn_begin(job->j_env, NULL, MDB_RDONLY, &txn);
+		if (rc == MDB_SUCCESS) {
+			rc = dumpbin(txn, job->j_dbis[i], i);
+			mdb_txn_abort(txn);
+		}
+		if (rc) {
+			pthread_mutex_lock(&job->j_lock);
+			if (!job->j_rc)
+				job->j_rc = rc;
+			pthread_mutex_unlock(&job->j_lock);
+		}
+	}
+	return NULL;
+}
+
+/* Dump the named databases in parallel. The environment is opened
+ * again with enough DBI slots to hold them all open at once. All the
+ * headers are written first, then the threads' blocks as they fill.
+ */
+static int dumppar(char *envname, int envflags, char **names, unsigned int count,
+	unsigned int nthreads)
+{
+	MDB_env *env;
+	MDB_txn *txn;
+	dumpjob job;
+	pthread_t *thr;
+	unsigned int i;
+	int rc;
+
+	memset(&job, 0, sizeof(job));
+	job.j_dbis = malloc(count * sizeof(MDB_dbi));
+	thr = malloc(nthreads * sizeof(pthread_t));
+	if (!job.j_dbis || !thr) {
+		rc = ENOMEM;
+		goto leave;
+	}
+	rc = mdb_env_create(&env);
+	if (rc) goto leave;
+	mdb_env_set_maxdbs(env, count + 1);
+	if (nthreads + 1 > 126)
+		mdb_env_set_maxreaders(env, nthreads + 1);
+	rc = mdb_env_open(env, envname, envflags | MDB_RDONLY, 0664);
+	if (rc) goto env_close;
+
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc) goto env_close;
+	for (i=0; i<count; i++) {
+		rc = mdb_open(txn, names[i], 0, &job.j_dbis[i]);
+		if (rc == MDB_SUCCESS)
+			rc = prhdr(txn, job.j_dbis[i], names[i]);
+		if (rc) {
+			mdb_txn_abort(txn);
+			goto env_close;
+		}
+	}
+	/* Committing keeps the DBI handles */
+	rc = mdb_txn_commit(txn);
+	if (rc) goto env_close;
+
+	job.j_env = env;
+	job.j_ndbs = count;
+	pthread_mutex_init(&job.j_lock, NULL);
+	if (nthreads > count)
+		nthreads = count;
+	for (i=0; i<nthreads; i++) {
+		if ((rc = pthread_create(&thr[i], NULL, dumpthr, &job)) != 0) {
+			pthread_mutex_lock(&job.j_lock);
+			job.j_rc = rc;
+			pthread_mutex_unlock(&job.j_lock);
+			break;
+		}
+	}
+	nthreads = i;
+	for (i=0; i<nthreads; i++)
+		pthread_join(thr[i], NULL);
+	pthread_mutex_destroy(&job.j_lock);
+	rc = job.j_rc;
+
+env_close:
+	mdb_env_close(env);
+leave:
+	free(thr);
+	free(job.j_dbis);
+	return rc;
+}
+
 int main(int argc, char *argv[])
 {
 	int i, rc;
@@ -163,7 +388,9 @@ int main(int argc, char *argv[])
 	MDB_dbi dbi;
 	char *prog = argv[0];
 	char *envname;
-	char *subname = NULL;
+	char *subname = NULL, *end;
+	char **names = NULL;
+	unsigned int nthreads = 1, nnames = 0;
 	int alldbs = 0, envflags = 0, list = 0;
 
 	if (argc < 2) {
@@ -174,12 +401,15 @@ int main(int argc, char *argv[])
 	 * -s: dump only the named subDB
 	 * -n: use NOSUBDIR flag on env_open
 	 * -p: use printable characters
+	 * -b: use the binary format
+	 * -c: checksum blocks of the binary format
+	 * -j: dump this many subDBs at once with -a -b
 	 * -f: write to file instead of stdout
 	 * -v: use previous snapshot
 	 * -V: print version and exit
 	 * (default) dump only the main DB
 	 */
-	while ((i = getopt(argc, argv, "af:lnps:V")) != EOF) {
+	while ((i = getopt(argc, argv, "abcf:j:lnps:V")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
@@ -209,6 +439,17 @@ int main(int argc, char *argv[])
 		case 'p':
 			mode |= PRINT;
 			break;
+		case 'b':
+			mode |= BINARY;
+			break;
+		case 'c':
+			mode |= CKSUM;
+			break;
+		case 'j':
+			nthreads = strtoul(optarg, &end, 10);
+			if (*end || !nthreads)
+				usage(prog);
+			break;
 		case 's':
 			if (alldbs)
 				usage(prog);
@@ -221,6 +462,12 @@ int main(int argc, char *argv[])
 
 	if (optind != argc - 1)
 		usage(prog);
+	if ((mode & BINARY) ? (mode & PRINT) != 0 : (mode & CKSUM) != 0)
+		usage(prog);
+	if (nthreads > 1 && (!(mode & BINARY) || alldbs != 1 || list))
+		usage(prog);
+	if (mode & CKSUM)
+		mblk_crcinit();
 
 #ifdef SIGPIPE
 	signal(SIGPIPE, dumpsig);
@@ -280,7 +527,21 @@ int main(int argc, char *argv[])
 			memcpy(str, key.mv_data, key.mv_size);
 			str[key.mv_size] = '\0';
 			rc = mdb_open(txn, str, 0, &db2);
-			if (rc == MDB_SUCCESS) {
+			if (rc == MDB_SUCCESS && nthreads > 1) {
+				/* Just collect the names for dumppar() */
+				char **n2 = realloc(names, (nnames+1) * sizeof(char *));
+				if (n2) {
+					names = n2;
+					names[nnames++] = str;
+					str = NULL;
+				}
+				mdb_close(env, db2);
+				if (!n2) {
+					free(str);
+					rc = ENOMEM;
+					break;
+				}
+			} else if (rc == MDB_SUCCESS) {
 				if (list) {
 					printf("%s\n", str);
 					list++;
@@ -301,6 +562,15 @@ int main(int argc, char *argv[])
 		} else if (rc == MDB_NOTFOUND) {
 			rc = MDB_SUCCESS;
 		}
+		if (nthreads > 1 && rc == MDB_SUCCESS) {
+			mdb_close(env, dbi);
+			mdb_txn_abort(txn);
+			mdb_env_close(env);
+			rc = dumppar(envname, envflags, names, nnames, nthreads);
+			if (rc)
+				fprintf(stderr, "%s: %s: %s\n", prog, envname, mdb_strerror(rc));
+			goto done;
+		}
 	} else {
 		rc = dumpit(txn, dbi, subname);
 	}
@@ -312,6 +582,12 @@ txn_abort:
 	mdb_txn_abort(txn);
 env_close:
 	mdb_env_close(env);
+done:
+	if (names) {
+		for (i=0; i<(int)nnames; i++)
+			free(names[i]);
+		free(names);
+	}
 
 	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
 }
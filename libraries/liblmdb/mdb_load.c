@@ -17,10 +17,14 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "lmdb.h"
+#include "mblk.h"
 
 #define PRINT	1
 #define NOHDR	2
+#define BINARY	4
+#define CKSUM	8
 static int mode;
 
 static char *subname = NULL;
@@ -66,6 +70,7 @@ static void readhdr(void)
 	char *ptr;
 
 	flags = 0;
+	mode &= ~(BINARY|CKSUM);
 	while (fgets(dbuf.mv_data, dbuf.mv_size, stdin) != NULL) {
 		lineno++;
 		if (!strncmp(dbuf.mv_data, "VERSION=", STRLENOF("VERSION="))) {
@@ -80,11 +85,20 @@ static void readhdr(void)
 		} else if (!strncmp(dbuf.mv_data, "format=", STRLENOF("format="))) {
 			if (!strncmp((char *)dbuf.mv_data+STRLENOF("FORMAT="), "print", STRLENOF("print")))
 				mode |= PRINT;
+			else if (!strncmp((char *)dbuf.mv_data+STRLENOF("FORMAT="), "binary", STRLENOF("binary")))
+				mode |= BINARY;
 			else if (strncmp((char *)dbuf.mv_data+STRLENOF("FORMAT="), "bytevalue", STRLENOF("bytevalue"))) {
 				fprintf(stderr, "%s: line %"Yu": unsupported FORMAT %s\n",
 					prog, lineno, (char *)dbuf.mv_data+STRLENOF("FORMAT="));
 				exit(EXIT_FAILURE);
 			}
+		} else if (!strncmp(dbuf.mv_data, "checksum=", STRLENOF("checksum="))) {
+			if (strncmp((char *)dbuf.mv_data+STRLENOF("checksum="), "crc32", STRLENOF("crc32"))) {
+				fprintf(stderr, "%s: line %"Yu": unsupported checksum %s\n",
+					prog, lineno, (char *)dbuf.mv_data+STRLENOF("checksum="));
+				exit(EXIT_FAILURE);
+			}
+			mode |= CKSUM;
 		} else if (!strncmp(dbuf.mv_data, "database=", STRLENOF("database="))) {
 			ptr = memchr(dbuf.mv_data, '\n', dbuf.mv_size);
 			if (ptr) *ptr = '\0';
@@ -285,12 +299,456 @@ static int greater(const MDB_val *a, const MDB_val *b)
 	return 1;
 }
 
+/* The binary format of mdb_dump -b, see mblk.h.
+ *
+ * A reader thread reads and decodes the blocks and hands them to the
+ * main thread, which does the puts.
+ */
+#define NBLKS	4	/* Blocks in flight between the threads */
+
+enum { B_HDR, B_DATA, B_END, B_EOF, B_ERR };
+
+typedef struct loadblk {
+	int b_type;
+	unsigned int b_db;
+	char *b_name;		/* B_HDR: database name */
+	int b_flags;		/* B_HDR: database flags */
+	unsigned char *b_buf;
+	size_t b_size;
+	MDB_val *b_recs;	/* B_DATA: key, data pairs pointing into b_buf */
+	size_t b_nrecs;
+	size_t b_maxrecs;
+} loadblk;
+
+static loadblk blks[NBLKS];
+static unsigned int bprod, bcons, nfull;
+static int bstop;
+static pthread_mutex_t blklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blkfull = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t blkfree = PTHREAD_COND_INITIALIZER;
+
+/* Per database checksum flags, owned by the reader thread */
+static char *sectsum;
+static unsigned int nsectsum;
+
+typedef struct loadsect {
+	char *s_name;
+	int s_flags;
+	MDB_dbi s_dbi;
+	MDB_cursor *s_mc;
+	MDB_bulk *s_bulk;
+	MDB_val s_prevk;
+	int s_open;
+	int s_done;
+} loadsect;
+
+/* Databases seen so far, owned by the main thread */
+static loadsect *sects;
+static unsigned int nsects;
+
+/* Wait for a block to fill (full) or to decode into (!full).
+ * Returns NULL once the main thread has given up.
+ */
+static loadblk *blkwait(int full)
+{
+	loadblk *b;
+
+	pthread_mutex_lock(&blklock);
+	while (!bstop && (full ? nfull == 0 : nfull == NBLKS))
+		pthread_cond_wait(full ? &blkfull : &blkfree, &blklock);
+	b = bstop ? NULL : &blks[(full ? bcons : bprod) % NBLKS];
+	pthread_mutex_unlock(&blklock);
+	return b;
+}
+
+/* Pass on the block from #blkwait() */
+static void blkdone(int full)
+{
+	pthread_mutex_lock(&blklock);
+	if (full) {
+		bcons++;
+		nfull--;
+		pthread_cond_signal(&blkfree);
+	} else {
+		bprod++;
+		nfull++;
+		pthread_cond_signal(&blkfull);
+	}
+	pthread_mutex_unlock(&blklock);
+}
+
+/* Remember the checksum flag of each header the reader sees */
+static int addsum(void)
+{
+	char *p = realloc(sectsum, nsectsum+1);
+	if (!p) return ENOMEM;
+	sectsum = p;
+	sectsum[nsectsum++] = (mode & CKSUM) != 0;
+	return MDB_SUCCESS;
+}
+
+static int addsect(char *name, int dbflags)
+{
+	loadsect *s = realloc(sects, (nsects+1) * sizeof(loadsect));
+	if (!s) return ENOMEM;
+	sects = s;
+	s += nsects++;
+	memset(s, 0, sizeof(*s));
+	s->s_name = name;
+	s->s_flags = dbflags;
+	return MDB_SUCCESS;
+}
+
+static int readblk(loadblk *b, mdb_size_t nblk)
+{
+	unsigned char hdr[BLK_HDRSIZE], *p, *end;
+	mblk_hdr h;
+	size_t len, klen, dlen;
+	int c;
+
+	c = getc(stdin);
+	if (c == EOF) {
+		b->b_type = B_EOF;
+		return MDB_SUCCESS;
+	}
+	ungetc(c, stdin);
+	if (c == 'V') {
+		readhdr();
+		if (!(mode & BINARY)) {
+			fprintf(stderr, "%s: line %"Yu": cannot mix binary and text formats\n",
+				prog, lineno);
+			return MDB_INVALID;
+		}
+		if (addsum())
+			return ENOMEM;
+		b->b_type = B_HDR;
+		b->b_db = nsectsum - 1;
+		b->b_name = subname ? strdup(subname) : NULL;
+		b->b_flags = flags;
+		return MDB_SUCCESS;
+	}
+	if (fread(hdr, 1, BLK_HDRSIZE, stdin) != BLK_HDRSIZE ||
+		mblk_gethdr(hdr, &h)) {
+		fprintf(stderr, "%s: block %"Yu": bad block header\n", prog, nblk);
+		return MDB_INVALID;
+	}
+	len = h.bh_len;
+	b->b_db = h.bh_db;
+	if (b->b_db >= nsectsum) {
+		fprintf(stderr, "%s: block %"Yu": no header for database %u\n",
+			prog, nblk, b->b_db);
+		return MDB_INVALID;
+	}
+	if (!len) {
+		b->b_type = B_END;
+		return MDB_SUCCESS;
+	}
+	if (len > b->b_size) {
+		p = realloc(b->b_buf, len);
+		if (!p) return ENOMEM;
+		b->b_buf = p;
+		b->b_size = len;
+	}
+	if (fread(b->b_buf, 1, len, stdin) != len) {
+		fprintf(stderr, "%s: block %"Yu": unexpected end of input\n", prog, nblk);
+		return MDB_INVALID;
+	}
+	if (sectsum[b->b_db] && mblk_sum(b->b_buf, len) != h.bh_sum) {
+		fprintf(stderr, "%s: block %"Yu": checksum mismatch\n", prog, nblk);
+		return MDB_INVALID;
+	}
+
+	b->b_type = B_DATA;
+	b->b_nrecs = 0;
+	p = b->b_buf;
+	end = p + len;
+	while (p < end) {
+		if (end - p < 8 ||
+			(klen = mblk_get32(p), dlen = mblk_get32(p+4), (size_t)(end - p - 8) < klen) ||
+			(size_t)(end - p - 8) - klen < dlen) {
+			fprintf(stderr, "%s: block %"Yu": bad record\n", prog, nblk);
+			return MDB_INVALID;
+		}
+		if (b->b_nrecs == b->b_maxrecs) {
+			size_t n = b->b_maxrecs ? b->b_maxrecs * 2 : 1024;
+			MDB_val *r = realloc(b->b_recs, n * 2 * sizeof(MDB_val));
+			if (!r) return ENOMEM;
+			b->b_recs = r;
+			b->b_maxrecs = n;
+		}
+		b->b_recs[b->b_nrecs*2].mv_size = klen;
+		b->b_recs[b->b_nrecs*2].mv_data = p+8;
+		b->b_recs[b->b_nrecs*2+1].mv_size = dlen;
+		b->b_recs[b->b_nrecs*2+1].mv_data = p+8+klen;
+		b->b_nrecs++;
+		p += 8 + klen + dlen;
+	}
+	return MDB_SUCCESS;
+}
+
+static void *readthr(void *arg)
+{
+	loadblk *b;
+	mdb_size_t nblk = 0;
+
+	while ((b = blkwait(0)) != NULL) {
+		if (readblk(b, nblk++))
+			b->b_type = B_ERR;
+		blkdone(0);
+		if (b->b_type == B_EOF || b->b_type == B_ERR)
+			break;
+	}
+	return NULL;
+}
+
+/* Open the cursors of the unfinished databases in a new txn */
+static int binbegin(MDB_env *env, MDB_txn **txn, int append)
+{
+	loadsect *s;
+	unsigned int i;
+	int rc;
+
+	rc = mdb_txn_begin(env, NULL, 0, txn);
+	if (rc) {
+		fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc, mdb_strerror(rc));
+		return rc;
+	}
+	for (i=0, s=sects; i<nsects; i++, s++) {
+		if (!s->s_open || s->s_done)
+			continue;
+		rc = mdb_cursor_open(*txn, s->s_dbi, &s->s_mc);
+		if (rc) {
+			fprintf(stderr, "mdb_cursor_open failed, error %d %s\n", rc, mdb_strerror(rc));
+			return rc;
+		}
+		if (append && (s->s_flags & MDB_DUPSORT) && s->s_prevk.mv_size) {
+			MDB_val k, d;
+			mdb_cursor_get(s->s_mc, &k, &d, MDB_LAST);
+		}
+	}
+	return MDB_SUCCESS;
+}
+
+/* Commit, and close the databases which are done */
+static int bincommit(MDB_env *env, MDB_txn **txn)
+{
+	loadsect *s;
+	unsigned int i;
+	int rc;
+
+	rc = mdb_txn_commit(*txn);
+	*txn = NULL;
+	if (rc) {
+		fprintf(stderr, "%s: line %"Yu": txn_commit: %s\n",
+			prog, lineno, mdb_strerror(rc));
+		return rc;
+	}
+	for (i=0, s=sects; i<nsects; i++, s++) {
+		if (s->s_open && s->s_done) {
+			mdb_dbi_close(env, s->s_dbi);
+			s->s_open = 0;
+		}
+	}
+	return MDB_SUCCESS;
+}
+
+static int binopen(MDB_txn *txn, loadsect *s, int append, size_t maxkey)
+{
+	int rc;
+
+	rc = mdb_open(txn, s->s_name, s->s_flags|MDB_CREATE, &s->s_dbi);
+	if (rc) {
+		fprintf(stderr, "mdb_open failed, error %d %s\n", rc, mdb_strerror(rc));
+		return rc;
+	}
+	s->s_open = 1;
+	if (append) {
+		mdb_set_compare(txn, s->s_dbi, greater);
+		if (s->s_flags & MDB_DUPSORT)
+			mdb_set_dupsort(txn, s->s_dbi, greater);
+	}
+	rc = mdb_cursor_open(txn, s->s_dbi, &s->s_mc);
+	if (rc) {
+		fprintf(stderr, "mdb_cursor_open failed, error %d %s\n", rc, mdb_strerror(rc));
+		return rc;
+	}
+	if (append && (s->s_flags & MDB_DUPSORT)) {
+		s->s_prevk.mv_data = malloc(maxkey);
+		if (!s->s_prevk.mv_data)
+			return ENOMEM;
+	}
+	/* Sorted input into an empty DB can be built directly */
+	if (append && !(s->s_flags & MDB_DUPSORT)) {
+		rc = mdb_bulk_begin(txn, s->s_dbi, 0, &s->s_bulk);
+		if (rc == MDB_INCOMPATIBLE) {
+			s->s_bulk = NULL;
+			rc = MDB_SUCCESS;
+		} else if (rc) {
+			fprintf(stderr, "mdb_bulk_begin failed, error %d %s\n", rc, mdb_strerror(rc));
+		}
+	}
+	return rc;
+}
+
+static int binput(loadsect *s, MDB_val *key, MDB_val *data, int putflags, int append)
+{
+	int rc, appflag = 0;
+
+	if (s->s_bulk) {
+		rc = mdb_bulk_add(s->s_bulk, key, data);
+		if (rc && !(rc == MDB_KEYEXIST && putflags))
+			fprintf(stderr, "mdb_bulk_add failed, error %d %s\n", rc, mdb_strerror(rc));
+		return rc;
+	}
+	if (append) {
+		appflag = MDB_APPEND;
+		if (s->s_flags & MDB_DUPSORT) {
+			if (s->s_prevk.mv_size == key->mv_size &&
+				!memcmp(s->s_prevk.mv_data, key->mv_data, key->mv_size))
+				appflag = MDB_CURRENT|MDB_APPENDDUP;
+			else {
+				memcpy(s->s_prevk.mv_data, key->mv_data, key->mv_size);
+				s->s_prevk.mv_size = key->mv_size;
+			}
+		}
+	}
+	rc = mdb_cursor_put(s->s_mc, key, data, putflags|appflag);
+	if (rc && !(rc == MDB_KEYEXIST && putflags))
+		fprintf(stderr, "mdb_cursor_put failed, error %d %s\n", rc, mdb_strerror(rc));
+	return rc;
+}
+
+/* Load a binary dump. The databases whose headers have been read
+ * already are in sects[].
+ */
+static int loadbin(MDB_env *env, int putflags, int append)
+{
+	MDB_txn *txn = NULL;
+	pthread_t thr;
+	loadblk *b;
+	loadsect *s;
+	size_t maxkey = mdb_env_get_maxkeysize(env), i;
+	unsigned int j;
+	int rc, nbulk = 0, batch = 0, type;
+
+	rc = mdb_txn_begin(env, NULL, 0, &txn);
+	if (rc) {
+		fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc, mdb_strerror(rc));
+		return rc;
+	}
+	for (j=0; j<nsects; j++) {
+		rc = binopen(txn, &sects[j], append, maxkey);
+		if (rc) goto txn_abort;
+		nbulk += sects[j].s_bulk != NULL;
+	}
+
+	if ((rc = pthread_create(&thr, NULL, readthr, NULL)) != 0) {
+		fprintf(stderr, "%s: pthread_create: %s\n", prog, strerror(rc));
+		goto txn_abort;
+	}
+
+	for (;;) {
+		b = blkwait(1);
+		type = b->b_type;
+		s = type == B_HDR || b->b_db >= nsects ? NULL : &sects[b->b_db];
+		switch(type) {
+		case B_HDR:
+			if ((rc = addsect(b->b_name, b->b_flags)) != 0)
+				break;
+			s = &sects[nsects-1];
+			rc = binopen(txn, s, append, maxkey);
+			nbulk += s->s_bulk != NULL;
+			break;
+		case B_DATA:
+			if (!s || s->s_done) {
+				fprintf(stderr, "%s: data for a finished database\n", prog);
+				rc = MDB_INVALID;
+				break;
+			}
+			for (i=0; i<b->b_nrecs; i++) {
+				rc = binput(s, &b->b_recs[i*2], &b->b_recs[i*2+1], putflags, append);
+				if (rc == MDB_KEYEXIST && putflags)
+					rc = MDB_SUCCESS;
+				else if (rc)
+					break;
+				else if (!s->s_bulk)
+					batch++;
+			}
+			break;
+		case B_END:
+			if (!s || s->s_done) {
+				fprintf(stderr, "%s: data for a finished database\n", prog);
+				rc = MDB_INVALID;
+				break;
+			}
+			if (s->s_bulk) {
+				rc = mdb_bulk_finish(s->s_bulk);
+				s->s_bulk = NULL;
+				nbulk--;
+				if (rc) {
+					fprintf(stderr, "mdb_bulk_finish failed, error %d %s\n", rc, mdb_strerror(rc));
+					break;
+				}
+			}
+			mdb_cursor_close(s->s_mc);
+			s->s_mc = NULL;
+			s->s_done = 1;
+			/* Commit so the DBI slot can be reused */
+			batch = 100;
+			break;
+		case B_ERR:
+			rc = MDB_INVALID;
+			break;
+		}
+		blkdone(1);
+		if (rc || type == B_EOF || type == B_ERR)
+			break;
+		/* A bulk build must finish in the txn that began it, and there
+		 * is only one write txn, so nothing is committed while any
+		 * bulk section is open: the other databases' records pile up
+		 * in this txn until the last open bulk section ends.
+		 */
+		if (batch >= 100 && !nbulk) {
+			if ((rc = bincommit(env, &txn)) != 0)
+				break;
+			if ((rc = binbegin(env, &txn, append)) != 0)
+				break;
+			batch = 0;
+		}
+	}
+
+	pthread_mutex_lock(&blklock);
+	bstop = 1;
+	pthread_cond_broadcast(&blkfree);
+	pthread_mutex_unlock(&blklock);
+	pthread_join(thr, NULL);
+
+	if (rc == MDB_SUCCESS) {
+		for (j=0; j<nsects; j++) {
+			if (!sects[j].s_done) {
+				fprintf(stderr, "%s: unexpected end of input\n", prog);
+				rc = MDB_INVALID;
+				break;
+			}
+		}
+	}
+	if (rc == MDB_SUCCESS)
+		return bincommit(env, &txn);
+
+txn_abort:
+	for (j=0; j<nsects; j++)
+		mdb_bulk_abort(sects[j].s_bulk);
+	mdb_txn_abort(txn);
+	return rc;
+}
+
 int main(int argc, char *argv[])
 {
 	int i, rc;
 	MDB_env *env;
 	MDB_txn *txn;
 	MDB_cursor *mc;
+	MDB_bulk *bulk = NULL;
 	MDB_dbi dbi;
 	char *envname;
 	int envflags = MDB_NOSYNC, putflags = 0;
@@ -353,6 +811,30 @@ int main(int argc, char *argv[])
 	if (!(mode & NOHDR))
 		readhdr();
 
+	if (mode & BINARY) {
+		int c;
+
+		mblk_crcinit();
+		/* Databases dumped in parallel have all their headers first */
+		for (;;) {
+			if (addsum() || addsect(subname ? strdup(subname) : NULL, flags)) {
+				fprintf(stderr, "%s: out of memory\n", prog);
+				exit(EXIT_FAILURE);
+			}
+			if ((c = getc(stdin)) != 'V')
+				break;
+			ungetc(c, stdin);
+			readhdr();
+			if (!(mode & BINARY)) {
+				fprintf(stderr, "%s: line %"Yu": cannot mix binary and text formats\n",
+					prog, lineno);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (c != EOF)
+			ungetc(c, stdin);
+	}
+
 	envname = argv[optind];
 	rc = mdb_env_create(&env);
 	if (rc) {
@@ -360,7 +842,7 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	mdb_env_set_maxdbs(env, 2);
+	mdb_env_set_maxdbs(env, nsects + 2);
 
 	if (info.me_maxreaders)
 		mdb_env_set_maxreaders(env, info.me_maxreaders);
@@ -377,6 +859,11 @@ int main(int argc, char *argv[])
 		goto env_close;
 	}
 
+	if (mode & BINARY) {
+		rc = loadbin(env, putflags, append);
+		goto env_close;
+	}
+
 	kbuf.mv_size = mdb_env_get_maxkeysize(env) * 2 + 2;
 	kbuf.mv_data = malloc(kbuf.mv_size * 2);
 	k0buf.mv_size = kbuf.mv_size;
@@ -390,9 +877,16 @@ int main(int argc, char *argv[])
 
 		if (!dohdr) {
 			dohdr = 1;
-		} else if (!(mode & NOHDR))
+		} else if (!(mode & NOHDR)) {
 			readhdr();
-		
+			if (mode & BINARY) {
+				fprintf(stderr, "%s: line %"Yu": cannot mix binary and text formats\n",
+					prog, lineno);
+				rc = MDB_INVALID;
+				goto env_close;
+			}
+		}
+
 		rc = mdb_txn_begin(env, NULL, 0, &txn);
 		if (rc) {
 			fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc, mdb_strerror(rc));
@@ -417,6 +911,17 @@ int main(int argc, char *argv[])
 			goto txn_abort;
 		}
 
+		/* Sorted input into an empty DB can be built directly */
+		if (append && !(flags & MDB_DUPSORT)) {
+			rc = mdb_bulk_begin(txn, dbi, 0, &bulk);
+			if (rc == MDB_INCOMPATIBLE) {
+				bulk = NULL;
+			} else if (rc) {
+				fprintf(stderr, "mdb_bulk_begin failed, error %d %s\n", rc, mdb_strerror(rc));
+				goto txn_abort;
+			}
+		}
+
 		while(1) {
 			rc = readline(&key, &kbuf);
 			if (rc)  /* rc == EOF */
@@ -428,6 +933,17 @@ int main(int argc, char *argv[])
 				goto txn_abort;
 			}
 
+			if (bulk) {
+				rc = mdb_bulk_add(bulk, &key, &data);
+				if (rc == MDB_KEYEXIST && putflags)
+					continue;
+				if (rc) {
+					fprintf(stderr, "mdb_bulk_add failed, error %d %s\n", rc, mdb_strerror(rc));
+					goto txn_abort;
+				}
+				continue;
+			}
+
 			if (append) {
 				appflag = MDB_APPEND;
 				if (flags & MDB_DUPSORT) {
@@ -473,6 +989,14 @@ int main(int argc, char *argv[])
 				batch = 0;
 			}
 		}
+		if (bulk) {
+			rc = mdb_bulk_finish(bulk);
+			bulk = NULL;
+			if (rc) {
+				fprintf(stderr, "mdb_bulk_finish failed, error %d %s\n", rc, mdb_strerror(rc));
+				goto txn_abort;
+			}
+		}
 		rc = mdb_txn_commit(txn);
 		txn = NULL;
 		if (rc) {
@@ -484,6 +1008,7 @@ int main(int argc, char *argv[])
 	}
 
 txn_abort:
+	mdb_bulk_abort(bulk);
 	mdb_txn_abort(txn);
 env_close:
 	mdb_env_close(env);
@@ -0,0 +1,105 @@
+/* mdb_restore.c - memory-mapped database incremental restore tool */
+/*
+ * Copyright 2012-2018 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include "lmdb.h"
+
+static void
+sighandle(int sig)
+{
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-V] [-n] envpath [deltafile ...]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, rc = 0, fd;
+	MDB_env *env;
+	char *prog = argv[0];
+	char *envname, *act;
+	const char *delta = "stdin";
+	int envflags = 0;
+
+	/* -n: use NOSUBDIR flag on env_open
+	 * -V: print version and exit
+	 * Each deltafile is applied in turn, or stdin if there are none.
+	 */
+	while ((i = getopt(argc, argv, "nV")) != EOF) {
+		switch(i) {
+		case 'V':
+			printf("%s\n", MDB_VERSION_STRING);
+			exit(0);
+			break;
+		case 'n':
+			envflags |= MDB_NOSUBDIR;
+			break;
+		default:
+			usage(prog);
+		}
+	}
+
+	if (optind >= argc)
+		usage(prog);
+	envname = argv[optind++];
+
+#ifdef SIGPIPE
+	signal(SIGPIPE, sighandle);
+#endif
+#ifdef SIGHUP
+	signal(SIGHUP, sighandle);
+#endif
+	signal(SIGINT, sighandle);
+	signal(SIGTERM, sighandle);
+
+	do {
+		fd = 0;
+		if (optind < argc) {
+			delta = argv[optind++];
+			act = "opening delta";
+			fd = open(delta, O_RDONLY);
+			if (fd < 0) {
+				rc = errno;
+				break;
+			}
+		}
+		/* The environment must be reopened after each delta */
+		act = "opening environment";
+		rc = mdb_env_create(&env);
+		if (rc == MDB_SUCCESS) {
+			rc = mdb_env_open(env, envname, envflags, 0664);
+			if (rc == MDB_SUCCESS) {
+				act = "applying delta";
+				rc = mdb_env_apply_delta(env, fd);
+			}
+			mdb_env_close(env);
+		}
+		if (fd)
+			close(fd);
+	} while (rc == MDB_SUCCESS && optind < argc);
+
+	if (rc)
+		fprintf(stderr, "%s: %s failed for %s, error %d (%s)\n",
+			prog, act, delta, rc, mdb_strerror(rc));
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
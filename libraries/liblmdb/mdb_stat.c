@@ -11,6 +11,7 @@
  * top-level directory of the distribution or, alternatively, at
  * <http://www.OpenLDAP.org/license.html>.
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,9 +33,97 @@ static void prstat(MDB_stat *ms)
 	printf("  Entries: %"Yu"\n",        ms->ms_entries);
 }
 
+/* Print a histogram of MDB_SIZE_HIST power-of-2 buckets. Bucket b
+ * holds the values of b significant bits; the first \b off buckets
+ * are omitted from \b hist.
+ */
+static void prhist(const char *title, mdb_size_t *hist, int off)
+{
+	char buf[64];
+	int i, b;
+
+	printf("    %s\n", title);
+	for (i = 0; i < MDB_SIZE_HIST; i++) {
+		if (!hist[i])
+			continue;
+		b = i + off;
+		if (b <= 1)
+			sprintf(buf, "%d", b);
+		else if (i == MDB_SIZE_HIST-1)
+			sprintf(buf, ">= %"Yu, (mdb_size_t)1 << (b - 1));
+		else
+			sprintf(buf, "%"Yu"-%"Yu, (mdb_size_t)1 << (b - 1),
+				((mdb_size_t)1 << b) - 1);
+		printf("      %16s: %"Yu"\n", buf, hist[i]);
+	}
+}
+
+static void prfill(const char *title, mdb_size_t pages, mdb_size_t bytes,
+	mdb_size_t *hist, unsigned int room)
+{
+	char buf[32];
+	int i;
+
+	printf("    %s: %"Yu, title, pages);
+	if (pages)
+		printf(", %.1f%% full on average", 100.0 * bytes / pages / room);
+	printf("\n");
+	for (i = 0; i < MDB_FILL_HIST; i++) {
+		if (!hist[i])
+			continue;
+		sprintf(buf, "%d-%d%%", i * 100 / MDB_FILL_HIST,
+			(i + 1) * 100 / MDB_FILL_HIST);
+		printf("      %16s: %"Yu"\n", buf, hist[i]);
+	}
+}
+
+static int prpages(MDB_txn *txn, MDB_dbi dbi, unsigned int nthreads)
+{
+	MDB_pageinfo mi;
+	MDB_stat mst;
+	mdb_size_t n;
+	unsigned int room;
+	int i, rc;
+
+	rc = mdb_stat_pages(txn, dbi, nthreads, &mi);
+	if (rc) {
+		fprintf(stderr, "mdb_stat_pages failed, error %d %s\n", rc, mdb_strerror(rc));
+		return rc;
+	}
+	mdb_env_stat(mdb_txn_env(txn), &mst);
+	/* Page header size, as seen in an empty page */
+	room = mst.ms_psize - 16;
+	printf("  Page usage\n");
+	prfill("Branch pages", mi.mi_branch_pages, mi.mi_branch_bytes,
+		mi.mi_branch_fill, room);
+	prfill("Leaf pages", mi.mi_leaf_pages, mi.mi_leaf_bytes,
+		mi.mi_leaf_fill, room);
+	prhist("Key sizes", mi.mi_key_sizes, 0);
+	prhist("Data sizes", mi.mi_data_sizes, 0);
+	printf("    Overflow values: %"Yu", %"Yu" pages", mi.mi_overflow_values,
+		mi.mi_overflow_pages);
+	if (mi.mi_overflow_pages)
+		printf(", %"Yu" bytes unused (%.1f%%)", mi.mi_overflow_waste,
+			100.0 * mi.mi_overflow_waste / mi.mi_overflow_pages / mst.ms_psize);
+	printf("\n");
+	for (i = 0, n = 0; i < MDB_SIZE_HIST; i++)
+		n += mi.mi_leaf_dist[i];
+	printf("    Sequential leaves: %"Yu" of %"Yu, mi.mi_leaf_dist[0], n);
+	if (n)
+		printf(" (%.1f%%)", 100.0 * mi.mi_leaf_dist[0] / n);
+	printf("\n");
+	mi.mi_leaf_dist[0] = 0;
+	prhist("Leaf distances in pages", mi.mi_leaf_dist, 0);
+	if (dbi == 0) {
+		printf("    Free pages in runs: %"Yu"\n", mi.mi_free_pages);
+		prhist("Free run lengths", mi.mi_free_runs, 1);
+	}
+	return MDB_SUCCESS;
+}
+
 static void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s [-V] [-n] [-e] [-r[r]] [-f[f[f]]] [-v] [-a|-s subdb] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-n] [-e] [-r[r]] [-f[f[f]]] [-p] [-v] [-a|-s subdb] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -50,6 +139,8 @@ int main(int argc, char *argv[])
 	char *envname;
 	char *subname = NULL;
 	int alldbs = 0, envinfo = 0, envflags = 0, freinfo = 0, rdrinfo = 0;
+	int pageinfo = 0;
+	unsigned int nthreads = 1;
 
 	if (argc < 2) {
 		usage(prog);
@@ -59,13 +150,14 @@ int main(int argc, char *argv[])
 	 * -s: print stat of only the named subDB
 	 * -e: print env info
 	 * -f: print freelist info
+	 * -p: print page usage of each DB printed
 	 * -r: print reader info
 	 * -n: use NOSUBDIR flag on env_open
 	 * -v: use previous snapshot
 	 * -V: print version and exit
 	 * (default) print stat of only the main DB
 	 */
-	while ((i = getopt(argc, argv, "Vaefnrs:")) != EOF) {
+	while ((i = getopt(argc, argv, "Vaefnprs:")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
@@ -82,6 +174,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			freinfo++;
 			break;
+		case 'p':
+			pageinfo++;
+			break;
 		case 'n':
 			envflags |= MDB_NOSUBDIR;
 			break;
@@ -104,6 +199,14 @@ int main(int argc, char *argv[])
 	if (optind != argc - 1)
 		usage(prog);
 
+#ifdef _SC_NPROCESSORS_ONLN
+	if (pageinfo) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > 1)
+			nthreads = n;
+	}
+#endif
+
 	envname = argv[optind];
 	rc = mdb_env_create(&env);
 	if (rc) {
@@ -157,7 +260,7 @@ int main(int argc, char *argv[])
 	if (freinfo) {
 		MDB_cursor *cursor;
 		MDB_val key, data;
-		mdb_size_t pages = 0, *iptr;
+		mdb_size_t pages = 0, dropped = 0, *iptr;
 
 		printf("Freelist Status\n");
 		dbi = 0;
@@ -173,6 +276,11 @@ int main(int argc, char *argv[])
 		}
 		prstat(&mst);
 		while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+			/* Trees of DBs dropped with MDB_DROP_LAZY, not page lists */
+			if (*(mdb_size_t *)key.mv_data >> (sizeof(mdb_size_t) * CHAR_BIT - 1)) {
+				dropped += data.mv_size / sizeof(mdb_size_t) / 2;
+				continue;
+			}
 			iptr = data.mv_data;
 			pages += *iptr;
 			if (freinfo > 1) {
@@ -202,6 +310,10 @@ int main(int argc, char *argv[])
 		}
 		mdb_cursor_close(cursor);
 		printf("  Free pages: %"Yu"\n", pages);
+		if (dropped)
+			printf("  Dropped trees not yet freed: %"Yu"\n", dropped);
+		if (pageinfo && (rc = prpages(txn, 0, nthreads)))
+			goto txn_abort;
 	}
 
 	rc = mdb_open(txn, subname, 0, &dbi);
@@ -217,6 +329,8 @@ int main(int argc, char *argv[])
 	}
 	printf("Status of %s\n", subname ? subname : "Main DB");
 	prstat(&mst);
+	if (pageinfo && (rc = prpages(txn, dbi, nthreads)))
+		goto txn_abort;
 
 	if (alldbs) {
 		MDB_cursor *cursor;
@@ -246,6 +360,8 @@ int main(int argc, char *argv[])
 				goto txn_abort;
 			}
 			prstat(&mst);
+			if (pageinfo && (rc = prpages(txn, db2, nthreads)))
+				goto txn_abort;
 			mdb_close(env, db2);
 		}
 		mdb_cursor_close(cursor);
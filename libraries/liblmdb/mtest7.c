@@ -0,0 +1,136 @@
+/* mtest7.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2018 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for multi-page allocations from a fragmented freelist */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+#define COUNT	3000
+
+static char *buf;
+static unsigned psize;
+
+/* Value of record i in round r: from 1 to 8 pages, filled by i and r */
+static void mkval(MDB_val *data, int i, int r)
+{
+	data->mv_size = ((i + r) % 8 + 1) * psize - 64;
+	data->mv_data = buf;
+	memset(buf, 'a' + (i * 7 + r) % 26, data->mv_size);
+}
+
+static void put(MDB_txn *txn, MDB_dbi dbi, int i, int r)
+{
+	MDB_val key, data;
+	char kval[16];
+	int rc;
+
+	sprintf(kval, "%08d", i);
+	key.mv_size = 8;
+	key.mv_data = kval;
+	mkval(&data, i, r);
+	E(mdb_put(txn, dbi, &key, &data, 0));
+}
+
+static void check(MDB_txn *txn, MDB_dbi dbi, int i, int r)
+{
+	MDB_val key, data, want;
+	char kval[16];
+	int rc;
+
+	sprintf(kval, "%08d", i);
+	key.mv_size = 8;
+	key.mv_data = kval;
+	E(mdb_get(txn, dbi, &key, &data));
+	mkval(&want, i, r);
+	CHECK(data.mv_size == want.mv_size &&
+		!memcmp(data.mv_data, want.mv_data, want.mv_size), "value");
+}
+
+int main(int argc,char * argv[])
+{
+	int i, rc;
+	MDB_env *env;
+	MDB_dbi dbi;
+	MDB_val key;
+	MDB_txn *txn;
+	MDB_stat mst;
+	MDB_envinfo info;
+	MDB_metrics mm;
+	mdb_size_t grows, last;
+	char kval[16];
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 256*1048576));
+	E(mdb_env_open(env, "./testdb", MDB_NOSYNC, 0664));
+	E(mdb_env_stat(env, &mst));
+	psize = mst.ms_psize;
+	buf = malloc(8 * psize);
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	for (i = 0; i < COUNT; i++)
+		put(txn, dbi, i, 0);
+	E(mdb_txn_commit(txn));
+
+	/* Free every other value, leaving runs of 1 to 8 pages between
+	 * the values still in use
+	 */
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	for (i = 0; i < COUNT; i += 2) {
+		sprintf(kval, "%08d", i);
+		key.mv_size = 8;
+		key.mv_data = kval;
+		E(mdb_del(txn, dbi, &key, NULL));
+	}
+	E(mdb_txn_commit(txn));
+	/* Let the freed pages age past the last snapshot */
+	for (i = 0; i < 2; i++) {
+		E(mdb_txn_begin(env, NULL, 0, &txn));
+		put(txn, dbi, COUNT, i);
+		E(mdb_txn_commit(txn));
+	}
+
+	E(mdb_env_info(env, &info));
+	last = info.me_last_pgno;
+	E(mdb_env_metrics(env, &mm));
+	grows = mm.mm_grows_multi;
+
+	/* Refill the gaps with values of other sizes */
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	for (i = 0; i < COUNT; i += 2)
+		put(txn, dbi, i, 3);
+	E(mdb_txn_commit(txn));
+
+	E(mdb_env_metrics(env, &mm));
+	/* Most of the multi-page values found a run in the freelist */
+	CHECK(mm.mm_grows_multi - grows < COUNT / 4, "runs not reused");
+	E(mdb_env_info(env, &info));
+	/* The new values average the old ones' size and mostly fit the gaps */
+	CHECK(info.me_last_pgno < last + last / 4, "freelist not reused");
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	for (i = 0; i < COUNT; i++)
+		check(txn, dbi, i, i & 1 ? 0 : 3);
+	mdb_txn_abort(txn);
+
+	mdb_env_close(env);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,185 @@
+/* mtest8.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2018 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for lazily dropped DBs across a reopen */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define RES(err, expr) ((rc = expr) == (err) || (CHECK(!rc, #expr), 0))
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+#define COUNT	2000
+#define RCL_BIT	((mdb_size_t)1 << (sizeof(mdb_size_t) * 8 - 1))
+
+static const char *names[] = { "big", "dups", "live" };
+#define NDBS	(sizeof(names) / sizeof(names[0]))
+
+static char buf[3 * 4096];
+
+static MDB_env *envopen(void)
+{
+	MDB_env *env;
+	int rc;
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 64*1048576));
+	E(mdb_env_set_maxdbs(env, 4));
+	E(mdb_env_open(env, "./testdb", MDB_NOSYNC, 0664));
+	return env;
+}
+
+/* Pages of a DB, including the sub-DBs of its DUPSORT keys */
+static mdb_size_t dbpages(MDB_txn *txn, MDB_dbi dbi)
+{
+	MDB_pageinfo pi;
+	int rc;
+
+	E(mdb_stat_pages(txn, dbi, 1, &pi));
+	return pi.mi_branch_pages + pi.mi_leaf_pages + pi.mi_overflow_pages;
+}
+
+/* Check that every page is in use by a DB or in the freelist,
+ * and return the number of lazily dropped trees still pending.
+ */
+static int audit(MDB_env *env)
+{
+	MDB_txn *txn;
+	MDB_cursor *cur;
+	MDB_val key, data;
+	MDB_envinfo info;
+	MDB_dbi dbi;
+	mdb_size_t total, id;
+	unsigned i;
+	int rc, pending = 0;
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	E(mdb_env_info(env, &info));
+	total = 2 + dbpages(txn, 0);
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	total += dbpages(txn, dbi);
+	for (i = 0; i < NDBS; i++) {
+		if (RES(MDB_NOTFOUND, mdb_dbi_open(txn, names[i], 0, &dbi)))
+			continue;
+		total += dbpages(txn, dbi);
+	}
+	E(mdb_cursor_open(txn, 0, &cur));
+	while ((rc = mdb_cursor_get(cur, &key, &data, MDB_NEXT)) == 0) {
+		memcpy(&id, key.mv_data, sizeof(id));
+		if (id & RCL_BIT)
+			pending++;
+		else
+			total += *(mdb_size_t *)data.mv_data;
+	}
+	CHECK(rc == MDB_NOTFOUND, "mdb_cursor_get");
+	mdb_cursor_close(cur);
+	mdb_txn_abort(txn);
+	if (!pending)
+		CHECK(total == info.me_last_pgno + 1, "page accounting");
+	return pending;
+}
+
+int main(int argc,char * argv[])
+{
+	int i, j, rc;
+	MDB_env *env;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	MDB_txn *txn;
+	MDB_envinfo info;
+	mdb_size_t last, dropped;
+	char kval[16];
+
+	memset(buf, 'x', sizeof(buf));
+	env = envopen();
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	key.mv_size = 8;
+	key.mv_data = kval;
+	/* Overflow values, a DUPSORT DB with sub-DBs, and one to keep */
+	E(mdb_dbi_open(txn, "big", MDB_CREATE, &dbi));
+	for (i = 0; i < COUNT / 4; i++) {
+		sprintf(kval, "%08d", i);
+		data.mv_size = sizeof(buf) - i % 100;
+		data.mv_data = buf;
+		E(mdb_put(txn, dbi, &key, &data, 0));
+	}
+	E(mdb_dbi_open(txn, "dups", MDB_CREATE|MDB_DUPSORT, &dbi));
+	for (i = 0; i < COUNT; i++) {
+		sprintf(kval, "%08d", i % 20);
+		data.mv_size = 8 + i % 50;
+		data.mv_data = buf;
+		memcpy(buf, &i, sizeof(i));
+		E(mdb_put(txn, dbi, &key, &data, 0));
+	}
+	memset(buf, 'x', sizeof(buf));
+	E(mdb_dbi_open(txn, "live", MDB_CREATE, &dbi));
+	for (i = 0; i < COUNT; i++) {
+		sprintf(kval, "%08d", i);
+		data.mv_size = 100;
+		data.mv_data = buf;
+		E(mdb_put(txn, dbi, &key, &data, 0));
+	}
+	E(mdb_txn_commit(txn));
+	CHECK(!audit(env), "audit before drop");
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, "big", 0, &dbi));
+	dropped = dbpages(txn, dbi);
+	E(mdb_drop(txn, dbi, 1|MDB_DROP_LAZY));
+	E(mdb_dbi_open(txn, "dups", 0, &dbi));
+	dropped += dbpages(txn, dbi);
+	E(mdb_drop(txn, dbi, 1|MDB_DROP_LAZY));
+	E(mdb_txn_commit(txn));
+	CHECK(audit(env) > 0, "drop not deferred");
+	E(mdb_env_info(env, &info));
+	last = info.me_last_pgno;
+	mdb_env_close(env);
+
+	/* A new env handle must pick up the pending trees from the freeDB.
+	 * Each txn needs more pages than the freelist has, so the dropped
+	 * pages must be used instead of growing the map, at least once the
+	 * first chunk has been read.
+	 */
+	env = envopen();
+	for (j = 0; audit(env); j++) {
+		CHECK(j < 100, "dropped pages never reclaimed");
+		E(mdb_txn_begin(env, NULL, 0, &txn));
+		E(mdb_dbi_open(txn, "live", 0, &dbi));
+		for (i = 0; i < 200; i++) {
+			sprintf(kval, "%08d", COUNT + j * 200 + i);
+			data.mv_size = 2000;
+			data.mv_data = buf;
+			E(mdb_put(txn, dbi, &key, &data, 0));
+		}
+		E(mdb_txn_commit(txn));
+	}
+	CHECK(j > 1, "dropped pages all freed at once");
+	E(mdb_env_info(env, &info));
+	CHECK(info.me_last_pgno - last < dropped / 2, "dropped pages not reused");
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	CHECK(mdb_dbi_open(txn, "big", 0, &dbi) == MDB_NOTFOUND, "big still exists");
+	E(mdb_dbi_open(txn, "live", 0, &dbi));
+	for (i = 0; i < COUNT; i++) {
+		sprintf(kval, "%08d", i);
+		E(mdb_get(txn, dbi, &key, &data));
+		CHECK(data.mv_size == 100, "live value");
+	}
+	mdb_txn_abort(txn);
+	mdb_env_close(env);
+	return 0;
+}
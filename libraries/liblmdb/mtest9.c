@@ -0,0 +1,255 @@
+/* mtest9.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2018 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for values updated by mdb_cursor_put_range() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+#define VSIZE	(300*1024)
+#define NKEYS	4
+
+static char *want[NKEYS];
+
+static MDB_env *envopen(const char *path)
+{
+	MDB_env *env;
+	int rc;
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 64*1048576));
+	E(mdb_env_open(env, path, MDB_NOSYNC, 0664));
+	return env;
+}
+
+/* Overwrite part of value k, in the txn and in want[] */
+static void update(MDB_txn *txn, MDB_dbi dbi, int k, size_t off, size_t len, int c,
+	char *copy)
+{
+	MDB_cursor *cur;
+	MDB_val key, data;
+	char kval[8];
+	int rc;
+
+	sprintf(kval, "key%d", k);
+	key.mv_size = 4;
+	key.mv_data = kval;
+	E(mdb_cursor_open(txn, dbi, &cur));
+	E(mdb_cursor_get(cur, &key, &data, MDB_SET));
+	data.mv_size = len;
+	data.mv_data = malloc(len);
+	memset(data.mv_data, c, len);
+	E(mdb_cursor_put_range(cur, off, &data));
+	memset(copy + off, c, len);
+	free(data.mv_data);
+	mdb_cursor_close(cur);
+}
+
+/* Check value k against \b v, whole and by a range across segments */
+static void verify(MDB_txn *txn, MDB_dbi dbi, int k, const char *v)
+{
+	MDB_cursor *cur;
+	MDB_val key, data;
+	char kval[8];
+	int rc;
+
+	sprintf(kval, "key%d", k);
+	key.mv_size = 4;
+	key.mv_data = kval;
+	E(mdb_cursor_open(txn, dbi, &cur));
+	E(mdb_cursor_get(cur, &key, &data, MDB_SET));
+	CHECK(data.mv_size == VSIZE && !memcmp(data.mv_data, v, VSIZE), "value");
+	data.mv_size = 50000;
+	E(mdb_cursor_get_range(cur, 100000, &data));
+	CHECK(!memcmp(data.mv_data, v + 100000, 50000), "range");
+	mdb_cursor_close(cur);
+}
+
+static void verify_all(MDB_env *env)
+{
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	int k, rc;
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	for (k = 0; k < NKEYS; k++)
+		verify(txn, dbi, k, want[k]);
+	mdb_txn_abort(txn);
+}
+
+/* Check that every page is in use by the main DB or in the freelist */
+static void audit(MDB_env *env)
+{
+	MDB_txn *txn;
+	MDB_cursor *cur;
+	MDB_val key, data;
+	MDB_envinfo info;
+	MDB_pageinfo pi;
+	MDB_stat st;
+	MDB_dbi dbi;
+	mdb_size_t total;
+	int rc;
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	E(mdb_env_info(env, &info));
+	E(mdb_stat_pages(txn, 0, 1, &pi));
+	total = 2 + pi.mi_branch_pages + pi.mi_leaf_pages + pi.mi_overflow_pages;
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	E(mdb_stat_pages(txn, dbi, 1, &pi));
+	E(mdb_stat(txn, dbi, &st));
+	CHECK(pi.mi_overflow_pages == st.ms_overflow_pages, "overflow page count");
+	total += pi.mi_branch_pages + pi.mi_leaf_pages + pi.mi_overflow_pages;
+	E(mdb_cursor_open(txn, 0, &cur));
+	while ((rc = mdb_cursor_get(cur, &key, &data, MDB_NEXT)) == 0)
+		total += *(mdb_size_t *)data.mv_data;
+	CHECK(rc == MDB_NOTFOUND, "mdb_cursor_get");
+	mdb_cursor_close(cur);
+	mdb_txn_abort(txn);
+	CHECK(total == info.me_last_pgno + 1, "page accounting");
+}
+
+int main(int argc,char * argv[])
+{
+	int i, k, rc;
+	MDB_env *env, *env2;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	MDB_txn *txn, *rtxn, *child;
+	mdb_size_t moved;
+	char kval[8], *old, *tmp;
+
+	env = envopen("./testdb");
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, NULL, 0, &dbi));
+	/* Filler first, so that dropping it leaves room for shrinking */
+	for (i = 0; i < 200; i++) {
+		sprintf(kval, "f%03d", i);
+		key.mv_size = 4;
+		key.mv_data = kval;
+		data.mv_size = 3000;
+		data.mv_data = calloc(1, 3000);
+		E(mdb_put(txn, dbi, &key, &data, 0));
+		free(data.mv_data);
+	}
+	E(mdb_txn_commit(txn));
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	for (k = 0; k < NKEYS; k++) {
+		want[k] = malloc(VSIZE);
+		for (i = 0; i < VSIZE; i++)
+			want[k][i] = 'a' + (i / 1000 + k) % 26;
+		sprintf(kval, "key%d", k);
+		key.mv_size = 4;
+		key.mv_data = kval;
+		data.mv_size = VSIZE;
+		data.mv_data = want[k];
+		E(mdb_put(txn, dbi, &key, &data, 0));
+	}
+	E(mdb_txn_commit(txn));
+	audit(env);
+
+	/* A reader keeps its snapshot while the values are segmented */
+	old = malloc(VSIZE);
+	memcpy(old, want[0], VSIZE);
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &rtxn));
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	for (k = 0; k < NKEYS; k++)
+		update(txn, dbi, k, 1000 + k * 50000, 20000, '0' + k, want[k]);
+	verify(txn, dbi, 0, want[0]);
+	E(mdb_txn_commit(txn));
+	verify(rtxn, dbi, 0, old);
+	mdb_txn_abort(rtxn);
+	verify_all(env);
+	audit(env);
+
+	/* Segments rewritten by a child are dropped if it aborts */
+	tmp = malloc(VSIZE);
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	update(txn, dbi, 1, 0, 10, 'x', want[1]);
+	memcpy(tmp, want[1], VSIZE);
+	E(mdb_txn_begin(env, txn, 0, &child));
+	update(child, dbi, 1, VSIZE - 70000, 60000, 'y', tmp);
+	verify(child, dbi, 1, tmp);
+	mdb_txn_abort(child);
+	verify(txn, dbi, 1, want[1]);
+	E(mdb_txn_begin(env, txn, 0, &child));
+	update(child, dbi, 1, 150000, 8000, 'z', want[1]);
+	update(child, dbi, 2, 99000, 2000, 'w', want[2]);
+	E(mdb_txn_commit(child));
+	verify(txn, dbi, 1, want[1]);
+	verify(txn, dbi, 2, want[2]);
+	E(mdb_txn_commit(txn));
+	verify_all(env);
+	audit(env);
+
+	/* A compacting copy keeps the segmented values */
+	system("rm -rf ./testdb/copy && mkdir ./testdb/copy");
+	E(mdb_env_copy2(env, "./testdb/copy", MDB_CP_COMPACT));
+	env2 = envopen("./testdb/copy");
+	verify_all(env2);
+	audit(env2);
+	mdb_env_close(env2);
+
+	/* Shrinking moves the segments down into the filler's pages */
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	for (i = 0; i < 200; i++) {
+		sprintf(kval, "f%03d", i);
+		key.mv_size = 4;
+		key.mv_data = kval;
+		E(mdb_del(txn, dbi, &key, NULL));
+	}
+	E(mdb_txn_commit(txn));
+	moved = 0;
+	for (i = 0; i < 100; i++) {
+		mdb_size_t n;
+		rc = mdb_env_shrink(env, 0, &n);
+		if (rc == MDB_NOTFOUND || rc == MDB_INCOMPATIBLE)
+			break;
+		CHECK(rc == MDB_SUCCESS || rc == EBUSY, "mdb_env_shrink");
+		if (!rc)
+			moved += n;
+	}
+	/* MDB_VL32 builds can't shrink */
+	if (rc != MDB_INCOMPATIBLE) {
+		CHECK(rc == MDB_NOTFOUND, "shrink did not finish");
+		CHECK(moved > 0, "nothing moved");
+	}
+	verify_all(env);
+	audit(env);
+
+	/* Deleting and dropping free every segment */
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	key.mv_size = 4;
+	key.mv_data = "key0";
+	E(mdb_del(txn, dbi, &key, NULL));
+	E(mdb_txn_commit(txn));
+	audit(env);
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_drop(txn, dbi, 0));
+	E(mdb_txn_commit(txn));
+	audit(env);
+
+	mdb_env_close(env);
+	for (k = 0; k < NKEYS; k++)
+		free(want[k]);
+	free(old);
+	free(tmp);
+	return 0;
+}